@@ -0,0 +1,2526 @@
+// 基准测试程序 chat_handler_bench（make bench）
+// 与 CGI 程序使用同一份源码：先包含 chat_handler.c（其中的 main 改名为 chat_handler_main），
+// 基准测试因此可以直接调用其中的静态函数；CGI 程序本身不包含这部分代码。
+// 用法：./chat_handler_bench --bench [名称]，其他参数与 chat_handler.cgi 相同
+
+#define main chat_handler_main
+#include "chat_handler.c"
+#undef main
+
+// 函数：单调时钟，单位为秒
+static double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 函数：创建含 rows 条消息的内存数据库，消息内容混入需要转义的字符
+static sqlite3 *bench_seed_messages(int rows) {
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	sqlite3_open(":memory:", &db);
+	sqlite3_exec(db, "CREATE TABLE messages (id INTEGER PRIMARY KEY, timestamp INTEGER, ip TEXT, username TEXT, message TEXT);"
+	                 "BEGIN;", 0, 0, 0);
+	sqlite3_prepare_v2(db, "INSERT INTO messages (timestamp, ip, username, message) VALUES (?, ?, ?, ?);", -1, &stmt, 0);
+	for (int i = 0; i < rows; i++) {
+		char message[160];
+		snprintf(message, sizeof(message), "第 %d 条消息：hello \"world\" \\ path/to/file\tend", i);
+		sqlite3_bind_int64(stmt, 1, 1700000000 + i);
+		sqlite3_bind_text(stmt, 2, "203.0.113.42", -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 3, i % 3 ? "alice" : "bob", -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 4, message, -1, SQLITE_TRANSIENT);
+		sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+	return db;
+}
+
+static long g_bench_cjson_allocs = 0;
+
+static void *bench_counting_malloc(size_t size) {
+	g_bench_cjson_allocs++;
+	return malloc(size);
+}
+
+// 函数：原先的 GET 实现——倒序查询，逐条构建 cJSON 对象，经临时数组反转后整体打印
+static void bench_get_cjson(sqlite3 *db, int limit, FILE *out) {
+	sqlite3_stmt *stmt;
+	sqlite3_prepare_v2(db, "SELECT id, timestamp, ip, username, message FROM messages WHERE id > ? ORDER BY id DESC LIMIT ?;", -1, &stmt, 0);
+	sqlite3_bind_int64(stmt, 1, 0);
+	sqlite3_bind_int(stmt, 2, limit);
+
+	cJSON *root = cJSON_CreateObject();
+	cJSON_AddStringToObject(root, "status", "success");
+	cJSON *data_array = cJSON_CreateArray();
+	cJSON_AddItemToObject(root, "data", data_array);
+	cJSON *temp_array = cJSON_CreateArray();
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		cJSON *message_obj = cJSON_CreateObject();
+		char id_str[20];
+		snprintf(id_str, sizeof(id_str), "%lld", (long long)sqlite3_column_int64(stmt, 0));
+		cJSON_AddStringToObject(message_obj, "id", id_str);
+		cJSON_AddNumberToObject(message_obj, "timestamp", sqlite3_column_int64(stmt, 1));
+		cJSON_AddStringToObject(message_obj, "ip", (const char *)sqlite3_column_text(stmt, 2));
+		cJSON_AddStringToObject(message_obj, "username", (const char *)sqlite3_column_text(stmt, 3));
+		cJSON_AddStringToObject(message_obj, "message", (const char *)sqlite3_column_text(stmt, 4));
+		cJSON_AddItemToArray(temp_array, message_obj);
+	}
+	for (int i = cJSON_GetArraySize(temp_array) - 1; i >= 0; i--) {
+		cJSON_AddItemToArray(data_array, cJSON_DetachItemFromArray(temp_array, i));
+	}
+	cJSON_Delete(temp_array);
+	sqlite3_finalize(stmt);
+
+	char *json_output = cJSON_PrintUnformatted(root);
+	fprintf(out, "%s\n", json_output);
+	cJSON_free(json_output);
+	cJSON_Delete(root);
+}
+
+// 函数：当前的 GET 实现——升序查询，流式写出
+static void bench_get_stream(sqlite3 *db, int limit, FILE *out) {
+	sqlite3_stmt *stmt;
+	sqlite3_prepare_v2(db, SQL_SELECT_LATEST_MESSAGES, -1, &stmt, 0);
+	sqlite3_bind_int64(stmt, 1, 0);
+	sqlite3_bind_int(stmt, 2, limit);
+
+	fputs(MESSAGES_JSON_PREFIX, out);
+	int count = 0;
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		if (count++ > 0) fputc(',', out);
+		json_write_message(out, stmt);
+	}
+	fputs(MESSAGES_JSON_SUFFIX, out);
+	sqlite3_finalize(stmt);
+}
+
+// 函数：比较 cJSON 与流式输出在 50、200、5000 条消息时的耗时
+static int bench_json() {
+	static const int sizes[] = {50, 200, 5000};
+	FILE *devnull = fopen("/dev/null", "w");
+	cJSON_Hooks hooks = { bench_counting_malloc, free };
+	cJSON_InitHooks(&hooks);
+
+	printf("%-8s %14s %14s %8s %16s\n", "rows", "cjson us/op", "stream us/op", "speedup", "cjson allocs/op");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		int rows = sizes[i];
+		sqlite3 *db = bench_seed_messages(rows);
+
+		// 先确认两种实现输出逐字节一致
+		char *a = NULL, *b = NULL;
+		size_t a_len = 0, b_len = 0;
+		FILE *fa = open_memstream(&a, &a_len);
+		FILE *fb = open_memstream(&b, &b_len);
+		bench_get_cjson(db, rows, fa);
+		bench_get_stream(db, rows, fb);
+		fclose(fa);
+		fclose(fb);
+		if (a_len != b_len || memcmp(a, b, a_len) != 0) {
+			fprintf(stderr, "Output mismatch at %d rows.\n", rows);
+			return 1;
+		}
+		free(a);
+		free(b);
+
+		int iterations = 500000 / rows;
+		g_bench_cjson_allocs = 0;
+		double start = bench_now();
+		for (int n = 0; n < iterations; n++) bench_get_cjson(db, rows, devnull);
+		double cjson_us = (bench_now() - start) * 1e6 / iterations;
+		long allocs = g_bench_cjson_allocs / iterations;
+
+		start = bench_now();
+		for (int n = 0; n < iterations; n++) bench_get_stream(db, rows, devnull);
+		double stream_us = (bench_now() - start) * 1e6 / iterations;
+
+		printf("%-8d %14.1f %14.1f %7.2fx %16ld\n", rows, cjson_us, stream_us, cjson_us / stream_us, allocs);
+		sqlite3_close(db);
+	}
+
+	cJSON_InitHooks(NULL);
+	fclose(devnull);
+	return 0;
+}
+
+// 函数：比较原先的 NOT IN 排序删除与按主键范围删除在不同保留数量下的单次写入耗时
+static int bench_retention() {
+	static const int sizes[] = {200, 10000, 100000};
+	setenv("CHAT_ARCHIVE", "0", 1); // 只比较删除方式，不写归档
+	printf("%-8s %14s %14s\n", "retain", "not-in us/op", "range us/op");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		int retain = sizes[i];
+		char value[16];
+		snprintf(value, sizeof(value), "%d", retain);
+		setenv("CHAT_MAX_MESSAGES", value, 1);
+
+		double results[2];
+		for (int strategy = 0; strategy < 2; strategy++) {
+			sqlite3 *db = bench_seed_messages(retain);
+			sqlite3_stmt *insert, *delete_old;
+			sqlite3_prepare_v2(db, "INSERT INTO messages (timestamp, ip, username, message) VALUES (?, '203.0.113.42', 'alice', 'hello');", -1, &insert, 0);
+			sqlite3_prepare_v2(db, "DELETE FROM messages WHERE id NOT IN (SELECT id FROM messages ORDER BY timestamp DESC, id DESC LIMIT ?);", -1, &delete_old, 0);
+			sqlite3_bind_int(delete_old, 1, retain);
+
+			int iterations = strategy == 0 ? 200000 / retain + 5 : 5000;
+			double start = bench_now();
+			for (int n = 0; n < iterations; n++) {
+				sqlite3_bind_int64(insert, 1, 1800000000 + n);
+				sqlite3_step(insert);
+				sqlite3_reset(insert);
+				if (strategy == 0) {
+					sqlite3_step(delete_old);
+					sqlite3_reset(delete_old);
+				} else {
+					prune_old_messages(db, sqlite3_last_insert_rowid(db), 1);
+				}
+			}
+			results[strategy] = (bench_now() - start) * 1e6 / iterations;
+
+			sqlite3_finalize(insert);
+			sqlite3_finalize(delete_old);
+			db_shutdown(); // 销毁 prune_old_messages 缓存在该连接上的语句
+			sqlite3_close(db);
+		}
+		printf("%-8d %14.1f %14.1f\n", retain, results[0], results[1]);
+	}
+	unsetenv("CHAT_MAX_MESSAGES");
+	unsetenv("CHAT_ARCHIVE");
+	return 0;
+}
+
+// 函数：在 CHAT_BENCH_SEARCH_ROWS 条消息（默认 100 万）上测量写入开销、索引大小和各类搜索的延迟
+static int bench_search() {
+	static const char *words[] = {
+		"hello", "world", "chat", "room", "server", "update", "deploy", "release", "coffee", "lunch",
+		"meeting", "tomorrow", "weekend", "game", "music", "photo", "link", "thanks", "sorry", "question",
+		"你好", "今天", "明天", "吃饭", "开会", "聊天室", "服务器", "谢谢", "周末", "游戏",
+	};
+	const int word_count = sizeof(words) / sizeof(words[0]);
+	int rows = config_int("CHAT_BENCH_SEARCH_ROWS", 1000000);
+	const char *path = "/tmp/chat_bench_search.db";
+	unlink(path);
+
+	sqlite3 *db;
+	if (sqlite3_open(path, &db) != SQLITE_OK || db_migrate(db) != 0) {
+		fprintf(stderr, "Failed to create %s.\n", path);
+		return 1;
+	}
+	sqlite3_exec(db, "PRAGMA synchronous=OFF;", 0, 0, 0);
+
+	// 消息由随机词组成，每 10000 条混入一个罕见词
+	sqlite3_stmt *insert;
+	sqlite3_prepare_v2(db, "INSERT INTO messages (timestamp, ip, username, message) VALUES (?, '203.0.113.42', ?, ?);", -1, &insert, 0);
+	srand(12345);
+	double start = bench_now();
+	sqlite3_exec(db, "BEGIN;", 0, 0, 0);
+	for (int i = 0; i < rows; i++) {
+		char message[256], username[16];
+		int len = 0, n = 4 + rand() % 9;
+		for (int w = 0; w < n; w++) {
+			len += snprintf(message + len, sizeof(message) - len, "%s%s", w ? " " : "", words[rand() % word_count]);
+		}
+		if (i % 10000 == 0) snprintf(message + len, sizeof(message) - len, " needle%d", i);
+		snprintf(username, sizeof(username), "user%d", rand() % 500);
+		sqlite3_bind_int64(insert, 1, 1700000000 + i);
+		sqlite3_bind_text(insert, 2, username, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text(insert, 3, message, -1, SQLITE_TRANSIENT);
+		sqlite3_step(insert);
+		sqlite3_reset(insert);
+	}
+	sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+	double insert_us = (bench_now() - start) * 1e6 / rows;
+	sqlite3_finalize(insert);
+
+	long long table_bytes = 0, index_bytes = 0;
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(db, "SELECT name LIKE 'messages_fts%', SUM(pgsize) FROM dbstat GROUP BY 1;", -1, &stmt, 0) == SQLITE_OK) {
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			if (sqlite3_column_int(stmt, 0)) index_bytes = sqlite3_column_int64(stmt, 1);
+			else table_bytes = sqlite3_column_int64(stmt, 1);
+		}
+		sqlite3_finalize(stmt);
+	}
+	printf("rows %d, insert %.1f us/row (with index triggers), table %.1f MB, fts index %.1f MB\n",
+	       rows, insert_us, table_bytes / 1048576.0, index_bytes / 1048576.0);
+
+	static const struct {
+		const char *label;
+		const char *q;
+		long long offset;
+	} cases[] = {
+		{"rare term", "needle5", 0},
+		{"common term", "hello", 0},
+		{"two terms", "hello world", 0},
+		{"chinese", "聊天室", 0},
+		{"deep page", "hello", 10000},
+		{"short (scan)", "吃饭", 0},
+		{"mixed (scan)", "吃饭 hello", 0},
+	};
+	FILE *devnull = fopen("/dev/null", "w");
+	printf("%-14s %12s %10s\n", "query", "ms/query", "results");
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		int iterations = 0, results = 0;
+		start = bench_now();
+		do {
+			if (search_prepare(db, cases[i].q, SEARCH_PAGE_SIZE, cases[i].offset, 0, &stmt) != SQLITE_OK) {
+				fprintf(stderr, "Failed to prepare search.\n");
+				return 1;
+			}
+			results = 0;
+			while (sqlite3_step(stmt) == SQLITE_ROW && results < SEARCH_PAGE_SIZE) {
+				json_write_message(devnull, stmt);
+				results++;
+			}
+			db_finalize(stmt);
+			iterations++;
+		} while (bench_now() - start < 1.0 && iterations < 1000);
+		printf("%-14s %12.3f %10d\n", cases[i].label, (bench_now() - start) * 1e3 / iterations, results);
+	}
+	fclose(devnull);
+
+	// 含短词的查询按词分别匹配：结果数应与逐词 LIKE 的参考查询一致，且每条结果都包含全部词（不要求相邻）
+	const char *mixed = "吃饭 hello";
+	long long expected = -1, total = search_count(db, mixed, 0);
+	if (sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM messages WHERE instr(message || ' ' || username, '吃饭') > 0 "
+	                       "AND instr(message || ' ' || username, 'hello') > 0;", -1, &stmt, 0) == SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW) expected = sqlite3_column_int64(stmt, 0);
+		sqlite3_finalize(stmt);
+	}
+	int bad = 0, checked = 0;
+	if (search_prepare(db, mixed, SEARCH_PAGE_SIZE, 0, 0, &stmt) == SQLITE_OK) {
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			const char *message = (const char *)sqlite3_column_text(stmt, 4);
+			if (strstr(message, "吃饭") == NULL || strstr(message, "hello") == NULL) bad++;
+			checked++;
+		}
+		db_finalize(stmt);
+	}
+	int ok = expected > 0 && total == expected && checked > 0 && bad == 0;
+	char name[96];
+	snprintf(name, sizeof(name), "mixed short/long query matches every term (%lld of %lld)", total, expected);
+	printf("%-60s %s\n", name, ok ? "ok" : "FAIL");
+
+	db_shutdown(); // 销毁缓存在该连接上的语句
+	sqlite3_close(db);
+	unlink(path);
+	return ok ? 0 : 1;
+}
+
+// 函数：比较 OFFSET 翻页与按主键 before 翻页在不同深度下读取一页（50 条）的耗时
+static int bench_history() {
+	static const int depths[] = {0, 10000, 100000, 900000};
+	const int rows = 1000000;
+	sqlite3 *db = bench_seed_messages(rows);
+	sqlite3_stmt *offset_stmt, *keyset_stmt;
+	sqlite3_prepare_v2(db, "SELECT id, timestamp, ip, username, message FROM messages ORDER BY id DESC LIMIT ? OFFSET ?;", -1, &offset_stmt, 0);
+	sqlite3_prepare_v2(db, SQL_SELECT_MESSAGES_BEFORE, -1, &keyset_stmt, 0);
+	FILE *devnull = fopen("/dev/null", "w");
+
+	printf("%-8s %14s %14s\n", "depth", "offset us/page", "before us/page");
+	for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+		double results[2];
+		for (int strategy = 0; strategy < 2; strategy++) {
+			sqlite3_stmt *stmt = strategy == 0 ? offset_stmt : keyset_stmt;
+			int iterations = 0;
+			double start = bench_now();
+			do {
+				if (strategy == 0) {
+					sqlite3_bind_int(stmt, 1, MAX_MESSAGES_GET);
+					sqlite3_bind_int(stmt, 2, depths[i]);
+				} else {
+					sqlite3_bind_int64(stmt, 1, rows + 1 - depths[i]);
+					sqlite3_bind_int(stmt, 2, MAX_MESSAGES_GET);
+					sqlite3_bind_int64(stmt, 3, 0);
+				}
+				while (sqlite3_step(stmt) == SQLITE_ROW) json_write_message(devnull, stmt);
+				sqlite3_reset(stmt);
+				iterations++;
+			} while (bench_now() - start < 0.5);
+			results[strategy] = (bench_now() - start) * 1e6 / iterations;
+		}
+		printf("%-8d %14.1f %14.1f\n", depths[i], results[0], results[1]);
+	}
+
+	fclose(devnull);
+	sqlite3_finalize(offset_stmt);
+	sqlite3_finalize(keyset_stmt);
+	sqlite3_close(db);
+	return 0;
+}
+
+// 函数：删除基准测试聊天室的数据库和归档文件
+static void bench_remove_room() {
+	static const char *suffixes[] = {"", "-wal", "-shm", NOTIFY_SUFFIX, SNAPSHOT_SUFFIX, SNAPSHOT_LOCK_SUFFIX, RING_SUFFIX,
+	                                 QUEUE_SUFFIX, QUEUE_LOCK_SUFFIX};
+	ring_unmap();
+	char path[ROOM_PATH_SIZE + 288];
+	for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+		snprintf(path, sizeof(path), "%s%s", g_room.db_path, suffixes[i]);
+		unlink(path);
+	}
+	struct dirent **names;
+	int n = scandir(g_room.archive_path, &names, NULL, alphasort);
+	for (int i = 0; i < n; i++) {
+		if (names[i]->d_name[0] != '.') {
+			snprintf(path, sizeof(path), "%s/%s", g_room.archive_path, names[i]->d_name);
+			unlink(path);
+		}
+		free(names[i]);
+	}
+	if (n >= 0) free(names);
+	rmdir(g_room.archive_path);
+}
+
+// 函数：比较直接删除与写入归档时的写入耗时，并测量归档大小和从归档读取历史、搜索的耗时
+static int bench_archive() {
+	const int rows = config_int("CHAT_BENCH_ARCHIVE_ROWS", 200000);
+	const int batch = MAX_BATCH_MESSAGES;
+	setenv("CHAT_MAX_MESSAGES", "200", 1);
+	select_room("__bench_archive__");
+
+	printf("%-10s %12s %12s %12s\n", "mode", "us/message", "hot MB", "archive MB");
+	for (int archive = 0; archive < 2; archive++) {
+		setenv("CHAT_ARCHIVE", archive ? "1" : "0", 1);
+		bench_remove_room();
+		sqlite3 *db;
+		sqlite3_stmt *stmt;
+		if (db_acquire_room(&db) != SQLITE_OK) return 1;
+
+		double start = bench_now();
+		for (int i = 0; i < rows; i += batch) {
+			sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0);
+			db_prepare(db, "INSERT INTO messages (timestamp, ip, username, message) VALUES (?, '203.0.113.42', 'alice', ?);", &stmt);
+			for (int j = 0; j < batch; j++) {
+				char message[96];
+				snprintf(message, sizeof(message), "第 %d 条消息：hello world%s", i + j, (i + j) % 1000 == 0 ? " needle" : "");
+				sqlite3_bind_int64(stmt, 1, 1700000000 + i + j);
+				sqlite3_bind_text(stmt, 2, message, -1, SQLITE_TRANSIENT);
+				sqlite3_step(stmt);
+				sqlite3_reset(stmt);
+			}
+			db_finalize(stmt);
+			prune_old_messages(db, sqlite3_last_insert_rowid(db), batch);
+			sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+		}
+		double us = (bench_now() - start) * 1e6 / rows;
+		sqlite3_exec(db, "PRAGMA wal_checkpoint(TRUNCATE);", 0, 0, 0);
+
+		struct stat st;
+		double hot_mb = stat(g_room.db_path, &st) == 0 ? st.st_size / 1048576.0 : 0;
+		double archive_mb = 0;
+		struct dirent **names;
+		int n = archive_list_segments(&names);
+		for (int i = 0; i < n; i++) {
+			char path[ROOM_PATH_SIZE + 288];
+			snprintf(path, sizeof(path), "%s/%.*s.dat", g_room.archive_path, (int)strlen(names[i]->d_name) - 4, names[i]->d_name);
+			if (stat(path, &st) == 0) archive_mb += st.st_size / 1048576.0;
+			snprintf(path, sizeof(path), "%s/%s", g_room.archive_path, names[i]->d_name);
+			if (stat(path, &st) == 0) archive_mb += st.st_size / 1048576.0;
+		}
+		archive_free_list(names, n);
+		printf("%-10s %12.1f %12.2f %12.2f\n", archive ? "archive" : "delete", us, hot_mb, archive_mb);
+		db_shutdown();
+	}
+
+	// 从归档读取历史页和搜索（归档中约有 rows 条消息）
+	FILE *devnull = fopen("/dev/null", "w");
+	static const int depths[] = {1000, 50000, 190000};
+	printf("%-22s %12s\n", "archive read", "ms/page");
+	for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+		if (depths[i] >= rows) continue;
+		int iterations = 0;
+		double start = bench_now();
+		do {
+			archive_write_before(devnull, rows - depths[i], MAX_MESSAGES_GET, 0);
+			iterations++;
+		} while (bench_now() - start < 0.5);
+		printf("history depth %-8d %12.3f\n", depths[i], (bench_now() - start) * 1e3 / iterations);
+	}
+	int iterations = 0, more;
+	double start = bench_now();
+	do {
+		archive_search(devnull, "needle", 0, SEARCH_PAGE_SIZE, 0, &more);
+		iterations++;
+	} while (bench_now() - start < 0.5);
+	printf("%-22s %12.3f\n", "search first page", (bench_now() - start) * 1e3 / iterations);
+	iterations = 0;
+	start = bench_now();
+	do {
+		archive_search(devnull, "no-such-word", 0, SEARCH_PAGE_SIZE, 0, &more);
+		iterations++;
+	} while (bench_now() - start < 0.5);
+	printf("%-22s %12.3f\n", "search full scan", (bench_now() - start) * 1e3 / iterations);
+	fclose(devnull);
+
+	bench_remove_room();
+	select_room(NULL);
+	unsetenv("CHAT_ARCHIVE");
+	unsetenv("CHAT_MAX_MESSAGES");
+	return 0;
+}
+
+// 函数：测量不同消息数量的 GET 响应体在各编码下的大小和压缩耗时，并换算为每个客户端每 5 秒拉取一次的流量
+static int bench_compress() {
+	static const int sizes[] = {10, 50, 200};
+	static const int encodings[] = {ENCODING_IDENTITY, ENCODING_GZIP, ENCODING_BROTLI};
+	printf("%-6s %-10s %10s %8s %12s %12s\n", "rows", "encoding", "bytes", "ratio", "us/compress", "MB/h/client");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		sqlite3 *db = bench_seed_messages(sizes[i]);
+		char *body = NULL;
+		size_t body_len = 0;
+		FILE *out = open_memstream(&body, &body_len);
+		bench_get_stream(db, sizes[i], out);
+		fclose(out);
+		sqlite3_close(db);
+
+		for (size_t m = 0; m < sizeof(encodings) / sizeof(encodings[0]); m++) {
+			size_t length = body_len;
+			double us = 0;
+			if (encodings[m] != ENCODING_IDENTITY) {
+				int iterations = 0;
+				double start = bench_now();
+				do {
+					free(compress_body(encodings[m], body, body_len, &length));
+					iterations++;
+				} while (bench_now() - start < 0.3);
+				us = (bench_now() - start) * 1e6 / iterations;
+			}
+			printf("%-6d %-10s %10zu %7.1f%% %12.1f %12.2f\n", sizes[i], encoding_names[encodings[m]], length,
+			       100.0 * length / body_len, us, length * 720 / 1048576.0);
+		}
+		free(body);
+	}
+	return 0;
+}
+
+// 函数：逐字节 URL 解码，作为模糊测试的参照实现（原来的 url_decode）；返回解码后的长度（%00 会解码出 '\0'）
+static size_t bench_url_decode_reference(char *dst, const char *src) {
+	char *start = dst;
+	while (*src) {
+		if (src[0] == '%' && isxdigit((unsigned char)src[1]) && isxdigit((unsigned char)src[2])) {
+			*dst++ = (char)(hex_value(src[1]) * 16 + hex_value(src[2]));
+			src += 3;
+		} else if (*src == '+') {
+			*dst++ = ' ';
+			src++;
+		} else {
+			*dst++ = *src++;
+		}
+	}
+	*dst = '\0';
+	return dst - start;
+}
+
+// 函数：生成随机的表单数据，偏向 '%'、'+'、'&'、'=' 和不完整的 %xx，长度跨越多个读取块
+static size_t bench_random_form(char *buf, size_t max_len, unsigned int *seed) {
+	static const char alphabet[] = "%%%++&&==abcXYZ019fF \t\xe4\xbd\xa0";
+	size_t len = rand_r(seed) % 4 == 0 ? rand_r(seed) % max_len : rand_r(seed) % 64;
+	for (size_t i = 0; i < len; i++) {
+		int r = rand_r(seed) % 8;
+		buf[i] = r == 0 ? (char)(1 + rand_r(seed) % 255) : alphabet[rand_r(seed) % (sizeof(alphabet) - 1)];
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+// 函数：对比流式表单读取、查询字符串解析与参照实现的结果；不一致时打印输入并返回 1
+static int bench_parse_fuzz(int iterations) {
+	const size_t max_len = FORM_READ_CHUNK * 3;
+	char *input = malloc(max_len + 1), *copy = malloc(max_len + 1);
+	char *expected = malloc(max_len + 1), *actual = malloc(max_len + 1);
+	unsigned int seed = 12345;
+	int failures = 0;
+	for (int it = 0; it < iterations && failures == 0; it++) {
+		size_t len = bench_random_form(input, max_len, &seed);
+		size_t truncate = 1 + rand_r(&seed) % 32; // 同时检查截断后的结果是完整结果的前缀
+
+		// url_decode_n 与参照实现（输入中可能含有 '\0' 之外的任意字节）
+		size_t expected_len = bench_url_decode_reference(expected, input);
+		size_t n = url_decode_n(actual, max_len + 1, input, len);
+		if (n != expected_len || memcmp(actual, expected, n) != 0) failures++;
+		memcpy(copy, input, len + 1);
+		url_decode_n(copy, truncate, copy, len); // 原地解码并截断
+		size_t kept = n < truncate - 1 ? n : truncate - 1;
+		if (memcmp(copy, expected, kept) != 0 || copy[kept] != '\0') failures++;
+
+		// form_reader 与 strtok_r 切分 + 参照解码（名称同样解码）
+		FILE *in = fmemopen(input, len > 0 ? len : 1, "r");
+		form_reader reader;
+		form_reader_init(&reader, in, len);
+		memcpy(copy, input, len + 1);
+		char *rest = copy, *token;
+		char name[64], ref_name[64];
+		while ((token = strtok_r(rest, "&", &rest)) != NULL && failures == 0) {
+			char *value = strchr(token, '=');
+			if (value == NULL) continue;
+			*value++ = '\0';
+			if (strlen(token) >= sizeof(ref_name) * 3) token[sizeof(ref_name) * 3 - 1] = '\0';
+			bench_url_decode_reference(expected, token);
+			snprintf(ref_name, sizeof(ref_name), "%s", expected); // 名称中的 %00 两边都会在此处截断
+			if (form_next_name(&reader, name, sizeof(name)) != 1 || strcmp(name, ref_name) != 0) {
+				failures++;
+				break;
+			}
+			expected_len = bench_url_decode_reference(expected, value);
+			size_t value_len = form_read_value(&reader, actual, truncate);
+			kept = value_len < truncate - 1 ? value_len : truncate - 1;
+			if (value_len != expected_len || memcmp(actual, expected, kept) != 0) failures++;
+		}
+		if (failures == 0 && form_next_name(&reader, name, sizeof(name)) != 0) failures++;
+		fclose(in);
+
+		// parse_fields 与 strtok_r 切分（只比较字段数量和值）
+		form_field fields[MAX_FORM_FIELDS];
+		int count = parse_fields(input, '&', fields, MAX_FORM_FIELDS);
+		memcpy(copy, input, len + 1);
+		rest = copy;
+		int ref_count = 0;
+		while ((token = strtok_r(rest, "&", &rest)) != NULL && ref_count < MAX_FORM_FIELDS) {
+			char *value = strchr(token, '=');
+			if (value == NULL) continue;
+			value++;
+			if (fields[ref_count].value.len != strlen(value) || memcmp(fields[ref_count].value.data, value, strlen(value)) != 0) {
+				failures++;
+			}
+			ref_count++;
+		}
+		if (count != ref_count) failures++;
+
+		if (failures) {
+			fprintf(stderr, "Parser mismatch at iteration %d for input (%zu bytes): %.200s\n", it, len, input);
+		}
+	}
+	free(input);
+	free(copy);
+	free(expected);
+	free(actual);
+	return failures != 0;
+}
+
+// 函数：模糊测试请求解析，并比较原来的复制 + strtok_r + 逐字节解码与单遍流式解析的耗时
+static int bench_parse() {
+	int iterations = config_int("CHAT_BENCH_FUZZ_ITERATIONS", 200000);
+	if (bench_parse_fuzz(iterations) != 0) return 1;
+	printf("fuzz: %d random inputs match the reference parser\n", iterations);
+
+	// 典型的批量发送请求体：几条含中文和标点的消息
+	static const char *bodies[] = {
+		"message=hello",
+		"message=%E4%BD%A0%E5%A5%BD%EF%BC%8C%E4%B8%96%E7%95%8C+hello+world%21&message=second+message",
+		NULL,
+	};
+	char long_body[8192];
+	int len = 0;
+	for (int i = 0; i < 8; i++) {
+		len += snprintf(long_body + len, sizeof(long_body) - len, "%smessage=", i ? "&" : "");
+		for (int j = 0; j < 120 && len < (int)sizeof(long_body) - 16; j++) {
+			len += snprintf(long_body + len, sizeof(long_body) - len, j % 10 == 0 ? "%%E4%%BD%%A0" : "word+");
+		}
+	}
+	bodies[2] = long_body;
+
+	printf("%-8s %14s %14s\n", "bytes", "old ns/body", "stream ns/body");
+	for (size_t b = 0; b < sizeof(bodies) / sizeof(bodies[0]); b++) {
+		size_t body_len = strlen(bodies[b]);
+		double results[2];
+		for (int strategy = 0; strategy < 2; strategy++) {
+			int count = 0;
+			double start = bench_now();
+			do {
+				FILE *in = fmemopen((void *)bodies[b], body_len, "r");
+				if (strategy == 0) {
+					// 原来的做法：读入固定缓冲区，strtok_r 切分，逐字节解码
+					static char post_data[65536 + 1];
+					size_t n = fread(post_data, 1, body_len, in);
+					post_data[n] = '\0';
+					char *rest = post_data, *token;
+					while ((token = strtok_r(rest, "&", &rest)) != NULL) {
+						char *value = strchr(token, '=');
+						if (value == NULL) continue;
+						*value++ = '\0';
+						char decoded[MAX_MESSAGE_LENGTH + 1];
+						if (strlen(value) > MAX_MESSAGE_LENGTH) value[MAX_MESSAGE_LENGTH] = '\0';
+						if (strcmp(token, "message") == 0) bench_url_decode_reference(decoded, value);
+					}
+				} else {
+					form_reader reader;
+					char key[16], value[MAX_MESSAGE_LENGTH + 1];
+					form_reader_init(&reader, in, body_len);
+					while (form_next_name(&reader, key, sizeof(key)) > 0) {
+						form_read_value(&reader, strcmp(key, "message") == 0 ? value : NULL, sizeof(value));
+					}
+				}
+				fclose(in);
+				count++;
+			} while (bench_now() - start < 0.3);
+			results[strategy] = (bench_now() - start) * 1e9 / count;
+		}
+		printf("%-8zu %14.0f %14.0f\n", body_len, results[0], results[1]);
+	}
+
+	// 单独比较解码：长消息中只有少量需要解码的字符
+	char text[MAX_MESSAGE_LENGTH + 1], decoded[MAX_MESSAGE_LENGTH + 1];
+	for (int i = 0; i < MAX_MESSAGE_LENGTH; i++) text[i] = i % 64 == 63 ? '+' : 'a' + i % 26;
+	text[MAX_MESSAGE_LENGTH] = '\0';
+	double results[2];
+	for (int strategy = 0; strategy < 2; strategy++) {
+		int count = 0;
+		double start = bench_now();
+		do {
+			if (strategy == 0) bench_url_decode_reference(decoded, text);
+			else url_decode_n(decoded, sizeof(decoded), text, MAX_MESSAGE_LENGTH);
+			count++;
+		} while (bench_now() - start < 0.3);
+		results[strategy] = (bench_now() - start) * 1e9 / count;
+	}
+	printf("url_decode of %d bytes: %.0f ns byte-by-byte, %.0f ns with %s scan\n", MAX_MESSAGE_LENGTH, results[0], results[1],
+#ifdef __SSE2__
+	       "SSE2"
+#else
+	       "scalar"
+#endif
+	);
+	return 0;
+}
+
+// 函数：测量计时和记录直方图的开销，确认可以在生产环境中常开
+static int bench_timing() {
+	const int iterations = 1000000;
+	char dir[] = "/tmp/chat_bench_timing.XXXXXX";
+	if (mkdtemp(dir) == NULL) return 1;
+	setenv("CHAT_DATA_DIR", dir, 1);
+	configure_paths();
+
+	double start = bench_now();
+	for (int i = 0; i < iterations; i++) {
+		long long t = timer_now();
+		timer_add(PHASE_QUERY, t);
+	}
+	double timer_ns = (bench_now() - start) * 1e9 / iterations;
+
+	// 一个典型的 POST 请求经过 7 个阶段
+	static const int post_phases[] = {PHASE_OPEN, PHASE_RATE_LIMIT, PHASE_AUTH, PHASE_QUEUE, PHASE_INSERT, PHASE_PRUNE, PHASE_SNAPSHOT};
+	timer_reset();
+	for (int i = 0; i < 7; i++) g_phase_ns[post_phases[i]] = 1000LL * (i + 1) * 37;
+	start = bench_now();
+	for (int i = 0; i < iterations; i++) metrics_record();
+	double record_ns = (bench_now() - start) * 1e9 / iterations;
+
+	start = bench_now();
+	for (int i = 0; i < iterations; i++) server_timing_header();
+	double header_ns = (bench_now() - start) * 1e9 / iterations;
+
+	printf("%-26s %10s\n", "operation", "ns/op");
+	printf("%-26s %10.1f\n", "timer pair", timer_ns);
+	printf("%-26s %10.1f\n", "metrics_record (8 phases)", record_ns);
+	printf("%-26s %10.1f\n", "Server-Timing header", header_ns);
+
+	unlink(g_metrics_path);
+	rmdir(dir);
+	return 0;
+}
+
+// 函数：测量令牌桶检查的开销（单进程命中、不同 IP 占用槽位、多进程争用同一个槽位）
+static int bench_ratelimit() {
+	const int iterations = 1000000;
+	const int processes = 4;
+	char dir[] = "/tmp/chat_bench_ratelimit.XXXXXX";
+	if (mkdtemp(dir) == NULL) return 1;
+	setenv("CHAT_DATA_DIR", dir, 1);
+	configure_paths();
+	int retry_after = 0;
+
+	// 速率设得足够高，测的是检查本身而不是拒绝路径
+	double start = bench_now();
+	for (int i = 0; i < iterations; i++) rate_limit_take(RATE_SCOPE_IP, "203.0.113.42", 1, 1000000, 100000, &retry_after);
+	double hit_ns = (bench_now() - start) * 1e9 / iterations;
+
+	char ips[1000][16];
+	for (int i = 0; i < 1000; i++) snprintf(ips[i], sizeof(ips[i]), "10.%d.%d.%d", i / 250, i % 250, (i * 7) % 256);
+	start = bench_now();
+	for (int i = 0; i < iterations; i++) rate_limit_take(RATE_SCOPE_IP, ips[i % 1000], 1, 1000000, 100000, &retry_after);
+	double spread_ns = (bench_now() - start) * 1e9 / iterations;
+
+	// 多个进程对同一个用户的令牌桶做 CAS
+	start = bench_now();
+	for (int p = 0; p < processes; p++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			for (int i = 0; i < iterations; i++) rate_limit_take(RATE_SCOPE_USER, "bench", 1, 1000000, 100000, &retry_after);
+			_exit(0);
+		}
+	}
+	while (wait(NULL) > 0) {}
+	double contended_ns = (bench_now() - start) * 1e9 / iterations;
+
+	// 默认限制下连续发送，统计被拒绝的次数
+	int allowed = 0;
+	for (int i = 0; i < 100; i++) {
+		if (!rate_limit_take(RATE_SCOPE_IP, "198.51.100.7", 1, RATE_IP_PER_MINUTE, RATE_IP_BURST, &retry_after)) allowed++;
+	}
+
+	printf("%-34s %10s\n", "operation", "ns/op");
+	printf("%-34s %10.1f\n", "same IP", hit_ns);
+	printf("%-34s %10.1f\n", "1000 distinct IPs", spread_ns);
+	printf("%-34s %10.1f\n", "same user, 4 processes (wall/op)", contended_ns);
+	printf("100 rapid posts at default limits: %d allowed, retry after %d s; table full %llu\n",
+	       allowed, retry_after, __atomic_load_n(&g_rate_limit->table_full, __ATOMIC_RELAXED));
+
+	munmap(g_rate_limit, sizeof(struct rate_limit_file));
+	g_rate_limit = NULL;
+	unlink(g_rate_limit_path);
+	rmdir(dir);
+	return 0;
+}
+
+// ---------- cgi：把 chat_handler.cgi 当作独立进程端到端运行 ----------
+// 与 Web 服务器一样为每个请求 fork/exec 一次，通过环境变量和标准输入传入请求，
+// 测得的延迟包含进程启动、打开数据库和会话验证。数据放在临时目录（CHAT_DATA_DIR），不影响正式数据。
+
+#define BENCH_CGI_PASSWORD "benchpw"
+#define BENCH_CGI_RESPONSE_SIZE 4096 // 保留的响应开头（用于读取状态码和 Set-Cookie）
+
+// 一次 CGI 请求
+typedef struct {
+	const char *method;
+	char query[128];
+	char body[256];
+	char cookie[SESSION_TOKEN_SIZE + 64];
+} bench_cgi_request;
+
+static const char *g_bench_cgi_path; // 被测的 CGI 程序
+static char g_bench_cgi_dir[64]; // 临时数据目录
+static char g_bench_cgi_session[SESSION_TOKEN_SIZE]; // 基准用户的会话令牌
+
+// 函数：运行一次 CGI 程序，返回响应的 HTTP 状态码（无法运行时返回 0）
+// response 不为 NULL 时保存响应的开头
+static int bench_cgi_run(const bench_cgi_request *req, char *response, size_t response_size) {
+	char env[7][SESSION_TOKEN_SIZE + 96];
+	snprintf(env[0], sizeof(env[0]), "REQUEST_METHOD=%s", req->method);
+	snprintf(env[1], sizeof(env[1]), "QUERY_STRING=%s", req->query);
+	snprintf(env[2], sizeof(env[2]), "CONTENT_LENGTH=%zu", strlen(req->body));
+	snprintf(env[3], sizeof(env[3]), "HTTP_COOKIE=%s", req->cookie);
+	snprintf(env[4], sizeof(env[4]), "CHAT_DATA_DIR=%s", g_bench_cgi_dir);
+	snprintf(env[5], sizeof(env[5]), "REMOTE_ADDR=203.0.113.42");
+	snprintf(env[6], sizeof(env[6]), "HTTP_ACCEPT_ENCODING=gzip, deflate, br");
+	// 保留全部消息，避免写入负载触发清理和归档，使各数据量下的结果可比；
+	// 所有请求来自同一个 IP 和用户，关闭发送频率限制
+	char *envp[] = {env[0], env[1], env[2], env[3], env[4], env[5], env[6], "CHAT_MAX_MESSAGES=1000000000", "CHAT_RATE_LIMIT=0", NULL};
+	char *argv[] = {(char *)g_bench_cgi_path, NULL};
+
+	int in_pipe[2], out_pipe[2];
+	if (pipe(in_pipe) != 0) return 0;
+	if (pipe(out_pipe) != 0) {
+		close(in_pipe[0]);
+		close(in_pipe[1]);
+		return 0;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		dup2(in_pipe[0], STDIN_FILENO);
+		dup2(out_pipe[1], STDOUT_FILENO);
+		int null_fd = open("/dev/null", O_WRONLY); // 诊断信息相当于 Web 服务器的错误日志，不计入输出
+		if (null_fd >= 0) dup2(null_fd, STDERR_FILENO);
+		close(in_pipe[0]);
+		close(in_pipe[1]);
+		close(out_pipe[0]);
+		close(out_pipe[1]);
+		execve(g_bench_cgi_path, argv, envp);
+		_exit(127);
+	}
+	close(in_pipe[0]);
+	close(out_pipe[1]);
+	if (pid > 0 && req->body[0]) {
+		// 请求体远小于管道容量，一次写入不会阻塞
+		if (write(in_pipe[1], req->body, strlen(req->body)) < 0) pid = -1;
+	}
+	close(in_pipe[1]);
+
+	char head[BENCH_CGI_RESPONSE_SIZE];
+	size_t kept = 0;
+	ssize_t n;
+	char discard[16384];
+	while (pid > 0) {
+		if (kept < sizeof(head) - 1) {
+			n = read(out_pipe[0], head + kept, sizeof(head) - 1 - kept);
+			if (n > 0) kept += n;
+		} else {
+			n = read(out_pipe[0], discard, sizeof(discard));
+		}
+		if (n == 0 || (n < 0 && errno != EINTR)) break;
+	}
+	close(out_pipe[0]);
+	head[kept] = '\0';
+
+	int wstatus;
+	if (pid < 0 || waitpid(pid, &wstatus, 0) != pid || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) == 127) return 0;
+	if (response != NULL) snprintf(response, response_size, "%s", head);
+	return strncmp(head, "Status: ", 8) == 0 ? atoi(head + 8) : 200; // CGI 规范：没有 Status 头时为 200
+}
+
+// 函数：生成负载 mix 中第 client 个客户端的第 i 个请求
+// rows 为当前数据量，concurrency 用于区分不同轮次注册的用户名
+static void bench_cgi_next(const char *mix, int rows, int concurrency, int client, int i, bench_cgi_request *req) {
+	req->method = "GET";
+	req->query[0] = req->body[0] = req->cookie[0] = '\0';
+	if (strcmp(mix, "mixed") == 0) {
+		// 浏览为主：80% 读取最新消息，15% 发送消息，5% 登录
+		int slot = i % 20;
+		mix = slot < 16 ? "get" : slot < 19 ? "post" : "login";
+	}
+
+	if (strcmp(mix, "get") == 0) {
+		return; // 默认聊天室的最新消息
+	}
+	if (strcmp(mix, "history") == 0) {
+		long long before = rows > 0 ? rows + 1 - (i * 7919LL) % rows : 1;
+		snprintf(req->query, sizeof(req->query), "before=%lld&limit=%d", before, MAX_MESSAGES_GET);
+		return;
+	}
+	if (strcmp(mix, "post") == 0) {
+		req->method = "POST";
+		snprintf(req->body, sizeof(req->body), "message=bench+client+%d+message+%d+%%E4%%BD%%A0%%E5%%A5%%BD", client, i);
+		snprintf(req->cookie, sizeof(req->cookie), "session=%s", g_bench_cgi_session);
+		return;
+	}
+	if (strcmp(mix, "auth") == 0) {
+		// 用户名和密码 Cookie 发送消息：每个请求都要查询密码
+		req->method = "POST";
+		snprintf(req->body, sizeof(req->body), "message=password+auth+%d", i);
+		snprintf(req->cookie, sizeof(req->cookie), "username=bench; password=" BENCH_CGI_PASSWORD);
+		return;
+	}
+	if (strcmp(mix, "login") == 0) {
+		req->method = "POST";
+		snprintf(req->query, sizeof(req->query), "action=login");
+		snprintf(req->body, sizeof(req->body), "username=bench&password=" BENCH_CGI_PASSWORD);
+		return;
+	}
+	// user：依次注册、修改密码、删除账户
+	char username[64];
+	snprintf(username, sizeof(username), "bench_%d_%d_%d_%d", rows, concurrency, client, i / 3);
+	switch (i % 3) {
+	case 0:
+		req->method = "POST";
+		snprintf(req->query, sizeof(req->query), "action=register");
+		snprintf(req->body, sizeof(req->body), "username=%s&password=old", username);
+		break;
+	case 1:
+		req->method = "POST";
+		snprintf(req->query, sizeof(req->query), "action=update");
+		snprintf(req->body, sizeof(req->body), "username=%s&password=old&new_password=new", username);
+		break;
+	default:
+		req->method = "DELETE";
+		snprintf(req->query, sizeof(req->query), "action=delete");
+		snprintf(req->cookie, sizeof(req->cookie), "username=%s; password=new", username);
+		break;
+	}
+}
+
+// 函数：把默认聊天室的消息补足到 rows 条（直接写入数据库，全文索引由触发器维护）
+static int bench_cgi_seed(int rows) {
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	if (db_acquire_room(&db) != SQLITE_OK) return 1;
+	sqlite3_exec(db, "BEGIN;", 0, 0, 0);
+	sqlite3_prepare_v2(db, "SELECT count(*) FROM messages;", -1, &stmt, 0);
+	int existing = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : 0;
+	sqlite3_finalize(stmt);
+	sqlite3_prepare_v2(db, "INSERT INTO messages (timestamp, ip, username, message) VALUES (?, ?, ?, ?);", -1, &stmt, 0);
+	for (int i = existing; i < rows; i++) {
+		char message[160];
+		snprintf(message, sizeof(message), "第 %d 条消息：hello \"world\" \\ path/to/file\tend", i);
+		sqlite3_bind_int64(stmt, 1, time(NULL) - rows + i);
+		sqlite3_bind_text(stmt, 2, "203.0.113.42", -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 3, i % 3 ? "alice" : "bob", -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 4, message, -1, SQLITE_TRANSIENT);
+		sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+	int rc = sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+	db_shutdown();
+	return rc != SQLITE_OK;
+}
+
+// 函数：删除目录及其中的文件（只处理基准测试生成的文件和一层子目录）
+static void bench_remove_tree(const char *dir) {
+	ring_unmap();
+	struct dirent **names;
+	int n = scandir(dir, &names, NULL, alphasort);
+	for (int i = 0; i < n; i++) {
+		if (strcmp(names[i]->d_name, ".") != 0 && strcmp(names[i]->d_name, "..") != 0) {
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "%s/%s", dir, names[i]->d_name);
+			if (unlink(path) != 0 && errno == EISDIR) bench_remove_tree(path);
+		}
+		free(names[i]);
+	}
+	if (n >= 0) free(names);
+	rmdir(dir);
+}
+
+// 函数：比较 double 的大小，用于 qsort
+static int bench_compare_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+// 函数：由 clients 个客户端进程并发发出共 requests 个请求，输出延迟分位数和吞吐量
+static void bench_cgi_load(const char *mix, int rows, int clients, int requests) {
+	int per_client = requests / clients;
+	requests = per_client * clients;
+	// 各客户端把每个请求的延迟和错误数写入共享内存，父进程汇总
+	size_t shared_size = requests * sizeof(double) + clients * sizeof(int);
+	double *latencies = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (latencies == MAP_FAILED) return;
+	int *errors = (int *)(latencies + requests);
+
+	double start = bench_now();
+	for (int c = 0; c < clients; c++) {
+		if (fork() != 0) continue;
+		for (int i = 0; i < per_client; i++) {
+			bench_cgi_request req;
+			bench_cgi_next(mix, rows, clients, c, i, &req);
+			double t = bench_now();
+			int status = bench_cgi_run(&req, NULL, 0);
+			latencies[c * per_client + i] = bench_now() - t;
+			if (status == 0 || status >= 400) errors[c]++;
+		}
+		_exit(0);
+	}
+	while (wait(NULL) > 0) {
+	}
+	double elapsed = bench_now() - start;
+
+	int error_count = 0;
+	for (int c = 0; c < clients; c++) error_count += errors[c];
+	qsort(latencies, requests, sizeof(double), bench_compare_double);
+	// 第 q 分位数取排序后第 ceil(q * n) 个样本
+	double p50 = latencies[(requests * 500 + 999) / 1000 - 1];
+	double p99 = latencies[(requests * 990 + 999) / 1000 - 1];
+	double p999 = latencies[(requests * 999 + 999) / 1000 - 1];
+	printf("%-8d %-8s %7d %8d %6d %9.2f %9.2f %9.2f %9.0f\n", rows, mix, clients, requests, error_count,
+	       p50 * 1e3, p99 * 1e3, p999 * 1e3, requests / elapsed);
+	fflush(stdout);
+	munmap(latencies, shared_size);
+}
+
+// 函数：在不同数据量下以单客户端和并发客户端运行各类负载
+// CHAT_BENCH_CGI 指定被测程序（默认 ./chat_handler.cgi），CHAT_BENCH_CGI_REQUESTS 为每组请求数，
+// CHAT_BENCH_CGI_CLIENTS 为并发客户端数，CHAT_BENCH_CGI_MAX_ROWS 限制最大数据量
+static int bench_cgi() {
+	static const int sizes[] = {0, 10000, 100000};
+	static const char *mixes[] = {"get", "history", "post", "auth", "login", "user", "mixed"};
+	int requests = config_int("CHAT_BENCH_CGI_REQUESTS", 1000);
+	int clients = config_int("CHAT_BENCH_CGI_CLIENTS", 8);
+	int max_rows = config_int("CHAT_BENCH_CGI_MAX_ROWS", 100000);
+	g_bench_cgi_path = getenv("CHAT_BENCH_CGI");
+	if (g_bench_cgi_path == NULL) g_bench_cgi_path = "./chat_handler.cgi";
+	if (access(g_bench_cgi_path, X_OK) != 0) {
+		fprintf(stderr, "CGI program %s not found; run make first.\n", g_bench_cgi_path);
+		return 1;
+	}
+
+	snprintf(g_bench_cgi_dir, sizeof(g_bench_cgi_dir), "/tmp/chat_bench_cgi.XXXXXX");
+	if (mkdtemp(g_bench_cgi_dir) == NULL) return 1;
+	setenv("CHAT_DATA_DIR", g_bench_cgi_dir, 1);
+	configure_paths();
+
+	// 注册基准用户并登录，取得会话令牌
+	bench_cgi_request req = {"POST", "action=register", "username=bench&password=" BENCH_CGI_PASSWORD, ""};
+	char response[BENCH_CGI_RESPONSE_SIZE];
+	int status = bench_cgi_run(&req, NULL, 0);
+	snprintf(req.query, sizeof(req.query), "action=login");
+	if (status == 0 || status >= 400 || bench_cgi_run(&req, response, sizeof(response)) != 200) {
+		fprintf(stderr, "Failed to set up the benchmark user (status %d).\n", status);
+		bench_remove_tree(g_bench_cgi_dir);
+		return 1;
+	}
+	char *cookie = strstr(response, "Set-Cookie: session=");
+	if (cookie != NULL) sscanf(cookie + 20, "%[^;\r\n]", g_bench_cgi_session);
+
+	printf("%-8s %-8s %7s %8s %6s %9s %9s %9s %9s\n", "rows", "mix", "clients", "requests", "errors",
+	       "p50 ms", "p99 ms", "p999 ms", "req/s");
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && sizes[s] <= max_rows; s++) {
+		if (bench_cgi_seed(sizes[s]) != 0) {
+			fprintf(stderr, "Failed to seed %d messages.\n", sizes[s]);
+			break;
+		}
+		for (size_t m = 0; m < sizeof(mixes) / sizeof(mixes[0]); m++) {
+			bench_cgi_load(mixes[m], sizes[s], 1, requests);
+			if (clients > 1) bench_cgi_load(mixes[m], sizes[s], clients, requests);
+		}
+	}
+
+	bench_remove_tree(g_bench_cgi_dir);
+	return 0;
+}
+
+// ---------- session：会话令牌的验证与撤销 ----------
+
+// 函数：记录一项检查的结果，失败时计数
+static void bench_session_check(const char *name, int passed, int *failures) {
+	printf("%-60s %s\n", name, passed ? "ok" : "FAIL");
+	if (!passed) (*failures)++;
+}
+
+// 函数：用指定的密钥、过期时间和撤销纪元签发令牌（与 session_issue_token 的格式相同）
+static void bench_session_forge(const session_key *key, long long expires, long long epoch, const char *username, char *token,
+                                size_t token_size) {
+	char encoded[SESSION_TOKEN_SIZE];
+	base64url_encode((const unsigned char *)username, strlen(username), encoded);
+	int len = snprintf(token, token_size, "%ld.%lld.%lld.%s", key->id, expires, epoch, encoded);
+	unsigned char mac[32];
+	session_mac(key, token, len, mac);
+	token[len] = '.';
+	base64url_encode(mac, sizeof(mac), token + len + 1);
+}
+
+// 函数：登录并取出会话令牌，失败返回非 0
+static int bench_session_login(const char *username, const char *password, char *token) {
+	bench_cgi_request req = {"POST", "action=login", "", ""};
+	snprintf(req.body, sizeof(req.body), "username=%s&password=%s", username, password);
+	char response[BENCH_CGI_RESPONSE_SIZE];
+	if (bench_cgi_run(&req, response, sizeof(response)) != 200) return 1;
+	char *cookie = strstr(response, "Set-Cookie: session=");
+	if (cookie == NULL || sscanf(cookie + 20, "%511[^;\r\n]", token) != 1) return 1;
+	return 0;
+}
+
+// 函数：带会话令牌的 CGI 请求发送一条消息，返回状态码
+static int bench_session_post(const char *token) {
+	bench_cgi_request req = {"POST", "", "message=session+check", ""};
+	snprintf(req.cookie, sizeof(req.cookie), "session=%s", token);
+	return bench_cgi_run(&req, NULL, 0);
+}
+
+// 函数：令牌在本进程中验证通过、用户名正确，且 CGI 程序接受它发送的消息
+static int bench_session_accepted(const char *token, const char *username) {
+	char name[256];
+	return session_verify_token(token, name, sizeof(name)) && strcmp(name, username) == 0 && bench_session_post(token) == 200;
+}
+
+// 函数：令牌在本进程中验证失败，CGI 程序也以 401 拒绝
+static int bench_session_rejected(const char *token) {
+	char name[256];
+	return !session_verify_token(token, name, sizeof(name)) && bench_session_post(token) == 401;
+}
+
+// 函数：同时为 count 个用户 bench_race_<i> 把密码从 pw<round> 改为 pw<round+1>（每个用户一个进程，同时开始），
+// 返回成功的请求数
+static int bench_session_concurrent_updates(int count, int round) {
+	int barrier[2];
+	if (pipe(barrier) != 0) return 0;
+	pid_t pids[64];
+	for (int i = 0; i < count; i++) {
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			char go;
+			close(barrier[1]);
+			if (read(barrier[0], &go, 1) < 0) _exit(1); // 等待全部进程就绪后一起开始
+			bench_cgi_request req = {"POST", "action=update", "", ""};
+			snprintf(req.body, sizeof(req.body), "username=bench_race_%d&password=pw%d&new_password=pw%d", i, round, round + 1);
+			_exit(bench_cgi_run(&req, NULL, 0) == 200 ? 0 : 1);
+		}
+	}
+	close(barrier[0]);
+	close(barrier[1]); // 关闭写端，所有子进程的 read 同时返回
+	int succeeded = 0;
+	for (int i = 0; i < count; i++) {
+		int wstatus;
+		if (pids[i] > 0 && waitpid(pids[i], &wstatus, 0) == pids[i] && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0) succeeded++;
+	}
+	return succeeded;
+}
+
+// 函数：检查会话令牌的签名、过期、密钥轮换和撤销（修改密码、删除账户、撤销纪元文件丢失），任何一项不符即失败；
+// 再让多个用户同时修改密码，检查每个用户之前的令牌都被拒绝（并发撤销不能互相覆盖撤销纪元文件）；最后测量一次验证的耗时。
+// CHAT_BENCH_CGI 指定被测程序，CHAT_BENCH_SESSION_ITERATIONS 为计时的验证次数（默认 20000），
+// CHAT_BENCH_SESSION_USERS 为同时修改密码的用户数（默认 16，最多 64），CHAT_BENCH_SESSION_ROUNDS 为轮数（默认 5）
+static int bench_session() {
+	int iterations = config_int("CHAT_BENCH_SESSION_ITERATIONS", 20000);
+	int race_users = config_int("CHAT_BENCH_SESSION_USERS", 16);
+	int race_rounds = config_int("CHAT_BENCH_SESSION_ROUNDS", 5);
+	if (race_users > 64) race_users = 64;
+	g_bench_cgi_path = getenv("CHAT_BENCH_CGI");
+	if (g_bench_cgi_path == NULL) g_bench_cgi_path = "./chat_handler.cgi";
+	if (access(g_bench_cgi_path, X_OK) != 0) {
+		fprintf(stderr, "CGI program %s not found; run make first.\n", g_bench_cgi_path);
+		return 1;
+	}
+	snprintf(g_bench_cgi_dir, sizeof(g_bench_cgi_dir), "/tmp/chat_bench_session.XXXXXX");
+	if (mkdtemp(g_bench_cgi_dir) == NULL) return 1;
+	setenv("CHAT_DATA_DIR", g_bench_cgi_dir, 1);
+	configure_paths();
+
+	int failures = 0;
+	char token[SESSION_TOKEN_SIZE], forged[SESSION_TOKEN_SIZE], name[256];
+	bench_cgi_request req = {"POST", "action=register", "username=alice&password=pw1", ""};
+	if (bench_cgi_run(&req, NULL, 0) != 200 || bench_session_login("alice", "pw1", token) != 0) {
+		fprintf(stderr, "Failed to set up the session test user.\n");
+		bench_remove_tree(g_bench_cgi_dir);
+		return 1;
+	}
+	bench_session_check("fresh token accepted", bench_session_accepted(token, "alice"), &failures);
+
+	// 签名：逐个翻转 HMAC 的每个字节
+	char *mac_part = strrchr(token, '.') + 1;
+	size_t payload_len = mac_part - token;
+	unsigned char mac[SESSION_TOKEN_SIZE];
+	int mac_len = base64url_decode(mac_part, strlen(mac_part), mac);
+	int flipped_accepted = mac_len != 32;
+	for (int i = 0; i < mac_len; i++) {
+		mac[i] ^= 1 << (i % 8);
+		memcpy(forged, token, payload_len);
+		base64url_encode(mac, mac_len, forged + payload_len);
+		if (session_verify_token(forged, name, sizeof(name))) flipped_accepted++;
+		if (i == 0 && bench_session_post(forged) != 401) flipped_accepted++;
+		mac[i] ^= 1 << (i % 8);
+	}
+	bench_session_check("token with any MAC byte flipped rejected (32 of 32)", !flipped_accepted, &failures);
+
+	// 过期：用当前密钥签发已过期的令牌（对照：同样签发的未过期令牌应通过）
+	session_key keys[SESSION_MAX_KEYS];
+	int key_count = session_load_keys(keys);
+	long long now = time(NULL);
+	bench_session_forge(&keys[0], now + 60, 0, "alice", forged, sizeof(forged));
+	int control = key_count > 0 && bench_session_accepted(forged, "alice");
+	bench_session_forge(&keys[0], now - 1, 0, "alice", forged, sizeof(forged));
+	bench_session_check("expired token rejected", key_count > 0 && control && bench_session_rejected(forged), &failures);
+
+	// 密钥轮换：保留 SESSION_MAX_KEYS 个密钥，之前签发的令牌在被淘汰前仍然有效
+	int old_accepted = 1;
+	for (int i = 0; i < SESSION_MAX_KEYS - 1; i++) {
+		session_rotate_key();
+		old_accepted &= bench_session_accepted(token, "alice");
+	}
+	bench_session_check("token accepted while its key is among the kept keys", old_accepted, &failures);
+	session_rotate_key();
+	bench_session_check("token signed by a rotated-out key rejected", bench_session_rejected(token), &failures);
+
+	// 修改密码：之前签发的令牌失效，新登录的令牌有效
+	char before_update[SESSION_TOKEN_SIZE];
+	if (bench_session_login("alice", "pw1", before_update) != 0) failures++;
+	req = (bench_cgi_request){"POST", "action=update", "username=alice&password=pw1&new_password=pw2", ""};
+	int status = bench_cgi_run(&req, NULL, 0);
+	bench_session_check("token issued before password update rejected", status == 200 && bench_session_rejected(before_update),
+	                    &failures);
+	char after_update[SESSION_TOKEN_SIZE];
+	bench_session_check("token issued after password update accepted",
+	                    bench_session_login("alice", "pw2", after_update) == 0 && bench_session_accepted(after_update, "alice"),
+	                    &failures);
+
+	// 删除账户：之前签发的令牌失效
+	req = (bench_cgi_request){"DELETE", "action=delete", "", "username=alice; password=pw2"};
+	status = bench_cgi_run(&req, NULL, 0);
+	bench_session_check("token issued before account deletion rejected", status == 200 && bench_session_rejected(after_update),
+	                    &failures);
+
+	// 撤销纪元文件丢失：退回查询数据库，已撤销的令牌仍被拒绝，并重建文件
+	struct stat st;
+	unlink(g_session_revocations_path);
+	int rejected = !session_verify_token(after_update, name, sizeof(name));
+	bench_session_check("revoked token rejected after revocations file is deleted", rejected, &failures);
+	bench_session_check("revocations file rebuilt from the database", stat(g_session_revocations_path, &st) == 0, &failures);
+	unlink(g_session_revocations_path);
+	bench_session_check("revoked token rejected by the CGI without the file", bench_session_post(after_update) == 401, &failures);
+	req = (bench_cgi_request){"POST", "action=register", "username=bob&password=pw", ""};
+	unlink(g_session_revocations_path);
+	bench_session_check("unrevoked token accepted without the file",
+	                    bench_cgi_run(&req, NULL, 0) == 200 && bench_session_login("bob", "pw", token) == 0 &&
+	                        (unlink(g_session_revocations_path), bench_session_accepted(token, "bob")),
+	                    &failures);
+
+	// 并发撤销：每轮所有用户同时修改密码，之后每个用户之前签发的令牌都必须被拒绝（按撤销纪元文件验证）
+	static char race_tokens[64][SESSION_TOKEN_SIZE];
+	int setup_failed = 0, updates = 0, survived = 0;
+	for (int i = 0; i < race_users; i++) {
+		req = (bench_cgi_request){"POST", "action=register", "", ""};
+		snprintf(req.body, sizeof(req.body), "username=bench_race_%d&password=pw0", i);
+		if (bench_cgi_run(&req, NULL, 0) != 200) setup_failed++;
+	}
+	for (int round = 0; round < race_rounds && !setup_failed; round++) {
+		for (int i = 0; i < race_users; i++) {
+			char username[32], password[16];
+			snprintf(username, sizeof(username), "bench_race_%d", i);
+			snprintf(password, sizeof(password), "pw%d", round);
+			if (bench_session_login(username, password, race_tokens[i]) != 0) setup_failed++;
+		}
+		updates += bench_session_concurrent_updates(race_users, round);
+		for (int i = 0; i < race_users; i++) {
+			if (session_verify_token(race_tokens[i], name, sizeof(name))) survived++;
+		}
+	}
+	char race_name[128];
+	snprintf(race_name, sizeof(race_name), "concurrent updates revoke every old token (%d users x %d)", race_users, race_rounds);
+	bench_session_check(race_name, !setup_failed && updates == race_users * race_rounds && survived == 0, &failures);
+	if (survived > 0 || updates != race_users * race_rounds) {
+		printf("  %d of %d updates succeeded, %d old tokens still accepted\n", updates, race_users * race_rounds, survived);
+	}
+
+	// 验证一个有效令牌的耗时（读取密钥文件和撤销纪元文件、计算 HMAC）
+	double start = bench_now();
+	int verified = 0;
+	for (int i = 0; i < iterations; i++) verified += session_verify_token(token, name, sizeof(name));
+	double elapsed = bench_now() - start;
+	printf("verify: %.2f us per token (%d of %d accepted)\n", elapsed * 1e6 / iterations, verified, iterations);
+	if (failures > 0) printf("%d session check(s) FAILED\n", failures);
+
+	db_shutdown();
+	bench_remove_tree(g_bench_cgi_dir);
+	return failures > 0;
+}
+
+// ---------- ring：GET 读取方式对比 ----------
+
+// 函数：比较共享环、快照文件和实时查询三种方式回应 GET 的耗时，再在持续写入时测量共享环的读取
+// CHAT_BENCH_RING_ITERATIONS 为每种情形的请求次数（默认 20000）
+static int bench_ring() {
+	int iterations = config_int("CHAT_BENCH_RING_ITERATIONS", 20000);
+	char dir[] = "/tmp/chat_bench_ring.XXXXXX";
+	if (mkdtemp(dir) == NULL) return 1;
+	setenv("CHAT_DATA_DIR", dir, 1);
+	configure_paths();
+	unsetenv("HTTP_ACCEPT_ENCODING");
+	unsetenv("HTTP_IF_NONE_MATCH");
+	unsetenv("CHAT_RING");
+	g_db_persistent = 1; // 实时查询复用连接，与 SCGI 工作进程相同
+
+	// 写入 1000 条消息并发布到快照和共享环
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	if (init_database() != 0 || db_acquire_room(&db) != SQLITE_OK) {
+		bench_remove_tree(dir);
+		return 1;
+	}
+	const int rows = 1000;
+	sqlite3_exec(db, "BEGIN;", 0, 0, 0);
+	db_prepare(db, SQL_INSERT_MESSAGE, &stmt);
+	for (int i = 0; i < rows; i++) {
+		char text[96];
+		snprintf(text, sizeof(text), "第 %d 条消息：hello \"world\" \\ path/to/file", i);
+		char *messages[1] = {text};
+		insert_messages(stmt, 1700000000 + i, "203.0.113.42", i % 3 ? "alice" : "bob", messages, 1);
+	}
+	db_finalize(stmt);
+	sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+	ring_note_commit(rows);
+	rebuild_snapshot(db);
+
+	static const struct {
+		const char *name;
+		long long since;
+	} cases[] = {{"poll, nothing new", rows}, {"poll, 1 new", rows - 1}, {"poll, 10 new", rows - 10}};
+	double results[3][3];
+	char snapshot_aside[ROOM_PATH_SIZE + 8];
+	snprintf(snapshot_aside, sizeof(snapshot_aside), "%s.aside", g_room.snapshot_path);
+
+	// 响应写到 /dev/null
+	fflush(stdout);
+	int saved_stdout = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, STDOUT_FILENO);
+	for (int c = 0; c < 3; c++) {
+		double start = bench_now();
+		for (int i = 0; i < iterations; i++) serve_ring(cases[c].since);
+		results[c][0] = (bench_now() - start) * 1e6 / iterations;
+
+		start = bench_now();
+		for (int i = 0; i < iterations; i++) serve_snapshot(cases[c].since);
+		results[c][1] = (bench_now() - start) * 1e6 / iterations;
+
+		// 没有共享环和快照时，handle_get_messages 执行实时查询
+		char query[48];
+		snprintf(query, sizeof(query), "since=%lld", cases[c].since);
+		setenv("QUERY_STRING", query, 1);
+		setenv("CHAT_RING", "0", 1);
+		rename(g_room.snapshot_path, snapshot_aside);
+		start = bench_now();
+		for (int i = 0; i < iterations; i++) handle_get_messages();
+		results[c][2] = (bench_now() - start) * 1e6 / iterations;
+		rename(snapshot_aside, g_room.snapshot_path);
+		unsetenv("CHAT_RING");
+		unsetenv("QUERY_STRING");
+	}
+	fflush(stdout);
+
+	// 另一个进程不停地发送消息（提交、重建快照、发布到共享环），同时轮询共享环；
+	// 只有一个 CPU 时写者与读者轮流运行，每次轮询的耗时包含写者占用的时间
+	db_shutdown();
+	pid_t writer = fork();
+	if (writer == 0) {
+		g_db_persistent = 1;
+		for (int i = 0;; i++) {
+			char text[32];
+			snprintf(text, sizeof(text), "concurrent %d", i);
+			char *messages[1] = {text};
+			if (db_acquire_room(&db) == SQLITE_OK) post_direct(db, time(NULL), "192.0.2.1", "writer", messages, 1);
+		}
+	}
+	int fallbacks = 0;
+	double start = bench_now();
+	for (int i = 0; i < iterations; i++) {
+		if (!serve_ring(rows)) fallbacks++;
+	}
+	double loaded = (bench_now() - start) * 1e6 / iterations;
+	kill(writer, SIGKILL);
+	waitpid(writer, NULL, 0);
+	struct ring_file *ring = ring_map(0);
+	long long published = ring != NULL ? ring->latest_id - rows : 0;
+
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+	close(null_fd);
+
+	printf("%-20s %10s %10s %10s\n", "request", "ring us", "snapshot us", "live us");
+	for (int c = 0; c < 3; c++) {
+		printf("%-20s %10.2f %10.2f %10.2f\n", cases[c].name, results[c][0], results[c][1], results[c][2]);
+	}
+	printf("under writes: %.2f us per poll, %d of %d fell back to the snapshot, %lld messages written meanwhile\n",
+	       loaded, fallbacks, iterations, published);
+
+	db_shutdown();
+	g_db_persistent = 0;
+	bench_remove_tree(dir);
+	return 0;
+}
+
+// ---------- queue：写入队列的崩溃恢复与组提交吞吐量 ----------
+
+// 函数：返回当前聊天室中最大的消息 ID（即至今写入的消息总数）
+static long long bench_queue_max_id() {
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	long long max_id = -1;
+	if (db_acquire_room(&db) != SQLITE_OK) return -1;
+	if (db_prepare(db, "SELECT IFNULL(MAX(id), 0) FROM messages;", &stmt) == SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW) max_id = sqlite3_column_int64(stmt, 0);
+		db_finalize(stmt);
+	}
+	db_release(db);
+	return max_id;
+}
+
+// 函数：processes 个进程共发送 posts 条消息（每个 POST 一条），按 CHAT_WRITE_QUEUE 当前的设置写入
+// 返回写入失败的次数
+static int bench_queue_load(const char *mode_name, int processes, int posts) {
+	int per_process = posts / processes;
+	posts = per_process * processes;
+	size_t shared_size = posts * sizeof(double) + processes * sizeof(int);
+	double *latencies = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (latencies == MAP_FAILED) return 1;
+	int *errors = (int *)(latencies + posts);
+	int mode = queue_mode();
+
+	db_shutdown(); // 不把连接带进子进程
+	double start = bench_now();
+	for (int p = 0; p < processes; p++) {
+		if (fork() != 0) continue;
+		g_db_persistent = 1; // 与 SCGI 工作进程一样复用连接
+		for (int i = 0; i < per_process; i++) {
+			char text[32];
+			snprintf(text, sizeof(text), "bench %d-%d", p, i);
+			char *messages[1] = {text};
+			sqlite3 *db;
+			double t = bench_now();
+			if (mode == QUEUE_OFF) {
+				if (db_acquire_room(&db) != SQLITE_OK || post_direct(db, time(NULL), "192.0.2.1", "bench", messages, 1) != NULL) {
+					errors[p]++;
+				}
+			} else if (queue_append(mode, time(NULL), "192.0.2.1", "bench", messages, 1) != 0) {
+				errors[p]++;
+			} else if (db_acquire_room(&db) == SQLITE_OK) {
+				queue_flush(db);
+			}
+			latencies[p * per_process + i] = bench_now() - t;
+		}
+		db_shutdown();
+		_exit(0);
+	}
+	while (wait(NULL) > 0) {
+	}
+	double elapsed = bench_now() - start;
+
+	int error_count = 0;
+	for (int p = 0; p < processes; p++) error_count += errors[p];
+	qsort(latencies, posts, sizeof(double), bench_compare_double);
+	printf("%-6s %9d %6d %6d %9.3f %9.3f %9.0f\n", mode_name, processes, posts, error_count,
+	       latencies[(posts * 500 + 999) / 1000 - 1] * 1e3, latencies[(posts * 990 + 999) / 1000 - 1] * 1e3, posts / elapsed);
+	fflush(stdout);
+	munmap(latencies, shared_size);
+	return error_count;
+}
+
+// 函数：先模拟刷新者崩溃检查恢复，再比较直接写入与各持久性级别下写入队列的吞吐量
+// CHAT_BENCH_QUEUE_POSTS 为每组发送的消息数（默认 2000）
+static int bench_queue() {
+	static const char *modes[] = {"off", "write", "fsync"};
+	static const int process_counts[] = {1, 8};
+	int posts = config_int("CHAT_BENCH_QUEUE_POSTS", 2000);
+	char dir[] = "/tmp/chat_bench_queue.XXXXXX";
+	if (mkdtemp(dir) == NULL) return 1;
+	setenv("CHAT_DATA_DIR", dir, 1);
+	configure_paths();
+	if (init_database() != 0) {
+		bench_remove_tree(dir);
+		return 1;
+	}
+
+	// 追加 100 条记录但不提交（相当于刷新者在提交前崩溃），之后是崩溃时写了一半的记录和 1 条完整记录
+	char text[] = "recovered";
+	char *messages[1] = {text};
+	for (int i = 0; i < 100; i++) queue_append(QUEUE_WRITE, time(NULL), "192.0.2.1", "bench", messages, 1);
+	struct queue_record torn = {QUEUE_RECORD_MAGIC, 100, 0, 1, 0};
+	int fd = open(g_room.queue_path, O_WRONLY | O_APPEND);
+	if (fd < 0 || write(fd, &torn, sizeof(torn)) != sizeof(torn) || write(fd, "torn", 4) != 4) {
+		fprintf(stderr, "Failed to append a torn record.\n");
+	}
+	if (fd >= 0) close(fd);
+	queue_append(QUEUE_WRITE, time(NULL), "192.0.2.1", "bench", messages, 1);
+
+	int rc = 0;
+	sqlite3 *db;
+	int recovered = -1, replayed = -1;
+	if (db_acquire_room(&db) == SQLITE_OK) {
+		recovered = queue_flush(db);
+		replayed = queue_flush(db);
+		db_release(db);
+	}
+	long long total = bench_queue_max_id();
+	printf("recovery: %d of 101 acknowledged messages committed, %d on a second flush\n", recovered, replayed);
+	if (recovered != 101 || replayed != 0 || total != 101) {
+		fprintf(stderr, "Write queue recovery FAILED (table has %lld messages).\n", total);
+		rc = 1;
+	}
+
+	printf("%-6s %9s %6s %6s %9s %9s %9s\n", "queue", "processes", "posts", "errors", "p50 ms", "p99 ms", "posts/s");
+	for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		setenv("CHAT_WRITE_QUEUE", modes[m], 1);
+		for (size_t p = 0; p < sizeof(process_counts) / sizeof(process_counts[0]); p++) {
+			if (bench_queue_load(modes[m], process_counts[p], posts) != 0) rc = 1;
+			total += posts / process_counts[p] * process_counts[p];
+		}
+	}
+	unsetenv("CHAT_WRITE_QUEUE");
+
+	// 所有已确认的消息都已提交，且没有重复
+	long long max_id = bench_queue_max_id();
+	if (max_id != total) {
+		fprintf(stderr, "Expected %lld messages in total, found %lld.\n", total, max_id);
+		rc = 1;
+	}
+	db_shutdown();
+	bench_remove_tree(dir);
+	return rc;
+}
+
+// ---------- server：HTTP/WebSocket 服务器模式 ----------
+
+// 函数：连接到本机 port 端口，失败返回 -1
+static int bench_server_connect(int port) {
+	struct sockaddr_in sin = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+		close(fd);
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+// 函数：在保持的连接上发送一个 GET 请求（headers 为附加的请求头）并读取完整的响应，返回状态码（失败时为 0）；
+// etag 不为 NULL 时复制响应的 ETag
+static int bench_server_get(int fd, const char *target, const char *headers, char *etag, size_t etag_size) {
+	char buf[65536];
+	int len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: localhost\r\n%s\r\n", target, headers);
+	if (write(fd, buf, len) != len) return 0;
+	size_t got = 0;
+	char *header_end = NULL;
+	for (;;) {
+		ssize_t n = read(fd, buf + got, sizeof(buf) - 1 - got);
+		if (n <= 0) return 0;
+		got += n;
+		buf[got] = '\0';
+		header_end = strstr(buf, "\r\n\r\n");
+		if (header_end == NULL) continue;
+		*header_end = '\0'; // 压缩的响应体中可能有 '\0'，只在响应头中查找
+		char *length = strcasestr(buf, "\r\nContent-Length:");
+		size_t body_len = length != NULL ? (size_t)atoll(length + 17) : 0; // 304 没有响应体
+		*header_end = '\r';
+		if (got >= (size_t)(header_end + 4 - buf) + body_len) break;
+		if (got == sizeof(buf) - 1) return 0;
+	}
+	if (etag != NULL) {
+		*header_end = '\0';
+		char *value = strcasestr(buf, "\r\nETag: ");
+		snprintf(etag, etag_size, "%.*s", value != NULL ? (int)strcspn(value + 8, "\r") : 0, value != NULL ? value + 8 : "");
+	}
+	return strncmp(buf, "HTTP/1.1 ", 9) == 0 ? atoi(buf + 9) : 0;
+}
+
+// 函数：启动服务器（1 个工作进程），测量保持连接上的请求耗时（对比每个请求启动一次 CGI），
+// 再由大量 SSE 和 WebSocket 订阅者测量新消息推送到全部订阅者的耗时
+// CHAT_BENCH_SERVER_REQUESTS 为请求次数（默认 5000），CHAT_BENCH_SERVER_SUBSCRIBERS 为订阅者数量（默认 1000，
+// 一半 SSE、一半 WebSocket），CHAT_BENCH_SERVER_MESSAGES 为推送的消息数（默认 20）
+static int bench_server() {
+	int requests = config_int("CHAT_BENCH_SERVER_REQUESTS", 5000);
+	int subscribers = config_int("CHAT_BENCH_SERVER_SUBSCRIBERS", 1000);
+	int messages = config_int("CHAT_BENCH_SERVER_MESSAGES", 20);
+	char dir[] = "/tmp/chat_bench_server.XXXXXX";
+	if (mkdtemp(dir) == NULL) return 1;
+	setenv("CHAT_DATA_DIR", dir, 1);
+	configure_paths();
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	if (init_database() != 0 || db_acquire_room(&db) != SQLITE_OK) {
+		bench_remove_tree(dir);
+		return 1;
+	}
+	const int rows = 100;
+	sqlite3_exec(db, "BEGIN;", 0, 0, 0);
+	db_prepare(db, SQL_INSERT_MESSAGE, &stmt);
+	for (int i = 0; i < rows; i++) {
+		char text[96];
+		snprintf(text, sizeof(text), "第 %d 条消息：hello \"world\" \\ path/to/file", i);
+		char *texts[1] = {text};
+		insert_messages(stmt, 1700000000 + i, "203.0.113.42", i % 3 ? "alice" : "bob", texts, 1);
+	}
+	db_finalize(stmt);
+	sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+	ring_note_commit(rows);
+	rebuild_snapshot(db);
+	db_shutdown();
+
+	// 订阅者和服务器都需要大量文件描述符
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && (rlim_t)subscribers * 2 + 64 > limit.rlim_cur) {
+		subscribers = (limit.rlim_cur - 64) / 2;
+	}
+
+	// 选一个空闲端口
+	struct sockaddr_in sin = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	socklen_t sin_len = sizeof(sin);
+	int probe = socket(AF_INET, SOCK_STREAM, 0);
+	if (probe < 0 || bind(probe, (struct sockaddr *)&sin, sizeof(sin)) != 0 || getsockname(probe, (struct sockaddr *)&sin, &sin_len) != 0) {
+		bench_remove_tree(dir);
+		return 1;
+	}
+	int port = ntohs(sin.sin_port);
+	close(probe);
+	char addr[32];
+	snprintf(addr, sizeof(addr), "127.0.0.1:%d", port);
+
+	setenv("CHAT_DOC_ROOT", "..", 0); // make bench 在 cgi-bin 中运行，页面在上一级目录
+	fflush(stdout);
+	signal(SIGPIPE, SIG_IGN);
+	pid_t server = fork();
+	if (server == 0) {
+		_exit(run_http_server(addr, 1));
+	}
+	int fd = -1;
+	for (int i = 0; i < 200 && fd < 0; i++) {
+		fd = bench_server_connect(port);
+		if (fd < 0) usleep(10000);
+	}
+	int rc = 0;
+	if (fd < 0) {
+		fprintf(stderr, "Server did not start.\n");
+		rc = 1;
+		goto done;
+	}
+
+	// 保持连接上的请求与每个请求启动一次 CGI 程序
+	char target[64];
+	snprintf(target, sizeof(target), "/cgi-bin/chat_handler.cgi?since=%d", rows - 1);
+	// 页面：未压缩、预压缩的 br 版本，以及缓存过期后凭 ETag 验证（headers 为 NULL 时使用上一项得到的 ETag）
+	static const struct {
+		const char *name;
+		const char *target;
+		const char *headers;
+		int status;
+	} cases[] = {{"GET poll, 1 new", NULL, "", 200},
+	             {"GET all messages", "/cgi-bin/chat_handler.cgi", "", 200},
+	             {"GET chat.html", "/chat.html", "", 200},
+	             {"GET chat.html br", "/chat.html", "Accept-Encoding: gzip, br\r\n", 200},
+	             {"GET chat.html 304", "/chat.html", NULL, 304}};
+	char etag[64] = "", revalidate[128];
+	printf("%-20s %14s %14s\n", "request", "keep-alive us", "CGI exec us");
+	g_bench_cgi_path = getenv("CHAT_BENCH_CGI");
+	if (g_bench_cgi_path == NULL) g_bench_cgi_path = "./chat_handler.cgi";
+	snprintf(g_bench_cgi_dir, sizeof(g_bench_cgi_dir), "%s", dir);
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+		const char *t = cases[c].target ? cases[c].target : target;
+		const char *headers = cases[c].headers;
+		if (headers == NULL) {
+			snprintf(revalidate, sizeof(revalidate), "Accept-Encoding: gzip, br\r\nIf-None-Match: %s\r\n", etag);
+			headers = revalidate;
+		}
+		int errors = 0;
+		double start = bench_now();
+		for (int i = 0; i < requests; i++) {
+			if (bench_server_get(fd, t, headers, etag, sizeof(etag)) != cases[c].status) errors++;
+		}
+		double keep_alive = (bench_now() - start) * 1e6 / requests;
+		// CGI 程序只能回应 API 请求
+		double cgi = 0;
+		const char *query = strchr(t, '?');
+		int cgi_runs = requests / 10 > 0 ? requests / 10 : 1;
+		if (strncmp(t, "/cgi-bin/", 9) == 0 && access(g_bench_cgi_path, X_OK) == 0) {
+			bench_cgi_request req = {.method = "GET"};
+			snprintf(req.query, sizeof(req.query), "%s", query ? query + 1 : "");
+			start = bench_now();
+			for (int i = 0; i < cgi_runs; i++) bench_cgi_run(&req, NULL, 0);
+			cgi = (bench_now() - start) * 1e6 / cgi_runs;
+		}
+		if (cgi > 0) printf("%-20s %14.1f %14.1f\n", cases[c].name, keep_alive, cgi);
+		else printf("%-20s %14.1f %14s\n", cases[c].name, keep_alive, "-");
+		if (errors > 0) {
+			fprintf(stderr, "%d of %d requests failed.\n", errors, requests);
+			rc = 1;
+		}
+	}
+	close(fd);
+
+	// 订阅者：偶数为 SSE，奇数为 WebSocket
+	int *fds = malloc(subscribers * sizeof(int));
+	double *latencies = malloc((size_t)subscribers * messages * sizeof(double));
+	char *received = malloc(subscribers);
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	int connected = 0;
+	for (int i = 0; i < subscribers && fds != NULL; i++) {
+		fds[i] = bench_server_connect(port);
+		if (fds[i] < 0) break;
+		char request[512];
+		int len;
+		if (i % 2 == 0) {
+			len = snprintf(request, sizeof(request), "GET /cgi-bin/chat_handler.cgi?action=stream&since=%d HTTP/1.1\r\nHost: localhost\r\n\r\n", rows);
+		} else {
+			len = snprintf(request, sizeof(request),
+			               "GET /cgi-bin/chat_handler.cgi?action=stream&since=%d HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+			               "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n", rows);
+		}
+		char response[1024];
+		if (write(fds[i], request, len) != len || read(fds[i], response, sizeof(response)) <= 0) {
+			close(fds[i]);
+			break;
+		}
+		fcntl(fds[i], F_SETFL, O_NONBLOCK);
+		struct epoll_event ev = {.events = EPOLLIN, .data.u32 = i};
+		epoll_ctl(ep, EPOLL_CTL_ADD, fds[i], &ev);
+		connected++;
+	}
+	if (connected < subscribers) {
+		fprintf(stderr, "Only %d of %d subscribers connected.\n", connected, subscribers);
+		rc = 1;
+	}
+
+	// 每轮写入一条消息（提交、重建快照、发布到共享环、写通知文件），从开始写入计时，直到每个订阅者都收到这条消息
+	g_db_persistent = 1;
+	int delivered = 0;
+	double post_total = 0, last_total = 0;
+	for (int m = 0; m < messages && connected > 0; m++) {
+		char text[32];
+		snprintf(text, sizeof(text), "fan-out %d", m);
+		char *texts[1] = {text};
+		char needle[48];
+		snprintf(needle, sizeof(needle), "\"id\":\"%d\"", rows + 1 + m);
+		memset(received, 0, connected);
+		double t0 = bench_now();
+		if (db_acquire_room(&db) != SQLITE_OK || post_direct(db, time(NULL), "192.0.2.1", "bench", texts, 1) != NULL) {
+			rc = 1;
+			break;
+		}
+		post_total += bench_now() - t0;
+		int round = 0;
+		while (round < connected && bench_now() - t0 < 5) {
+			struct epoll_event events[256];
+			int n = epoll_wait(ep, events, 256, 100);
+			for (int e = 0; e < n; e++) {
+				int i = events[e].data.u32;
+				char buf[4096];
+				ssize_t got;
+				while ((got = read(fds[i], buf, sizeof(buf))) > 0) {
+					if (!received[i] && memmem(buf, got, needle, strlen(needle)) != NULL) {
+						received[i] = 1;
+						latencies[delivered++] = bench_now() - t0;
+						round++;
+					}
+				}
+			}
+		}
+		last_total += bench_now() - t0;
+		if (round < connected) {
+			fprintf(stderr, "Message %d reached %d of %d subscribers.\n", m, round, connected);
+			rc = 1;
+		}
+	}
+	if (delivered > 0) {
+		qsort(latencies, delivered, sizeof(double), bench_compare_double);
+		printf("fan-out to %d subscribers (%d SSE, %d WebSocket), %d messages: post %.2f ms, delivery p50 %.2f ms, "
+		       "p99 %.2f ms, last subscriber %.2f ms\n", connected, (connected + 1) / 2, connected / 2, messages,
+		       post_total * 1e3 / messages, latencies[(delivered * 500 + 999) / 1000 - 1] * 1e3,
+		       latencies[(delivered * 990 + 999) / 1000 - 1] * 1e3, last_total * 1e3 / messages);
+	}
+	for (int i = 0; i < connected; i++) close(fds[i]);
+	close(ep);
+	free(fds);
+	free(latencies);
+	free(received);
+
+done:
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	db_shutdown();
+	g_db_persistent = 0;
+	bench_remove_tree(dir);
+	return rc;
+}
+
+// ---------- replica：变更日志复制 ----------
+
+// 函数：通过主实例发送 count 条消息（每条 size 字节，每个 POST batch 条），返回最后一条的 ID，失败返回 -1
+static long long bench_replica_post(int count, int batch, size_t size, double *latencies) {
+	char *texts = malloc(batch * (size + 1));
+	char **messages = malloc(batch * sizeof(char *));
+	long long new_id = -1;
+	if (texts == NULL || messages == NULL) goto done;
+	for (int i = 0; i < batch; i++) {
+		messages[i] = texts + i * (size + 1);
+		memset(messages[i], 'a' + i % 26, size);
+		messages[i][size] = '\0';
+	}
+	for (int i = 0; i < count; i += batch) {
+		sqlite3 *db;
+		double start = bench_now();
+		if (db_acquire_room(&db) != SQLITE_OK || post_direct(db, time(NULL), "192.0.2.1", "bench", messages, batch) != NULL) {
+			new_id = -1;
+			goto done;
+		}
+		if (latencies != NULL) latencies[i / batch] = bench_now() - start;
+		new_id = read_notified_id();
+	}
+done:
+	free(messages);
+	free(texts);
+	return new_id;
+}
+
+// 函数：等待各副本发布 ID 不小于 id 的消息（读取副本的通知文件），记录每个副本追上的时刻；10 秒内没有追上返回 -1
+static int bench_replica_wait(int notify_fd, char paths[][ROOM_PATH_SIZE], int count, long long id, double *caught_up) {
+	int pending = count;
+	double deadline = bench_now() + 10;
+	for (int i = 0; i < count; i++) caught_up[i] = 0;
+	for (;;) {
+		for (int i = 0; i < count; i++) {
+			char buf[24];
+			ssize_t n = 0;
+			int fd = caught_up[i] > 0 ? -1 : open(paths[i], O_RDONLY);
+			if (fd < 0) continue;
+			n = read(fd, buf, sizeof(buf) - 1);
+			close(fd);
+			buf[n > 0 ? n : 0] = '\0';
+			if (n > 0 && atoll(buf) >= id) {
+				caught_up[i] = bench_now();
+				pending--;
+			}
+		}
+		if (pending == 0) return 0;
+		if (bench_now() > deadline) return -1;
+		struct pollfd pfd = {.fd = notify_fd, .events = POLLIN};
+		if (poll(&pfd, 1, 100) > 0) {
+			char events[4096];
+			while (read(notify_fd, events, sizeof(events)) > 0) {
+			}
+		}
+	}
+}
+
+// 函数：比较主实例与副本数据库中保留的最新 CHAT_MAX_MESSAGES 条消息（ID、内容），一致返回 0
+// 两边按各自的批次清理旧消息，更早的消息可能一边已经删除而另一边还在
+static int bench_replica_compare(const char *primary, const char *replica) {
+	const char *sql = "SELECT COUNT(*), IFNULL(MIN(id), 0), IFNULL(MAX(id), 0), TOTAL(id * LENGTH(message)), "
+	                  "TOTAL(timestamp), TOTAL(LENGTH(username) + LENGTH(ip)) FROM messages "
+	                  "WHERE id > (SELECT MAX(id) FROM messages) - ?;";
+	double results[2][6];
+	const char *paths[2] = {primary, replica};
+	for (int i = 0; i < 2; i++) {
+		sqlite3 *db;
+		sqlite3_stmt *stmt;
+		if (sqlite3_open_v2(paths[i], &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+		    sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+			sqlite3_close(db);
+			return -1;
+		}
+		sqlite3_bind_int(stmt, 1, config_int("CHAT_MAX_MESSAGES", MAX_MESSAGES_POST));
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			for (int c = 0; c < 6; c++) results[i][c] = sqlite3_column_double(stmt, c);
+		}
+		sqlite3_finalize(stmt);
+		sqlite3_close(db);
+	}
+	if (memcmp(results[0], results[1], sizeof(results[0])) != 0) {
+		fprintf(stderr, "Replica %s has %.0f messages (%.0f-%.0f), primary has %.0f (%.0f-%.0f).\n", replica, results[1][0],
+		        results[1][1], results[1][2], results[0][0], results[0][1], results[0][2]);
+		return -1;
+	}
+	return 0;
+}
+
+// 函数：一个主实例、两个副本（各自一个 --replicate 进程）：比较开启变更日志前后的发送耗时，
+// 测量副本追上的延迟和速度，暂停一个副本检查响应中的复制延迟，最后日志轮换后比较全部副本的内容
+// CHAT_BENCH_REPLICA_POSTS 为测量延迟时发送的消息数（默认 500）
+static int bench_replica() {
+	enum { REPLICAS = 2 };
+	int posts = config_int("CHAT_BENCH_REPLICA_POSTS", 500);
+	char primary[] = "/tmp/chat_bench_primary.XXXXXX";
+	char replicas[REPLICAS][32] = {"/tmp/chat_bench_replica.XXXXXX", "/tmp/chat_bench_replica.XXXXXX"};
+	char notify_paths[REPLICAS][ROOM_PATH_SIZE], db_paths[REPLICAS][ROOM_PATH_SIZE];
+	char primary_db[ROOM_PATH_SIZE];
+	pid_t replicators[REPLICAS] = {0};
+	double *latencies = malloc(posts * REPLICAS * sizeof(double));
+	double caught_up[REPLICAS];
+	int rc = 1;
+	if (latencies == NULL || mkdtemp(primary) == NULL) return 1;
+	for (int i = 0; i < REPLICAS; i++) {
+		if (mkdtemp(replicas[i]) == NULL) return 1;
+		snprintf(notify_paths[i], sizeof(notify_paths[i]), "%s/chat_messages.db%s", replicas[i], NOTIFY_SUFFIX);
+		snprintf(db_paths[i], sizeof(db_paths[i]), "%s/chat_messages.db", replicas[i]);
+	}
+	snprintf(primary_db, sizeof(primary_db), "%s/chat_messages.db", primary);
+	setenv("CHAT_DATA_DIR", primary, 1);
+	unsetenv("CHAT_REPLICA_OF");
+	unsetenv("CHAT_WRITE_QUEUE");
+	configure_paths();
+	g_db_persistent = 1;
+	if (init_database() != 0) goto done;
+
+	// 发送的耗时：不写变更日志与写变更日志（第一次写日志时会追加已有的全部消息，不计入）
+	double post_us[2];
+	for (int on = 0; on < 2; on++) {
+		setenv("CHAT_CHANGELOG", on ? "1" : "0", 1);
+		if (on && bench_replica_post(1, 1, 64, NULL) < 0) goto done;
+		if (bench_replica_post(posts, 1, 64, latencies) < 0) goto done;
+		qsort(latencies, posts, sizeof(double), bench_compare_double);
+		post_us[on] = latencies[(posts * 500 + 999) / 1000 - 1] * 1e6;
+	}
+	long long latest = read_notified_id();
+	printf("post p50: %.1f us without changelog, %.1f us with changelog\n", post_us[0], post_us[1]);
+
+	// 启动副本，先从日志开头追上已有的消息
+	int notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	db_shutdown();
+	fflush(stdout);
+	for (int i = 0; i < REPLICAS; i++) {
+		int fd = open(notify_paths[i], O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+		if (fd >= 0) close(fd);
+		inotify_add_watch(notify_fd, notify_paths[i], IN_CLOSE_WRITE | IN_MODIFY);
+		replicators[i] = fork();
+		if (replicators[i] == 0) {
+			int null_fd = open("/dev/null", O_WRONLY);
+			dup2(null_fd, STDERR_FILENO);
+			setenv("CHAT_DATA_DIR", replicas[i], 1);
+			setenv("CHAT_REPLICA_OF", primary, 1);
+			unsetenv("CHAT_CHANGELOG");
+			configure_paths();
+			_exit(run_replicator());
+		}
+	}
+	double start = bench_now();
+	if (bench_replica_wait(notify_fd, notify_paths, REPLICAS, latest, caught_up) != 0) {
+		fprintf(stderr, "Replicas did not catch up with %lld messages.\n", latest);
+		goto done;
+	}
+	printf("initial catch-up: %lld messages in %.1f ms\n", latest, (caught_up[REPLICAS - 1] - start) * 1e3);
+
+	// 复制延迟：每次发送一条，等两个副本都发布后再发下一条
+	int samples = 0;
+	for (int i = 0; i < posts; i++) {
+		long long id = bench_replica_post(1, 1, 64, NULL);
+		double posted = bench_now();
+		if (id < 0 || bench_replica_wait(notify_fd, notify_paths, REPLICAS, id, caught_up) != 0) {
+			fprintf(stderr, "Replicas did not receive message %lld.\n", id);
+			goto done;
+		}
+		for (int r = 0; r < REPLICAS; r++) latencies[samples++] = caught_up[r] - posted;
+	}
+	qsort(latencies, samples, sizeof(double), bench_compare_double);
+	printf("replication lag over %d posts x %d replicas: p50 %.2f ms, p99 %.2f ms, max %.2f ms\n", posts, REPLICAS,
+	       latencies[(samples * 500 + 999) / 1000 - 1] * 1e3, latencies[(samples * 990 + 999) / 1000 - 1] * 1e3,
+	       latencies[samples - 1] * 1e3);
+
+	// 暂停第二个副本，期间发送的消息超过一段日志（发生轮换），副本的响应头报告落后的消息数和时间
+	kill(replicators[1], SIGSTOP);
+	start = bench_now();
+	latest = bench_replica_post(5000, 500, 1000, NULL);
+	if (latest < 0) goto done;
+	double burst = bench_now() - start;
+	usleep(100000);
+	setenv("CHAT_DATA_DIR", replicas[1], 1);
+	setenv("CHAT_REPLICA_OF", primary, 1);
+	configure_paths();
+	int iterations = 10000;
+	start = bench_now();
+	for (int i = 0; i < iterations; i++) replica_lag_header();
+	double header_us = (bench_now() - start) * 1e6 / iterations;
+	printf("paused replica: %s", g_replication_header);
+	printf("  (X-Replication-* computed in %.2f us per request)\n", header_us);
+	struct stat st;
+	printf("changelog rotated during the burst: %s\n", stat(g_room.changelog_path, &st) == 0 &&
+	       access(g_room.changelog_old_path, F_OK) != 0 ? "no" : "yes");
+
+	// 恢复后两个副本都追上，并且内容与主实例相同
+	start = bench_now();
+	kill(replicators[1], SIGCONT);
+	if (bench_replica_wait(notify_fd, notify_paths, REPLICAS, latest, caught_up) != 0) {
+		fprintf(stderr, "Replicas did not catch up after the burst.\n");
+		goto done;
+	}
+	printf("burst of 5000 x 1000-byte messages: primary %.1f ms, paused replica caught up in %.1f ms after resuming\n",
+	       burst * 1e3, (caught_up[1] - start) * 1e3);
+	// 副本先发布消息，再记录进度，响应头稍晚一点才归零
+	for (int i = 0; i < 100; i++) {
+		replica_lag_header();
+		if (strncmp(g_replication_header, "X-Replication-Behind: 0\r\n", 25) == 0) break;
+		usleep(1000);
+	}
+	printf("resumed replica: %s", g_replication_header);
+	rc = 0;
+	for (int i = 0; i < REPLICAS; i++) {
+		if (bench_replica_compare(primary_db, db_paths[i]) != 0) rc = 1;
+	}
+	printf("replica contents %s the primary\n", rc == 0 ? "match" : "DIFFER from");
+
+done:
+	for (int i = 0; i < REPLICAS; i++) {
+		if (replicators[i] > 0) {
+			kill(replicators[i], SIGKILL);
+			waitpid(replicators[i], NULL, 0);
+		}
+		bench_remove_tree(replicas[i]);
+	}
+	unsetenv("CHAT_CHANGELOG");
+	unsetenv("CHAT_REPLICA_OF");
+	g_replication_header[0] = '\0';
+	db_shutdown();
+	g_db_persistent = 0;
+	bench_remove_tree(primary);
+	free(latencies);
+	return rc;
+}
+
+// ---------- maintenance：在线备份与增量清理 ----------
+
+// 后台请求的一次采样
+struct bench_maintenance_sample {
+	double at; // 请求开始的时刻（bench_now）
+	double latency;
+};
+
+// 负载进程与主进程共享的采样区
+struct bench_maintenance_load {
+	volatile int stop;
+	int counts[2]; // 0 为 POST，1 为翻页 GET
+	struct bench_maintenance_sample samples[2][200000];
+};
+
+// 函数：负载进程：kind 为 0 时每 2 毫秒发送一条消息，为 1 时每毫秒读取一页历史消息（查询数据库），直到 stop
+static void bench_maintenance_worker(struct bench_maintenance_load *load, int kind, long long history_before) {
+	g_db_persistent = 1;
+	int null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, STDOUT_FILENO);
+	char query[48];
+	snprintf(query, sizeof(query), "before=%lld", history_before);
+	setenv("QUERY_STRING", query, 1);
+	char text[] = "maintenance load";
+	char *messages[1] = {text};
+	while (!load->stop && load->counts[kind] < (int)(sizeof(load->samples[0]) / sizeof(load->samples[0][0]))) {
+		double start = bench_now();
+		if (kind == 0) {
+			sqlite3 *db;
+			if (db_acquire_room(&db) == SQLITE_OK) post_direct(db, time(NULL), "192.0.2.1", "bench", messages, 1);
+		} else {
+			handle_get_messages();
+		}
+		fflush(stdout);
+		struct bench_maintenance_sample *sample = &load->samples[kind][load->counts[kind]];
+		sample->at = start;
+		sample->latency = bench_now() - start;
+		load->counts[kind]++;
+		usleep(kind == 0 ? 2000 : 1000);
+	}
+	db_shutdown();
+	_exit(0);
+}
+
+// 函数：输出 [from, to) 期间开始的请求的延迟
+static void bench_maintenance_phase(const struct bench_maintenance_load *load, const char *name, double from, double to) {
+	static double latencies[200000];
+	printf("%-28s", name);
+	for (int kind = 0; kind < 2; kind++) {
+		int n = 0;
+		for (int i = 0; i < load->counts[kind]; i++) {
+			if (load->samples[kind][i].at >= from && load->samples[kind][i].at < to) latencies[n++] = load->samples[kind][i].latency;
+		}
+		if (n == 0) {
+			printf(" %6d %8s %8s %8s", 0, "-", "-", "-");
+			continue;
+		}
+		qsort(latencies, n, sizeof(double), bench_compare_double);
+		printf(" %6d %8.2f %8.2f %8.2f", n, latencies[(n * 500 + 999) / 1000 - 1] * 1e3, latencies[(n * 990 + 999) / 1000 - 1] * 1e3,
+		       latencies[n - 1] * 1e3);
+	}
+	printf("\n");
+}
+
+// 函数：写入 CHAT_BENCH_MAINTENANCE_ROWS 条消息（默认 20000）后清理到只剩 200 条，留下大量空闲页；
+// 在持续的发送和翻页请求下依次运行分步备份、一步完成的备份和增量清理，比较各阶段的请求延迟，
+// 并测量同样的空闲页用一次 VACUUM 清理时写者需要等待的时间
+static int bench_maintenance() {
+	int rows = config_int("CHAT_BENCH_MAINTENANCE_ROWS", 20000);
+	char dir[] = "/tmp/chat_bench_maintenance.XXXXXX";
+	if (mkdtemp(dir) == NULL) return 1;
+	char backup_dir[64], backup_db[128];
+	snprintf(backup_dir, sizeof(backup_dir), "%s/backup", dir);
+	snprintf(backup_db, sizeof(backup_db), "%s/" DB_FILE, backup_dir);
+	setenv("CHAT_DATA_DIR", dir, 1);
+	setenv("CHAT_ARCHIVE", "0", 1);
+	setenv("CHAT_MAX_MESSAGES", "200", 1);
+	setenv("CHAT_RING", "0", 1);
+	unsetenv("CHAT_WRITE_QUEUE");
+	unsetenv("CHAT_CHANGELOG");
+	configure_paths();
+	g_db_persistent = 1;
+	int rc = 1;
+	struct bench_maintenance_load *load = mmap(NULL, sizeof(*load), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	pid_t workers[2] = {0, 0};
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	if (load == MAP_FAILED) return 1;
+	if (init_database() != 0 || db_acquire_room(&db) != SQLITE_OK) goto done;
+
+	// 写入消息，再像保留窗口那样删除旧消息
+	sqlite3_exec(db, "BEGIN;", 0, 0, 0);
+	db_prepare(db, SQL_INSERT_MESSAGE, &stmt);
+	for (int i = 0; i < rows; i++) {
+		char text[448];
+		snprintf(text, sizeof(text), "第 %d 条消息 %0400d", i, i);
+		char *messages[1] = {text};
+		insert_messages(stmt, 1700000000 + i, "203.0.113.42", i % 3 ? "alice" : "bob", messages, 1);
+	}
+	db_finalize(stmt);
+	prune_old_messages(db, rows, PRUNE_INTERVAL);
+	sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+	sqlite3_exec(db, "PRAGMA wal_checkpoint(TRUNCATE);", 0, 0, 0);
+	rebuild_snapshot(db);
+	long long pages = maintenance_query_int(db, "PRAGMA page_count;");
+	long long free_pages = maintenance_query_int(db, "PRAGMA freelist_count;");
+	printf("database: %lld pages, %lld free after pruning %d messages to 200 (auto_vacuum=%lld)\n", pages, free_pages, rows,
+	       maintenance_query_int(db, "PRAGMA auto_vacuum;"));
+	db_shutdown();
+
+	// 后台负载：一个进程发送，一个进程翻页
+	fflush(stdout);
+	for (int kind = 0; kind < 2; kind++) {
+		workers[kind] = fork();
+		if (workers[kind] == 0) bench_maintenance_worker(load, kind, rows - 50);
+	}
+	double marks[5];
+	usleep(100000); // 不计入负载进程打开数据库的耗时
+	marks[0] = bench_now();
+	usleep(1000000);
+	marks[1] = bench_now();
+	if (run_backup(backup_dir) != 0) goto done;
+	marks[2] = bench_now();
+	setenv("CHAT_BACKUP_STEP_PAGES", "1000000000", 1); // 一步复制全部页
+	if (run_backup(backup_dir) != 0) goto done;
+	unsetenv("CHAT_BACKUP_STEP_PAGES");
+	marks[3] = bench_now();
+	if (run_compact() != 0) goto done;
+	marks[4] = bench_now();
+	usleep(200000);
+	load->stop = 1;
+	for (int kind = 0; kind < 2; kind++) waitpid(workers[kind], NULL, 0);
+	workers[0] = workers[1] = 0;
+
+	printf("%-28s %6s %8s %8s %8s %6s %8s %8s %8s\n", "phase", "posts", "p50 ms", "p99 ms", "max ms", "gets", "p50 ms",
+	       "p99 ms", "max ms");
+	bench_maintenance_phase(load, "idle", marks[0], marks[1]);
+	bench_maintenance_phase(load, "backup, paced steps", marks[1], marks[2]);
+	bench_maintenance_phase(load, "backup, one step", marks[2], marks[3]);
+	bench_maintenance_phase(load, "incremental vacuum", marks[3], marks[4]);
+
+	// 备份完整可用；备份是清理之前的状态，在它上面测量一次 VACUUM 释放同样的空闲页时写者要等待的时间
+	rc = 0;
+	sqlite3 *copy;
+	if (sqlite3_open(backup_db, &copy) != SQLITE_OK || sqlite3_exec(copy, "PRAGMA quick_check;", 0, 0, 0) != SQLITE_OK) {
+		rc = 1;
+	} else {
+		long long copy_free = maintenance_query_int(copy, "PRAGMA freelist_count;");
+		long long start = monotonic_us();
+		sqlite3_exec(copy, "VACUUM;", 0, 0, 0);
+		printf("a full VACUUM of the backup (%lld free pages) would block writers for %.2f ms\n", copy_free,
+		       (monotonic_us() - start) / 1000.0);
+	}
+	sqlite3_close(copy);
+	if (db_acquire_room(&db) == SQLITE_OK) {
+		printf("after compaction: %lld pages, %lld free; backup %s\n", maintenance_query_int(db, "PRAGMA page_count;"),
+		       maintenance_query_int(db, "PRAGMA freelist_count;"), rc == 0 ? "passes quick_check" : "FAILED quick_check");
+	}
+
+done:
+	for (int kind = 0; kind < 2; kind++) {
+		if (workers[kind] > 0) {
+			kill(workers[kind], SIGKILL);
+			waitpid(workers[kind], NULL, 0);
+		}
+	}
+	munmap(load, sizeof(*load));
+	unsetenv("CHAT_ARCHIVE");
+	unsetenv("CHAT_MAX_MESSAGES");
+	unsetenv("CHAT_RING");
+	unsetenv("QUERY_STRING");
+	db_shutdown();
+	g_db_persistent = 0;
+	bench_remove_tree(dir);
+	return rc;
+}
+
+// ---------- arena：请求内存池与固定响应 ----------
+
+// 分配次数 = SQLite 分配器的 malloc/realloc + cJSON 钩子的 malloc + 内存池新分配的块。
+// SQLite 的计数包装只在 arena 基准期间安装（sqlite3_shutdown 之后配置，结束时恢复），不影响其他基准
+static sqlite3_mem_methods g_bench_sqlite_mem; // SQLite 原来的分配器
+static long g_bench_sqlite_allocs = 0;
+
+static void *bench_sqlite_malloc(int size) {
+	g_bench_sqlite_allocs++;
+	return g_bench_sqlite_mem.xMalloc(size);
+}
+
+static void *bench_sqlite_realloc(void *ptr, int size) {
+	g_bench_sqlite_allocs++;
+	return g_bench_sqlite_mem.xRealloc(ptr, size);
+}
+
+// 函数：安装（install 非 0）或移除 SQLite 分配器的计数包装；会先关闭连接池中的连接，失败时返回非 0
+static int bench_sqlite_count_allocs(int install) {
+	db_shutdown();
+	sqlite3_shutdown();
+	int rc;
+	if (install) {
+		rc = sqlite3_config(SQLITE_CONFIG_GETMALLOC, &g_bench_sqlite_mem);
+		if (rc == SQLITE_OK) {
+			sqlite3_mem_methods counting = g_bench_sqlite_mem;
+			counting.xMalloc = bench_sqlite_malloc;
+			counting.xRealloc = bench_sqlite_realloc;
+			rc = sqlite3_config(SQLITE_CONFIG_MALLOC, &counting);
+		}
+	} else {
+		rc = sqlite3_config(SQLITE_CONFIG_MALLOC, &g_bench_sqlite_mem);
+	}
+	sqlite3_initialize();
+	return rc;
+}
+
+// 函数：内存池当前持有的、用 malloc 分配的块数（不含静态的第一块）
+static long bench_arena_blocks() {
+	long blocks = 0;
+	for (struct arena_block *b = g_arena; b != NULL && b->next != NULL; b = b->next) blocks++;
+	return blocks;
+}
+
+// 函数：到目前为止的分配次数（内存池的块在每次使用后另行累加）
+static long bench_allocs() {
+	return g_bench_sqlite_allocs + g_bench_cjson_allocs;
+}
+
+// 函数：当前进程的常驻内存（KB）
+static long bench_rss_kb() {
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL) return 0;
+	if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// 函数：去掉响应中的 Server-Timing 行（其中的耗时每次都不同）
+static void bench_strip_timing(char *response, size_t *length) {
+	char *line = strstr(response, "Server-Timing: ");
+	char *end = line != NULL ? strstr(line, "\r\n") : NULL;
+	if (end == NULL) return;
+	end += 2;
+	memmove(line, end, response + *length - end + 1);
+	*length -= end - line;
+}
+
+// 函数：原先的固定错误响应——逐个构建 cJSON 对象再打印
+static void bench_error_cjson() {
+	cJSON *response_json = cJSON_CreateObject();
+	cJSON_AddStringToObject(response_json, "status", "error");
+	cJSON_AddStringToObject(response_json, "message", "Unsupported request method.");
+	send_json_response(405, "Method Not Allowed", response_json);
+}
+
+// 函数：当前的固定错误响应
+static void bench_error_fixed() {
+	send_fixed_response(405, "Method Not Allowed", JSON_ERROR("Unsupported request method."));
+}
+
+// 函数：route_request 以常驻模式处理几类请求，测量每个请求的分配次数、耗时和前后的常驻内存；
+// 再比较固定错误响应原先用 cJSON 构建（使用 malloc 或内存池）和现在用常量输出的开销。CHAT_BENCH_ARENA_ITERATIONS 为每种情形的请求次数（默认 20000）
+static int bench_arena() {
+	int iterations = config_int("CHAT_BENCH_ARENA_ITERATIONS", 20000);
+	char dir[] = "/tmp/chat_bench_arena.XXXXXX";
+	if (mkdtemp(dir) == NULL) return 1;
+	setenv("CHAT_DATA_DIR", dir, 1);
+	configure_paths();
+	unsetenv("HTTP_ACCEPT_ENCODING");
+	unsetenv("HTTP_IF_NONE_MATCH");
+	unsetenv("HTTP_COOKIE");
+	g_db_persistent = 1;
+	if (bench_sqlite_count_allocs(1) != SQLITE_OK) printf("(SQLite allocator could not be wrapped; SQLite allocations not counted)\n");
+
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	if (init_database() != 0 || db_acquire_room(&db) != SQLITE_OK) {
+		bench_sqlite_count_allocs(0);
+		bench_remove_tree(dir);
+		return 1;
+	}
+	const int rows = 100;
+	sqlite3_exec(db, "BEGIN;", 0, 0, 0);
+	db_prepare(db, SQL_INSERT_MESSAGE, &stmt);
+	for (int i = 0; i < rows; i++) {
+		char text[64];
+		snprintf(text, sizeof(text), "第 %d 条消息：hello \"world\"", i);
+		char *messages[1] = {text};
+		insert_messages(stmt, 1700000000 + i, "203.0.113.42", "alice", messages, 1);
+	}
+	db_finalize(stmt);
+	sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+	ring_note_commit(rows);
+	rebuild_snapshot(db);
+	db_release(db);
+	long setup_allocs = bench_allocs(); // 建库和写入期间的分配，用来确认计数包装生效
+
+	static const struct {
+		const char *name;
+		const char *method;
+		const char *query;
+	} cases[] = {
+		{"PUT (405)", "PUT", ""},
+		{"DELETE, no action (405)", "DELETE", ""},
+		{"long room name (400)", "GET", "room=aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"},
+		{"GET, nothing new", "GET", "since=100"},
+		{"GET, 10 new", "GET", "since=90"},
+	};
+	const int case_count = sizeof(cases) / sizeof(cases[0]);
+	double results[8][2]; // [情形][分配次数/耗时]
+
+	fflush(stdout);
+	int saved_stdout = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, STDOUT_FILENO);
+	arena_init();
+	long rss_before = bench_rss_kb();
+	for (int c = 0; c < case_count; c++) {
+		setenv("REQUEST_METHOD", cases[c].method, 1);
+		setenv("QUERY_STRING", cases[c].query, 1);
+		route_request(); // 预热：打开数据库连接、准备语句
+		long before = bench_allocs(), blocks = 0;
+		double start = bench_now();
+		for (int i = 0; i < iterations; i++) {
+			route_request(); // 开始时回收上一个请求的内存池
+			blocks += bench_arena_blocks();
+		}
+		results[c][1] = (bench_now() - start) * 1e6 / iterations;
+		results[c][0] = (double)(bench_allocs() - before + blocks) / iterations;
+	}
+	long rss_after = bench_rss_kb();
+
+	// 固定错误响应：cJSON + malloc、cJSON + 内存池、常量
+	double direct[3][2];
+	for (int variant = 0; variant < 3; variant++) {
+		if (variant == 0) {
+			cJSON_Hooks hooks = {bench_counting_malloc, free};
+			cJSON_InitHooks(&hooks);
+			g_arena = NULL;
+		} else {
+			arena_init();
+		}
+		long before = bench_allocs(), blocks = 0;
+		double start = bench_now();
+		for (int i = 0; i < iterations; i++) {
+			arena_reset();
+			if (variant < 2) bench_error_cjson();
+			else bench_error_fixed();
+			blocks += bench_arena_blocks();
+		}
+		direct[variant][1] = (bench_now() - start) * 1e9 / iterations;
+		direct[variant][0] = (double)(bench_allocs() - before + blocks) / iterations;
+	}
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+	close(null_fd);
+
+	// 两种写法的输出必须逐字节一致（客户端接受压缩时原先的写法先缓冲响应体，同样带 Content-Length）
+	char *outputs[2];
+	size_t sizes[2];
+	int rc = 0;
+	setenv("HTTP_ACCEPT_ENCODING", "gzip", 1);
+	for (int variant = 0; variant < 2; variant++) {
+		FILE *memory = open_memstream(&outputs[variant], &sizes[variant]);
+		FILE *saved = stdout;
+		stdout = memory;
+		if (variant == 0) bench_error_cjson();
+		else bench_error_fixed();
+		stdout = saved;
+		fclose(memory);
+		bench_strip_timing(outputs[variant], &sizes[variant]);
+	}
+	unsetenv("HTTP_ACCEPT_ENCODING");
+	if (sizes[0] != sizes[1] || memcmp(outputs[0], outputs[1], sizes[0]) != 0) {
+		printf("MISMATCH: fixed response differs from cJSON output\n");
+		rc = 1;
+	}
+	free(outputs[0]);
+	free(outputs[1]);
+
+	printf("%-26s %14s %12s\n", "request", "allocs", "us");
+	for (int c = 0; c < case_count; c++) printf("%-26s %14.1f %12.2f\n", cases[c].name, results[c][0], results[c][1]);
+	printf("RSS: %ld -> %ld KB over %d requests\n", rss_before, rss_after, iterations * case_count);
+	printf("(%ld SQLite allocations counted while creating and seeding the database)\n", setup_allocs);
+	static const char *variants[] = {"cJSON + malloc", "cJSON + arena", "constant body"};
+	printf("%-26s %14s %12s\n", "405 error response", "allocs", "ns");
+	for (int variant = 0; variant < 3; variant++) {
+		printf("%-26s %14.1f %12.0f\n", variants[variant], direct[variant][0], direct[variant][1]);
+	}
+
+	unsetenv("REQUEST_METHOD");
+	unsetenv("QUERY_STRING");
+	bench_sqlite_count_allocs(0); // 同时关闭连接池中的连接
+	g_db_persistent = 0;
+	bench_remove_tree(dir);
+	return rc;
+}
+
+// 函数：运行指定名称的基准测试，"all" 运行全部
+int run_bench(const char *name) {
+	int all = strcmp(name, "all") == 0;
+	int matched = 0, rc = 0;
+	if (all || strcmp(name, "json") == 0) {
+		printf("== json: GET 响应序列化 ==\n");
+		rc |= bench_json();
+		matched = 1;
+	}
+	if (all || strcmp(name, "retention") == 0) {
+		printf("== retention: 写入并清理旧消息 ==\n");
+		rc |= bench_retention();
+		matched = 1;
+	}
+	if (all || strcmp(name, "compress") == 0) {
+		printf("== compress: 响应压缩 ==\n");
+		rc |= bench_compress();
+		matched = 1;
+	}
+	if (all || strcmp(name, "history") == 0) {
+		printf("== history: 向前翻页 ==\n");
+		rc |= bench_history();
+		matched = 1;
+	}
+	if (all || strcmp(name, "archive") == 0) {
+		printf("== archive: 归档旧消息 ==\n");
+		rc |= bench_archive();
+		matched = 1;
+	}
+	if (all || strcmp(name, "search") == 0) {
+		printf("== search: 全文搜索 ==\n");
+		rc |= bench_search();
+		matched = 1;
+	}
+	if (all || strcmp(name, "parse") == 0) {
+		printf("== parse: 请求解析 ==\n");
+		rc |= bench_parse();
+		matched = 1;
+	}
+	if (all || strcmp(name, "timing") == 0) {
+		printf("== timing: 耗时统计的开销 ==\n");
+		rc |= bench_timing();
+		matched = 1;
+	}
+	if (all || strcmp(name, "ratelimit") == 0) {
+		printf("== ratelimit: 发送频率限制的开销 ==\n");
+		rc |= bench_ratelimit();
+		matched = 1;
+	}
+	if (all || strcmp(name, "cgi") == 0) {
+		printf("== cgi: 端到端 CGI 请求 ==\n");
+		rc |= bench_cgi();
+		matched = 1;
+	}
+	if (all || strcmp(name, "session") == 0) {
+		printf("== session: 会话令牌的验证与撤销 ==\n");
+		rc |= bench_session();
+		matched = 1;
+	}
+	if (all || strcmp(name, "queue") == 0) {
+		printf("== queue: 写入队列与组提交 ==\n");
+		rc |= bench_queue();
+		matched = 1;
+	}
+	if (all || strcmp(name, "ring") == 0) {
+		printf("== ring: 共享环、快照与实时查询 ==\n");
+		rc |= bench_ring();
+		matched = 1;
+	}
+	if (all || strcmp(name, "server") == 0) {
+		printf("== server: HTTP/WebSocket 服务器模式 ==\n");
+		rc |= bench_server();
+		matched = 1;
+	}
+	if (all || strcmp(name, "replica") == 0) {
+		printf("== replica: 变更日志复制 ==\n");
+		rc |= bench_replica();
+		matched = 1;
+	}
+	if (all || strcmp(name, "maintenance") == 0) {
+		printf("== maintenance: 在线备份与增量清理 ==\n");
+		rc |= bench_maintenance();
+		matched = 1;
+	}
+	if (all || strcmp(name, "arena") == 0) {
+		printf("== arena: 请求内存池与固定响应 ==\n");
+		rc |= bench_arena();
+		matched = 1;
+	}
+	if (!matched) {
+		fprintf(stderr, "Unknown benchmark: %s\n", name);
+		return 1;
+	}
+	return rc;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc >= 2 && strcmp(argv[1], "--bench") == 0) {
+		arena_init();
+		if (configure_paths() != 0) {
+			fprintf(stderr, "CHAT_DATA_DIR is too long.\n");
+			return 1;
+		}
+		return run_bench(argc >= 3 ? argv[2] : "all");
+	}
+	return chat_handler_main(argc, argv);
+}
@@ -1,823 +1,6481 @@
+#define _GNU_SOURCE // fwrite_unlocked 等函数
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <sqlite3.h>
 #include <time.h>
 #include <ctype.h>
+#include <strings.h>
+#include <limits.h>
 #include <sys/stat.h> // 用于检查文件是否存在
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sched.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
+#include <zlib.h>
+#include <brotli/encode.h>
 #include <cjson/cJSON.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define DB_PATH "/tmp/chat_messages.db"
+#define DATA_DIR "/tmp" // 数据文件所在目录的默认值，可用环境变量 CHAT_DATA_DIR 修改
+#define MAX_DATA_DIR_LENGTH 160 // 数据目录路径的最大长度
+#define DB_PATH_SIZE (MAX_DATA_DIR_LENGTH + 64) // 数据库文件路径的缓冲区大小（目录 + 文件名）
+#define DB_FILE "chat_messages.db" // 用户数据和默认聊天室的消息
+#define ROOM_DB_FILE_FORMAT "chat_room_%016llx.db" // 其他聊天室的数据库文件，按房间名的哈希分片
+#define NOTIFY_SUFFIX ".notify" // 新消息通知文件，内容为最新消息 ID
+#define SNAPSHOT_SUFFIX ".snapshot" // 预先生成的最新消息 JSON 快照
+#define SNAPSHOT_LOCK_SUFFIX ".snapshot.lock" // 重建快照时使用的文件锁
+#define ARCHIVE_SUFFIX ".archive" // 超出保留窗口的消息的归档目录
+#define SESSION_KEYS_SUFFIX ".session_keys" // 会话签名密钥文件
+#define SESSION_REVOCATIONS_SUFFIX ".revocations" // 会话撤销纪元文件
+#define METRICS_SUFFIX ".metrics" // 各阶段耗时的共享直方图
+#define RATE_LIMIT_SUFFIX ".ratelimit" // 发送频率限制的共享令牌桶
+#define RING_SUFFIX ".ring" // 最新消息的共享内存环
+#define QUEUE_SUFFIX ".queue" // 等待提交到数据库的消息（写入队列）
+#define QUEUE_LOCK_SUFFIX ".queue.lock" // 写入队列刷新者的文件锁
+#define CHANGELOG_SUFFIX ".changes" // 主实例的变更日志（复制给只读副本）
+#define CHANGELOG_OLD_SUFFIX ".changes.1" // 轮换下来的上一段变更日志
+#define REPLICA_SUFFIX ".replica" // 只读副本的应用进度
+#define MAX_ROOM_NAME_LENGTH 64 // 聊天室名称的最大长度
+#define ROOM_PATH_SIZE 256 // 聊天室相关文件路径的缓冲区大小
 #define MAX_MESSAGES_GET 50 // 用于GET请求限制获取的消息数量
+#define MAX_HISTORY_PAGE 200 // 向前翻页时每页消息数量的上限
 #define MAX_MESSAGE_LENGTH 1024 // 消息内容的最大长度
-#define MAX_MESSAGES_POST 200 // 数据库中保留的最大消息数量（用于POST请求清理旧消息）
-#define MAX_POST_DATA_SIZE 4096 // POST 数据缓冲区最大尺寸
-
-// 函数：URL 解码字符串
-void url_decode(char *dst, const char *src) {
-	char a, b;
-	while (*src) {
-		// 处理 %xx 形式的编码字符
-		if ((*src == '%') &&
-			((a = src[1]) && (b = src[2])) &&
-			(isxdigit(a) && isxdigit(b))) {
-			// 将十六进制字符转换为对应的数值
-			if (a >= 'a') a -= 'a' - 'A';
-			if (a >= '0' && a <= '9') a -= '0';
-			else a -= 'A' - 10;
-			if (b >= 'a') b -= 'a' - 'A';
-			if (b >= '0' && b <= '9') b -= '0';
-			else b -= 'A' - 10;
-			*dst++ = 16*a + b; // 将两个半字节合并为一个字节
-			src+=3; // 跳过 % 和两个十六进制字符
-		} else if (*src == '+') {
-			// 处理 '+' 编码，将其替换为空格
-			*dst++ = ' ';
-			src++;
-		} else {
-			// 其他字符直接复制
-			*dst++ = *src++;
+#define MAX_MESSAGES_POST 200 // 数据库中保留的最大消息数量的默认值（可用环境变量 CHAT_MAX_MESSAGES 修改）
+#define PRUNE_INTERVAL 16 // 每写入多少条消息清理一次旧消息的默认值（可用环境变量 CHAT_PRUNE_INTERVAL 修改）
+#define MAX_BATCH_MESSAGES 16 // 一次 POST 最多包含的消息条数
+#define MAX_SEARCH_QUERY_LENGTH 256 // 搜索词的最大长度（字节）
+
+// ========== 请求解析 ==========
+// 查询字符串和 Cookie 只扫描一遍，切分成指向原字符串的视图，不复制也不修改环境变量，只在取值时解码。
+// POST 请求体由 form_reader 从 stdin 分块流式读取，边读边解码。每个字段只保留调用方缓冲区能容纳的部分，
+// 所以请求体的大小不受固定缓冲区限制。
+// 解码时用 SSE2 一次检查 16 字节，找出 '%'、'+' 和分隔符，其余字节成段复制。
+
+#define MAX_FORM_FIELDS 64 // 查询字符串或 Cookie 中最多识别的字段数量
+#define FORM_READ_CHUNK 4096 // 从 stdin 读取请求体的块大小
+
+// 字符串视图：指向原字符串中的一段，不以 '\0' 结尾
+typedef struct {
+	const char *data;
+	size_t len;
+} str_view;
+
+// 查询字符串或 Cookie 中的一个字段（名称和值都未解码）
+typedef struct {
+	str_view name;
+	str_view value;
+} form_field;
+
+// 从 stdin 流式读取的表单请求体
+typedef struct {
+	FILE *in;
+	size_t remaining; // 还未从 in 读取的字节数
+	size_t pos, len; // buf 中未处理部分的范围
+	int error; // 请求体比 CONTENT_LENGTH 短
+	char buf[FORM_READ_CHUNK];
+} form_reader;
+
+// 函数：在 [p, end) 中查找第一个等于 c1..c4 之一的字节，没有时返回 end
+static const char *scan_special(const char *p, const char *end, char c1, char c2, char c3, char c4) {
+#ifdef __SSE2__
+	const __m128i v1 = _mm_set1_epi8(c1), v2 = _mm_set1_epi8(c2), v3 = _mm_set1_epi8(c3), v4 = _mm_set1_epi8(c4);
+	while (end - p >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)p);
+		__m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, v1), _mm_cmpeq_epi8(chunk, v2)),
+		                           _mm_or_si128(_mm_cmpeq_epi8(chunk, v3), _mm_cmpeq_epi8(chunk, v4)));
+		int mask = _mm_movemask_epi8(hit);
+		if (mask != 0) return p + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	while (p < end && *p != c1 && *p != c2 && *p != c3 && *p != c4) p++;
+	return p;
+}
+
+// 函数：十六进制字符的值，不是十六进制字符时返回 -1
+static int hex_value(int c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// 函数：URL 解码 src 的前 len 字节（%xx 和 '+'），结果最多保留 dst_size - 1 字节并以 '\0' 结尾
+// 返回完整解码后的长度（可能大于保留的部分）；dst 可以与 src 相同（原地解码）
+size_t url_decode_n(char *dst, size_t dst_size, const char *src, size_t len) {
+	const char *end = src + len;
+	size_t n = 0;
+	while (src < end) {
+		// 普通字符整段复制
+		const char *special = scan_special(src, end, '%', '+', '%', '+');
+		size_t run = special - src;
+		if (n < dst_size - 1) memmove(dst + n, src, run < dst_size - 1 - n ? run : dst_size - 1 - n);
+		n += run;
+		src = special;
+		if (src == end) break;
+
+		char c = *src++;
+		if (c == '+') {
+			c = ' ';
+		} else if (end - src >= 2 && hex_value(src[0]) >= 0 && hex_value(src[1]) >= 0) {
+			c = (char)(hex_value(src[0]) * 16 + hex_value(src[1]));
+			src += 2;
+		} // 不完整的 %xx 原样保留
+		if (n < dst_size - 1) dst[n] = c;
+		n++;
+	}
+	dst[n < dst_size - 1 ? n : dst_size - 1] = '\0';
+	return n;
+}
+
+// 函数：单遍切分查询字符串（separator 为 '&'）或 Cookie（separator 为 ';'，忽略字段前的空格）
+// 没有 '=' 的字段被忽略，超过 max 个的字段也被忽略；返回字段数量
+int parse_fields(const char *input, char separator, form_field *fields, int max) {
+	int count = 0;
+	if (input == NULL) return 0;
+	const char *p = input;
+	const char *end = p + strlen(p);
+	while (p < end && count < max) {
+		while (separator == ';' && p < end && *p == ' ') p++;
+		const char *field_end = memchr(p, separator, end - p);
+		if (field_end == NULL) field_end = end;
+		const char *eq = memchr(p, '=', field_end - p);
+		if (eq != NULL) {
+			fields[count].name = (str_view){p, eq - p};
+			fields[count].value = (str_view){eq + 1, field_end - eq - 1};
+			count++;
 		}
+		p = field_end + 1;
 	}
-	*dst++ = '\0'; // 字符串以空字符结尾
+	return count;
+}
+
+// 函数：在字段列表中按名称查找字段，找不到返回 NULL
+const form_field *find_field(const form_field *fields, int count, const char *name) {
+	size_t name_len = strlen(name);
+	for (int i = 0; i < count; i++) {
+		if (fields[i].name.len == name_len && memcmp(fields[i].name.data, name, name_len) == 0) return &fields[i];
+	}
+	return NULL;
 }
 
 // 函数：解析 HTTP Cookie 字符串，获取用户名和密码
 void parse_cookies(const char *cookie_str, char *username, size_t username_size, char *password, size_t password_size) {
-	if (!cookie_str) return;
+	form_field fields[MAX_FORM_FIELDS];
+	int count = parse_fields(cookie_str, ';', fields, MAX_FORM_FIELDS);
+	const form_field *field = find_field(fields, count, "username");
+	if (field != NULL) url_decode_n(username, username_size, field->value.data, field->value.len);
+	field = find_field(fields, count, "password");
+	if (field != NULL) url_decode_n(password, password_size, field->value.data, field->value.len);
+}
 
-	char *cookie_copy = strdup(cookie_str);
-	if (!cookie_copy) return;
+// 函数：从 Cookie 字符串中获取指定名称的原始值（不解码），找到返回 1，否则返回 0
+int get_cookie(const char *cookie_str, const char *name, char *value, size_t value_size) {
+	form_field fields[MAX_FORM_FIELDS];
+	int count = parse_fields(cookie_str, ';', fields, MAX_FORM_FIELDS);
+	const form_field *field = find_field(fields, count, name);
+	if (field == NULL || field->value.len >= value_size) return 0;
+	memcpy(value, field->value.data, field->value.len);
+	value[field->value.len] = '\0';
+	return 1;
+}
 
-	char *token;
-	char *rest = cookie_copy;
+// 函数：从查询字符串中获取指定参数的值（URL 解码后），找到返回 1，否则返回 0
+int get_query_param(const char *query_string, const char *name, char *value, size_t value_size) {
+	form_field fields[MAX_FORM_FIELDS];
+	int count = parse_fields(query_string, '&', fields, MAX_FORM_FIELDS);
+	const form_field *field = find_field(fields, count, name);
+	if (field == NULL) return 0;
+	url_decode_n(value, value_size, field->value.data, field->value.len);
+	return 1;
+}
 
-	while ((token = strtok_r(rest, ";", &rest))) {
-		// Trim leading spaces
-		while (*token == ' ') token++;
+// 函数：开始从 in 读取 content_length 字节的表单请求体
+void form_reader_init(form_reader *r, FILE *in, size_t content_length) {
+	r->in = in;
+	r->remaining = content_length;
+	r->pos = r->len = 0;
+	r->error = 0;
+}
 
-		char *key = token;
-		char *value = strchr(token, '=');
+// 函数：把未处理的部分移到缓冲区开头并继续读取，返回新读入的字节数（请求体已读完或读取失败时为 0）
+static size_t form_reader_fill(form_reader *r) {
+	if (r->pos > 0) {
+		memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+		r->len -= r->pos;
+		r->pos = 0;
+	}
+	size_t want = sizeof(r->buf) - r->len;
+	if (want > r->remaining) want = r->remaining;
+	if (want == 0) return 0;
+	size_t got = fread(r->buf + r->len, 1, want, r->in);
+	if (got == 0) {
+		r->error = 1;
+		r->remaining = 0;
+	}
+	r->len += got;
+	r->remaining -= got;
+	return got;
+}
 
-		if (value) {
-			*value = '\0';
-			value++;
+// 函数：查看当前位置之后第 i 个字节（可跨越读取块），请求体结束时返回 -1
+static int form_reader_peek(form_reader *r, size_t i) {
+	while (r->len - r->pos <= i) {
+		if (form_reader_fill(r) == 0) return -1;
+	}
+	return (unsigned char)r->buf[r->pos + i];
+}
 
-			char decoded_value[MAX_MESSAGE_LENGTH + 1];
-			url_decode(decoded_value, value);
+// 函数：把 [p, end) 中第一个特殊字节（'%'、'+'、stop1 或 stop2）之前的部分追加到 out 的第 *n 字节处，
+// 最多保留到 out_size - 1 字节，返回特殊字节的位置（没有时为 end）；out 为 NULL 时只查找。
+// 输出空间足够时每次整块写入 16 字节，越过特殊字节的部分之后会被覆盖，所以 out 不能与输入重叠
+static const char *form_copy_run(const char *p, const char *end, char *out, size_t out_size, size_t *n, char stop1, char stop2) {
+#ifdef __SSE2__
+	const __m128i percent = _mm_set1_epi8('%'), plus = _mm_set1_epi8('+');
+	const __m128i v1 = _mm_set1_epi8(stop1), v2 = _mm_set1_epi8(stop2);
+	while (out != NULL && end - p >= 16 && *n + 16 < out_size) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)p);
+		_mm_storeu_si128((__m128i *)(out + *n), chunk);
+		__m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, percent), _mm_cmpeq_epi8(chunk, plus)),
+		                           _mm_or_si128(_mm_cmpeq_epi8(chunk, v1), _mm_cmpeq_epi8(chunk, v2)));
+		int mask = _mm_movemask_epi8(hit);
+		if (mask != 0) {
+			*n += __builtin_ctz(mask);
+			return p + __builtin_ctz(mask);
+		}
+		*n += 16;
+		p += 16;
+	}
+#endif
+	const char *special = scan_special(p, end, '%', '+', stop1, stop2);
+	size_t run = special - p;
+	if (out != NULL && *n < out_size - 1) memcpy(out + *n, p, run < out_size - 1 - *n ? run : out_size - 1 - *n);
+	*n += run;
+	return special;
+}
 
-			if (strcmp(key, "username") == 0) {
-				strncpy(username, decoded_value, username_size - 1);
-				username[username_size - 1] = '\0';
-			} else if (strcmp(key, "password") == 0) {
-				strncpy(password, decoded_value, password_size - 1);
-				password[password_size - 1] = '\0';
+// 函数：边读边解码，直到遇到 stop1 或 stop2（已消耗但不写入 out）或请求体结束
+// out 为 NULL 时只跳过；返回遇到的分隔符，请求体结束时返回 0；*full_len 为完整解码后的长度
+static int form_reader_part(form_reader *r, char *out, size_t out_size, char stop1, char stop2, size_t *full_len) {
+	size_t n = 0;
+	int stop = 0;
+	while (stop == 0) {
+		if (r->pos == r->len && form_reader_fill(r) == 0) break;
+		// 在已读入的数据中连续解码，只有 '%' 位于末尾、缺少后两个字节时才退出
+		const char *p = r->buf + r->pos, *end = r->buf + r->len;
+		for (;;) {
+			p = form_copy_run(p, end, out, out_size, &n, stop1, stop2);
+			if (p == end) break;
+			char c = *p;
+			if (c == stop1 || c == stop2) {
+				stop = c;
+				p++;
+				break;
+			}
+			if (c == '+') {
+				c = ' ';
+				p++;
+			} else if (end - p >= 3) {
+				int hi = hex_value(p[1]), lo = hex_value(p[2]);
+				if (hi >= 0 && lo >= 0) {
+					c = (char)(hi * 16 + lo);
+					p += 3;
+				} else {
+					p++; // 不完整的 %xx 原样保留
+				}
+			} else {
+				break;
 			}
+			if (out != NULL && n < out_size - 1) out[n] = c;
+			n++;
 		}
+		r->pos = p - r->buf;
+		if (stop != 0 || r->pos == r->len) continue;
+
+		// '%' 位于已读入数据的末尾，逐字节读取后两个字节（可能需要再读入一块）
+		char c = r->buf[r->pos++];
+		int hi = hex_value(form_reader_peek(r, 0));
+		int lo = hi >= 0 ? hex_value(form_reader_peek(r, 1)) : -1;
+		if (lo >= 0) {
+			c = (char)(hi * 16 + lo);
+			r->pos += 2;
+		} // 不完整的 %xx 原样保留
+		if (out != NULL && n < out_size - 1) out[n] = c;
+		n++;
 	}
-	free(cookie_copy);
+	if (out != NULL) out[n < out_size - 1 ? n : out_size - 1] = '\0';
+	if (full_len != NULL) *full_len = n;
+	return stop;
 }
 
-// 函数：发送统一的 JSON 响应
-void send_json_response(int http_status, const char *status_text, cJSON *json_body) {
-	printf("Status: %d %s\r\n", http_status, status_text);
-	printf("Content-type: application/json\r\n\r\n");
-	char *json_output = cJSON_PrintUnformatted(json_body);
-	if (json_output != NULL) {
-		printf("%s\n", json_output);
-		free(json_output);
+// 函数：读取下一个字段的名称（解码后，最多保留 name_size - 1 字节），之后应调用 form_read_value 读取值
+// 没有 '=' 的字段被跳过；返回 1 表示读到字段，0 表示请求体已结束，-1 表示请求体不完整
+int form_next_name(form_reader *r, char *name, size_t name_size) {
+	for (;;) {
+		int stop = form_reader_part(r, name, name_size, '=', '&', NULL);
+		if (stop == '=') return 1;
+		if (stop == 0) return r->error ? -1 : 0;
 	}
-	cJSON_Delete(json_body);
 }
 
-// 函数：初始化数据库
-int init_database() {
-	sqlite3 *db;
-	char *err_msg = 0;
-	int rc;
+// 函数：读取当前字段的值（解码后，最多保留 value_size - 1 字节）；value 为 NULL 时跳过
+// 返回完整解码后的长度，调用方据此判断是否被截断
+size_t form_read_value(form_reader *r, char *value, size_t value_size) {
+	size_t full_len;
+	form_reader_part(r, value, value_size, '&', '&', &full_len);
+	return full_len;
+}
 
-	// 检查数据库文件是否存在
-	struct stat buffer;
-	if (stat(DB_PATH, &buffer) == 0) {
-		return 0;
-	}
+// 函数：读取整数类型的运行时配置（环境变量），未设置或无效时使用默认值
+int config_int(const char *name, int default_value) {
+	const char *value = getenv(name);
+	if (value == NULL || *value == '\0') return default_value;
+	char *end;
+	long n = strtol(value, &end, 10);
+	if (*end != '\0' || n <= 0 || n > INT_MAX) return default_value;
+	return (int)n;
+}
 
-	fprintf(stderr, "Creating new database at %s...\n", DB_PATH);
+// ========== 请求耗时统计 ==========
+// 每个请求按阶段累计单调时钟耗时，并在响应中以 Server-Timing 头给出。
+// 请求结束时把各阶段耗时计入共享的直方图文件（<数据库>.metrics），这个文件 mmap 后用原子加法更新。
+// 所有 CGI 进程和 SCGI 工作进程共用这个文件，GET ?action=metrics 以 Prometheus 文本格式输出。
+// 每个阶段只调用两次 clock_gettime（vDSO，不进入内核），记录一次请求只需几十次原子加法。
+// CHAT_METRICS=0 时不写直方图文件，Server-Timing 头照常输出。
 
-	// 打开数据库连接（如果文件不存在，会自动创建）
-	rc = sqlite3_open(DB_PATH, &db);
-	if (rc) {
-		fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
-		return 1;
-	}
-
-	// 创建 messages 表的 SQL 语句
-	const char *sql_create_table = "CREATE TABLE messages ("
-								   "id INTEGER PRIMARY KEY,"
-								   "timestamp INTEGER,"
-								   "ip TEXT,"
-								   "username TEXT,"
-								   "message TEXT"
-								   ");";
-								   
-	// 创建 users 表的 SQL 语句，用于存储用户名和密码
-	const char *sql_create_users_table = "CREATE TABLE users ("
-										 "username TEXT PRIMARY KEY,"
-										 "password TEXT"
-										 ");";
-
-	// 执行 SQL 语句
-	rc = sqlite3_exec(db, sql_create_table, 0, 0, &err_msg);
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "SQL error: %s\n", err_msg);
-		sqlite3_free(err_msg);
-		sqlite3_close(db);
-		return 1;
-	}
+enum {
+	PHASE_INIT, // 检查并初始化数据库文件（CGI 模式）
+	PHASE_OPEN, // 打开数据库连接并检查结构
+	PHASE_RATE_LIMIT, // 检查发送频率
+	PHASE_AUTH, // 验证会话令牌或查询密码
+	PHASE_QUEUE, // 把消息追加到写入队列
+	PHASE_QUERY, // 读取消息（包括逐行写出 JSON）
+	PHASE_INSERT, // 写入消息并提交事务
+	PHASE_PRUNE, // 清理和归档旧消息
+	PHASE_SNAPSHOT, // 写入后重建快照
+	PHASE_SERIALIZE, // 把 cJSON 响应序列化为文本
+	PHASE_COMPRESS, // 压缩响应体
+	PHASE_TOTAL, // 整个请求
+	PHASE_COUNT
+};
 
-	// 执行创建 users 表的 SQL 语句
-	rc = sqlite3_exec(db, sql_create_users_table, 0, 0, &err_msg);
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "SQL error: %s\n", err_msg);
-		sqlite3_free(err_msg);
-		sqlite3_close(db);
-		return 1;
-	}
+static const char *phase_names[PHASE_COUNT] = {
+	"init", "open", "ratelimit", "auth", "queue", "query", "insert", "prune", "snapshot", "serialize", "compress", "total"
+};
 
-	sqlite3_close(db);
-	fprintf(stderr, "Database created successfully.\n");
+#define METRICS_MAGIC 0x3352544d54414843ULL // 直方图文件的格式标识（"CHATMTR3"），布局改变时递增
+#define METRICS_BUCKETS 16 // 直方图桶的数量（最后一个桶为 +Inf）
 
-	// 设置数据库文件权限
-	if (chmod(DB_PATH, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) != 0) { // 660 权限
-		fprintf(stderr, "Error setting database file permissions.\n");
-		return 1;
-	}
+// 直方图各桶的上界（微秒）
+static const unsigned int metrics_bucket_us[METRICS_BUCKETS - 1] = {
+	50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000
+};
 
-	return 0;
-}
+// 共享直方图文件的布局（原生字节序），各字段只用原子操作读写
+struct metrics_file {
+	unsigned long long magic;
+	struct {
+		unsigned long long buckets[METRICS_BUCKETS]; // 落在各桶中的次数（非累计）
+		unsigned long long count;
+		unsigned long long sum_ns;
+	} phases[PHASE_COUNT];
+};
 
+static long long g_phase_ns[PHASE_COUNT]; // 当前请求各阶段的累计耗时
+static long long g_request_start; // 当前请求的开始时间
+static int g_request_untimed; // 非 0 表示当前请求不计入直方图（长时间保持的推送连接）
+static char g_metrics_path[ROOM_PATH_SIZE]; // 直方图文件（由 configure_paths 设置）
+static struct metrics_file *g_metrics; // 已映射的直方图文件，常驻进程只映射一次
 
-// 处理 GET 请求的函数
-int handle_get_messages() {
-	sqlite3 *db; // SQLite 数据库连接对象
-	sqlite3_stmt *stmt; // SQLite 预处理语句对象
-	int rc; // SQLite 操作的返回码
+// 函数：单调时钟，单位为纳秒
+static long long timer_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-	// 打开 SQLite 数据库连接
-	rc = sqlite3_open(DB_PATH, &db);
-	if (rc) {
-		// 如果打开数据库失败，则输出错误信息到标准错误流，并返回错误码
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", sqlite3_errmsg(db));
-		send_json_response(500, "Internal Server Error", response_json);
-		return 1;
-	}
+// 函数：把从 start（timer_now 的返回值）到现在的耗时计入阶段 phase
+static void timer_add(int phase, long long start) {
+	g_phase_ns[phase] += timer_now() - start;
+}
 
-	cJSON *root = cJSON_CreateObject();
-	cJSON_AddStringToObject(root, "status", "success");
-	cJSON *data_array = cJSON_CreateArray();
-	cJSON_AddItemToObject(root, "data", data_array);
+// 函数：开始一次请求的计时
+void timer_reset() {
+	memset(g_phase_ns, 0, sizeof(g_phase_ns));
+	g_request_untimed = 0;
+	g_request_start = timer_now();
+}
 
-	if (root == NULL || data_array == NULL) {
-		// 如果创建 JSON 数组失败，则输出错误信息，关闭数据库，并返回错误码
-		cJSON_Delete(root);
-		sqlite3_close(db);
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "Failed to create JSON array");
-		send_json_response(500, "Internal Server Error", response_json);
-		return 1;
+// 函数：生成 Server-Timing 响应头（以 \r\n 结尾），只包含目前已经发生的阶段
+// 直接写到 stdout 的响应先发送响应头，其中不包含之后写出消息的耗时
+const char *server_timing_header() {
+	static char header[384];
+	size_t len = snprintf(header, sizeof(header), "Server-Timing: ");
+	for (int i = 0; i < PHASE_TOTAL; i++) {
+		if (g_phase_ns[i] > 0 && len < sizeof(header)) {
+			len += snprintf(header + len, sizeof(header) - len, "%s;dur=%.3f, ", phase_names[i], g_phase_ns[i] / 1e6);
+		}
 	}
-
-	// SQL 查询语句：选择最新的 MAX_MESSAGES_GET 条消息，按 ID 降序排列 (ID 通常隐式地按时间戳生成)
-	const char *sql = "SELECT id, timestamp, ip, username, message FROM messages ORDER BY id DESC LIMIT ?;";
-	// 准备 SQL 语句
-	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
-	if (rc != SQLITE_OK) {
-		// 如果准备语句失败，则输出错误信息，释放 JSON 对象，关闭数据库，并返回错误码
-		cJSON_Delete(root);
-		sqlite3_close(db);
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "Failed to prepare statement");
-		send_json_response(500, "Internal Server Error", response_json);
-		return 1;
+	if (len < sizeof(header)) {
+		snprintf(header + len, sizeof(header) - len, "total;dur=%.3f\r\n", (timer_now() - g_request_start) / 1e6);
 	}
+	return header;
+}
 
-	// 绑定 MAX_MESSAGES_GET 到 SQL 语句中的 LIMIT 参数
-	sqlite3_bind_int(stmt, 1, MAX_MESSAGES_GET);
+// 函数：映射共享直方图文件，文件不存在时创建；格式不符或失败时返回 NULL
+static struct metrics_file *metrics_map() {
+	if (g_metrics != NULL) return g_metrics;
+	int fd = open(g_metrics_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	if (fd < 0) return NULL;
+	struct stat st;
+	// 多个进程同时创建时都扩展到相同大小，新增部分全为 0
+	if (fstat(fd, &st) != 0 || (st.st_size < (off_t)sizeof(struct metrics_file) && ftruncate(fd, sizeof(struct metrics_file)) != 0)) {
+		close(fd);
+		return NULL;
+	}
+	struct metrics_file *m = mmap(NULL, sizeof(struct metrics_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) return NULL;
+	unsigned long long expected = 0;
+	__atomic_compare_exchange_n(&m->magic, &expected, METRICS_MAGIC, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&m->magic, __ATOMIC_RELAXED) != METRICS_MAGIC) {
+		fprintf(stderr, "Metrics file %s has an unknown format; delete it to reset.\n", g_metrics_path);
+		munmap(m, sizeof(struct metrics_file));
+		return NULL;
+	}
+	g_metrics = m;
+	return m;
+}
 
-	// 创建一个临时 cJSON 数组，用于按逆序（从最新到最旧）存储从数据库中获取的消息
-	cJSON *temp_array = cJSON_CreateArray();
-	if (temp_array == NULL) {
-		// 如果创建临时 JSON 数组失败，则输出错误信息，释放 JSON 对象，结束语句，关闭数据库，并返回错误码
-		cJSON_Delete(root);
-		sqlite3_finalize(stmt);
-		sqlite3_close(db);
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "Failed to create temporary JSON array");
-		send_json_response(500, "Internal Server Error", response_json);
-		return 1;
+// 函数：请求结束时把各阶段的耗时计入共享直方图，没有经过的阶段不计数
+void metrics_record() {
+	const char *value = getenv("CHAT_METRICS");
+	if (g_request_untimed || (value != NULL && strcmp(value, "0") == 0)) return;
+	g_phase_ns[PHASE_TOTAL] = timer_now() - g_request_start;
+	struct metrics_file *m = metrics_map();
+	if (m == NULL) return;
+	for (int i = 0; i < PHASE_COUNT; i++) {
+		if (g_phase_ns[i] <= 0) continue;
+		long long us = g_phase_ns[i] / 1000;
+		int bucket = 0;
+		while (bucket < METRICS_BUCKETS - 1 && us > metrics_bucket_us[bucket]) bucket++;
+		__atomic_fetch_add(&m->phases[i].buckets[bucket], 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&m->phases[i].count, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&m->phases[i].sum_ns, g_phase_ns[i], __ATOMIC_RELAXED);
 	}
+}
 
-	// 循环遍历查询结果集，每次获取一行消息数据
-	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-		// 为当前消息创建一个 cJSON 对象
-		cJSON *message_obj = cJSON_CreateObject();
-		if (message_obj == NULL) {
-			// 如果创建消息 JSON 对象失败，则输出错误信息，释放所有 JSON 对象，结束语句，关闭数据库，并返回错误码
-			cJSON_Delete(root);
-			cJSON_Delete(temp_array);
-			sqlite3_finalize(stmt);
-			sqlite3_close(db);
-			cJSON *response_json = cJSON_CreateObject();
-			cJSON_AddStringToObject(response_json, "status", "error");
-			cJSON_AddStringToObject(response_json, "message", "Failed to create JSON object for message");
-			send_json_response(500, "Internal Server Error", response_json);
-			return 1;
-		}
+// ========== 请求内存池 ==========
+// cJSON 通过 cJSON_InitHooks 从按请求使用的内存池分配：分配只移动指针，cJSON_Delete 不做任何事，
+// 下一个请求开始时（route_request）整体回收。第一块是静态数组，常见请求不调用 malloc；不够时再 malloc 新块，
+// 回收时释放。CGI 进程处理一个请求后退出，常驻模式下第一块在请求之间复用。设置 CHAT_ARENA=0 时 cJSON 使用 malloc/free。
 
-		// 从查询结果中获取消息的各个字段
-		const long long id_raw = sqlite3_column_int64(stmt, 0); // 消息 ID
-		long long timestamp_raw = sqlite3_column_int64(stmt, 1); // 时间戳 (long long 类型以确保兼容性)
-		const char *ip = (const char *)sqlite3_column_text(stmt, 2); // 用户 IP 地址
-		const char *username = (const char *)sqlite3_column_text(stmt, 3); // 用户名
-		const char *message = (const char *)sqlite3_column_text(stmt, 4); // 消息内容
+#define ARENA_BLOCK_SIZE 16384 // 内存池每块的大小；更大的单次分配使用单独的块
+#define ARENA_ALIGN 16 // 分配的对齐字节数
 
-		char id_str[20];
-		snprintf(id_str, sizeof(id_str), "%lld", id_raw);
+struct arena_block {
+	struct arena_block *next; // 之前的块
+	size_t size; // data 的字节数
+	size_t used;
+	unsigned char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
 
-		// 将消息字段添加到 JSON 对象中
-		cJSON_AddStringToObject(message_obj, "id", id_str);
-		cJSON_AddNumberToObject(message_obj, "timestamp", timestamp_raw);
-		cJSON_AddStringToObject(message_obj, "ip", ip);
-		cJSON_AddStringToObject(message_obj, "username", username);
-		cJSON_AddStringToObject(message_obj, "message", message);
+static unsigned char g_arena_static[sizeof(struct arena_block) + ARENA_BLOCK_SIZE] __attribute__((aligned(ARENA_ALIGN)));
+static struct arena_block *g_arena; // 当前块，NULL 表示未启用
 
-		// 将当前消息 JSON 对象添加到临时数组中（此时是逆序）
-		cJSON_AddItemToArray(temp_array, message_obj);
+// 函数：从内存池分配（cJSON 的 malloc_fn），失败返回 NULL
+static void *arena_alloc(size_t size) {
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (g_arena->size - g_arena->used < size) {
+		size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		struct arena_block *block = malloc(sizeof(*block) + block_size);
+		if (block == NULL) return NULL;
+		block->next = g_arena;
+		block->size = block_size;
+		block->used = 0;
+		g_arena = block;
 	}
+	void *ptr = g_arena->data + g_arena->used;
+	g_arena->used += size;
+	return ptr;
+}
+
+// 函数：cJSON 的 free_fn；内存池中的内存随请求整体回收，这里不做任何事
+static void arena_free(void *ptr) {
+	(void)ptr;
+}
 
-	// 将消息从临时数组（逆序）添加到根数组（正序），实现按时间顺序排列
-	for (int i = cJSON_GetArraySize(temp_array) - 1; i >= 0; i--) {
-		cJSON_AddItemToArray(data_array, cJSON_DetachItemFromArray(temp_array, i));
+// 函数：回收从内存池分配的全部内存（保留静态的第一块）
+void arena_reset() {
+	if (g_arena == NULL) return;
+	while (g_arena->next != NULL) {
+		struct arena_block *next = g_arena->next;
+		free(g_arena);
+		g_arena = next;
 	}
-	cJSON_Delete(temp_array); // 释放临时数组的内存
+	g_arena->used = 0;
+}
 
-	sqlite3_finalize(stmt); // 结束 SQLite 预处理语句
-	sqlite3_close(db); // 关闭 SQLite 数据库连接
+// 函数：让 cJSON 使用内存池（进程启动时调用一次）
+void arena_init() {
+	const char *enabled = getenv("CHAT_ARENA");
+	if (enabled != NULL && strcmp(enabled, "0") == 0) return;
+	g_arena = (struct arena_block *)g_arena_static;
+	g_arena->next = NULL;
+	g_arena->size = ARENA_BLOCK_SIZE;
+	g_arena->used = 0;
+	cJSON_Hooks hooks = {arena_alloc, arena_free};
+	cJSON_InitHooks(&hooks);
+}
 
-	send_json_response(200, "OK", root); // 返回响应并释放根 JSON 数组的内存
+// ========== 响应压缩 ==========
+// 根据 HTTP_ACCEPT_ENCODING 选择 br 或 gzip。需要压缩时响应体先写入内存，
+// 结束时若不小于 CHAT_COMPRESS_MIN_SIZE 字节（默认 COMPRESS_MIN_SIZE）再整体压缩，更小的响应原样发送。
+// 客户端不接受压缩时响应体直接写到 stdout，和原来一样流式输出。
 
-	return 0; // 程序成功执行
-}
+#define COMPRESS_MIN_SIZE 1024 // 小于该字节数的响应不压缩
+#define GZIP_LEVEL 6 // gzip 压缩级别
+#define BROTLI_QUALITY 5 // brotli 质量（更高的质量对聊天消息只小几个百分点，耗时却成倍增加）
 
-// 处理 POST 请求的函数（原先的聊天消息处理）
-int handle_post_message() {
-	// 获取 POST 请求的内容长度
-	char *content_length_str = getenv("CONTENT_LENGTH");
-	int content_length = 0;
-	if (content_length_str != NULL) {
-		content_length = atoi(content_length_str); // 将字符串转换为整数
-	}
+enum {
+	ENCODING_IDENTITY,
+	ENCODING_GZIP,
+	ENCODING_BROTLI,
+};
 
-	// 检查内容长度是否有效
-	if (content_length <= 0 || content_length > MAX_POST_DATA_SIZE) {
-		// 如果内容长度无效，则打印错误信息
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "Invalid or missing POST data length.");
-		send_json_response(400, "Bad Request", response_json);
-		return 1;
-	}
+static const char *encoding_names[] = {"identity", "gzip", "br"};
 
-	char post_data[MAX_POST_DATA_SIZE + 1];
-	if (fread(post_data, 1, content_length, stdin) != content_length) {
-		 // 如果读取失败，则打印错误信息
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "Failed to read POST data from stdin.");
-		send_json_response(500, "Internal Server Error", response_json);
-		return 1;
-	}
-	post_data[content_length] = '\0'; // 确保字符串以空字符结尾
+static struct {
+	FILE *body; // 写入内存的响应体；为 NULL 表示直接写到 stdout
+	char *buffer;
+	size_t length;
+	int encoding;
+	int http_status;
+	const char *status_text;
+	const char *content_type;
+	char extra_headers[512];
+} g_response;
 
-	char username[256] = ""; // 用户名缓冲区
-	char password[256] = ""; // 密码缓冲区
-	char message[MAX_MESSAGE_LENGTH + 1] = ""; // 消息内容缓冲区
-	char decoded_value[MAX_MESSAGE_LENGTH + 1]; // 用于存储解码后的值
+static char g_replication_header[96]; // 只读副本附加在响应中的复制延迟响应头（每行以 \r\n 结尾），由 replica_lag_header 设置
 
-	char *token; // 用于 strtok_r 的令牌
-	char *rest = post_data; // 用于 strtok_r 的剩余字符串指针
+// 函数：按 Accept-Encoding（含 q 值和 *）选择响应编码，br 与 gzip 同等可接受时优先 br
+int negotiate_encoding(const char *accept_encoding) {
+	if (accept_encoding == NULL) return ENCODING_IDENTITY;
+	double q_gzip = -1, q_br = -1, q_any = -1;
+	const char *p = accept_encoding;
+	while (*p) {
+		while (*p == ' ' || *p == ',') p++;
+		const char *name = p;
+		while (*p && *p != ',' && *p != ';' && *p != ' ') p++;
+		size_t name_len = p - name;
+		double q = 1;
+		const char *item_end = strchr(p, ',');
+		if (item_end == NULL) item_end = p + strlen(p);
+		const char *q_param = strstr(p, "q=");
+		if (q_param != NULL && q_param < item_end) q = strtod(q_param + 2, NULL);
+		if (name_len == 4 && strncasecmp(name, "gzip", 4) == 0) q_gzip = q;
+		else if (name_len == 2 && strncasecmp(name, "br", 2) == 0) q_br = q;
+		else if (name_len == 1 && *name == '*') q_any = q;
+		p = item_end;
+	}
+	if (q_gzip < 0) q_gzip = q_any;
+	if (q_br < 0) q_br = q_any;
+	if (q_br > 0 && q_br >= q_gzip) return ENCODING_BROTLI;
+	if (q_gzip > 0) return ENCODING_GZIP;
+	return ENCODING_IDENTITY;
+}
 
-	// 解析 POST 数据，只获取消息内容
-	while ((token = strtok_r(rest, "&", &rest))) { // 按 '&' 分割键值对
-		char *key = token;
-		char *value = strchr(token, '='); // 查找 '=' 分隔符
-		if (value) {
-			*value = '\0'; // 在 '=' 处截断，将 key 字符串空终止
-			value++;       // 移动指针到值的开始
-			url_decode(decoded_value, value); // 解码值
-			if (strcmp(key, "message") == 0) {
-				strncpy(message, decoded_value, sizeof(message) - 1); // 复制解码后的消息
-				message[sizeof(message) - 1] = '\0'; // 确保空终止
+// 函数：用指定编码和压缩级别（gzip 级别或 brotli 质量）压缩数据，返回 malloc 分配的结果（调用方 free），失败时返回 NULL
+unsigned char *compress_body_level(int encoding, int level, const void *data, size_t length, size_t *out_length) {
+	unsigned char *out = NULL;
+	if (encoding == ENCODING_GZIP) {
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return NULL; // +16：gzip 头
+		size_t bound = deflateBound(&zs, length);
+		out = malloc(bound);
+		if (out != NULL) {
+			zs.next_in = (Bytef *)data;
+			zs.avail_in = length;
+			zs.next_out = out;
+			zs.avail_out = bound;
+			if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+				*out_length = zs.total_out;
+			} else {
+				free(out);
+				out = NULL;
 			}
 		}
+		deflateEnd(&zs);
+	} else if (encoding == ENCODING_BROTLI) {
+		size_t bound = BrotliEncoderMaxCompressedSize(length);
+		if (bound == 0) return NULL;
+		out = malloc(bound);
+		*out_length = bound;
+		if (out != NULL && !BrotliEncoderCompress(level, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, length, data, out_length, out)) {
+			free(out);
+			out = NULL;
+		}
 	}
-	
-	// 从环境变量中获取 Cookie，并解析用户名和密码
-	const char *cookie_str = getenv("HTTP_COOKIE");
-	parse_cookies(cookie_str, username, sizeof(username), password, sizeof(password));
+	return out;
+}
 
-	// 检查消息内容是否为空
-	if (strlen(message) == 0) {
-		// 如果消息为空，则打印错误信息
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "Message is empty.");
-		send_json_response(400, "Bad Request", response_json);
-		return 1;
-	}
+// 函数：用指定编码和默认压缩级别压缩响应体
+unsigned char *compress_body(int encoding, const void *data, size_t length, size_t *out_length) {
+	return compress_body_level(encoding, encoding == ENCODING_BROTLI ? BROTLI_QUALITY : GZIP_LEVEL, data, length, out_length);
+}
 
-	// 检查消息内容是否超出最大长度，如果超出则截断
-	if (strlen(message) > MAX_MESSAGE_LENGTH) {
-		message[MAX_MESSAGE_LENGTH] = '\0'; // 截断消息
-		fprintf(stderr, "Warning: Message truncated to %d characters.\n", MAX_MESSAGE_LENGTH); // 打印警告信息
+// 函数：开始输出响应，返回写入响应体的流；extra_headers 为附加的响应头（每行以 \r\n 结尾），可以为 NULL
+FILE *response_begin(int http_status, const char *status_text, const char *extra_headers, const char *content_type) {
+	g_response.encoding = negotiate_encoding(getenv("HTTP_ACCEPT_ENCODING"));
+	if (extra_headers == NULL) extra_headers = "";
+	if (g_response.encoding != ENCODING_IDENTITY && strlen(extra_headers) < sizeof(g_response.extra_headers)) {
+		g_response.body = open_memstream(&g_response.buffer, &g_response.length);
 	}
-	
-	// 如果没有从Cookie中获取到用户名，则使用默认值
-	if (strlen(username) == 0) {
-		strncpy(username, "anonymous", sizeof(username));
+	if (g_response.body == NULL) {
+		printf("Status: %d %s\r\n%s%s%sVary: Accept-Encoding\r\nContent-type: %s\r\n\r\n", http_status, status_text, extra_headers,
+		       server_timing_header(), g_replication_header, content_type);
+		return stdout;
 	}
+	g_response.http_status = http_status;
+	g_response.status_text = status_text;
+	g_response.content_type = content_type;
+	strcpy(g_response.extra_headers, extra_headers);
+	return g_response.body;
+}
 
-	sqlite3 *db; // SQLite 数据库连接对象
-	sqlite3_stmt *stmt; // SQLite 预处理语句对象
-	int rc; // SQLite 操作的返回码
-
-	// 打开 SQLite 数据库连接
-	rc = sqlite3_open(DB_PATH, &db);
-	if (rc) {
-		// 如果打开数据库失败，则打印错误信息
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "Can't open database.");
-		send_json_response(500, "Internal Server Error", response_json);
-		return 1;
-	}
+// 函数：结束响应；响应体在内存中时决定是否压缩，然后写出响应头和响应体
+void response_end() {
+	if (g_response.body == NULL) return;
+	fclose(g_response.body);
+	g_response.body = NULL;
 
-	// ========== 身份验证逻辑开始 ==========
-	if (strcmp(username, "anonymous") != 0) {
-		// 尝试从 users 表中查询用户
-		const char *sql_check_user = "SELECT password FROM users WHERE username = ?;";
-		rc = sqlite3_prepare_v2(db, sql_check_user, -1, &stmt, 0);
-		if (rc != SQLITE_OK) {
-			sqlite3_close(db);
-			cJSON *response_json = cJSON_CreateObject();
-			cJSON_AddStringToObject(response_json, "status", "error");
-			cJSON_AddStringToObject(response_json, "message", "Failed to prepare user check statement.");
-			send_json_response(500, "Internal Server Error", response_json);
-			return 1;
-		}
-		sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-		
-		// 检查用户是否存在
-		rc = sqlite3_step(stmt);
-		if (rc == SQLITE_ROW) {
-			// 用户已存在，检查密码是否匹配
-			const char *stored_password = (const char *)sqlite3_column_text(stmt, 0);
-			if (strlen(password) == 0 || strcmp(password, stored_password) != 0) {
-				sqlite3_finalize(stmt);
-				sqlite3_close(db);
-				cJSON *response_json = cJSON_CreateObject();
-				cJSON_AddStringToObject(response_json, "status", "error");
-				cJSON_AddStringToObject(response_json, "message", "Incorrect password or password not provided for existing user.");
-				send_json_response(400, "Bad Request", response_json);
-				return 1;
-			}
+	const char *body = g_response.buffer;
+	size_t length = g_response.length;
+	unsigned char *compressed = NULL;
+	if (length >= (size_t)config_int("CHAT_COMPRESS_MIN_SIZE", COMPRESS_MIN_SIZE)) {
+		size_t compressed_length;
+		long long start = timer_now();
+		compressed = compress_body(g_response.encoding, body, length, &compressed_length);
+		timer_add(PHASE_COMPRESS, start);
+		if (compressed != NULL && compressed_length < length) {
+			body = (const char *)compressed;
+			length = compressed_length;
 		} else {
-			// 查询出错
-			sqlite3_finalize(stmt);
-			sqlite3_close(db);
-			cJSON *response_json = cJSON_CreateObject();
-			cJSON_AddStringToObject(response_json, "status", "error");
-			cJSON_AddStringToObject(response_json, "message", "User check failed.");
-			send_json_response(500, "Internal Server Error", response_json);
-			return 1;
+			free(compressed);
+			compressed = NULL;
 		}
-		sqlite3_finalize(stmt); // 结束语句
 	}
-	// ========== 身份验证逻辑结束 ==========
 
-	// 获取用户 IP 地址（优先从 Cloudflare 代理头获取，其次从 REMOTE_ADDR 获取）
-	const char *user_ip = getenv("HTTP_CF_CONNECTING_IP");
-	if (user_ip == NULL) {
-		user_ip = getenv("REMOTE_ADDR");
-	}
-	if (user_ip == NULL || strlen(user_ip) == 0) {
-		user_ip = "UNKNOWN_IP"; // 如果无法获取 IP，则设置为 "UNKNOWN_IP"
-	}
+	printf("Status: %d %s\r\n%s%s%sVary: Accept-Encoding\r\n", g_response.http_status, g_response.status_text, g_response.extra_headers,
+	       server_timing_header(), g_replication_header);
+	if (compressed != NULL) printf("Content-Encoding: %s\r\n", encoding_names[g_response.encoding]);
+	printf("Content-Length: %zu\r\nContent-type: %s\r\n\r\n", length, g_response.content_type);
+	fwrite(body, 1, length, stdout);
 
-	// SQL 插入语句：将新消息插入到 messages 表中
-	const char *sql_insert = "INSERT INTO messages (timestamp, ip, username, message) VALUES (?, ?, ?, ?);";
-	// 准备 SQL 插入语句
-	rc = sqlite3_prepare_v2(db, sql_insert, -1, &stmt, 0);
-	if (rc != SQLITE_OK) {
-		// 如果准备失败，则打印错误信息
-		sqlite3_close(db); // 关闭数据库
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "Failed to prepare insert statement.");
-		send_json_response(500, "Internal Server Error", response_json);
-		return 1;
+	free(compressed);
+	free(g_response.buffer);
+	g_response.buffer = NULL;
+}
+
+// 函数：发送统一的 JSON 响应，extra_headers 为附加的响应头（每行以 \r\n 结尾），可以为 NULL
+void send_json_response_with_headers(int http_status, const char *status_text, const char *extra_headers, cJSON *json_body) {
+	// 先序列化再发送响应头，Server-Timing 中才能包含序列化的耗时
+	long long start = timer_now();
+	char *json_output = cJSON_PrintUnformatted(json_body);
+	timer_add(PHASE_SERIALIZE, start);
+	FILE *out = response_begin(http_status, status_text, extra_headers, "application/json");
+	if (json_output != NULL) {
+		fprintf(out, "%s\n", json_output);
+		cJSON_free(json_output);
 	}
+	response_end();
+	cJSON_Delete(json_body);
+}
 
-	// 绑定参数到插入语句
-	sqlite3_bind_int64(stmt, 1, time(NULL)); // 绑定时间戳
-	sqlite3_bind_text(stmt, 2, user_ip, -1, SQLITE_STATIC); // 绑定用户 IP
-	sqlite3_bind_text(stmt, 3, username, -1, SQLITE_STATIC); // 绑定用户名
-	sqlite3_bind_text(stmt, 4, message, -1, SQLITE_STATIC); // 绑定消息内容
+// 函数：发送统一的 JSON 响应
+void send_json_response(int http_status, const char *status_text, cJSON *json_body) {
+	send_json_response_with_headers(http_status, status_text, NULL, json_body);
+}
 
-	// 执行插入语句
-	rc = sqlite3_step(stmt);
-	if (rc != SQLITE_DONE) {
-		// 如果执行失败，则打印错误信息
-		sqlite3_finalize(stmt); // 结束语句
-		sqlite3_close(db); // 关闭数据库
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "Failed to execute insert statement.");
-		send_json_response(500, "Internal Server Error", response_json);
-		return 1;
-	}
-	sqlite3_finalize(stmt); // 结束语句
+// 内容固定的 JSON 响应体：编译时拼接成字符串常量，与 cJSON_PrintUnformatted 的输出加换行逐字节一致。
+// message 必须是不含引号、反斜杠和控制字符的字符串常量
+#define JSON_ERROR(message) "{\"status\":\"error\",\"message\":\"" message "\"}\n"
+#define JSON_SUCCESS(message) "{\"status\":\"success\",\"message\":\"" message "\"}\n"
 
-	// 清理旧消息：只保留最新的 MAX_MESSAGES_POST 条消息
-	const char *sql_delete_old = "DELETE FROM messages WHERE id NOT IN (SELECT id FROM messages ORDER BY timestamp DESC, id DESC LIMIT ?);"; // 按时间戳和 ID 降序排序，然后限制数量
-	// 准备 SQL 删除语句
-	rc = sqlite3_prepare_v2(db, sql_delete_old, -1, &stmt, 0);
-	if (rc != SQLITE_OK) {
-		// 如果准备失败，则打印错误信息
-		sqlite3_close(db); // 关闭数据库
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "Failed to prepare delete statement.");
-		send_json_response(500, "Internal Server Error", response_json);
-		return 1;
+// 函数：发送已经生成好的 JSON 响应体：响应头和响应体在栈上拼好后一次写出，不创建 cJSON 对象，也不分配内存。
+// 这类响应体都很短，不压缩；extra_headers 为附加的响应头（每行以 \r\n 结尾），可以为 NULL
+void send_json_text(int http_status, const char *status_text, const char *extra_headers, const char *body, size_t body_len) {
+	char buf[2048];
+	int len = snprintf(buf, sizeof(buf), "Status: %d %s\r\n%s%s%sVary: Accept-Encoding\r\nContent-Length: %zu\r\n"
+	                   "Content-type: application/json\r\n\r\n", http_status, status_text, extra_headers != NULL ? extra_headers : "",
+	                   server_timing_header(), g_replication_header, body_len);
+	if (len < 0) return;
+	if ((size_t)len + body_len <= sizeof(buf)) {
+		memcpy(buf + len, body, body_len);
+		fwrite(buf, 1, len + body_len, stdout);
+	} else {
+		// 响应头过长（附加的头部很大）时分两次写出
+		fwrite(buf, 1, (size_t)len < sizeof(buf) ? (size_t)len : sizeof(buf) - 1, stdout);
+		fwrite(body, 1, body_len, stdout);
 	}
-	sqlite3_bind_int(stmt, 1, MAX_MESSAGES_POST); // 绑定要保留的消息数量
+}
 
-	// 执行删除语句
-	rc = sqlite3_step(stmt);
-	if (rc != SQLITE_DONE) {
-		// 如果执行失败，则打印错误信息
-		sqlite3_finalize(stmt); // 结束语句
-		sqlite3_close(db); // 关闭数据库
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "Failed to execute delete statement.");
-		send_json_response(500, "Internal Server Error", response_json);
-		return 1;
-	}
-	sqlite3_finalize(stmt); // 结束语句
+// 发送内容固定的 JSON 响应，body 为 JSON_ERROR 或 JSON_SUCCESS 生成的常量，长度在编译时确定
+#define send_fixed_response(http_status, status_text, body) \
+	send_json_text(http_status, status_text, NULL, body, sizeof(body) - 1)
+#define send_fixed_response_with_headers(http_status, status_text, extra_headers, body) \
+	send_json_text(http_status, status_text, extra_headers, body, sizeof(body) - 1)
 
-	sqlite3_close(db); // 关闭数据库连接
+// ========== 数据库访问层 ==========
+// 所有处理函数通过 db_acquire/db_prepare/db_finalize/db_release 访问数据库。
+// db_acquire 打开主数据库（用户、会话撤销和默认聊天室），db_acquire_room 打开当前请求所在聊天室的数据库。
+// 每个聊天室是独立的数据库文件，不同聊天室的写入不会争用同一把写锁，清理和快照也各自独立。
+// CGI 模式下每个请求结束时关闭连接；SCGI 常驻模式下连接和预处理语句在请求之间复用。
+// 数据库使用 WAL 日志，读者不会被写者阻塞；遇到锁时按指数退避重试，并统计等待时间。
 
-	// 打印成功信息
-	cJSON *response_json = cJSON_CreateObject();
-	cJSON_AddStringToObject(response_json, "status", "success");
-	cJSON_AddStringToObject(response_json, "message", "Message posted and old messages cleaned.");
-	send_json_response(200, "OK", response_json);
+#define MAX_CACHED_STMTS 32 // 缓存的预处理语句数量上限
+#define DB_POOL_SIZE 8 // 常驻模式下同时保持打开的连接数（主数据库和最近访问的聊天室）
+#define DB_BUSY_TIMEOUT_MS 5000 // 等待数据库锁的最长时间
+#define DB_BUSY_MAX_DELAY_US 50000 // 单次退避等待的上限
 
-	return 0; // 程序成功执行
-}
+// 结构迁移：第 N 项把数据库从 user_version N 升级到 N+1。
+// 只能在末尾追加新项，已发布的项不能修改。
+static const char *schema_migrations[] = {
+	// 1：初始结构（IF NOT EXISTS 兼容引入版本号之前创建的数据库）
+	"CREATE TABLE IF NOT EXISTS messages ("
+	"id INTEGER PRIMARY KEY,"
+	"timestamp INTEGER,"
+	"ip TEXT,"
+	"username TEXT,"
+	"message TEXT"
+	");"
+	"CREATE TABLE IF NOT EXISTS users ("
+	"username TEXT PRIMARY KEY,"
+	"password TEXT"
+	");",
+	// 2：会话令牌撤销纪元（删除账户后仍保留，防止同名新账户沿用旧令牌）
+	"CREATE TABLE session_revocations ("
+	"username TEXT PRIMARY KEY,"
+	"epoch INTEGER NOT NULL"
+	");",
+	// 3：消息全文索引（外部内容表，触发器随插入和清理同步；trigram 分词支持中文子串搜索）
+	"CREATE VIRTUAL TABLE messages_fts USING fts5("
+	"message, username, content='messages', content_rowid='id', tokenize='trigram'"
+	");"
+	"CREATE TRIGGER messages_fts_insert AFTER INSERT ON messages BEGIN "
+	"INSERT INTO messages_fts (rowid, message, username) VALUES (new.id, new.message, new.username);"
+	"END;"
+	"CREATE TRIGGER messages_fts_delete AFTER DELETE ON messages BEGIN "
+	"INSERT INTO messages_fts (messages_fts, rowid, message, username) VALUES ('delete', old.id, old.message, old.username);"
+	"END;"
+	"CREATE TRIGGER messages_fts_update AFTER UPDATE ON messages BEGIN "
+	"INSERT INTO messages_fts (messages_fts, rowid, message, username) VALUES ('delete', old.id, old.message, old.username);"
+	"INSERT INTO messages_fts (rowid, message, username) VALUES (new.id, new.message, new.username);"
+	"END;"
+	"INSERT INTO messages_fts (messages_fts) VALUES ('rebuild');",
+	// 4：写入队列已提交到的位置（与消息在同一个事务中更新，崩溃后从这里重放）
+	"CREATE TABLE write_queue ("
+	"id INTEGER PRIMARY KEY CHECK (id = 1),"
+	"epoch INTEGER NOT NULL,"
+	"applied INTEGER NOT NULL"
+	");"
+	"INSERT INTO write_queue VALUES (1, 0, 0);",
+};
+#define SCHEMA_VERSION ((int)(sizeof(schema_migrations) / sizeof(schema_migrations[0])))
 
-// 新增：处理用户管理请求
-int handle_user_management(const char *action, const char *request_method) {
+static struct {
+	char path[PATH_MAX];
 	sqlite3 *db;
+	unsigned long long last_used;
+} g_db_pool[DB_POOL_SIZE]; // 当前进程打开的数据库连接，按文件路径区分
+static unsigned long long g_db_pool_clock = 0; // 用于淘汰最久未使用的连接
+static int g_db_persistent = 0; // 非 0 表示常驻模式，请求结束时不关闭连接
+
+// 当前请求所在的聊天室及其存储路径（由 select_room 设置）
+static struct {
+	char name[MAX_ROOM_NAME_LENGTH + 1]; // 空字符串表示默认聊天室
+	char db_path[ROOM_PATH_SIZE];
+	char notify_path[ROOM_PATH_SIZE];
+	char snapshot_path[ROOM_PATH_SIZE];
+	char snapshot_lock_path[ROOM_PATH_SIZE];
+	char archive_path[ROOM_PATH_SIZE];
+	char ring_path[ROOM_PATH_SIZE];
+	char queue_path[ROOM_PATH_SIZE];
+	char queue_lock_path[ROOM_PATH_SIZE];
+	char changelog_path[ROOM_PATH_SIZE];
+	char changelog_old_path[ROOM_PATH_SIZE];
+	char replica_path[ROOM_PATH_SIZE];
+} g_room;
+
+// 数据文件路径（由 configure_paths 根据 CHAT_DATA_DIR 设置）
+static char g_db_path[DB_PATH_SIZE]; // 主数据库
+static char g_session_keys_path[ROOM_PATH_SIZE]; // 会话签名密钥文件
+static char g_session_revocations_path[ROOM_PATH_SIZE]; // 会话撤销纪元文件
+static char g_rate_limit_path[ROOM_PATH_SIZE]; // 发送频率限制的令牌桶文件
+
+static struct {
+	const char *sql;
 	sqlite3_stmt *stmt;
-	int rc;
+} g_stmt_cache[MAX_CACHED_STMTS];
+static int g_stmt_cache_count = 0;
 
-	rc = sqlite3_open(DB_PATH, &db);
-	if (rc) {
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "Can't open database for user management.");
-		send_json_response(500, "Internal Server Error", response_json);
+static long long g_db_lock_wait_us = 0; // 当前请求等待数据库锁的累计时间（微秒）
+static long long g_db_busy_started_us = 0; // 本轮锁等待开始的时间
+
+// 函数：单调时钟，单位为微秒
+static long long monotonic_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// 函数：SQLite 忙等待回调，按 1ms、2ms、4ms……指数退避（带随机抖动），超过 DB_BUSY_TIMEOUT_MS 后放弃
+static int db_busy_handler(void *arg, int count) {
+	(void)arg;
+	long long now = monotonic_us();
+	if (count == 0) g_db_busy_started_us = now;
+	if (now - g_db_busy_started_us >= DB_BUSY_TIMEOUT_MS * 1000LL) return 0;
+
+	long long delay_us = 1000LL << (count < 6 ? count : 6);
+	if (delay_us > DB_BUSY_MAX_DELAY_US) delay_us = DB_BUSY_MAX_DELAY_US;
+	delay_us = delay_us / 2 + rand() % (delay_us / 2 + 1); // 抖动，避免多个进程同时醒来
+	usleep(delay_us);
+	g_db_lock_wait_us += monotonic_us() - now;
+	return 1;
+}
+
+// 函数：按 user_version 执行尚未应用的结构迁移
+static int db_migrate(sqlite3 *db) {
+	sqlite3_stmt *stmt;
+	int version = 0;
+	if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, 0) != SQLITE_OK) return 1;
+	if (sqlite3_step(stmt) == SQLITE_ROW) version = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	if (version >= SCHEMA_VERSION) return 0;
+
+	// 新数据库使用增量自动清理（必须在建表之前设置，已有表时不起作用），空闲页由 --compact 分步释放
+	if (version == 0) sqlite3_exec(db, "PRAGMA auto_vacuum = INCREMENTAL;", 0, 0, 0);
+	// 日志模式不能在事务中修改；WAL 设置会保存在数据库文件中
+	sqlite3_exec(db, "PRAGMA journal_mode=WAL;", 0, 0, 0);
+
+	char *err_msg = 0;
+	if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, &err_msg) != SQLITE_OK) {
+		fprintf(stderr, "SQL error: %s\n", err_msg);
+		sqlite3_free(err_msg);
 		return 1;
 	}
-	
-	// 获取 POST/PATCH/DELETE 数据
-	char post_data[MAX_POST_DATA_SIZE + 1] = "";
-	char *content_length_str = getenv("CONTENT_LENGTH");
-	int content_length = 0;
-	if (content_length_str != NULL) {
-		content_length = atoi(content_length_str);
-	}
-	if (content_length > 0 && content_length <= MAX_POST_DATA_SIZE) {
-		fread(post_data, 1, content_length, stdin);
-		post_data[content_length] = '\0';
-	}
 
-	char username[256] = "";
-	char password[256] = "";
-	char new_password[256] = "";
+	// 拿到写锁后重新读取版本，其他进程可能已经完成迁移
+	if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, 0) == SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW) version = sqlite3_column_int(stmt, 0);
+		sqlite3_finalize(stmt);
+	}
 
-	// 解析表单数据
-	char *token;
-	char *rest = post_data;
-	char decoded_value[MAX_MESSAGE_LENGTH + 1];
-	while ((token = strtok_r(rest, "&", &rest))) {
-		char *key = token;
-		char *value = strchr(token, '=');
-		if (value) {
-			*value = '\0';
-			value++;
-			url_decode(decoded_value, value);
-
-			if (strcmp(key, "username") == 0) {
-				if (strlen(decoded_value) >= sizeof(username)) {
-					// 如果用户名过长，发送错误响应并退出
-					cJSON *response_json = cJSON_CreateObject();
-					cJSON_AddStringToObject(response_json, "status", "error");
-					cJSON_AddStringToObject(response_json, "message", "Username is too long.");
-					send_json_response(400, "Bad Request", response_json);
-					sqlite3_close(db);
-					return 1;
-				}
-				strncpy(username, decoded_value, sizeof(username) - 1);
-			} else if (strcmp(key, "password") == 0) {
-				if (strlen(decoded_value) >= sizeof(password)) {
-					// 密码过长，发送错误响应并退出
-					cJSON *response_json = cJSON_CreateObject();
-					cJSON_AddStringToObject(response_json, "status", "error");
-					cJSON_AddStringToObject(response_json, "message", "Password is too long.");
-					send_json_response(400, "Bad Request", response_json);
-					sqlite3_close(db);
-					return 1;
-				}
-				strncpy(password, decoded_value, sizeof(password) - 1);
-			} else if (strcmp(key, "new_password") == 0) {
-				if (strlen(decoded_value) >= sizeof(new_password)) {
-					// 新密码过长，发送错误响应并退出
-					cJSON *response_json = cJSON_CreateObject();
-					cJSON_AddStringToObject(response_json, "status", "error");
-					cJSON_AddStringToObject(response_json, "message", "New password is too long.");
-					send_json_response(400, "Bad Request", response_json);
-					sqlite3_close(db);
-					return 1;
-				}
-				strncpy(new_password, decoded_value, sizeof(new_password) - 1);
-			}
+	for (; version < SCHEMA_VERSION; version++) {
+		if (sqlite3_exec(db, schema_migrations[version], 0, 0, &err_msg) != SQLITE_OK) {
+			fprintf(stderr, "Schema migration %d failed: %s\n", version + 1, err_msg);
+			sqlite3_free(err_msg);
+			sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+			return 1;
 		}
+		fprintf(stderr, "Applied schema migration %d.\n", version + 1);
 	}
-	
-	// 如果是 DELETE 请求，则从 Cookie 中获取用户名和密码
-	if (strcmp(request_method, "DELETE") == 0) {
-		const char *cookie_str = getenv("HTTP_COOKIE");
-		parse_cookies(cookie_str, username, sizeof(username), password, sizeof(password));
+
+	char sql[64];
+	snprintf(sql, sizeof(sql), "PRAGMA user_version = %d;", SCHEMA_VERSION);
+	sqlite3_exec(db, sql, 0, 0, 0);
+	if (sqlite3_exec(db, "COMMIT;", 0, 0, &err_msg) != SQLITE_OK) {
+		fprintf(stderr, "SQL error: %s\n", err_msg);
+		sqlite3_free(err_msg);
+		sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+		return 1;
 	}
+	return 0;
+}
 
+// 函数：新连接的初始设置
+static int db_configure(sqlite3 *db) {
+	srand((unsigned)(getpid() ^ monotonic_us())); // 各进程的退避抖动互不相同
+	sqlite3_busy_handler(db, db_busy_handler, NULL);
+	// WAL 模式下 NORMAL 只在检查点时同步，断电最多丢失最近提交的事务，但不会损坏数据库
+	sqlite3_exec(db, "PRAGMA synchronous=NORMAL;", 0, 0, 0);
+	return db_migrate(db);
+}
 
-	// 注册 (POST action=register)
-	if (strcmp(request_method, "POST") == 0 && strcmp(action, "register") == 0) {
-		if (strlen(username) == 0 || strlen(password) == 0) {
-			cJSON *response_json = cJSON_CreateObject();
+// 函数：关闭连接池中的一个连接，并销毁属于它的缓存语句
+static void db_close_slot(int slot) {
+	sqlite3 *db = g_db_pool[slot].db;
+	if (db == NULL) return;
+	int kept = 0;
+	for (int i = 0; i < g_stmt_cache_count; i++) {
+		if (sqlite3_db_handle(g_stmt_cache[i].stmt) == db) {
+			sqlite3_finalize(g_stmt_cache[i].stmt);
+		} else {
+			g_stmt_cache[kept++] = g_stmt_cache[i];
+		}
+	}
+	g_stmt_cache_count = kept;
+	sqlite3_close(db);
+	g_db_pool[slot].db = NULL;
+	g_db_pool[slot].path[0] = '\0';
+}
+
+// 函数：获取指定数据库文件的连接（常驻模式下复用已打开的连接）
+// 文件不存在时创建并执行全部结构迁移
+static int db_open(const char *path, sqlite3 **db) {
+	int slot = -1;
+	for (int i = 0; i < DB_POOL_SIZE; i++) {
+		if (g_db_pool[i].db != NULL && strcmp(g_db_pool[i].path, path) == 0) {
+			g_db_pool[i].last_used = ++g_db_pool_clock;
+			*db = g_db_pool[i].db;
+			return SQLITE_OK;
+		}
+		// 优先使用空位，否则淘汰最久未使用的连接
+		if (slot < 0 || (g_db_pool[slot].db != NULL &&
+		    (g_db_pool[i].db == NULL || g_db_pool[i].last_used < g_db_pool[slot].last_used))) {
+			slot = i;
+		}
+	}
+	db_close_slot(slot);
+
+	long long start = timer_now();
+	struct stat st;
+	int created = stat(path, &st) != 0;
+	sqlite3 *conn;
+	int rc = sqlite3_open(path, &conn);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Can't open database %s: %s\n", path, sqlite3_errmsg(conn));
+		*db = NULL;
+		sqlite3_close(conn);
+		return rc;
+	}
+	int configured = db_configure(conn);
+	timer_add(PHASE_OPEN, start);
+	if (configured != 0) {
+		*db = NULL;
+		sqlite3_close(conn);
+		return SQLITE_ERROR;
+	}
+	if (created) {
+		chmod(path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP); // 660 权限
+	}
+
+	snprintf(g_db_pool[slot].path, sizeof(g_db_pool[slot].path), "%s", path);
+	g_db_pool[slot].db = conn;
+	g_db_pool[slot].last_used = ++g_db_pool_clock;
+	*db = conn;
+	return SQLITE_OK;
+}
+
+// 函数：获取主数据库连接（用户数据和会话撤销）
+int db_acquire(sqlite3 **db) {
+	return db_open(g_db_path, db);
+}
+
+// 函数：获取当前聊天室的数据库连接（消息）
+int db_acquire_room(sqlite3 **db) {
+	return db_open(g_room.db_path, db);
+}
+
+// 函数：设置聊天室的名称和数据库文件路径，其余文件的路径跟随数据库文件
+static void room_set_paths(const char *name, const char *db_path) {
+	snprintf(g_room.name, sizeof(g_room.name), "%s", name);
+	snprintf(g_room.db_path, sizeof(g_room.db_path), "%s", db_path);
+	snprintf(g_room.notify_path, sizeof(g_room.notify_path), "%s" NOTIFY_SUFFIX, db_path);
+	snprintf(g_room.snapshot_path, sizeof(g_room.snapshot_path), "%s" SNAPSHOT_SUFFIX, db_path);
+	snprintf(g_room.snapshot_lock_path, sizeof(g_room.snapshot_lock_path), "%s" SNAPSHOT_LOCK_SUFFIX, db_path);
+	snprintf(g_room.archive_path, sizeof(g_room.archive_path), "%s" ARCHIVE_SUFFIX, db_path);
+	snprintf(g_room.ring_path, sizeof(g_room.ring_path), "%s" RING_SUFFIX, db_path);
+	snprintf(g_room.queue_path, sizeof(g_room.queue_path), "%s" QUEUE_SUFFIX, db_path);
+	snprintf(g_room.queue_lock_path, sizeof(g_room.queue_lock_path), "%s" QUEUE_LOCK_SUFFIX, db_path);
+	snprintf(g_room.changelog_path, sizeof(g_room.changelog_path), "%s" CHANGELOG_SUFFIX, db_path);
+	snprintf(g_room.changelog_old_path, sizeof(g_room.changelog_old_path), "%s" CHANGELOG_OLD_SUFFIX, db_path);
+	snprintf(g_room.replica_path, sizeof(g_room.replica_path), "%s" REPLICA_SUFFIX, db_path);
+}
+
+// 函数：选择本次请求所在的聊天室，name 为空时使用默认聊天室
+// 聊天室的数据库文件由房间名的 64 位 FNV-1a 哈希决定，通知文件和快照跟随数据库文件
+// 名称过长时返回 1
+int select_room(const char *name) {
+	const char *db_path = g_db_path;
+	char room_path[DB_PATH_SIZE];
+	if (name == NULL) name = "";
+	if (strlen(name) > MAX_ROOM_NAME_LENGTH) return 1;
+	if (*name) {
+		unsigned long long hash = 14695981039346656037ULL;
+		for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+			hash = (hash ^ *p) * 1099511628211ULL;
+		}
+		const char *dir_end = strrchr(g_db_path, '/');
+		snprintf(room_path, sizeof(room_path), "%.*s" ROOM_DB_FILE_FORMAT, (int)(dir_end - g_db_path + 1), g_db_path, hash);
+		db_path = room_path;
+	}
+	room_set_paths(name, db_path);
+	return 0;
+}
+
+// 函数：根据环境变量 CHAT_DATA_DIR 设置数据文件路径并选择默认聊天室
+// 同一台机器上的多个实例（基准测试、副本）可以各自使用独立的目录；路径过长时返回 1
+int configure_paths() {
+	const char *dir = getenv("CHAT_DATA_DIR");
+	if (dir == NULL || *dir == '\0') dir = DATA_DIR;
+	size_t len = strlen(dir);
+	while (len > 1 && dir[len - 1] == '/') len--;
+	if (len > MAX_DATA_DIR_LENGTH) return 1;
+	snprintf(g_db_path, sizeof(g_db_path), "%.*s/" DB_FILE, (int)len, dir);
+	snprintf(g_session_keys_path, sizeof(g_session_keys_path), "%s" SESSION_KEYS_SUFFIX, g_db_path);
+	snprintf(g_session_revocations_path, sizeof(g_session_revocations_path), "%s" SESSION_REVOCATIONS_SUFFIX, g_db_path);
+	snprintf(g_metrics_path, sizeof(g_metrics_path), "%s" METRICS_SUFFIX, g_db_path);
+	snprintf(g_rate_limit_path, sizeof(g_rate_limit_path), "%s" RATE_LIMIT_SUFFIX, g_db_path);
+	return select_room(NULL);
+}
+
+// 函数：准备 SQL 语句，优先从缓存中取出已编译的语句
+int db_prepare(sqlite3 *db, const char *sql, sqlite3_stmt **stmt) {
+	for (int i = 0; i < g_stmt_cache_count; i++) {
+		if ((g_stmt_cache[i].sql == sql || strcmp(g_stmt_cache[i].sql, sql) == 0) &&
+		    sqlite3_db_handle(g_stmt_cache[i].stmt) == db) {
+			*stmt = g_stmt_cache[i].stmt;
+			sqlite3_reset(*stmt); // 防止上一个请求中途返回时语句未被重置
+			sqlite3_clear_bindings(*stmt);
+			return SQLITE_OK;
+		}
+	}
+
+	int rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, stmt, 0);
+	if (rc == SQLITE_OK && g_stmt_cache_count < MAX_CACHED_STMTS) {
+		g_stmt_cache[g_stmt_cache_count].sql = sql;
+		g_stmt_cache[g_stmt_cache_count].stmt = *stmt;
+		g_stmt_cache_count++;
+	}
+	return rc;
+}
+
+// 函数：结束语句的使用；缓存中的语句只重置，不销毁
+void db_finalize(sqlite3_stmt *stmt) {
+	for (int i = 0; i < g_stmt_cache_count; i++) {
+		if (g_stmt_cache[i].stmt == stmt) {
+			sqlite3_reset(stmt);
+			sqlite3_clear_bindings(stmt);
+			return;
+		}
+	}
+	sqlite3_finalize(stmt);
+}
+
+// 函数：关闭所有连接并销毁所有缓存的语句
+void db_shutdown() {
+	for (int i = 0; i < DB_POOL_SIZE; i++) {
+		db_close_slot(i);
+	}
+	// 不属于连接池的连接（例如基准测试自己打开的数据库）上缓存的语句
+	for (int i = 0; i < g_stmt_cache_count; i++) {
+		sqlite3_finalize(g_stmt_cache[i].stmt);
+	}
+	g_stmt_cache_count = 0;
+}
+
+// 函数：释放数据库连接（CGI 模式下真正关闭，常驻模式下保留），并报告本次请求的锁等待时间
+void db_release(sqlite3 *db) {
+	if (g_db_lock_wait_us > 0) {
+		fprintf(stderr, "SQLite lock wait: %.1f ms\n", g_db_lock_wait_us / 1000.0);
+		g_db_lock_wait_us = 0;
+	}
+	if (!g_db_persistent) {
+		for (int i = 0; i < DB_POOL_SIZE; i++) {
+			if (g_db_pool[i].db == db) db_close_slot(i);
+		}
+	}
+}
+
+// 函数：初始化数据库（数据库文件不存在时创建）
+// 已存在的数据库在每个进程首次打开连接时检查并升级结构，这里只做一次 stat
+int init_database() {
+	// 检查数据库文件是否存在
+	struct stat buffer;
+	if (stat(g_db_path, &buffer) == 0) {
+		return 0;
+	}
+
+	fprintf(stderr, "Creating new database at %s...\n", g_db_path);
+
+	// 打开数据库连接（如果文件不存在，会自动创建，并执行全部结构迁移）
+	sqlite3 *db;
+	if (db_acquire(&db) != SQLITE_OK) {
+		return 1;
+	}
+	db_shutdown(); // 不把连接留给之后 fork 出的工作进程
+	fprintf(stderr, "Database created successfully.\n");
+
+	// 设置数据库文件权限
+	if (chmod(g_db_path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) != 0) { // 660 权限
+		fprintf(stderr, "Error setting database file permissions.\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+// ========== 流式 JSON 输出 ==========
+// 把查询结果逐个字段转义后直接写入输出流，不构建 cJSON 树，每条消息没有堆分配。
+// 转义规则与 cJSON_PrintUnformatted 相同，输出逐字节一致。
+
+#define MESSAGES_JSON_PREFIX "{\"status\":\"success\",\"data\":["
+#define MESSAGES_JSON_SUFFIX "]}\n"
+
+// 查询 ID 大于 ?1 的最新 ?2 条消息，按 ID 升序返回（子查询走主键倒序，外层只对少量结果排序）
+static const char *SQL_SELECT_LATEST_MESSAGES =
+	"SELECT id, timestamp, ip, username, message FROM "
+	"(SELECT id, timestamp, ip, username, message FROM messages WHERE id > ? ORDER BY id DESC LIMIT ?) "
+	"ORDER BY id ASC;";
+
+// 查询 ID 在 (?3, ?1) 内的最后 ?2 条消息，按 ID 升序返回（向前翻页；?3 为已归档的最后 ID）
+// messages 的 INTEGER PRIMARY KEY 就是行所在 B 树的键，每页只是主键上的一次范围读取，与翻到多深无关
+static const char *SQL_SELECT_MESSAGES_BEFORE =
+	"SELECT id, timestamp, ip, username, message FROM "
+	"(SELECT id, timestamp, ip, username, message FROM messages WHERE id < ?1 AND id > ?3 ORDER BY id DESC LIMIT ?2) "
+	"ORDER BY id ASC;";
+
+// 统计 ID 在 (?2, ?1) 内的消息数量，最多数到 ?3
+static const char *SQL_COUNT_MESSAGES_BEFORE =
+	"SELECT COUNT(*) FROM (SELECT 1 FROM messages WHERE id < ?1 AND id > ?2 LIMIT ?3);";
+
+// 函数：写出带引号的 JSON 字符串；无需转义的连续字节整段写出
+void json_write_string(FILE *out, const char *s) {
+	static const char hex[] = "0123456789abcdef";
+	putc_unlocked('"', out);
+	if (s != NULL) {
+		const char *run = s;
+		for (; *s; s++) {
+			unsigned char c = (unsigned char)*s;
+			if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+			fwrite_unlocked(run, 1, s - run, out);
+			putc_unlocked('\\', out);
+			switch (c) {
+				case '"': putc_unlocked('"', out); break;
+				case '\\': putc_unlocked('\\', out); break;
+				case '\b': putc_unlocked('b', out); break;
+				case '\f': putc_unlocked('f', out); break;
+				case '\n': putc_unlocked('n', out); break;
+				case '\r': putc_unlocked('r', out); break;
+				case '\t': putc_unlocked('t', out); break;
+				default:
+					fputs_unlocked("u00", out);
+					putc_unlocked(hex[c >> 4], out);
+					putc_unlocked(hex[c & 0xf], out);
+					break;
+			}
+			run = s + 1;
+		}
+		fwrite_unlocked(run, 1, s - run, out);
+	}
+	putc_unlocked('"', out);
+}
+
+// 函数：把一条消息的各字段写成一个消息 JSON 对象
+void json_write_message_fields(FILE *out, long long id, long long timestamp, const char *ip, const char *username, const char *message) {
+	fprintf(out, "{\"id\":\"%lld\",\"timestamp\":%lld,\"ip\":", id, timestamp);
+	json_write_string(out, ip);
+	fputs_unlocked(",\"username\":", out);
+	json_write_string(out, username);
+	fputs_unlocked(",\"message\":", out);
+	json_write_string(out, message);
+	putc_unlocked('}', out);
+}
+
+// 函数：把当前行（id, timestamp, ip, username, message）写成一个消息 JSON 对象
+void json_write_message(FILE *out, sqlite3_stmt *stmt) {
+	json_write_message_fields(out, sqlite3_column_int64(stmt, 0), sqlite3_column_int64(stmt, 1),
+	                          (const char *)sqlite3_column_text(stmt, 2), (const char *)sqlite3_column_text(stmt, 3),
+	                          (const char *)sqlite3_column_text(stmt, 4));
+}
+
+// ========== 归档层 ==========
+// 超出保留窗口的消息不直接删除，而是先追加到聊天室数据库旁的归档目录（<数据库>.archive/）。
+// 归档由若干段组成：seg-<首条ID>.dat 依次存放 zlib 压缩块，每块 ARCHIVE_BLOCK_MESSAGES 条消息；
+// seg-<首条ID>.idx 是稀疏索引，每块一项，记录 ID 范围、时间范围以及块在 .dat 中的位置。
+// 两种文件都只追加，写入后不再修改；.dat 超过 ARCHIVE_SEGMENT_SIZE 后开始新段。
+// 追加发生在 POST 的写事务内，同一聊天室同一时刻只有一个写者；事务回滚后再次归档时会跳过已归档的 ID。
+// 读者 mmap 段文件，按索引只解压需要的块。文件使用本机字节序，不能跨架构复制。
+// 块内每条消息：id(8) timestamp(8) ip 长度(2) username 长度(2) message 长度(4)，然后是三段以 NUL 结尾的文本。
+
+#define ARCHIVE_BLOCK_MESSAGES 256 // 每个压缩块包含的消息数量
+#define ARCHIVE_SEGMENT_SIZE (4 * 1024 * 1024) // 段文件达到该大小后开始新段
+#define ARCHIVE_RECORD_HEADER 24 // 块内每条消息固定部分的长度
+#define ARCHIVE_MAX_SEARCH_TERMS 16 // 归档搜索最多使用的词数
+
+struct archive_index_entry {
+	long long first_id;
+	long long last_id;
+	long long first_ts;
+	long long last_ts;
+	long long offset; // 块在 .dat 文件中的偏移
+	unsigned int compressed_len;
+	unsigned int raw_len;
+	unsigned int count; // 块内消息数量
+	unsigned int reserved;
+};
+
+struct archive_segment {
+	const struct archive_index_entry *index;
+	size_t entries;
+	size_t index_size;
+	const unsigned char *data;
+	size_t data_size;
+};
+
+struct archive_record {
+	long long id;
+	long long timestamp;
+	const char *ip;
+	const char *username;
+	const char *message;
+};
+
+// 函数：判断是否启用归档（CHAT_ARCHIVE=0 时超出保留窗口的消息直接删除）
+int archive_enabled() {
+	const char *value = getenv("CHAT_ARCHIVE");
+	return value == NULL || strcmp(value, "0") != 0;
+}
+
+static int archive_segment_filter(const struct dirent *entry) {
+	size_t len = strlen(entry->d_name);
+	return len > 8 && strncmp(entry->d_name, "seg-", 4) == 0 && strcmp(entry->d_name + len - 4, ".idx") == 0;
+}
+
+// 函数：列出当前聊天室的段索引文件，按首条 ID 升序；返回数量，*names 由调用方用 archive_free_list 释放
+static int archive_list_segments(struct dirent ***names) {
+	int n = scandir(g_room.archive_path, names, archive_segment_filter, alphasort);
+	if (n < 0) {
+		*names = NULL;
+		return 0;
+	}
+	return n;
+}
+
+static void archive_free_list(struct dirent **names, int n) {
+	for (int i = 0; i < n; i++) free(names[i]);
+	free(names);
+}
+
+// 函数：映射一个段的索引和数据文件，index_name 为 .idx 文件名；末尾写了一半的索引项会被忽略
+static int archive_open_segment(const char *index_name, struct archive_segment *seg) {
+	char path[ROOM_PATH_SIZE + 288];
+	struct stat st;
+	memset(seg, 0, sizeof(*seg));
+
+	snprintf(path, sizeof(path), "%s/%s", g_room.archive_path, index_name);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct archive_index_entry)) {
+		close(fd);
+		return -1;
+	}
+	seg->entries = st.st_size / sizeof(struct archive_index_entry);
+	seg->index_size = seg->entries * sizeof(struct archive_index_entry);
+	void *index = mmap(NULL, seg->index_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (index == MAP_FAILED) return -1;
+	seg->index = index;
+
+	strcpy(path + strlen(path) - 4, ".dat");
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+		if (fd >= 0) close(fd);
+		munmap((void *)seg->index, seg->index_size);
+		return -1;
+	}
+	seg->data_size = st.st_size;
+	void *data = mmap(NULL, seg->data_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		munmap((void *)seg->index, seg->index_size);
+		return -1;
+	}
+	seg->data = data;
+	return 0;
+}
+
+static void archive_close_segment(struct archive_segment *seg) {
+	if (seg->index != NULL) munmap((void *)seg->index, seg->index_size);
+	if (seg->data != NULL) munmap((void *)seg->data, seg->data_size);
+	memset(seg, 0, sizeof(*seg));
+}
+
+// 函数：解压一个块，返回 malloc 分配的缓冲区（调用方 free），数据损坏时返回 NULL
+static unsigned char *archive_read_block(const struct archive_segment *seg, const struct archive_index_entry *entry) {
+	if (entry->offset < 0 || (size_t)entry->offset + entry->compressed_len > seg->data_size) return NULL;
+	unsigned char *raw = malloc(entry->raw_len);
+	if (raw == NULL) return NULL;
+	uLongf raw_len = entry->raw_len;
+	if (uncompress(raw, &raw_len, seg->data + entry->offset, entry->compressed_len) != Z_OK || raw_len != entry->raw_len) {
+		free(raw);
+		return NULL;
+	}
+	return raw;
+}
+
+// 函数：从解压后的块中取出下一条消息，到达末尾或数据损坏时返回 0
+static int archive_next_record(const unsigned char **p, const unsigned char *end, struct archive_record *record) {
+	if (end - *p < ARCHIVE_RECORD_HEADER) return 0;
+	unsigned short ip_len, username_len;
+	unsigned int message_len;
+	memcpy(&record->id, *p, 8);
+	memcpy(&record->timestamp, *p + 8, 8);
+	memcpy(&ip_len, *p + 16, 2);
+	memcpy(&username_len, *p + 18, 2);
+	memcpy(&message_len, *p + 20, 4);
+	size_t total = ARCHIVE_RECORD_HEADER + (size_t)ip_len + username_len + message_len + 3;
+	if ((size_t)(end - *p) < total) return 0;
+	record->ip = (const char *)*p + ARCHIVE_RECORD_HEADER;
+	record->username = record->ip + ip_len + 1;
+	record->message = record->username + username_len + 1;
+	*p += total;
+	return 1;
+}
+
+// 函数：读取最新一段的名称（不含扩展名）和其中最后一条消息的 ID；没有归档时返回 0
+static long long archive_latest(char *segment, size_t segment_size) {
+	struct dirent **names;
+	int n = archive_list_segments(&names);
+	long long last_id = 0;
+	if (segment != NULL) segment[0] = '\0';
+	if (n > 0) {
+		struct archive_segment seg;
+		if (segment != NULL) snprintf(segment, segment_size, "%.*s", (int)strlen(names[n - 1]->d_name) - 4, names[n - 1]->d_name);
+		if (archive_open_segment(names[n - 1]->d_name, &seg) == 0) {
+			last_id = seg.index[seg.entries - 1].last_id;
+			archive_close_segment(&seg);
+		}
+	}
+	archive_free_list(names, n);
+	return last_id;
+}
+
+// 函数：压缩一个块并追加到当前段（必要时开始新段），数据和索引都落盘后才返回 0
+static int archive_append_block(char *segment, size_t segment_size, const unsigned char *raw, size_t raw_len,
+                                struct archive_index_entry *entry) {
+	uLongf compressed_len = compressBound(raw_len);
+	unsigned char *compressed = malloc(compressed_len);
+	if (compressed == NULL || compress2(compressed, &compressed_len, raw, raw_len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		free(compressed);
+		return -1;
+	}
+
+	char path[ROOM_PATH_SIZE + 288];
+	struct stat st;
+	int dat_fd = -1;
+	if (segment[0] != '\0') {
+		snprintf(path, sizeof(path), "%s/%s.dat", g_room.archive_path, segment);
+		dat_fd = open(path, O_WRONLY | O_APPEND);
+		if (dat_fd >= 0 && (fstat(dat_fd, &st) != 0 || st.st_size >= ARCHIVE_SEGMENT_SIZE)) {
+			close(dat_fd);
+			dat_fd = -1;
+		}
+	}
+	if (dat_fd < 0) {
+		// 开始新段，以块的首条 ID 命名（十六进制定长，按文件名排序即按 ID 排序）
+		snprintf(segment, segment_size, "seg-%016llx", entry->first_id);
+		snprintf(path, sizeof(path), "%s/%s.dat", g_room.archive_path, segment);
+		dat_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+		if (dat_fd < 0 || fstat(dat_fd, &st) != 0) {
+			if (dat_fd >= 0) close(dat_fd);
+			free(compressed);
+			return -1;
+		}
+	}
+
+	// 上次崩溃留下的不完整数据不会被索引引用，新块直接接在文件末尾
+	entry->offset = st.st_size;
+	entry->compressed_len = compressed_len;
+	entry->raw_len = raw_len;
+	int ok = write(dat_fd, compressed, compressed_len) == (ssize_t)compressed_len && fdatasync(dat_fd) == 0;
+	close(dat_fd);
+	free(compressed);
+	if (!ok) return -1;
+
+	snprintf(path, sizeof(path), "%s/%s.idx", g_room.archive_path, segment);
+	int idx_fd = open(path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	if (idx_fd < 0) return -1;
+	// 截掉上次崩溃时写了一半的索引项
+	off_t idx_size = lseek(idx_fd, 0, SEEK_END);
+	off_t whole = idx_size - idx_size % (off_t)sizeof(*entry);
+	if (whole != idx_size && ftruncate(idx_fd, whole) != 0) whole = -1;
+	ok = whole >= 0 && pwrite(idx_fd, entry, sizeof(*entry), whole) == (ssize_t)sizeof(*entry) && fdatasync(idx_fd) == 0;
+	close(idx_fd);
+	return ok ? 0 : -1;
+}
+
+// 函数：把 ID 不超过 upto_id 且尚未归档的消息按整块追加到归档，不足一块的消息留在热表中等下次
+// 返回已归档的最后一条消息 ID（调用方只删除不超过它的消息），没有归档时返回 0，失败返回 -1
+long long archive_messages(sqlite3 *db, long long upto_id) {
+	char segment[64];
+	long long last_id = archive_latest(segment, sizeof(segment));
+	if (upto_id <= last_id) return last_id;
+
+	sqlite3_stmt *stmt;
+	const char *sql_pending = "SELECT COUNT(*) FROM messages WHERE id > ? AND id <= ?;";
+	if (db_prepare(db, sql_pending, &stmt) != SQLITE_OK) return -1;
+	sqlite3_bind_int64(stmt, 1, last_id);
+	sqlite3_bind_int64(stmt, 2, upto_id);
+	long long pending = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+	db_finalize(stmt);
+	if (pending < ARCHIVE_BLOCK_MESSAGES) return last_id;
+
+	if (mkdir(g_room.archive_path, S_IRWXU | S_IRWXG) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Failed to create archive directory %s.\n", g_room.archive_path);
+		return -1;
+	}
+
+	const char *sql_select = "SELECT id, timestamp, ip, username, message FROM messages WHERE id > ? AND id <= ? ORDER BY id LIMIT ?;";
+	if (db_prepare(db, sql_select, &stmt) != SQLITE_OK) return -1;
+	sqlite3_bind_int64(stmt, 1, last_id);
+	sqlite3_bind_int64(stmt, 2, upto_id);
+	sqlite3_bind_int64(stmt, 3, pending - pending % ARCHIVE_BLOCK_MESSAGES);
+
+	size_t capacity = 64 * 1024, raw_len = 0;
+	unsigned char *raw = malloc(capacity);
+	struct archive_index_entry entry;
+	memset(&entry, 0, sizeof(entry));
+	int rc = raw != NULL ? SQLITE_ROW : SQLITE_NOMEM;
+	while (rc == SQLITE_ROW && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		const char *ip = (const char *)sqlite3_column_text(stmt, 2);
+		const char *username = (const char *)sqlite3_column_text(stmt, 3);
+		const char *message = (const char *)sqlite3_column_text(stmt, 4);
+		unsigned short ip_len = ip ? strlen(ip) : 0;
+		unsigned short username_len = username ? strlen(username) : 0;
+		unsigned int message_len = message ? strlen(message) : 0;
+		long long id = sqlite3_column_int64(stmt, 0);
+		long long timestamp = sqlite3_column_int64(stmt, 1);
+
+		size_t need = ARCHIVE_RECORD_HEADER + (size_t)ip_len + username_len + message_len + 3;
+		if (raw_len + need > capacity) {
+			while (raw_len + need > capacity) capacity *= 2;
+			unsigned char *grown = realloc(raw, capacity);
+			if (grown == NULL) {
+				rc = SQLITE_NOMEM;
+				break;
+			}
+			raw = grown;
+		}
+		unsigned char *p = raw + raw_len;
+		memcpy(p, &id, 8);
+		memcpy(p + 8, &timestamp, 8);
+		memcpy(p + 16, &ip_len, 2);
+		memcpy(p + 18, &username_len, 2);
+		memcpy(p + 20, &message_len, 4);
+		p += ARCHIVE_RECORD_HEADER;
+		memcpy(p, ip ? ip : "", ip_len + 1);
+		p += ip_len + 1;
+		memcpy(p, username ? username : "", username_len + 1);
+		p += username_len + 1;
+		memcpy(p, message ? message : "", message_len + 1);
+		raw_len += need;
+
+		if (entry.count == 0) {
+			entry.first_id = id;
+			entry.first_ts = timestamp;
+		}
+		entry.last_id = id;
+		entry.last_ts = timestamp;
+		if (++entry.count == ARCHIVE_BLOCK_MESSAGES) {
+			if (archive_append_block(segment, sizeof(segment), raw, raw_len, &entry) != 0) {
+				rc = SQLITE_IOERR;
+				break;
+			}
+			last_id = entry.last_id;
+			memset(&entry, 0, sizeof(entry));
+			raw_len = 0;
+		}
+	}
+	db_finalize(stmt);
+	free(raw);
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "Failed to archive messages (rc=%d).\n", rc);
+		// 已经落盘的块仍然有效，只删除这些块中的消息
+	}
+	return last_id;
+}
+
+// 函数：按 ID 升序写出归档中 ID 小于 before_id 的最后 limit 条消息；written 为已写出的条数（决定是否先写逗号）
+// 返回本次写出的条数
+int archive_write_before(FILE *out, long long before_id, int limit, int written) {
+	struct {
+		unsigned char *raw;
+		size_t len;
+	} blocks[16]; // 从新到旧收集的块
+	int block_count = 0, available = 0;
+
+	struct dirent **names;
+	int n = archive_list_segments(&names);
+	for (int i = n - 1; i >= 0 && available < limit && block_count < 16; i--) {
+		struct archive_segment seg;
+		if (archive_open_segment(names[i]->d_name, &seg) != 0) continue;
+		for (long e = (long)seg.entries - 1; e >= 0 && available < limit && block_count < 16; e--) {
+			const struct archive_index_entry *entry = &seg.index[e];
+			if (entry->first_id >= before_id) continue;
+			unsigned char *raw = archive_read_block(&seg, entry);
+			if (raw == NULL) continue;
+			blocks[block_count].raw = raw;
+			blocks[block_count].len = entry->raw_len;
+			block_count++;
+			if (entry->last_id < before_id) {
+				available += entry->count;
+			} else {
+				const unsigned char *p = raw;
+				struct archive_record record;
+				while (archive_next_record(&p, raw + entry->raw_len, &record) && record.id < before_id) available++;
+			}
+		}
+		archive_close_segment(&seg);
+	}
+	archive_free_list(names, n);
+
+	// 从最旧的块开始输出，跳过多取的部分
+	int skip = available > limit ? available - limit : 0, count = 0;
+	for (int b = block_count - 1; b >= 0; b--) {
+		const unsigned char *p = blocks[b].raw;
+		struct archive_record record;
+		while (archive_next_record(&p, blocks[b].raw + blocks[b].len, &record) && record.id < before_id) {
+			if (skip > 0) {
+				skip--;
+				continue;
+			}
+			if (written + count++ > 0) putc_unlocked(',', out);
+			json_write_message_fields(out, record.id, record.timestamp, record.ip, record.username, record.message);
+		}
+		free(blocks[b].raw);
+	}
+	return count;
+}
+
+// 函数：在归档中按 ID 倒序查找消息内容或用户名包含全部搜索词（不区分大小写）的消息
+// 跳过前 skip 条匹配，最多写出 limit 条；written 为已写出的条数。返回本次写出的条数，*more 表示之后还有匹配
+int archive_search(FILE *out, const char *q, long long skip, int limit, int written, int *more) {
+	char terms_buf[MAX_SEARCH_QUERY_LENGTH + 2];
+	char *terms[ARCHIVE_MAX_SEARCH_TERMS];
+	int term_count = 0;
+	snprintf(terms_buf, sizeof(terms_buf), "%s", q);
+	for (char *save, *t = strtok_r(terms_buf, " \t\r\n", &save); t && term_count < ARCHIVE_MAX_SEARCH_TERMS;
+	     t = strtok_r(NULL, " \t\r\n", &save)) {
+		terms[term_count++] = t;
+	}
+
+	*more = 0;
+	int count = 0;
+	struct dirent **names;
+	int n = archive_list_segments(&names);
+	for (int i = n - 1; i >= 0 && !*more; i--) {
+		struct archive_segment seg;
+		if (archive_open_segment(names[i]->d_name, &seg) != 0) continue;
+		for (long e = (long)seg.entries - 1; e >= 0 && !*more; e--) {
+			const struct archive_index_entry *entry = &seg.index[e];
+			unsigned char *raw = archive_read_block(&seg, entry);
+			if (raw == NULL) continue;
+
+			// 块内按 ID 升序存放，先收集再倒序检查
+			struct archive_record records[ARCHIVE_BLOCK_MESSAGES];
+			int record_count = 0;
+			const unsigned char *p = raw;
+			while (record_count < ARCHIVE_BLOCK_MESSAGES && archive_next_record(&p, raw + entry->raw_len, &records[record_count])) {
+				record_count++;
+			}
+			for (int r = record_count - 1; r >= 0; r--) {
+				int matched = 1;
+				for (int t = 0; t < term_count && matched; t++) {
+					matched = strcasestr(records[r].message, terms[t]) != NULL || strcasestr(records[r].username, terms[t]) != NULL;
+				}
+				if (!matched) continue;
+				if (skip > 0) {
+					skip--;
+				} else if (count == limit) {
+					*more = 1;
+					break;
+				} else {
+					if (written + count++ > 0) putc_unlocked(',', out);
+					json_write_message_fields(out, records[r].id, records[r].timestamp, records[r].ip, records[r].username, records[r].message);
+				}
+			}
+			free(raw);
+		}
+		archive_close_segment(&seg);
+	}
+	archive_free_list(names, n);
+	return count;
+}
+
+
+// ========== 最新消息共享环 ==========
+// 每个聊天室的最新消息同时保存在共享内存文件 <数据库>.ring 中（mmap），GET 直接从中读取，
+// 不打开数据库，也不读取快照文件。环由 RING_SLOTS 个固定大小的槽位组成，每条消息占一个槽位，
+// 按写入顺序循环使用；槽位大小固定，读者只复制用到的字节。
+// 写者是重建快照的进程（持有快照文件锁，同一时刻只有一个），只追加比环中更新的消息。
+// 读写通过序列锁同步：写者在修改前后各把 seq 加一（奇数表示正在写入），
+// 读者复制所需的槽位后确认 seq 没有变化，否则重新读取；读者从不加锁，也不会阻塞写者。
+// 文件不存在、格式不符或写者中途崩溃（seq 停在奇数）时，由下一次重建快照从 SQLite 整环重写。
+// CHAT_RING=0 时 GET 不读取共享环（用于对比和排查）。
+
+#define RING_MAGIC 0x31474e5254414843ULL // 共享环文件的格式标识（"CHATRNG1"），布局改变时递增
+#define RING_SLOTS 64 // 槽位数量，不少于 MAX_MESSAGES_GET
+#define RING_SLOT_SIZE 2048 // 每个槽位的字节数（缓存行的整数倍）
+#define RING_READ_ATTEMPTS 100 // 读者重试的次数上限，超过后退回快照
+#define RING_STALE_MS 1000 // 提交之后超过这么久仍未发布到环中，认为发布者已崩溃，读者退回快照
+
+// 一条消息；text 中依次是 IP、用户名和消息内容，各以 '\0' 结尾
+struct ring_slot {
+	long long id;
+	long long timestamp;
+	unsigned int length; // text 中已用的字节数，0 表示这条消息放不下（读者遇到时退回快照）
+	unsigned int reserved;
+	char text[RING_SLOT_SIZE - 24];
+};
+
+// 共享环文件的布局（原生字节序），文件头占一个缓存行
+struct ring_file {
+	unsigned long long magic;
+	unsigned long long seq; // 序列锁，奇数表示正在写入
+	long long latest_id; // 最新消息的 ID（ETag）
+	long long min_id; // 最新 MAX_MESSAGES_GET 条消息中最早的 ID，更早的槽位已失效
+	long long committed_id; // 已提交的最新 ID；大于 latest_id 说明提交之后还没有发布到环中
+	unsigned long long head; // 累计写入的消息数，下一条写入槽位 head % RING_SLOTS
+	long long committed_ms; // 最近一次提交的时间（单调时钟，毫秒）
+	unsigned long long reserved;
+	struct ring_slot slots[RING_SLOTS];
+};
+
+static struct ring_file *g_ring; // 已映射的共享环，常驻进程保留最近访问的聊天室的映射
+static char g_ring_path[ROOM_PATH_SIZE]; // g_ring 对应的文件
+static int g_ring_writing; // 本次发布是否已经进入写状态
+
+// 函数：解除共享环的映射（文件被删除或替换之后）
+void ring_unmap() {
+	if (g_ring != NULL) munmap(g_ring, sizeof(struct ring_file));
+	g_ring = NULL;
+	g_ring_path[0] = '\0';
+}
+
+// 函数：映射当前聊天室的共享环；create 为 1 时文件不存在或大小不符就创建或调整（写者），
+// 为 0 时返回 NULL（读者）。不检查格式标识
+static struct ring_file *ring_map(int create) {
+	if (g_ring != NULL && strcmp(g_ring_path, g_room.ring_path) == 0) return g_ring;
+	ring_unmap();
+	int fd = open(g_room.ring_path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	if (fd < 0) return NULL;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (st.st_size != (off_t)sizeof(struct ring_file) &&
+	    (!create || ftruncate(fd, sizeof(struct ring_file)) != 0))) {
+		close(fd);
+		return NULL;
+	}
+	struct ring_file *ring = mmap(NULL, sizeof(struct ring_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED) return NULL;
+	g_ring = ring;
+	snprintf(g_ring_path, sizeof(g_ring_path), "%s", g_room.ring_path);
+	return ring;
+}
+
+// 函数：进入写状态（seq 变为奇数）；之前的写者崩溃留下的奇数 seq 仍保持奇数
+static void ring_write_enter(struct ring_file *ring) {
+	if (g_ring_writing) return;
+	unsigned long long seq = __atomic_load_n(&ring->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring->seq, (seq + 1) | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	g_ring_writing = 1;
+}
+
+// 函数：退出写状态（seq 变为偶数），读者随后能看到完整的修改
+static void ring_write_exit(struct ring_file *ring) {
+	if (!g_ring_writing) return;
+	__atomic_store_n(&ring->seq, __atomic_load_n(&ring->seq, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+	g_ring_writing = 0;
+}
+
+// 函数：开始一次发布，返回环中已有的最新 ID；环无效（不存在、格式不符或写者崩溃）时清空并返回 0
+static long long ring_publish_begin(struct ring_file *ring) {
+	if (ring->magic == RING_MAGIC && (__atomic_load_n(&ring->seq, __ATOMIC_RELAXED) & 1) == 0) return ring->latest_id;
+	ring_write_enter(ring);
+	ring->head = 0;
+	ring->latest_id = 0;
+	ring->min_id = LLONG_MAX;
+	return 0;
+}
+
+// 函数：把查询结果的当前行（id, timestamp, ip, username, message）追加到环中
+static void ring_publish_row(struct ring_file *ring, sqlite3_stmt *stmt) {
+	ring_write_enter(ring);
+	struct ring_slot *slot = &ring->slots[ring->head % RING_SLOTS];
+	slot->id = sqlite3_column_int64(stmt, 0);
+	slot->timestamp = sqlite3_column_int64(stmt, 1);
+	size_t length = 0;
+	for (int column = 2; column <= 4; column++) {
+		length += sqlite3_column_bytes(stmt, column) + 1;
+	}
+	slot->length = 0;
+	if (length <= sizeof(slot->text)) {
+		char *p = slot->text;
+		for (int column = 2; column <= 4; column++) {
+			const unsigned char *text = sqlite3_column_text(stmt, column);
+			size_t n = sqlite3_column_bytes(stmt, column);
+			if (n > 0) memcpy(p, text, n);
+			p[n] = '\0';
+			p += n + 1;
+		}
+		slot->length = length;
+	}
+	ring->head++;
+}
+
+// 函数：标记环无效（读者退回快照），下一次重建快照时整环重写
+static void ring_invalidate(struct ring_file *ring) {
+	ring_write_enter(ring);
+	ring->magic = 0;
+	ring->committed_id = 0;
+	ring_write_exit(ring);
+}
+
+// 函数：结束一次发布；first_id 和 latest_id 为最新 MAX_MESSAGES_GET 条消息的首尾 ID（没有消息时为 0）
+// 环中的最新 ID 比数据库中的还大（数据库被替换）时标记环无效
+static void ring_publish_end(struct ring_file *ring, long long first_id, long long latest_id) {
+	long long min_id = latest_id > 0 ? first_id : LLONG_MAX;
+	if (ring->latest_id > latest_id) {
+		ring_invalidate(ring);
+		return;
+	}
+	if (ring->latest_id != latest_id || ring->min_id != min_id || ring->magic != RING_MAGIC) {
+		ring_write_enter(ring);
+		ring->latest_id = latest_id;
+		ring->min_id = min_id;
+		ring->magic = RING_MAGIC;
+		if (ring->committed_id < latest_id) ring->committed_id = latest_id;
+	}
+	ring_write_exit(ring);
+}
+
+// 函数：提交新消息后立即记录已提交的最新 ID 和提交时间
+// 提交与发布之间正常只有几百微秒，读者照常使用环；长时间没有发布说明发布者已崩溃，读者据此退回快照
+void ring_note_commit(long long message_id) {
+	struct ring_file *ring = ring_map(1);
+	if (ring == NULL) return;
+	__atomic_store_n(&ring->committed_ms, timer_now() / 1000000, __ATOMIC_RELAXED);
+	long long current = __atomic_load_n(&ring->committed_id, __ATOMIC_RELAXED);
+	while (current < message_id &&
+	       !__atomic_compare_exchange_n(&ring->committed_id, &current, message_id, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	}
+}
+
+// 函数：按序列锁复制 ID 大于 since_id 的最新消息（从新到旧，最多 MAX_MESSAGES_GET 条），复制期间有写入就重新读取
+// 返回复制的条数，并给出环中的最新 ID 和有效范围的起点；环无效、一直在写入或遇到放不下的消息时返回 -1
+static int ring_read(struct ring_file *ring, long long since_id, struct ring_slot *copies, long long *latest_id, long long *min_id) {
+	for (int attempt = 0; attempt < RING_READ_ATTEMPTS; attempt++) {
+		unsigned long long seq = __atomic_load_n(&ring->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		unsigned long long magic = ring->magic, head = ring->head;
+		*min_id = ring->min_id;
+		*latest_id = ring->latest_id;
+		int count = 0, complete = 1;
+		for (unsigned long long i = head; i > 0 && head - i < RING_SLOTS && count < MAX_MESSAGES_GET;) {
+			const struct ring_slot *slot = &ring->slots[--i % RING_SLOTS];
+			long long id = slot->id;
+			if (id < *min_id || id <= since_id) break;
+			unsigned int length = slot->length;
+			if (length == 0 || length > sizeof(slot->text)) {
+				complete = 0;
+				break;
+			}
+			memcpy(&copies[count++], slot, offsetof(struct ring_slot, text) + length);
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&ring->seq, __ATOMIC_RELAXED) == seq) {
+			return magic == RING_MAGIC && complete ? count : -1;
+		}
+	}
+	return -1;
+}
+
+// 函数：取出复制出的槽位中的 IP、用户名和消息内容；长度与写者记录的不一致时返回 -1
+static int ring_slot_fields(const struct ring_slot *slot, const char *fields[3]) {
+	const char *p = slot->text, *end = p + slot->length;
+	for (int f = 0; f < 3; f++) {
+		const char *nul = memchr(p, '\0', end - p);
+		if (nul == NULL) return -1;
+		fields[f] = p;
+		p = nul + 1;
+	}
+	return p == end ? 0 : -1;
+}
+
+// ========== 最新消息快照 ==========
+// 每次写入新消息后，把最新 MAX_MESSAGES_GET 条消息预先序列化为 GET 响应体并原子替换快照文件，
+// GET 请求直接从快照中输出，不需要访问 SQLite 或构建 cJSON 对象。
+// 文件格式：
+//   CHATSNAP2 <最新ID> <消息数量> <消息体长度> <gzip 长度> <brotli 长度>\n
+//   每条消息一行 "<ID> <在消息体中的偏移>\n"（按 ID 升序）
+//   消息体：{"status":"success","data":[...]}\n
+//   完整消息体的 gzip 和 brotli 压缩结果（长度为 0 表示没有），首次加载的请求直接发送，不必每次压缩
+
+#define SNAPSHOT_MAGIC "CHATSNAP2"
+
+// 函数：读取通知文件中记录的最新消息 ID，文件不存在时返回 -1
+static long long read_notified_id() {
+	int fd = open(g_room.notify_path, O_RDONLY);
+	if (fd < 0) return -1;
+	char buf[24];
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) return -1;
+	buf[n] = '\0';
+	return atoll(buf);
+}
+
+// 函数：重建快照文件（先写临时文件再 rename，读者不会看到写了一半的快照）
+// 在文件锁内查询，保证最后完成的重建反映最后一次提交
+int rebuild_snapshot(sqlite3 *db) {
+	int lock_fd = open(g_room.snapshot_lock_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	if (lock_fd < 0 || flock(lock_fd, LOCK_EX) != 0) {
+		if (lock_fd >= 0) close(lock_fd);
+		return 1;
+	}
+
+	char *body = NULL, *index = NULL;
+	size_t body_len = 0, index_len = 0;
+	FILE *body_stream = open_memstream(&body, &body_len);
+	FILE *index_stream = open_memstream(&index, &index_len);
+	sqlite3_stmt *stmt;
+	int result = 1;
+	long long latest_id = 0, first_id = 0;
+	int count = 0;
+
+	if (body_stream == NULL || index_stream == NULL || db_prepare(db, SQL_SELECT_LATEST_MESSAGES, &stmt) != SQLITE_OK) {
+		goto cleanup;
+	}
+	sqlite3_bind_int64(stmt, 1, 0);
+	sqlite3_bind_int(stmt, 2, MAX_MESSAGES_GET);
+
+	// 同一批结果同时发布到共享环，只追加环中还没有的消息
+	struct ring_file *ring = ring_map(1);
+	long long ring_latest = ring != NULL ? ring_publish_begin(ring) : 0;
+
+	fputs(MESSAGES_JSON_PREFIX, body_stream);
+	int step_rc;
+	while ((step_rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (count > 0) fputc(',', body_stream);
+		fflush(body_stream); // 更新 body_len，得到本条消息的偏移
+		latest_id = sqlite3_column_int64(stmt, 0);
+		if (count == 0) first_id = latest_id;
+		fprintf(index_stream, "%lld %zu\n", latest_id, body_len);
+		json_write_message(body_stream, stmt);
+		if (ring != NULL && latest_id > ring_latest) ring_publish_row(ring, stmt);
+		count++;
+	}
+	db_finalize(stmt);
+	if (ring != NULL) {
+		if (step_rc == SQLITE_DONE) {
+			ring_publish_end(ring, first_id, latest_id);
+		} else {
+			ring_invalidate(ring);
+		}
+	}
+	fputs(MESSAGES_JSON_SUFFIX, body_stream);
+	fclose(body_stream);
+	fclose(index_stream);
+	body_stream = index_stream = NULL;
+
+	char tmp_path[ROOM_PATH_SIZE + 24];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", g_room.snapshot_path, (int)getpid());
+	FILE *fp = fopen(tmp_path, "w");
+	if (fp == NULL) goto cleanup;
+	size_t gzip_len = 0, brotli_len = 0;
+	unsigned char *gzip_body = compress_body(ENCODING_GZIP, body, body_len, &gzip_len);
+	unsigned char *brotli_body = compress_body(ENCODING_BROTLI, body, body_len, &brotli_len);
+	if (gzip_body == NULL) gzip_len = 0;
+	if (brotli_body == NULL) brotli_len = 0;
+	fprintf(fp, "%s %lld %d %zu %zu %zu\n", SNAPSHOT_MAGIC, latest_id, count, body_len, gzip_len, brotli_len);
+	fwrite(index, 1, index_len, fp);
+	fwrite(body, 1, body_len, fp);
+	fwrite(gzip_body, 1, gzip_len, fp);
+	fwrite(brotli_body, 1, brotli_len, fp);
+	free(gzip_body);
+	free(brotli_body);
+	if (fclose(fp) != 0 || rename(tmp_path, g_room.snapshot_path) != 0) {
+		unlink(tmp_path);
+		goto cleanup;
+	}
+	chmod(g_room.snapshot_path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	result = 0;
+
+cleanup:
+	if (body_stream) fclose(body_stream);
+	if (index_stream) fclose(index_stream);
+	free(body);
+	free(index);
+	if (result != 0) {
+		unlink(g_room.snapshot_path); // 快照无法更新时删除旧快照，让读者退回实时查询
+		fprintf(stderr, "Failed to rebuild message snapshot.\n");
+	}
+	flock(lock_fd, LOCK_UN);
+	close(lock_fd);
+	return result;
+}
+
+// 函数：尝试用快照回应 GET 请求；成功返回 1，快照缺失、损坏或过期时返回 0（调用方执行实时查询）
+int serve_snapshot(long long since_id) {
+	long long start = timer_now();
+	int fd = open(g_room.snapshot_path, O_RDONLY);
+	if (fd < 0) return 0;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return 0;
+
+	int served = 0;
+	long long latest_id;
+	int count;
+	size_t body_len, gzip_len, brotli_len;
+	int header_len = 0;
+	char *end = map + st.st_size;
+	if (memchr(map, '\n', st.st_size) == NULL ||
+	    sscanf(map, SNAPSHOT_MAGIC " %lld %d %zu %zu %zu\n%n", &latest_id, &count, &body_len, &gzip_len, &brotli_len, &header_len) != 5 ||
+	    header_len == 0) {
+		goto done;
+	}
+
+	// 写入后还没来得及重建（或重建失败）的快照视为过期
+	if (latest_id < read_notified_id()) goto done;
+
+	// 从索引中找到第一条 ID 大于 since 的消息
+	// 没有更新的消息时只输出空数组
+	char *p = map + header_len;
+	size_t start_offset = body_len - strlen(MESSAGES_JSON_SUFFIX);
+	int found = 0;
+	for (int i = 0; i < count; i++) {
+		char *line_end = memchr(p, '\n', end - p);
+		if (line_end == NULL) goto done;
+		long long id = strtoll(p, &p, 10);
+		size_t offset = strtoull(p, NULL, 10);
+		if (!found && id > since_id) {
+			start_offset = offset;
+			found = 1;
+		}
+		p = line_end + 1;
+	}
+	if ((size_t)(end - p) != body_len + gzip_len + brotli_len || body_len < strlen(MESSAGES_JSON_SUFFIX) || start_offset > body_len) {
+		goto done; // 文件被截断或已损坏
+	}
+	timer_add(PHASE_QUERY, start);
+
+	char etag[40];
+	snprintf(etag, sizeof(etag), "\"m%lld\"", latest_id);
+	const char *if_none_match = getenv("HTTP_IF_NONE_MATCH");
+	if (if_none_match != NULL && strstr(if_none_match, etag) != NULL) {
+		printf("Status: 304 Not Modified\r\nETag: %s\r\nCache-Control: no-cache\r\n%s%s\r\n", etag, server_timing_header(),
+		       g_replication_header);
+		served = 1;
+		goto done;
+	}
+	char extra_headers[96];
+	snprintf(extra_headers, sizeof(extra_headers), "ETag: %s\r\nCache-Control: no-cache\r\n", etag);
+
+	// 需要全部消息且客户端接受压缩时，直接发送预先压缩好的消息体
+	int encoding = negotiate_encoding(getenv("HTTP_ACCEPT_ENCODING"));
+	size_t compressed_len = encoding == ENCODING_GZIP ? gzip_len : encoding == ENCODING_BROTLI ? brotli_len : 0;
+	if (start_offset == strlen(MESSAGES_JSON_PREFIX) && compressed_len > 0 &&
+	    body_len >= (size_t)config_int("CHAT_COMPRESS_MIN_SIZE", COMPRESS_MIN_SIZE)) {
+		const char *compressed = p + body_len + (encoding == ENCODING_BROTLI ? gzip_len : 0);
+		printf("Status: 200 OK\r\n%s%s%sVary: Accept-Encoding\r\nContent-Encoding: %s\r\n", extra_headers, server_timing_header(),
+		       g_replication_header, encoding_names[encoding]);
+		printf("Content-Length: %zu\r\nContent-type: application/json\r\n\r\n", compressed_len);
+		fwrite(compressed, 1, compressed_len, stdout);
+		served = 1;
+		goto done;
+	}
+
+	FILE *out = response_begin(200, "OK", extra_headers, "application/json");
+	fputs(MESSAGES_JSON_PREFIX, out);
+	fwrite(p + start_offset, 1, body_len - start_offset, out);
+	response_end();
+	served = 1;
+
+done:
+	munmap(map, st.st_size);
+	return served;
+}
+
+// 函数：尝试用共享环回应 GET 请求；成功返回 1，环不可用或已过期时返回 0（调用方改用快照）
+// 环不存在或格式不符时先从 SQLite 重建；增量轮询和 304 由环回应，首次加载全部消息交给快照
+int serve_ring(long long since_id) {
+	const char *enabled = getenv("CHAT_RING");
+	if (enabled != NULL && strcmp(enabled, "0") == 0) return 0;
+	long long start = timer_now();
+	struct ring_file *ring = ring_map(0);
+	if (ring == NULL || ring->magic != RING_MAGIC) {
+		sqlite3 *db;
+		if (db_acquire_room(&db) != SQLITE_OK) return 0;
+		rebuild_snapshot(db);
+		db_release(db);
+		ring = ring_map(0);
+		if (ring == NULL) return 0;
+	}
+
+	static struct ring_slot copies[MAX_MESSAGES_GET];
+	long long latest_id, min_id;
+	int count = ring_read(ring, since_id, copies, &latest_id, &min_id);
+	if (count < 0) return 0;
+	if (latest_id < __atomic_load_n(&ring->committed_id, __ATOMIC_ACQUIRE) &&
+	    timer_now() / 1000000 - __atomic_load_n(&ring->committed_ms, __ATOMIC_RELAXED) > RING_STALE_MS) {
+		return 0;
+	}
+
+	const char *fields[MAX_MESSAGES_GET][3];
+	for (int i = 0; i < count; i++) {
+		if (ring_slot_fields(&copies[i], fields[i]) != 0) return 0;
+	}
+	timer_add(PHASE_QUERY, start);
+
+	char etag[40];
+	snprintf(etag, sizeof(etag), "\"m%lld\"", latest_id);
+	char extra_headers[96];
+	snprintf(extra_headers, sizeof(extra_headers), "ETag: %s\r\nCache-Control: no-cache\r\n", etag);
+	const char *if_none_match = getenv("HTTP_IF_NONE_MATCH");
+	if (if_none_match != NULL && strstr(if_none_match, etag) != NULL) {
+		printf("Status: 304 Not Modified\r\n%s%s%s\r\n", extra_headers, server_timing_header(), g_replication_header);
+		return 1;
+	}
+	// 首次加载全部消息时，快照中整段写好（以及预先压缩）的消息体比逐条生成更快
+	if (since_id == 0) return 0;
+
+	FILE *out = response_begin(200, "OK", extra_headers, "application/json");
+	start = timer_now();
+	fputs(MESSAGES_JSON_PREFIX, out);
+	for (int i = count - 1; i >= 0; i--) {
+		json_write_message_fields(out, copies[i].id, copies[i].timestamp, fields[i][0], fields[i][1], fields[i][2]);
+		if (i > 0) putc(',', out);
+	}
+	fputs(MESSAGES_JSON_SUFFIX, out);
+	timer_add(PHASE_SERIALIZE, start);
+	response_end();
+	return 1;
+}
+
+// 函数：处理向前翻页请求（?before=<id>&limit=N），返回 ID 小于 before 的 limit 条消息
+// 热表中不够一页时，其余部分从归档中读取；已写入的消息不会改变，允许浏览器短时间缓存
+int handle_get_history(long long before_id, int limit) {
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	if (db_acquire_room(&db) != SQLITE_OK) {
+		send_fixed_response(500, "Internal Server Error", JSON_ERROR("Can't open database."));
+		return 1;
+	}
+	// 已归档的消息可能因事务回滚暂时还留在热表中，热表只读取归档之后的部分
+	long long start = timer_now();
+	long long archived_id = archive_latest(NULL, 0);
+	int hot_count = 0;
+	if (archived_id > 0) {
+		if (db_prepare(db, SQL_COUNT_MESSAGES_BEFORE, &stmt) != SQLITE_OK) {
+			db_release(db);
+			send_fixed_response(500, "Internal Server Error", JSON_ERROR("Failed to prepare statement"));
+			return 1;
+		}
+		sqlite3_bind_int64(stmt, 1, before_id);
+		sqlite3_bind_int64(stmt, 2, archived_id);
+		sqlite3_bind_int(stmt, 3, limit);
+		if (sqlite3_step(stmt) == SQLITE_ROW) hot_count = sqlite3_column_int(stmt, 0);
+		db_finalize(stmt);
+	}
+
+	if (db_prepare(db, SQL_SELECT_MESSAGES_BEFORE, &stmt) != SQLITE_OK) {
+		db_release(db);
+		send_fixed_response(500, "Internal Server Error", JSON_ERROR("Failed to prepare statement"));
+		return 1;
+	}
+	sqlite3_bind_int64(stmt, 1, before_id);
+	sqlite3_bind_int(stmt, 2, limit);
+	sqlite3_bind_int64(stmt, 3, archived_id);
+	timer_add(PHASE_QUERY, start);
+
+	FILE *out = response_begin(200, "OK", "Cache-Control: private, max-age=60\r\n", "application/json");
+	start = timer_now();
+	fputs(MESSAGES_JSON_PREFIX, out);
+	int count = 0;
+	if (archived_id > 0 && hot_count < limit) {
+		long long archive_before = before_id < archived_id + 1 ? before_id : archived_id + 1;
+		count = archive_write_before(out, archive_before, limit - hot_count, 0);
+	}
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		if (count++ > 0) putc(',', out);
+		json_write_message(out, stmt);
+	}
+	fputs(MESSAGES_JSON_SUFFIX, out);
+	timer_add(PHASE_QUERY, start);
+	response_end();
+
+	db_finalize(stmt);
+	db_release(db);
+	return 0;
+}
+
+// 处理 GET 请求的函数
+int handle_get_messages() {
+	sqlite3 *db; // SQLite 数据库连接对象
+	sqlite3_stmt *stmt; // SQLite 预处理语句对象
+	int rc; // SQLite 操作的返回码
+	const char *query_string = getenv("QUERY_STRING");
+
+	// 向前翻页：按主键范围读取 before 之前的一页，不经过快照和 ETag
+	char before_str[32];
+	if (get_query_param(query_string, "before", before_str, sizeof(before_str))) {
+		long long before_id = atoll(before_str);
+		int limit = MAX_MESSAGES_GET;
+		char limit_str[16];
+		if (get_query_param(query_string, "limit", limit_str, sizeof(limit_str))) {
+			limit = atoi(limit_str);
+			if (limit <= 0) limit = MAX_MESSAGES_GET;
+			if (limit > MAX_HISTORY_PAGE) limit = MAX_HISTORY_PAGE;
+		}
+		return handle_get_history(before_id, limit);
+	}
+
+	// 解析增量同步游标：只返回 ID 大于 since 的消息
+	long long since_id = 0;
+	char since_str[32];
+	if (get_query_param(query_string, "since", since_str, sizeof(since_str))) {
+		since_id = atoll(since_str);
+		if (since_id < 0) since_id = 0;
+	}
+
+	// 优先使用共享环，其次是快照，都不访问数据库
+	if (serve_ring(since_id) || serve_snapshot(since_id)) {
+		return 0;
+	}
+
+	// 打开当前聊天室的数据库连接
+	rc = db_acquire_room(&db);
+	if (rc) {
+		// 如果打开数据库失败，则输出错误信息到标准错误流，并返回错误码
+		send_fixed_response(500, "Internal Server Error", JSON_ERROR("Can't open database."));
+		return 1;
+	}
+
+	// 以最新消息 ID 作为 ETag；消息只会追加或随新消息一起被清理，所以 ID 不变即内容不变
+	long long start = timer_now();
+	long long latest_id = 0;
+	const char *sql_latest = "SELECT IFNULL(MAX(id), 0) FROM messages;";
+	rc = db_prepare(db, sql_latest, &stmt);
+	if (rc != SQLITE_OK) {
+		db_release(db);
+		send_fixed_response(500, "Internal Server Error", JSON_ERROR("Failed to prepare statement"));
+		return 1;
+	}
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		latest_id = sqlite3_column_int64(stmt, 0);
+	}
+	db_finalize(stmt);
+	timer_add(PHASE_QUERY, start);
+
+	char etag[40];
+	snprintf(etag, sizeof(etag), "\"m%lld\"", latest_id);
+	char extra_headers[96];
+	snprintf(extra_headers, sizeof(extra_headers), "ETag: %s\r\nCache-Control: no-cache\r\n", etag);
+
+	// 客户端已持有最新版本时直接返回 304，不生成 JSON
+	const char *if_none_match = getenv("HTTP_IF_NONE_MATCH");
+	if (if_none_match != NULL && strstr(if_none_match, etag) != NULL) {
+		db_release(db);
+		printf("Status: 304 Not Modified\r\n%s%s%s\r\n", extra_headers, server_timing_header(), g_replication_header);
+		return 0;
+	}
+
+	// 查询 ID 大于游标的最新 MAX_MESSAGES_GET 条消息，结果已按 ID 升序排列
+	rc = db_prepare(db, SQL_SELECT_LATEST_MESSAGES, &stmt);
+	if (rc != SQLITE_OK) {
+		// 如果准备语句失败，则输出错误信息，关闭数据库，并返回错误码
+		db_release(db);
+		send_fixed_response(500, "Internal Server Error", JSON_ERROR("Failed to prepare statement"));
+		return 1;
+	}
+
+	// 绑定游标和 MAX_MESSAGES_GET 到 SQL 语句中的参数
+	sqlite3_bind_int64(stmt, 1, since_id);
+	sqlite3_bind_int(stmt, 2, MAX_MESSAGES_GET);
+
+	FILE *out = response_begin(200, "OK", extra_headers, "application/json");
+
+	// 逐行把消息直接写入响应体，不构建 cJSON 树
+	start = timer_now();
+	fputs(MESSAGES_JSON_PREFIX, out);
+	int count = 0;
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (count++ > 0) putc(',', out);
+		json_write_message(out, stmt);
+	}
+	fputs(MESSAGES_JSON_SUFFIX, out);
+	timer_add(PHASE_QUERY, start);
+	response_end();
+
+	db_finalize(stmt); // 结束 SQLite 预处理语句
+	db_release(db); // 释放 SQLite 数据库连接
+
+	return 0; // 程序成功执行
+}
+
+// ========== 全文搜索 ==========
+// GET ?action=search&q=...&limit=N&offset=M 在当前聊天室中搜索消息内容和用户名。
+// 查询按空白拆成多个词，每个词作为短语匹配，全部命中才返回，结果按 bm25 相关度排序。
+// trigram 索引只能匹配至少 3 个字符的词；查询中含更短的词时退回对 messages 表的子串扫描（同样要求每个词都命中），按时间倒序返回。
+// 热表中的结果全部给出后，继续按时间倒序扫描归档（不区分大小写的子串匹配），offset 在两部分之间连续计数。
+
+#define SEARCH_PAGE_SIZE 20 // 每页结果数量的默认值
+#define MAX_SEARCH_PAGE_SIZE 50 // 每页结果数量的上限
+#define MAX_SEARCH_SCAN_TERMS 16 // 子串扫描最多使用的词数，多出的词被忽略（与归档搜索相同）
+#define SEARCH_SCAN_SQL_SIZE (160 + MAX_SEARCH_SCAN_TERMS * 80) // 子串扫描语句文本的长度上限
+
+static const char *SQL_SEARCH_MESSAGES =
+	"SELECT m.id, m.timestamp, m.ip, m.username, m.message FROM messages_fts "
+	"JOIN messages m ON m.id = messages_fts.rowid "
+	"WHERE messages_fts MATCH ?1 AND messages_fts.rowid > ?4 ORDER BY rank LIMIT ?2 OFFSET ?3;";
+
+static const char *SQL_COUNT_SEARCH =
+	"SELECT COUNT(*) FROM messages_fts WHERE messages_fts MATCH ?1 AND rowid > ?2;";
+
+// 子串扫描语句按词数生成：每个词一个条件，全部用 AND 连接。搜索语句的词模式从 ?5 起编号（?2 至 ?4 与索引语句相同），
+// 计数语句从 ?3 起编号（?2 为 after_id）
+static const char *SQL_SEARCH_MESSAGES_SCAN_HEAD =
+	"SELECT id, timestamp, ip, username, message FROM messages WHERE id > ?4";
+static const char *SQL_SEARCH_MESSAGES_SCAN_TAIL = " ORDER BY id DESC LIMIT ?2 OFFSET ?3;";
+static const char *SQL_COUNT_SEARCH_SCAN_HEAD = "SELECT COUNT(*) FROM messages WHERE id > ?2";
+#define SQL_SEARCH_SCAN_TERM " AND (message LIKE ?%d ESCAPE '\\' OR username LIKE ?%d ESCAPE '\\')"
+
+// 函数：把用户输入转换为 FTS5 查询（每个词加引号，避免被解析为 FTS5 语法）
+// 有少于 3 个字符的词时返回 0，调用方应改用子串扫描
+int build_search_match(const char *q, char *out, size_t out_size) {
+	size_t len = 0;
+	int terms = 0;
+	const char *p = q;
+	while (*p) {
+		while (*p && isspace((unsigned char)*p)) p++;
+		if (!*p) break;
+		int chars = 0;
+		if (len + 3 >= out_size) return 0;
+		if (terms++ > 0) out[len++] = ' ';
+		out[len++] = '"';
+		for (; *p && !isspace((unsigned char)*p); p++) {
+			if (((unsigned char)*p & 0xC0) != 0x80) chars++; // 按 UTF-8 字符计数
+			if (len + 4 >= out_size) return 0;
+			if (*p == '"') out[len++] = '"';
+			out[len++] = *p;
+		}
+		out[len++] = '"';
+		if (chars < 3) return 0;
+	}
+	out[len] = '\0';
+	return terms > 0;
+}
+
+// 函数：把用户输入按空白拆成词（与 build_search_match 相同），每个词转换为 LIKE 子串模式并转义其中的通配符
+// 模式依次存放在 out 中，patterns 指向各个模式；返回词数，最多 MAX_SEARCH_SCAN_TERMS 个
+int build_search_patterns(const char *q, char *out, size_t out_size, const char **patterns) {
+	size_t len = 0;
+	int terms = 0;
+	const char *p = q;
+	while (*p && terms < MAX_SEARCH_SCAN_TERMS) {
+		while (*p && isspace((unsigned char)*p)) p++;
+		if (!*p || len + 3 >= out_size) break;
+		patterns[terms++] = out + len;
+		out[len++] = '%';
+		for (; *p && !isspace((unsigned char)*p) && len + 4 < out_size; p++) {
+			if (*p == '%' || *p == '_' || *p == '\\') out[len++] = '\\';
+			out[len++] = *p;
+		}
+		out[len++] = '%';
+		out[len++] = '\0';
+	}
+	return terms;
+}
+
+// 函数：取得含 terms 个词条件的子串扫描语句（count 非 0 时为计数语句）
+// 语句文本只生成一次并一直保留，语句缓存按指针复用已编译的语句
+const char *search_scan_sql(int terms, int count) {
+	static char sql[2][MAX_SEARCH_SCAN_TERMS][SEARCH_SCAN_SQL_SIZE];
+	char *out = sql[count != 0][terms - 1];
+	if (out[0] == '\0') {
+		int first = count ? 3 : 5;
+		size_t len = snprintf(out, SEARCH_SCAN_SQL_SIZE, "%s", count ? SQL_COUNT_SEARCH_SCAN_HEAD : SQL_SEARCH_MESSAGES_SCAN_HEAD);
+		for (int i = 0; i < terms; i++) {
+			len += snprintf(out + len, SEARCH_SCAN_SQL_SIZE - len, SQL_SEARCH_SCAN_TERM, first + i, first + i);
+		}
+		snprintf(out + len, SEARCH_SCAN_SQL_SIZE - len, "%s", count ? ";" : SQL_SEARCH_MESSAGES_SCAN_TAIL);
+	}
+	return out;
+}
+
+// 每个字节最多转义成两个字节，另加引号、空格和通配符
+#define SEARCH_MATCH_SIZE (MAX_SEARCH_QUERY_LENGTH * 3 + 8)
+
+// 函数：准备热表搜索语句并绑定参数（多取一条结果，用于判断是否还有下一页），只搜索 ID 大于 after_id 的消息
+int search_prepare(sqlite3 *db, const char *q, int limit, long long offset, long long after_id, sqlite3_stmt **stmt) {
+	char match[SEARCH_MATCH_SIZE];
+	const char *patterns[MAX_SEARCH_SCAN_TERMS];
+	int terms = 0;
+	int use_index = build_search_match(q, match, sizeof(match));
+	if (!use_index) terms = build_search_patterns(q, match, sizeof(match), patterns);
+	if (!use_index && terms == 0) return SQLITE_MISUSE;
+
+	int rc = db_prepare(db, use_index ? SQL_SEARCH_MESSAGES : search_scan_sql(terms, 0), stmt);
+	if (rc != SQLITE_OK) return rc;
+	if (use_index) sqlite3_bind_text(*stmt, 1, match, -1, SQLITE_TRANSIENT);
+	for (int i = 0; i < terms; i++) sqlite3_bind_text(*stmt, 5 + i, patterns[i], -1, SQLITE_TRANSIENT);
+	sqlite3_bind_int(*stmt, 2, limit + 1);
+	sqlite3_bind_int64(*stmt, 3, offset);
+	sqlite3_bind_int64(*stmt, 4, after_id);
+	return SQLITE_OK;
+}
+
+// 函数：统计热表中的匹配数量（offset 越过热表结果时用于计算归档部分的偏移）
+long long search_count(sqlite3 *db, const char *q, long long after_id) {
+	char match[SEARCH_MATCH_SIZE];
+	const char *patterns[MAX_SEARCH_SCAN_TERMS];
+	int terms = 0;
+	int use_index = build_search_match(q, match, sizeof(match));
+	if (!use_index) terms = build_search_patterns(q, match, sizeof(match), patterns);
+	if (!use_index && terms == 0) return 0;
+
+	sqlite3_stmt *stmt;
+	long long total = 0;
+	if (db_prepare(db, use_index ? SQL_COUNT_SEARCH : search_scan_sql(terms, 1), &stmt) != SQLITE_OK) return 0;
+	if (use_index) sqlite3_bind_text(stmt, 1, match, -1, SQLITE_TRANSIENT);
+	for (int i = 0; i < terms; i++) sqlite3_bind_text(stmt, 3 + i, patterns[i], -1, SQLITE_TRANSIENT);
+	sqlite3_bind_int64(stmt, 2, after_id);
+	if (sqlite3_step(stmt) == SQLITE_ROW) total = sqlite3_column_int64(stmt, 0);
+	db_finalize(stmt);
+	return total;
+}
+
+// 函数：处理搜索请求，结果直接从查询行流式输出
+int handle_search_messages() {
+	const char *query_string = getenv("QUERY_STRING");
+	char q[MAX_SEARCH_QUERY_LENGTH + 2]; // 多留一个字节用于发现过长的查询
+	if (!get_query_param(query_string, "q", q, sizeof(q)) || q[strspn(q, " \t\r\n")] == '\0') {
+		send_fixed_response(400, "Bad Request", JSON_ERROR("Search query is empty."));
+		return 1;
+	}
+	if (strlen(q) > MAX_SEARCH_QUERY_LENGTH) {
+		send_fixed_response(400, "Bad Request", JSON_ERROR("Search query is too long."));
+		return 1;
+	}
+
+	int limit = SEARCH_PAGE_SIZE;
+	long long offset = 0;
+	char num[24];
+	if (get_query_param(query_string, "limit", num, sizeof(num))) {
+		limit = atoi(num);
+		if (limit <= 0) limit = SEARCH_PAGE_SIZE;
+		if (limit > MAX_SEARCH_PAGE_SIZE) limit = MAX_SEARCH_PAGE_SIZE;
+	}
+	if (get_query_param(query_string, "offset", num, sizeof(num))) {
+		offset = atoll(num);
+		if (offset < 0) offset = 0;
+	}
+
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	if (db_acquire_room(&db) != SQLITE_OK) {
+		send_fixed_response(500, "Internal Server Error", JSON_ERROR("Can't open database."));
+		return 1;
+	}
+	// 已归档的消息由归档部分负责，热表只搜索之后的消息
+	long long start = timer_now();
+	long long archived_id = archive_latest(NULL, 0);
+	if (search_prepare(db, q, limit, offset, archived_id, &stmt) != SQLITE_OK) {
+		db_release(db);
+		send_fixed_response(500, "Internal Server Error", JSON_ERROR("Failed to prepare statement"));
+		return 1;
+	}
+
+	// 先取第一行，查询出错时还能返回错误响应
+	int rc = sqlite3_step(stmt);
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		db_finalize(stmt);
+		db_release(db);
+		send_fixed_response(500, "Internal Server Error", JSON_ERROR("Search failed."));
+		return 1;
+	}
+
+	timer_add(PHASE_QUERY, start);
+
+	FILE *out = response_begin(200, "OK", "Cache-Control: no-cache\r\n", "application/json");
+	start = timer_now();
+	fputs(MESSAGES_JSON_PREFIX, out);
+	int count = 0;
+	for (; rc == SQLITE_ROW && count < limit; rc = sqlite3_step(stmt)) {
+		if (count++ > 0) putc(',', out);
+		json_write_message(out, stmt);
+	}
+	int more = rc == SQLITE_ROW;
+	db_finalize(stmt);
+
+	// 热表的结果已经全部给出，本页剩余部分从归档中查找
+	if (!more && count < limit && archived_id > 0) {
+		long long hot_total = offset + count;
+		if (count == 0 && offset > 0) hot_total = search_count(db, q, archived_id);
+		long long skip = offset > hot_total ? offset - hot_total : 0;
+		count += archive_search(out, q, skip, limit - count, count, &more);
+	}
+	db_release(db);
+	timer_add(PHASE_QUERY, start);
+
+	// 还有更多结果时给出下一页的 offset，否则为 null
+	if (more) {
+		fprintf(out, "],\"next_offset\":%lld}\n", offset + count);
+	} else {
+		fputs("],\"next_offset\":null}\n", out);
+	}
+	response_end();
+	return 0;
+}
+
+// ========== 新消息通知与推送（Server-Sent Events） ==========
+// POST 写入成功后改写通知文件，推送连接通过 inotify 监视该文件，无需轮询数据库
+
+#define STREAM_TIMEOUT_SECONDS 55 // 单个推送连接的最长保持时间，超时后由浏览器自动重连
+#define STREAM_HEARTBEAT_SECONDS 15 // 空闲时发送心跳的间隔，用于发现已断开的连接
+#define STREAM_FALLBACK_POLL_MS 1000 // 无法使用 inotify 时检查新消息的间隔
+
+// 函数：通知推送连接有新消息（写入最新消息 ID 并关闭文件，触发 IN_CLOSE_WRITE）
+void notify_new_message(long long message_id) {
+	int fd = open(g_room.notify_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open notify file %s.\n", g_room.notify_path);
+		return;
+	}
+	char id_str[24];
+	int len = snprintf(id_str, sizeof(id_str), "%lld\n", message_id);
+	if (write(fd, id_str, len) != len) {
+		fprintf(stderr, "Failed to write notify file %s.\n", g_room.notify_path);
+	}
+	close(fd);
+}
+
+// 函数：创建监视通知文件的 inotify 描述符，失败时返回 -1（调用方退回定时检查）
+static int open_message_notifier() {
+	int fd = open(g_room.notify_path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP); // 确保通知文件存在
+	if (fd >= 0) close(fd);
+
+	int notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (notify_fd < 0) return -1;
+	if (inotify_add_watch(notify_fd, g_room.notify_path, IN_CLOSE_WRITE | IN_MODIFY) < 0) {
+		close(notify_fd);
+		return -1;
+	}
+	return notify_fd;
+}
+
+// 函数：等待新消息通知，最多等待 timeout_ms 毫秒；有通知返回 1，超时返回 0
+static int wait_for_message_notification(int notify_fd, int timeout_ms) {
+	if (notify_fd < 0) {
+		// 没有 inotify 时按固定间隔醒来，由调用方重新查询
+		poll(NULL, 0, timeout_ms < STREAM_FALLBACK_POLL_MS ? timeout_ms : STREAM_FALLBACK_POLL_MS);
+		return 1;
+	}
+
+	struct pollfd pfd = { .fd = notify_fd, .events = POLLIN };
+	int ready = poll(&pfd, 1, timeout_ms);
+	if (ready <= 0) return 0;
+
+	// 读空事件队列，多次写入只触发一次查询
+	char events[4096];
+	while (read(notify_fd, events, sizeof(events)) > 0);
+	return 1;
+}
+
+// 函数：把 ID 大于 *last_id 的消息作为 SSE 事件发送，并推进 *last_id
+// 返回发送的消息数量，写入失败（客户端已断开）时返回 -1
+static int stream_send_messages(sqlite3 *db, long long *last_id) {
+	sqlite3_stmt *stmt;
+	const char *sql = "SELECT id, timestamp, ip, username, message FROM messages WHERE id > ? ORDER BY id ASC LIMIT ?;";
+	if (db_prepare(db, sql, &stmt) != SQLITE_OK) return -1;
+	sqlite3_bind_int64(stmt, 1, *last_id);
+	sqlite3_bind_int(stmt, 2, MAX_MESSAGES_GET);
+
+	int count = 0;
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		*last_id = sqlite3_column_int64(stmt, 0);
+		// JSON 输出不含换行，可以直接作为一行 data
+		printf("id: %lld\ndata: ", *last_id);
+		json_write_message(stdout, stmt);
+		printf("\n\n");
+		count++;
+	}
+	db_finalize(stmt);
+
+	if (fflush(stdout) != 0) return -1;
+	return count;
+}
+
+// 处理推送请求（GET action=stream）：以 text/event-stream 持续推送新消息
+int handle_stream_messages() {
+	sqlite3 *db;
+	int rc;
+
+	// 浏览器重连时通过 Last-Event-ID 告知已收到的最后一条消息，优先于 since 参数
+	long long last_id = 0;
+	char since_str[32];
+	const char *last_event_id = getenv("HTTP_LAST_EVENT_ID");
+	if (last_event_id != NULL && *last_event_id) {
+		last_id = atoll(last_event_id);
+	} else if (get_query_param(getenv("QUERY_STRING"), "since", since_str, sizeof(since_str))) {
+		last_id = atoll(since_str);
+	}
+	if (last_id < 0) last_id = 0;
+
+	rc = db_acquire_room(&db);
+	if (rc) {
+		send_fixed_response(500, "Internal Server Error", JSON_ERROR("Can't open database."));
+		return 1;
+	}
+
+	// 先建立监视再查询，避免漏掉两者之间写入的消息
+	int notify_fd = open_message_notifier();
+
+	printf("Status: 200 OK\r\n");
+	printf("Content-type: text/event-stream\r\n");
+	printf("Cache-Control: no-cache\r\n\r\n");
+	printf("retry: 3000\n\n"); // 连接断开后浏览器的重连间隔
+
+	time_t deadline = time(NULL) + STREAM_TIMEOUT_SECONDS;
+	for (;;) {
+		int sent = stream_send_messages(db, &last_id);
+		if (sent < 0) break;
+		if (sent == MAX_MESSAGES_GET) continue; // 还有积压的消息，继续发送
+
+		long remaining = deadline - time(NULL);
+		if (remaining <= 0) break;
+		int wait_seconds = remaining < STREAM_HEARTBEAT_SECONDS ? remaining : STREAM_HEARTBEAT_SECONDS;
+		if (wait_for_message_notification(notify_fd, wait_seconds * 1000) == 0) {
+			printf(": keepalive\n\n");
+			if (fflush(stdout) != 0) break;
+		}
+	}
+
+	if (notify_fd >= 0) close(notify_fd);
+	db_release(db);
+	return 0;
+}
+
+// 函数：清理旧消息，只保留最新的 CHAT_MAX_MESSAGES 条；new_id 为刚写入的最后一条消息，count 为本次写入的条数
+// 消息 ID 单调递增，按主键范围删除只触及被删除的行，耗时与保留数量无关；
+// 只在写入的 ID 跨过 CHAT_PRUNE_INTERVAL 的倍数时执行，表中最多多出 CHAT_PRUNE_INTERVAL - 1 条消息；
+// 启用归档时被清理的消息先按整块写入归档，不足一块的部分暂时留在表中
+int prune_old_messages(sqlite3 *db, long long new_id, int count) {
+	int interval = config_int("CHAT_PRUNE_INTERVAL", PRUNE_INTERVAL);
+	if (new_id / interval == (new_id - count) / interval) return SQLITE_OK;
+
+	long long delete_upto = new_id - config_int("CHAT_MAX_MESSAGES", MAX_MESSAGES_POST);
+	if (archive_enabled()) {
+		// 只删除已经写入归档的消息；归档失败时保留在热表中，下次清理时再试
+		delete_upto = archive_messages(db, delete_upto);
+		if (delete_upto <= 0) return SQLITE_OK;
+	}
+
+	sqlite3_stmt *stmt;
+	const char *sql_delete_old = "DELETE FROM messages WHERE id <= ?;";
+	int rc = db_prepare(db, sql_delete_old, &stmt);
+	if (rc != SQLITE_OK) return rc;
+	sqlite3_bind_int64(stmt, 1, delete_upto);
+	rc = sqlite3_step(stmt);
+	db_finalize(stmt);
+	return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// ========== 只读副本（变更日志复制） ==========
+// 主实例设置 CHAT_CHANGELOG=1 后，每次提交都把新消息按 ID 顺序追加到聊天室的变更日志（<数据库>.changes）。
+// 只读副本设置 CHAT_REPLICA_OF=<主实例的数据目录>（本机目录或共享目录），由 chat_handler.cgi --replicate
+// 进程跟踪其中各聊天室的变更日志，把消息按原 ID 写入副本自己数据目录中的数据库，再像主实例一样清理旧消息、
+// 发布共享环、重建快照并通知推送连接。副本上的 GET、翻页、搜索和推送都读取副本自己的数据，
+// 代码路径与主实例相同；发送消息和账户操作返回 403，应发往主实例。
+// 追加在日志的文件锁内进行，每次都从数据库读取 ID 大于日志末尾的全部消息，所以日志有序、不重复，
+// 某次提交后没能追加（例如进程崩溃）的消息由下一次提交补上。文件头中的 end 只在记录写完之后才更新，
+// 副本只读取 end 之前的部分，不会看到写了一半的记录；写了一半的内容由下一次追加覆盖。
+// 日志超过 CHANGELOG_ROTATE_SIZE 时，当前文件成为 <数据库>.changes.1（替换更早的一段），再开始新文件。
+// 新副本从两段日志中最早的记录开始应用，更早的消息（以及已经归档的历史）不会复制；默认设置下两段日志
+// 远多于热表保留的消息。副本也设置 CHAT_CHANGELOG=1 时会继续生成日志，可以级联复制。
+// 副本的每个响应都带有复制延迟：X-Replication-Behind 为主实例日志中尚未应用的消息数，
+// X-Replication-Lag 为其中最早一条追加到日志至今的毫秒数（已追上时为 0）。
+
+#define CHANGELOG_MAGIC 0x3147484354414843ULL // 变更日志文件头的格式标识（"CHATCHG1"）
+#define CHANGELOG_RECORD_MAGIC 0x52434843U // 记录的起始标识（"CHCR"）
+#define CHANGELOG_ROTATE_SIZE (4 * 1024 * 1024) // 日志超过该大小后轮换
+#define CHANGELOG_READ_BYTES (1024 * 1024) // 副本每个事务最多读取的字节数
+#define CHANGELOG_MAX_RECORD 65536 // 一条记录可变部分的长度上限（用于发现损坏）
+#define REPLICA_POLL_MS 1000 // 副本在没有 inotify 事件时检查日志的间隔
+
+// 变更日志文件头（原生字节序）
+struct changelog_header {
+	unsigned long long magic;
+	long long last_id; // 日志中最新的消息 ID
+	long long last_ms; // 最近一次追加的时间（毫秒，CLOCK_REALTIME）
+	long long end; // 完整记录的结尾，之后的内容无效
+};
+
+// 每条消息一条记录，固定部分之后依次是 IP、用户名和消息内容，各以 '\0' 结尾
+struct changelog_record {
+	unsigned int magic;
+	unsigned int length; // 可变部分的字节数
+	unsigned int crc; // 固定部分（crc 取 0）与可变部分的 CRC-32
+	unsigned int reserved;
+	long long id;
+	long long timestamp;
+	long long shipped_ms; // 追加到日志的时间（毫秒，CLOCK_REALTIME）
+};
+
+// 副本跟踪的一个聊天室
+struct replica_room {
+	char file[64]; // 数据库文件名（主实例与副本相同）
+	int fd; // 正在读取的日志段，-1 表示尚未打开
+	ino_t ino;
+	long long offset; // 下一条要读取的记录在日志段中的位置
+	long long applied_id; // 副本数据库中最新的消息 ID，-1 表示尚未读取
+	int dirty; // 收到了日志的修改事件，本轮需要检查
+};
+
+static const char *SQL_SELECT_CHANGES = "SELECT id, timestamp, ip, username, message FROM messages WHERE id > ? ORDER BY id;";
+static const char *SQL_REPLICA_INSERT = "INSERT OR IGNORE INTO messages (id, timestamp, ip, username, message) VALUES (?, ?, ?, ?, ?);";
+
+// 函数：当前时间（毫秒，CLOCK_REALTIME；主实例和副本的进程之间可以比较）
+static long long wall_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// 函数：本实例是否为只读副本（设置了 CHAT_REPLICA_OF）
+int replica_mode() {
+	const char *source = getenv("CHAT_REPLICA_OF");
+	return source != NULL && *source != '\0';
+}
+
+// 函数：生成主实例目录中与当前聊天室对应的文件路径（文件名与副本相同，目录为 CHAT_REPLICA_OF）
+static void replica_source_path(const char *suffix, char *path, size_t size) {
+	const char *name = strrchr(g_room.db_path, '/');
+	snprintf(path, size, "%s/%s%s", getenv("CHAT_REPLICA_OF"), name != NULL ? name + 1 : g_room.db_path, suffix);
+}
+
+// 函数：计算记录的 CRC（crc 字段取 0）
+static unsigned int changelog_crc(const struct changelog_record *record, const void *fields, size_t len) {
+	struct changelog_record copy = *record;
+	copy.crc = 0;
+	uLong crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)&copy, sizeof(copy));
+	return (unsigned int)crc32(crc, fields, len);
+}
+
+// 函数：打开当前聊天室的变更日志并加锁，文件不存在时创建（写入文件头）；失败返回 -1
+static int changelog_open_locked() {
+	for (int attempt = 0; attempt < 4; attempt++) {
+		int fd = open(g_room.changelog_path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+		if (fd < 0) return -1;
+		struct stat fd_st, path_st;
+		if (flock(fd, LOCK_EX) != 0 || fstat(fd, &fd_st) != 0) {
+			close(fd);
+			return -1;
+		}
+		if (stat(g_room.changelog_path, &path_st) != 0 || path_st.st_ino != fd_st.st_ino) {
+			close(fd); // 等锁期间日志被轮换了，重新打开
+			continue;
+		}
+		if (fd_st.st_size == 0) {
+			struct changelog_header header = {CHANGELOG_MAGIC, 0, 0, sizeof(struct changelog_header)};
+			if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+				close(fd);
+				return -1;
+			}
+		}
+		return fd;
+	}
+	return -1;
+}
+
+// 函数：轮换变更日志：当前文件成为 .changes.1，新文件只有文件头（沿用最新 ID）。
+// 新文件先写好再改名替换，其他进程任何时候打开的都是完整的日志；调用方持有当前文件的锁
+static void changelog_rotate(const struct changelog_header *current) {
+	struct changelog_header header = *current;
+	header.end = sizeof(header);
+	char tmp_path[ROOM_PATH_SIZE + 8];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", g_room.changelog_path);
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	if (fd < 0) return;
+	int ok = pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+	close(fd);
+	unlink(g_room.changelog_old_path);
+	if (!ok || link(g_room.changelog_path, g_room.changelog_old_path) != 0 || rename(tmp_path, g_room.changelog_path) != 0) {
+		fprintf(stderr, "Failed to rotate changelog %s.\n", g_room.changelog_path);
+		unlink(tmp_path);
+	}
+}
+
+// 函数：把数据库中 ID 大于日志末尾的消息追加到当前聊天室的变更日志（提交之后调用；未设置 CHAT_CHANGELOG 时不做任何事）
+void changelog_ship(sqlite3 *db) {
+	if (!config_int("CHAT_CHANGELOG", 0)) return;
+	int fd = changelog_open_locked();
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open changelog %s.\n", g_room.changelog_path);
+		return;
+	}
+	struct changelog_header header;
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != CHANGELOG_MAGIC) {
+		fprintf(stderr, "Changelog %s is damaged; move it aside to continue.\n", g_room.changelog_path);
+		close(fd);
+		return;
+	}
+
+	sqlite3_stmt *stmt;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&buf, &len);
+	long long now = wall_ms();
+	if (out != NULL && db_prepare(db, SQL_SELECT_CHANGES, &stmt) == SQLITE_OK) {
+		sqlite3_bind_int64(stmt, 1, header.last_id);
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			struct changelog_record record = {CHANGELOG_RECORD_MAGIC, 0, 0, 0, sqlite3_column_int64(stmt, 0),
+			                                  sqlite3_column_int64(stmt, 1), now};
+			char fields[CHANGELOG_MAX_RECORD];
+			for (int i = 2; i <= 4; i++) {
+				const char *value = (const char *)sqlite3_column_text(stmt, i);
+				size_t value_len = value != NULL ? strlen(value) : 0;
+				if (record.length + value_len + 1 > sizeof(fields)) value_len = sizeof(fields) - record.length - 1;
+				memcpy(fields + record.length, value != NULL ? value : "", value_len);
+				fields[record.length + value_len] = '\0';
+				record.length += value_len + 1;
+			}
+			record.crc = changelog_crc(&record, fields, record.length);
+			fwrite(&record, sizeof(record), 1, out);
+			fwrite(fields, 1, record.length, out);
+			header.last_id = record.id;
+		}
+		db_finalize(stmt);
+	}
+	if (out != NULL) fclose(out);
+
+	if (len > 0) {
+		// 先写记录，再更新文件头中的结尾：副本看到的结尾之前一定都是完整的记录
+		long long offset = header.end;
+		header.end += len;
+		header.last_ms = now;
+		if (pwrite(fd, buf, len, offset) != (ssize_t)len || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+			fprintf(stderr, "Failed to write changelog %s.\n", g_room.changelog_path);
+		} else if (header.end >= CHANGELOG_ROTATE_SIZE) {
+			changelog_rotate(&header);
+		}
+	}
+	free(buf);
+	close(fd);
+}
+
+// 函数：计算当前聊天室的复制延迟，生成 g_replication_header（副本上每个请求调用一次，主实例上清空）
+// 只读取副本的进度文件、主实例日志的文件头和第一条未应用的记录，不访问数据库
+void replica_lag_header() {
+	g_replication_header[0] = '\0';
+	if (!replica_mode()) return;
+	long long applied_id = 0, offset = 0;
+	unsigned long long ino = 0;
+	FILE *state = fopen(g_room.replica_path, "r");
+	if (state != NULL) {
+		if (fscanf(state, "%lld %llu %lld", &applied_id, &ino, &offset) != 3) applied_id = 0;
+		fclose(state);
+	}
+	char path[ROOM_PATH_SIZE + MAX_DATA_DIR_LENGTH];
+	replica_source_path(CHANGELOG_SUFFIX, path, sizeof(path));
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct changelog_header header;
+	if (fd < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != CHANGELOG_MAGIC) {
+		if (fd >= 0) close(fd);
+		snprintf(g_replication_header, sizeof(g_replication_header), "X-Replication-Lag: unknown\r\n");
+		return;
+	}
+	long long behind = header.last_id > applied_id ? header.last_id - applied_id : 0;
+	long long lag = 0;
+	if (behind > 0) {
+		// 第一条未应用的记录在副本正在读取的日志段中（当前段，或轮换后的上一段）；两段都不是时按最新的记录计算，结果偏小
+		long long first_ms = header.last_ms;
+		struct changelog_record record;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_ino != ino) {
+			close(fd);
+			replica_source_path(CHANGELOG_OLD_SUFFIX, path, sizeof(path));
+			fd = open(path, O_RDONLY | O_CLOEXEC);
+		}
+		if (fd >= 0 && fstat(fd, &st) == 0 && st.st_ino == ino && pread(fd, &record, sizeof(record), offset) == sizeof(record) &&
+		    record.magic == CHANGELOG_RECORD_MAGIC) {
+			first_ms = record.shipped_ms;
+		}
+		lag = wall_ms() - first_ms;
+		if (lag < 0) lag = 0;
+	}
+	if (fd >= 0) close(fd);
+	snprintf(g_replication_header, sizeof(g_replication_header), "X-Replication-Behind: %lld\r\nX-Replication-Lag: %lld\r\n",
+	         behind, lag);
+}
+
+// 函数：打开副本接下来要读取的日志段：上一段（.changes.1）中有未应用的消息且不是刚读完的那段时先读它，否则读当前段
+static int replica_open_segment(struct replica_room *r) {
+	const char *suffixes[] = {CHANGELOG_OLD_SUFFIX, CHANGELOG_SUFFIX};
+	for (int i = 0; i < 2; i++) {
+		char path[ROOM_PATH_SIZE + MAX_DATA_DIR_LENGTH];
+		replica_source_path(suffixes[i], path, sizeof(path));
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) continue;
+		struct stat st;
+		struct changelog_header header;
+		if (fstat(fd, &st) == 0 && st.st_ino != r->ino && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+		    header.magic == CHANGELOG_MAGIC && (i == 1 || header.last_id > r->applied_id)) {
+			r->fd = fd;
+			r->ino = st.st_ino;
+			r->offset = sizeof(header);
+			return 0;
+		}
+		close(fd);
+	}
+	return -1;
+}
+
+// 函数：记录副本的进度（已应用的最新 ID 和日志中的读取位置），先写临时文件再改名
+static void replica_write_state(const struct replica_room *r) {
+	char tmp_path[ROOM_PATH_SIZE + 8];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", g_room.replica_path);
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+	if (fd < 0) return;
+	int ok = dprintf(fd, "%lld %llu %lld\n", r->applied_id, (unsigned long long)r->ino, r->offset) > 0;
+	if (close(fd) != 0 || !ok || rename(tmp_path, g_room.replica_path) != 0) unlink(tmp_path);
+}
+
+// 函数：在一个事务中应用 buf 中的完整记录（跳过已应用的 ID），返回处理的字节数，日志损坏或写入失败时返回 -1
+static long long replica_apply(sqlite3 *db, struct replica_room *r, const unsigned char *buf, size_t len) {
+	long long start = timer_now();
+	if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK) return -1;
+	sqlite3_stmt *stmt;
+	if (db_prepare(db, SQL_REPLICA_INSERT, &stmt) != SQLITE_OK) {
+		sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+		return -1;
+	}
+	size_t pos = 0;
+	int count = 0, rc = SQLITE_OK;
+	long long new_id = r->applied_id;
+	while (rc == SQLITE_OK && len - pos >= sizeof(struct changelog_record)) {
+		struct changelog_record record;
+		memcpy(&record, buf + pos, sizeof(record));
+		if (record.magic != CHANGELOG_RECORD_MAGIC || record.length > CHANGELOG_MAX_RECORD || record.length < 3) {
+			rc = SQLITE_CORRUPT;
+			break;
+		}
+		if (len - pos - sizeof(record) < record.length) break; // 本次读取的结尾，下一批再处理
+		const char *fields = (const char *)buf + pos + sizeof(record);
+		if (changelog_crc(&record, fields, record.length) != record.crc || fields[record.length - 1] != '\0') {
+			rc = SQLITE_CORRUPT;
+			break;
+		}
+		pos += sizeof(record) + record.length;
+		if (record.id <= new_id) continue;
+		if (new_id > 0 && record.id != new_id + 1) {
+			fprintf(stderr, "Replica of %s missed messages %lld-%lld (changelog rotated past them).\n", r->file, new_id + 1, record.id - 1);
+		}
+		const char *ip = fields, *username = ip + strlen(ip) + 1, *message = username + strlen(username) + 1;
+		sqlite3_bind_int64(stmt, 1, record.id);
+		sqlite3_bind_int64(stmt, 2, record.timestamp);
+		sqlite3_bind_text(stmt, 3, ip, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 4, username, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 5, message, -1, SQLITE_STATIC);
+		rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+		sqlite3_reset(stmt);
+		new_id = record.id;
+		count++;
+	}
+	db_finalize(stmt);
+	timer_add(PHASE_INSERT, start);
+	if (rc == SQLITE_OK && count > 0) {
+		start = timer_now();
+		rc = prune_old_messages(db, new_id, count);
+		timer_add(PHASE_PRUNE, start);
+	}
+	if (rc == SQLITE_OK) rc = sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Failed to apply changelog of %s at offset %lld: %s\n", r->file, r->offset + (long long)pos,
+		        rc == SQLITE_CORRUPT ? "damaged record" : sqlite3_errmsg(db));
+		sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+		return -1;
+	}
+	if (count > 0) {
+		r->applied_id = new_id;
+		ring_note_commit(new_id);
+		start = timer_now();
+		changelog_ship(db); // 级联复制
+		rebuild_snapshot(db);
+		timer_add(PHASE_SNAPSHOT, start);
+		notify_new_message(new_id);
+	}
+	return pos;
+}
+
+// 函数：把一个聊天室在主实例日志中新增的记录全部应用到副本的数据库；读完的日志段已被轮换时接着读下一段
+static void replica_pull(struct replica_room *r, sqlite3 *db, unsigned char *buf) {
+	if (r->applied_id < 0) {
+		sqlite3_stmt *stmt;
+		if (db_prepare(db, "SELECT IFNULL(MAX(id), 0) FROM messages;", &stmt) != SQLITE_OK) return;
+		if (sqlite3_step(stmt) == SQLITE_ROW) r->applied_id = sqlite3_column_int64(stmt, 0);
+		db_finalize(stmt);
+		if (r->applied_id < 0) return;
+	}
+	char path[ROOM_PATH_SIZE + MAX_DATA_DIR_LENGTH];
+	replica_source_path(CHANGELOG_SUFFIX, path, sizeof(path));
+	for (;;) {
+		if (r->fd < 0 && replica_open_segment(r) != 0) return;
+		struct changelog_header header;
+		if (pread(r->fd, &header, sizeof(header), 0) != sizeof(header)) return;
+		if (r->offset < header.end) {
+			size_t len = header.end - r->offset < CHANGELOG_READ_BYTES ? (size_t)(header.end - r->offset) : CHANGELOG_READ_BYTES;
+			ssize_t n = pread(r->fd, buf, len, r->offset);
+			long long used = n > 0 ? replica_apply(db, r, buf, n) : -1;
+			if (used <= 0) return; // 出错时停在这里，下次再试
+			r->offset += used;
+			replica_write_state(r);
+			continue;
+		}
+		// 这一段已经读完；主实例日志已轮换时，重新读一次文件头（轮换之前的最后一次追加），再转到下一段
+		struct stat st;
+		if (stat(path, &st) != 0 || st.st_ino == r->ino) return;
+		if (pread(r->fd, &header, sizeof(header), 0) == sizeof(header) && r->offset < header.end) continue;
+		close(r->fd);
+		r->fd = -1;
+	}
+}
+
+// 函数：查找或添加主实例目录中名为 name 的变更日志对应的聊天室；不是变更日志时返回 NULL
+static struct replica_room *replica_find_room(struct replica_room **rooms, int *count, const char *name) {
+	size_t len = strlen(name), suffix_len = strlen(CHANGELOG_SUFFIX);
+	if (len <= suffix_len || len - suffix_len >= sizeof((*rooms)->file) || strcmp(name + len - suffix_len, CHANGELOG_SUFFIX) != 0) {
+		return NULL;
+	}
+	for (int i = 0; i < *count; i++) {
+		if (strncmp((*rooms)[i].file, name, len - suffix_len) == 0 && (*rooms)[i].file[len - suffix_len] == '\0') return &(*rooms)[i];
+	}
+	struct replica_room *grown = realloc(*rooms, (*count + 1) * sizeof(**rooms));
+	if (grown == NULL) return NULL;
+	*rooms = grown;
+	struct replica_room *r = &grown[(*count)++];
+	memset(r, 0, sizeof(*r));
+	snprintf(r->file, sizeof(r->file), "%.*s", (int)(len - suffix_len), name);
+	r->fd = -1;
+	r->applied_id = -1;
+	r->dirty = 1;
+	return r;
+}
+
+// 用法：CHAT_DATA_DIR=<副本目录> CHAT_REPLICA_OF=<主实例的数据目录> chat_handler.cgi --replicate
+// 函数：副本的复制进程：发现主实例目录中各聊天室的变更日志，日志有追加时（inotify 通知，另外每秒检查一次全部聊天室）
+// 应用到副本的数据库。进度保存在副本的数据库和进度文件中，进程可以随时终止和重新启动
+int run_replicator() {
+	if (!replica_mode()) {
+		fprintf(stderr, "Set CHAT_REPLICA_OF to the primary's data directory.\n");
+		return 1;
+	}
+	const char *source = getenv("CHAT_REPLICA_OF");
+	char source_real[PATH_MAX], own_dir[MAX_DATA_DIR_LENGTH + 1], own_real[PATH_MAX];
+	snprintf(own_dir, sizeof(own_dir), "%.*s", (int)(strrchr(g_db_path, '/') - g_db_path), g_db_path);
+	if (realpath(source, source_real) == NULL) {
+		perror(source);
+		return 1;
+	}
+	if (realpath(own_dir, own_real) != NULL && strcmp(source_real, own_real) == 0) {
+		fprintf(stderr, "CHAT_DATA_DIR must differ from CHAT_REPLICA_OF.\n");
+		return 1;
+	}
+	if (init_database() != 0) {
+		fprintf(stderr, "Failed to initialize database.\n");
+		return 1;
+	}
+	g_db_persistent = 1;
+	unsigned char *buf = malloc(CHANGELOG_READ_BYTES);
+	int notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (buf == NULL) return 1;
+	if (notify_fd >= 0 && inotify_add_watch(notify_fd, source, IN_MODIFY | IN_CREATE | IN_MOVED_TO) < 0) {
+		close(notify_fd);
+		notify_fd = -1;
+	}
+	fprintf(stderr, "Replicating %s into %s.\n", source_real, own_dir);
+
+	struct replica_room *rooms = NULL;
+	int room_count = 0;
+	long long last_scan = 0;
+	for (;;) {
+		long long now = timer_now() / 1000000;
+		if (now - last_scan >= REPLICA_POLL_MS) {
+			// 定期重新扫描目录并检查全部聊天室（新聊天室、漏掉的事件、无法使用 inotify）
+			last_scan = now;
+			DIR *dir = opendir(source);
+			struct dirent *entry;
+			while (dir != NULL && (entry = readdir(dir)) != NULL) replica_find_room(&rooms, &room_count, entry->d_name);
+			if (dir != NULL) closedir(dir);
+			for (int i = 0; i < room_count; i++) rooms[i].dirty = 1;
+		}
+		for (int i = 0; i < room_count; i++) {
+			if (!rooms[i].dirty) continue;
+			rooms[i].dirty = 0;
+			char db_path[ROOM_PATH_SIZE];
+			snprintf(db_path, sizeof(db_path), "%s/%s", own_dir, rooms[i].file);
+			room_set_paths("", db_path);
+			sqlite3 *db;
+			if (db_acquire_room(&db) != SQLITE_OK) continue;
+			replica_pull(&rooms[i], db, buf);
+			db_release(db);
+		}
+
+		struct pollfd pfd = {.fd = notify_fd, .events = POLLIN};
+		int timeout = REPLICA_POLL_MS - (int)(timer_now() / 1000000 - last_scan);
+		if (poll(&pfd, notify_fd >= 0 ? 1 : 0, timeout > 0 ? timeout : 0) > 0) {
+			char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+			ssize_t n;
+			while ((n = read(notify_fd, events, sizeof(events))) > 0) {
+				for (char *p = events; p < events + n;) {
+					const struct inotify_event *event = (const struct inotify_event *)p;
+					struct replica_room *r = event->len > 0 ? replica_find_room(&rooms, &room_count, event->name) : NULL;
+					if (r != NULL) r->dirty = 1;
+					p += sizeof(struct inotify_event) + event->len;
+				}
+			}
+		}
+	}
+}
+
+// ========== 写入队列（组提交） ==========
+// POST 把校验过的消息作为一条记录追加到聊天室的队列文件（<数据库>.queue，O_APPEND），落盘后即可确认。
+// 同一时刻只有一个进程担任刷新者（对 <数据库>.queue.lock 加 flock），把尚未提交的记录分批写入数据库，
+// 每批一个事务；清理、快照重建和推送通知也按批进行，而不是每个 POST 各做一次。
+// 追加完记录的进程随后尝试成为刷新者：拿到锁就自己提交（低负载时与直接写入相同）；拿不到锁说明已有刷新者，
+// 它释放锁之后会再检查一次队列，不会漏掉刚追加的记录。
+// 已提交到的位置与消息在同一个事务中写入 write_queue 表，崩溃后从这里重放，消息既不丢失也不重复。
+// 每条记录带 CRC；崩溃时写了一半的记录从未被确认，刷新时跳过。
+// 文件头中有一个随机纪元。全部提交且文件超过 QUEUE_COMPACT_SIZE 时，用新纪元的空文件替换；
+// 数据库中的纪元与文件不同就说明文件已被替换，从头读取。
+// CHAT_WRITE_QUEUE 选择确认前的持久性：
+//   write（默认）：write(2) 完成即确认，进程崩溃不丢消息，与数据库的 synchronous=NORMAL 相当；
+//   fsync：fdatasync 之后才确认，断电也不丢已确认的消息；
+//   off：不使用队列，每个 POST 在自己的事务中直接写入。
+
+#define QUEUE_MAGIC 0x3145555154414843ULL // 队列文件头的格式标识（"CHATQUE1"）
+#define QUEUE_RECORD_MAGIC 0x52514843U // 记录的起始标识（"CHQR"）
+#define QUEUE_FLUSH_BYTES (1024 * 1024) // 刷新者每个事务最多读取的字节数
+#define QUEUE_COMPACT_SIZE (4 * 1024 * 1024) // 全部提交后队列文件超过该大小时替换为空文件
+#define QUEUE_FIELD_SIZE 256 // 记录中 IP 和用户名的最大长度（含结尾的 '\0'）
+
+enum {
+	QUEUE_OFF,
+	QUEUE_WRITE,
+	QUEUE_FSYNC
+};
+
+// 队列文件头（原生字节序）
+struct queue_header {
+	unsigned long long magic;
+	unsigned long long epoch; // 随机纪元，文件被替换时改变
+	unsigned long long applied; // 最近一次提交到的位置，只用于快速判断有无待提交的记录，以数据库中的为准
+	unsigned long long reserved;
+};
+
+// 每条记录的固定部分，之后依次是 IP、用户名和 count 条消息，各以 '\0' 结尾
+struct queue_record {
+	unsigned int magic;
+	unsigned int length; // 可变部分的字节数
+	unsigned int crc; // 固定部分（crc 取 0）与可变部分的 CRC-32
+	unsigned int count; // 消息条数
+	long long timestamp;
+};
+
+#define QUEUE_MAX_RECORD (sizeof(struct queue_record) + 2 * QUEUE_FIELD_SIZE + MAX_BATCH_MESSAGES * (MAX_MESSAGE_LENGTH + 1))
+
+static const char *SQL_INSERT_MESSAGE = "INSERT INTO messages (timestamp, ip, username, message) VALUES (?, ?, ?, ?);";
+
+// 函数：读取 CHAT_WRITE_QUEUE，返回 QUEUE_OFF、QUEUE_WRITE 或 QUEUE_FSYNC
+int queue_mode() {
+	const char *value = getenv("CHAT_WRITE_QUEUE");
+	if (value == NULL || *value == '\0' || strcmp(value, "write") == 0) return QUEUE_WRITE;
+	if (strcmp(value, "fsync") == 0) return QUEUE_FSYNC;
+	if (strcmp(value, "off") == 0 || strcmp(value, "0") == 0) return QUEUE_OFF;
+	fprintf(stderr, "Unknown CHAT_WRITE_QUEUE value %s; using write.\n", value);
+	return QUEUE_WRITE;
+}
+
+// 函数：用已准备好的插入语句在当前事务中写入同一个用户的一批消息，返回 SQLite 返回码
+int insert_messages(sqlite3_stmt *stmt, long long timestamp, const char *ip, const char *username, char **messages, int count) {
+	for (int i = 0; i < count; i++) {
+		sqlite3_bind_int64(stmt, 1, timestamp); // 绑定时间戳
+		sqlite3_bind_text(stmt, 2, ip, -1, SQLITE_STATIC); // 绑定用户 IP
+		sqlite3_bind_text(stmt, 3, username, -1, SQLITE_STATIC); // 绑定用户名
+		sqlite3_bind_text(stmt, 4, messages[i], -1, SQLITE_STATIC); // 绑定消息内容
+		int rc = sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+		if (rc != SQLITE_DONE) return rc;
+	}
+	return SQLITE_OK;
+}
+
+// 函数：同步 path 所在目录，使新建或改名的文件在断电后仍然存在
+static void fsync_parent_dir(const char *path) {
+	char dir[ROOM_PATH_SIZE];
+	const char *slash = strrchr(path, '/');
+	snprintf(dir, sizeof(dir), "%.*s", slash == NULL ? 1 : (int)(slash - path + (slash == path)), slash == NULL ? "." : path);
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) return;
+	fsync(fd);
+	close(fd);
+}
+
+// 函数：创建只有文件头（新的随机纪元）的队列文件，先写临时文件再放到位，其他进程不会看到没有文件头的队列
+// replace 为 0 时只在队列不存在时创建（已被其他进程创建也算成功），为 1 时替换现有队列
+static int queue_create(int replace) {
+	struct queue_header header = {QUEUE_MAGIC, 0, sizeof(struct queue_header), 0};
+	int random_fd = open("/dev/urandom", O_RDONLY);
+	if (random_fd < 0 || read(random_fd, &header.epoch, sizeof(header.epoch)) != sizeof(header.epoch)) {
+		header.epoch = (unsigned long long)timer_now() ^ ((unsigned long long)getpid() << 32);
+	}
+	if (random_fd >= 0) close(random_fd);
+
+	char tmp_path[ROOM_PATH_SIZE + 24];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", g_room.queue_path, (int)getpid());
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	if (fd < 0) return 1;
+	fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	int ok = write(fd, &header, sizeof(header)) == sizeof(header) && fdatasync(fd) == 0;
+	close(fd);
+	if (ok) {
+		ok = replace ? rename(tmp_path, g_room.queue_path) == 0
+		             : link(tmp_path, g_room.queue_path) == 0 || errno == EEXIST;
+	}
+	unlink(tmp_path);
+	if (ok) fsync_parent_dir(g_room.queue_path);
+	return ok ? 0 : 1;
+}
+
+// 函数：把一批消息作为一条记录追加到当前聊天室的写入队列，按 mode 的要求落盘后返回 0，失败返回 1
+// 整条记录由一次 writev 写入，O_APPEND 保证并发追加的记录互不交错
+int queue_append(int mode, long long timestamp, const char *ip, const char *username, char **messages, int count) {
+	struct queue_record record = {QUEUE_RECORD_MAGIC, 0, 0, (unsigned int)count, timestamp};
+	char ip_field[QUEUE_FIELD_SIZE], username_field[QUEUE_FIELD_SIZE];
+	snprintf(ip_field, sizeof(ip_field), "%s", ip);
+	snprintf(username_field, sizeof(username_field), "%s", username);
+
+	struct iovec iov[3 + MAX_BATCH_MESSAGES];
+	int iov_count = 0;
+	iov[iov_count++] = (struct iovec){&record, sizeof(record)};
+	iov[iov_count++] = (struct iovec){ip_field, strlen(ip_field) + 1};
+	iov[iov_count++] = (struct iovec){username_field, strlen(username_field) + 1};
+	for (int i = 0; i < count; i++) {
+		iov[iov_count++] = (struct iovec){messages[i], strlen(messages[i]) + 1};
+	}
+	for (int i = 1; i < iov_count; i++) record.length += iov[i].iov_len;
+	uLong crc = crc32(0L, Z_NULL, 0);
+	for (int i = 0; i < iov_count; i++) crc = crc32(crc, iov[i].iov_base, iov[i].iov_len);
+	record.crc = (unsigned int)crc;
+
+	for (int attempt = 0; attempt < 4; attempt++) {
+		int fd = open(g_room.queue_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+		if (fd < 0) {
+			if (errno != ENOENT || queue_create(0) != 0) return 1;
+			continue;
+		}
+		// 持有共享锁期间刷新者不会替换文件，也不会把正在写入的记录当作损坏
+		struct stat fd_st, path_st;
+		if (flock(fd, LOCK_SH) != 0 || fstat(fd, &fd_st) != 0) {
+			close(fd);
+			return 1;
+		}
+		if (stat(g_room.queue_path, &path_st) != 0 || path_st.st_ino != fd_st.st_ino) {
+			close(fd); // 打开之后文件被刷新者替换了，重新打开
+			continue;
+		}
+		ssize_t written = writev(fd, iov, iov_count);
+		int ok = written == (ssize_t)(sizeof(record) + record.length) && (mode != QUEUE_FSYNC || fdatasync(fd) == 0);
+		close(fd);
+		return ok ? 0 : 1;
+	}
+	return 1;
+}
+
+// 函数：检查 buf 开头是否为一条完整有效的记录，是则返回记录的总长度，不完整或损坏时返回 0
+static size_t queue_record_size(const unsigned char *buf, size_t len) {
+	struct queue_record record;
+	if (len < sizeof(record)) return 0;
+	memcpy(&record, buf, sizeof(record));
+	if (record.magic != QUEUE_RECORD_MAGIC || record.count == 0 || record.count > MAX_BATCH_MESSAGES ||
+	    record.length > QUEUE_MAX_RECORD || len - sizeof(record) < record.length || record.length == 0) {
+		return 0;
+	}
+	unsigned int crc = record.crc;
+	record.crc = 0;
+	uLong actual = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)&record, sizeof(record));
+	actual = crc32(actual, buf + sizeof(record), record.length);
+	if ((unsigned int)actual != crc) return 0;
+
+	// 可变部分必须恰好是 count + 2 个以 '\0' 结尾的字符串
+	const unsigned char *p = buf + sizeof(record), *end = p + record.length;
+	unsigned int strings = 0;
+	while (p < end && (p = memchr(p, '\0', end - p)) != NULL) {
+		p++;
+		strings++;
+	}
+	if (strings != record.count + 2 || end[-1] != '\0') return 0;
+	return sizeof(record) + record.length;
+}
+
+// 函数：读取数据库中记录的已提交位置；纪元与队列文件不同（文件已被替换）时从文件头之后开始
+static long long queue_applied(sqlite3 *db, unsigned long long epoch) {
+	sqlite3_stmt *stmt;
+	if (db_prepare(db, "SELECT epoch, applied FROM write_queue;", &stmt) != SQLITE_OK) return -1;
+	long long applied = sizeof(struct queue_header);
+	if (sqlite3_step(stmt) == SQLITE_ROW && (unsigned long long)sqlite3_column_int64(stmt, 0) == epoch &&
+	    sqlite3_column_int64(stmt, 1) > applied) {
+		applied = sqlite3_column_int64(stmt, 1);
+	}
+	db_finalize(stmt);
+	return applied;
+}
+
+// 函数：offset 处没有完整有效的记录时调用，返回刷新应当继续的位置
+// 先加排他锁等待正在进行的追加完成，记录变得有效就返回 offset；
+// 否则是崩溃时写了一半的记录（从未被确认），向后查找下一条有效记录，找不到时跳到文件末尾
+static long long queue_skip_damaged(int fd, long long offset, unsigned char *buf) {
+	struct stat st;
+	if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0) return -1;
+	long long next = offset;
+	while (next < st.st_size) {
+		size_t len = st.st_size - next < QUEUE_FLUSH_BYTES ? (size_t)(st.st_size - next) : QUEUE_FLUSH_BYTES;
+		ssize_t n = pread(fd, buf, len, next);
+		if (n <= 0) {
+			next = -1;
+			break;
+		}
+		size_t i = 0;
+		while (i < (size_t)n && queue_record_size(buf + i, n - i) == 0) i++;
+		if (i < (size_t)n) {
+			next += i;
+			break;
+		}
+		// 末尾的记录可能跨出本次读取的范围，下一轮从它可能的起点重新查找
+		if (next + n >= st.st_size) {
+			next = st.st_size;
+		} else {
+			next += n - QUEUE_MAX_RECORD;
+		}
+	}
+	flock(fd, LOCK_UN);
+	if (next > offset) {
+		fprintf(stderr, "Write queue %s: skipped %lld damaged bytes at offset %lld.\n", g_room.queue_path, next - offset, offset);
+	}
+	return next;
+}
+
+// 函数：全部记录提交后用空队列替换过大的队列文件
+// 替换之前同步 WAL 文件：synchronous=NORMAL 下提交只写入 WAL，而队列是断电后重放的依据
+static void queue_compact(int fd, off_t size) {
+	struct stat st;
+	if (flock(fd, LOCK_EX) != 0) return;
+	if (fstat(fd, &st) == 0 && st.st_size == size) {
+		char wal_path[ROOM_PATH_SIZE + 8];
+		snprintf(wal_path, sizeof(wal_path), "%s-wal", g_room.db_path);
+		int wal_fd = open(wal_path, O_RDWR);
+		if (wal_fd < 0 || fdatasync(wal_fd) == 0) queue_create(1);
+		if (wal_fd >= 0) close(wal_fd);
+	}
+	flock(fd, LOCK_UN);
+}
+
+// 函数：把队列中尚未提交的记录分批写入数据库（调用方持有刷新锁）
+// 返回本次提交的消息条数，出错时返回 -1；有新消息时重建快照并通知推送连接
+static int queue_drain(sqlite3 *db) {
+	int fd = open(g_room.queue_path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) return errno == ENOENT ? 0 : -1;
+	struct queue_header header;
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != QUEUE_MAGIC) {
+		close(fd);
+		fprintf(stderr, "Write queue %s is damaged; move it aside to continue.\n", g_room.queue_path);
+		return -1;
+	}
+	unsigned char *buf = malloc(QUEUE_FLUSH_BYTES);
+	if (buf == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	int total = 0;
+	long long new_id = 0, applied = 0;
+	struct stat st;
+	for (;;) {
+		applied = queue_applied(db, header.epoch);
+		if (applied < 0 || fstat(fd, &st) != 0) {
+			total = -1;
+			break;
+		}
+		if (applied >= st.st_size) break;
+		size_t len = st.st_size - applied < QUEUE_FLUSH_BYTES ? (size_t)(st.st_size - applied) : QUEUE_FLUSH_BYTES;
+		ssize_t n = pread(fd, buf, len, applied);
+		if (n <= 0) {
+			total = -1;
+			break;
+		}
+
+		// 本批包含从 applied 开始连续的完整记录
+		size_t end = 0, size;
+		while ((size = queue_record_size(buf + end, n - end)) > 0) end += size;
+		long long next = applied + end;
+		if (end == 0) {
+			next = queue_skip_damaged(fd, applied, buf);
+			if (next < 0) {
+				total = -1;
+				break;
+			}
+			if (next == applied) continue; // 记录刚写完，重新读取
+		}
+
+		long long start = timer_now();
+		sqlite3_stmt *stmt;
+		if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK) {
+			total = -1;
+			break;
+		}
+		int rc = db_prepare(db, SQL_INSERT_MESSAGE, &stmt);
+		int prepared = rc == SQLITE_OK;
+		int count = 0;
+		for (size_t pos = 0; rc == SQLITE_OK && pos < end; pos += size) {
+			struct queue_record record;
+			memcpy(&record, buf + pos, sizeof(record));
+			size = sizeof(record) + record.length;
+			char *ip = (char *)buf + pos + sizeof(record);
+			char *username = ip + strlen(ip) + 1;
+			char *messages[MAX_BATCH_MESSAGES];
+			messages[0] = username + strlen(username) + 1;
+			for (unsigned int i = 1; i < record.count; i++) messages[i] = messages[i - 1] + strlen(messages[i - 1]) + 1;
+			rc = insert_messages(stmt, record.timestamp, ip, username, messages, record.count);
+			count += record.count;
+		}
+		if (prepared) db_finalize(stmt);
+		long long batch_id = sqlite3_last_insert_rowid(db);
+		if (rc == SQLITE_OK) {
+			sqlite3_stmt *update;
+			rc = db_prepare(db, "UPDATE write_queue SET epoch = ?, applied = ?;", &update);
+			if (rc == SQLITE_OK) {
+				sqlite3_bind_int64(update, 1, (long long)header.epoch);
+				sqlite3_bind_int64(update, 2, next);
+				rc = sqlite3_step(update) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+				db_finalize(update);
+			}
+		}
+		timer_add(PHASE_INSERT, start);
+		if (rc == SQLITE_OK && count > 0) {
+			start = timer_now();
+			rc = prune_old_messages(db, batch_id, count);
+			timer_add(PHASE_PRUNE, start);
+		}
+		if (rc == SQLITE_OK) {
+			start = timer_now();
+			rc = sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+			timer_add(PHASE_INSERT, start);
+		}
+		if (rc != SQLITE_OK) {
+			fprintf(stderr, "Failed to commit queued messages: %s\n", sqlite3_errmsg(db));
+			sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+			total = -1;
+			break;
+		}
+		if (count > 0) {
+			new_id = batch_id;
+			ring_note_commit(new_id);
+		}
+		total += count;
+	}
+
+	if (total >= 0) {
+		// 文件头中的位置只是提示，写失败不影响正确性
+		if (pwrite(fd, &applied, sizeof(applied), offsetof(struct queue_header, applied)) != sizeof(applied)) {
+			fprintf(stderr, "Failed to update write queue header %s.\n", g_room.queue_path);
+		}
+		if (applied == st.st_size && st.st_size >= QUEUE_COMPACT_SIZE) queue_compact(fd, st.st_size);
+	}
+	free(buf);
+	close(fd);
+
+	if (new_id > 0) {
+		// 把新消息追加到变更日志（只读副本据此复制），再重建最新消息快照（失败时 GET 会退回实时查询）
+		long long start = timer_now();
+		changelog_ship(db);
+		rebuild_snapshot(db);
+		timer_add(PHASE_SNAPSHOT, start);
+		// 唤醒正在等待新消息的推送连接
+		notify_new_message(new_id);
+	}
+	return total;
+}
+
+// 函数：检查当前聊天室的写入队列中是否有尚未提交的记录（只读文件头，不访问数据库）
+int queue_pending() {
+	int fd = open(g_room.queue_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+	struct queue_header header;
+	struct stat st;
+	int pending = pread(fd, &header, sizeof(header), 0) == sizeof(header) && fstat(fd, &st) == 0 &&
+	              (unsigned long long)st.st_size > header.applied;
+	close(fd);
+	return pending;
+}
+
+// 函数：尝试成为刷新者并提交队列中的全部记录；已有其他刷新者时立即返回 0（由它负责提交）
+// 释放锁之后总要再检查一次队列（即使这一轮没有提交任何记录）：持锁期间追加的记录，其追加者拿不到锁，只能由这里接着处理
+// 返回提交的消息条数，出错时返回 -1（记录仍在队列中，之后的刷新者会重试）
+int queue_flush(sqlite3 *db) {
+	int lock_fd = open(g_room.queue_lock_path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	if (lock_fd < 0) return -1;
+	int total = 0;
+	while (flock(lock_fd, LOCK_EX | LOCK_NB) == 0) {
+		int n = queue_drain(db);
+		flock(lock_fd, LOCK_UN);
+		if (n < 0) {
+			total = -1;
+			break;
+		}
+		total += n;
+		if (!queue_pending()) break;
+	}
+	close(lock_fd);
+	return total;
+}
+
+// 函数：读取消息之前补交队列中遗留的记录（例如刷新者崩溃），保证已确认的消息可见
+void queue_recover() {
+	if (queue_mode() == QUEUE_OFF || !queue_pending()) return;
+	sqlite3 *db;
+	if (db_acquire_room(&db) != SQLITE_OK) return;
+	queue_flush(db);
+	db_release(db);
+}
+
+// ========== 会话令牌 ==========
+// 登录成功后签发 HMAC-SHA256 签名、带过期时间的会话令牌（Cookie: session）。
+// 发送消息时只需验证签名、过期时间和撤销纪元，不需要查询数据库。
+// 令牌格式：<密钥ID>.<过期时间>.<撤销纪元>.<base64url(用户名)>.<base64url(HMAC)>
+// 修改密码或删除账户时该用户的撤销纪元加一，之前签发的令牌全部失效。
+
+// 签名密钥文件（主数据库路径 + SESSION_KEYS_SUFFIX），每行 "<密钥ID> <十六进制密钥>"，第一行用于签发
+// 撤销纪元文件（主数据库路径 + SESSION_REVOCATIONS_SUFFIX），每行 "<纪元> <base64url(用户名)>"
+#define SESSION_TTL_SECONDS (7 * 24 * 3600) // 令牌有效期，与前端 Cookie 保存时间一致
+#define SESSION_KEY_SIZE 32 // 密钥长度（字节）
+#define SESSION_MAX_KEYS 3 // 轮换时保留的密钥数量（包括当前密钥）
+#define SESSION_TOKEN_SIZE 512 // 令牌缓冲区大小
+
+typedef struct {
+	long id;
+	unsigned char key[SESSION_KEY_SIZE];
+} session_key;
+
+// 函数：base64url 编码（不带填充），返回编码后的长度
+static size_t base64url_encode(const unsigned char *src, size_t len, char *dst) {
+	int n = EVP_EncodeBlock((unsigned char *)dst, src, (int)len);
+	while (n > 0 && dst[n - 1] == '=') n--;
+	for (int i = 0; i < n; i++) {
+		if (dst[i] == '+') dst[i] = '-';
+		else if (dst[i] == '/') dst[i] = '_';
+	}
+	dst[n] = '\0';
+	return n;
+}
+
+// 函数：base64url 解码，dst 至少需要 len * 3 / 4 + 3 字节，失败返回 -1
+static int base64url_decode(const char *src, size_t len, unsigned char *dst) {
+	char buf[SESSION_TOKEN_SIZE];
+	if (len + 4 > sizeof(buf)) return -1;
+	for (size_t i = 0; i < len; i++) {
+		if (src[i] == '-') buf[i] = '+';
+		else if (src[i] == '_') buf[i] = '/';
+		else buf[i] = src[i];
+	}
+	size_t padded = len;
+	while (padded % 4) buf[padded++] = '=';
+	int n = EVP_DecodeBlock(dst, (unsigned char *)buf, (int)padded);
+	if (n < 0) return -1;
+	return n - (int)(padded - len); // EVP_DecodeBlock 把填充也算进长度
+}
+
+// 函数：生成一个新的随机密钥
+static int session_generate_key(unsigned char *key) {
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0) return 1;
+	ssize_t n = read(fd, key, SESSION_KEY_SIZE);
+	close(fd);
+	return n == SESSION_KEY_SIZE ? 0 : 1;
+}
+
+// 函数：把密钥列表写入密钥文件（临时文件 + rename）
+static int session_write_keys(const session_key *keys, int count) {
+	char tmp_path[ROOM_PATH_SIZE + 24];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", g_session_keys_path, (int)getpid());
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR); // 600 权限
+	if (fd < 0) return 1;
+	FILE *fp = fdopen(fd, "w");
+	for (int i = 0; i < count; i++) {
+		fprintf(fp, "%ld ", keys[i].id);
+		for (int j = 0; j < SESSION_KEY_SIZE; j++) fprintf(fp, "%02x", keys[i].key[j]);
+		fputc('\n', fp);
+	}
+	if (fclose(fp) != 0 || rename(tmp_path, g_session_keys_path) != 0) {
+		unlink(tmp_path);
+		return 1;
+	}
+	return 0;
+}
+
+// 函数：读取签名密钥，文件不存在时生成第一个密钥；返回读到的密钥数量，失败返回 0
+static int session_load_keys(session_key *keys) {
+	for (int attempt = 0; attempt < 2; attempt++) {
+		FILE *fp = fopen(g_session_keys_path, "r");
+		if (fp != NULL) {
+			int count = 0;
+			char hex[SESSION_KEY_SIZE * 2 + 1];
+			while (count < SESSION_MAX_KEYS && fscanf(fp, "%ld %64s", &keys[count].id, hex) == 2) {
+				if (strlen(hex) != SESSION_KEY_SIZE * 2) break;
+				for (int j = 0; j < SESSION_KEY_SIZE; j++) {
+					sscanf(hex + j * 2, "%2hhx", &keys[count].key[j]);
+				}
+				count++;
+			}
+			fclose(fp);
+			return count;
+		}
+
+		// 首次使用：生成密钥；用 O_EXCL 锁文件避免多个进程同时生成不同的密钥
+		char lock_path[ROOM_PATH_SIZE + 8];
+		snprintf(lock_path, sizeof(lock_path), "%s.init", g_session_keys_path);
+		int lock_fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+		if (lock_fd >= 0) {
+			keys[0].id = 1;
+			int failed = session_generate_key(keys[0].key) || session_write_keys(keys, 1);
+			close(lock_fd);
+			unlink(lock_path);
+			if (failed) return 0;
+		} else {
+			usleep(10000); // 其他进程正在生成，稍后重新读取
+		}
+	}
+	return 0;
+}
+
+// 函数：生成新的签名密钥并放在第一行，保留最近的旧密钥用于验证已签发的令牌
+int session_rotate_key() {
+	session_key keys[SESSION_MAX_KEYS];
+	int count = session_load_keys(keys);
+	long next_id = 1;
+	for (int i = 0; i < count; i++) {
+		if (keys[i].id >= next_id) next_id = keys[i].id + 1;
+	}
+	if (count == SESSION_MAX_KEYS) count--;
+	memmove(keys + 1, keys, count * sizeof(session_key));
+	keys[0].id = next_id;
+	if (session_generate_key(keys[0].key) != 0 || session_write_keys(keys, count + 1) != 0) {
+		fprintf(stderr, "Failed to rotate session key.\n");
+		return 1;
+	}
+	fprintf(stderr, "Session signing key rotated to id %ld (%d keys kept).\n", next_id, count + 1);
+	return 0;
+}
+
+// 函数：计算载荷的 HMAC-SHA256
+static void session_mac(const session_key *key, const char *payload, size_t len, unsigned char *mac) {
+	unsigned int mac_len = 0;
+	HMAC(EVP_sha256(), key->key, SESSION_KEY_SIZE, (const unsigned char *)payload, len, mac, &mac_len);
+}
+
+// 函数：从数据库读取用户当前的撤销纪元（没有记录时为 0）
+static long long session_epoch_from_db(sqlite3 *db, const char *username) {
+	sqlite3_stmt *stmt;
+	long long epoch = 0;
+	const char *sql = "SELECT epoch FROM session_revocations WHERE username = ?;";
+	if (db_prepare(db, sql, &stmt) != SQLITE_OK) return -1;
+	sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW) epoch = sqlite3_column_int64(stmt, 0);
+	db_finalize(stmt);
+	return epoch;
+}
+
+// 函数：取得撤销纪元锁（撤销纪元文件旁的 .lock 文件上的排他 flock），返回锁文件描述符（关闭即释放），失败返回 -1。
+// 撤销和重建都在持锁期间读表、改名，依次进行，较旧的快照不会覆盖较新的文件
+static int session_revocations_lock() {
+	char lock_path[ROOM_PATH_SIZE + 8];
+	snprintf(lock_path, sizeof(lock_path), "%s.lock", g_session_revocations_path);
+	int fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	if (fd < 0) return -1;
+	if (flock(fd, LOCK_EX) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// 函数：根据 session_revocations 表重写撤销纪元文件（临时文件 + rename），调用者需持有撤销纪元锁
+static int session_write_revocations(sqlite3 *db) {
+	char tmp_path[ROOM_PATH_SIZE + 24];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", g_session_revocations_path, (int)getpid());
+	FILE *fp = fopen(tmp_path, "w");
+	if (fp == NULL) return 1;
+
+	sqlite3_stmt *stmt;
+	const char *sql = "SELECT username, epoch FROM session_revocations;";
+	if (db_prepare(db, sql, &stmt) != SQLITE_OK) {
+		fclose(fp);
+		unlink(tmp_path);
+		return 1;
+	}
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		const char *name = (const char *)sqlite3_column_text(stmt, 0);
+		char encoded[SESSION_TOKEN_SIZE];
+		if (name == NULL || strlen(name) > 255) continue;
+		base64url_encode((const unsigned char *)name, strlen(name), encoded);
+		fprintf(fp, "%lld %s\n", (long long)sqlite3_column_int64(stmt, 1), encoded);
+	}
+	db_finalize(stmt);
+
+	if (fclose(fp) != 0 || rename(tmp_path, g_session_revocations_path) != 0) {
+		unlink(tmp_path);
+		return 1;
+	}
+	chmod(g_session_revocations_path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	return 0;
+}
+
+// 函数：修改账户并撤销该用户已签发的全部令牌（撤销纪元加一）。change 为已绑定参数的修改密码或删除账户语句（由本函数结束），
+// 它和纪元加一在同一个事务中，任何一步失败时回滚并返回非 0，密码和令牌都保持不变；
+// 从事务开始到重写撤销纪元文件一直持有撤销纪元锁
+int session_revoke_user(sqlite3 *db, sqlite3_stmt *change, const char *username) {
+	int lock_fd = session_revocations_lock();
+	if (lock_fd < 0) {
+		db_finalize(change);
+		return 1;
+	}
+	int rc = sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0);
+	if (rc == SQLITE_OK) rc = sqlite3_step(change) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+	db_finalize(change);
+	if (rc == SQLITE_OK) {
+		sqlite3_stmt *stmt;
+		const char *sql = "INSERT INTO session_revocations (username, epoch) VALUES (?, 1) "
+		                  "ON CONFLICT(username) DO UPDATE SET epoch = epoch + 1;";
+		rc = db_prepare(db, sql, &stmt);
+		if (rc == SQLITE_OK) {
+			sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+			rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+			db_finalize(stmt);
+		}
+	}
+	if (rc == SQLITE_OK) rc = sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Failed to revoke sessions of %s: %s\n", username, sqlite3_errmsg(db));
+		sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+		close(lock_fd);
+		return 1;
+	}
+	if (session_write_revocations(db) != 0) {
+		// 文件未能更新时删除它，验证时退回查询数据库，保证已撤销的令牌不会被接受
+		unlink(g_session_revocations_path);
+	}
+	close(lock_fd);
+	return 0;
+}
+
+// 函数：读取用户当前的撤销纪元，优先读撤销纪元文件；文件不存在时查询数据库并重建文件
+static long long session_current_epoch(const char *encoded_username) {
+	FILE *fp = fopen(g_session_revocations_path, "r");
+	if (fp != NULL) {
+		long long epoch;
+		char name[SESSION_TOKEN_SIZE];
+		long long result = 0;
+		while (fscanf(fp, "%lld %511s", &epoch, name) == 2) {
+			if (strcmp(name, encoded_username) == 0) {
+				result = epoch;
+				break;
+			}
+		}
+		fclose(fp);
+		return result;
+	}
+
+	unsigned char username[SESSION_TOKEN_SIZE];
+	int len = base64url_decode(encoded_username, strlen(encoded_username), username);
+	if (len < 0) return -1;
+	username[len] = '\0';
+
+	// 持锁读表并重建文件：同时进行的撤销要等这里改名之后才读表，不会被这里较旧的快照覆盖
+	sqlite3 *db;
+	if (db_acquire(&db) != SQLITE_OK) return -1;
+	int lock_fd = session_revocations_lock();
+	long long epoch = session_epoch_from_db(db, (const char *)username);
+	if (lock_fd >= 0) {
+		session_write_revocations(db);
+		close(lock_fd);
+	}
+	db_release(db);
+	return epoch;
+}
+
+// 函数：为用户签发会话令牌，epoch 为该用户当前的撤销纪元；成功返回 0
+int session_issue_token(const char *username, long long epoch, char *token, size_t token_size) {
+	session_key keys[SESSION_MAX_KEYS];
+	if (session_load_keys(keys) == 0 || strlen(username) > 255) return 1;
+
+	char encoded_username[SESSION_TOKEN_SIZE];
+	base64url_encode((const unsigned char *)username, strlen(username), encoded_username);
+	int payload_len = snprintf(token, token_size, "%ld.%lld.%lld.%s", keys[0].id,
+	                           (long long)time(NULL) + SESSION_TTL_SECONDS, epoch, encoded_username);
+	if (payload_len < 0 || (size_t)payload_len + 50 > token_size) return 1;
+
+	unsigned char mac[32];
+	session_mac(&keys[0], token, payload_len, mac);
+	token[payload_len] = '.';
+	base64url_encode(mac, sizeof(mac), token + payload_len + 1);
+	return 0;
+}
+
+// 函数：验证会话令牌（常数时间比较签名），有效时把用户名写入 username 并返回 1
+int session_verify_token(const char *token, char *username, size_t username_size) {
+	const char *mac_part = strrchr(token, '.');
+	if (mac_part == NULL) return 0;
+	size_t payload_len = mac_part - token;
+	mac_part++;
+
+	long key_id;
+	long long expires, epoch;
+	int name_offset = 0;
+	if (sscanf(token, "%ld.%lld.%lld.%n", &key_id, &expires, &epoch, &name_offset) != 3 || name_offset == 0 ||
+	    (size_t)name_offset >= payload_len) {
+		return 0;
+	}
+	if (expires < (long long)time(NULL)) return 0;
+
+	session_key keys[SESSION_MAX_KEYS];
+	int key_count = session_load_keys(keys);
+	const session_key *key = NULL;
+	for (int i = 0; i < key_count; i++) {
+		if (keys[i].id == key_id) key = &keys[i];
+	}
+	if (key == NULL) return 0; // 密钥已被轮换淘汰
+
+	unsigned char expected[32], actual[SESSION_TOKEN_SIZE];
+	session_mac(key, token, payload_len, expected);
+	if (base64url_decode(mac_part, strlen(mac_part), actual) != sizeof(expected) ||
+	    CRYPTO_memcmp(expected, actual, sizeof(expected)) != 0) {
+		return 0;
+	}
+
+	// 签名有效后再检查撤销纪元
+	char encoded_username[SESSION_TOKEN_SIZE];
+	size_t encoded_len = payload_len - name_offset;
+	if (encoded_len >= sizeof(encoded_username)) return 0;
+	memcpy(encoded_username, token + name_offset, encoded_len);
+	encoded_username[encoded_len] = '\0';
+	if (session_current_epoch(encoded_username) != epoch) return 0;
+
+	unsigned char decoded[SESSION_TOKEN_SIZE];
+	int len = base64url_decode(encoded_username, encoded_len, decoded);
+	if (len <= 0 || (size_t)len >= username_size) return 0;
+	memcpy(username, decoded, len);
+	username[len] = '\0';
+	return 1;
+}
+
+// 函数：生成设置会话 Cookie 的响应头（token 为 NULL 时生成清除 Cookie 的响应头）
+void session_cookie_header(const char *token, char *header, size_t header_size) {
+	if (token == NULL) {
+		snprintf(header, header_size, "Set-Cookie: session=; Path=/; Max-Age=0; HttpOnly; SameSite=Lax\r\n");
+	} else {
+		snprintf(header, header_size, "Set-Cookie: session=%s; Path=/; Max-Age=%d; HttpOnly; SameSite=Lax\r\n",
+		         token, SESSION_TTL_SECONDS);
+	}
+}
+
+// ========== 发送频率限制 ==========
+// 每个 IP 和每个用户各有一个令牌桶。每条消息消耗一个令牌，令牌按固定速率补充，最多积累 burst 个。
+// 令牌桶保存在共享文件 <数据库>.ratelimit 中（mmap），所有 CGI 进程和 SCGI 工作进程共用。
+// 这个文件是开放寻址的哈希表。每个槽位把上次补充的时间和剩余令牌打包在一个 64 位整数里，
+// 用 CAS 原子更新，不需要加锁。
+// 超出限制的请求在打开数据库之前返回 429，不会占用写锁，也不会把正常消息挤出保留窗口。
+// CHAT_RATE_LIMIT=0 关闭限制，速率和容量可用 CHAT_RATE_{IP,USER}_{PER_MINUTE,BURST} 调整。
+// IP 令牌桶按连接的对端地址（REMOTE_ADDR）计数；代理头 CF-Connecting-IP 可由客户端任意设置，
+// 只有 REMOTE_ADDR 是 CHAT_TRUSTED_PROXY（逗号分隔的地址列表）中的代理时才使用。
+
+#define RATE_LIMIT_SLOTS 4096 // 哈希表槽位数量
+#define RATE_LIMIT_PROBES 8 // 查找时最多探测的槽位数
+#define RATE_LIMIT_MAGIC 0x3154494d494c5452ULL // 令牌桶文件的格式标识（"RTLIMIT1"）
+#define RATE_IP_PER_MINUTE 30 // 每个 IP 每分钟补充的令牌数
+#define RATE_IP_BURST 20 // 每个 IP 最多积累的令牌数（不小于 MAX_BATCH_MESSAGES，一次批量发送才能通过）
+#define RATE_USER_PER_MINUTE 20 // 每个用户每分钟补充的令牌数
+#define RATE_USER_BURST 20 // 每个用户最多积累的令牌数
+#define RATE_TOKEN_SCALE 1000 // 令牌以千分之一个为单位保存，补充时不丢失零头
+#define RATE_TOKEN_BITS 24 // 状态中令牌所占的低位数，其余高位为毫秒时间戳
+#define RATE_TOKEN_MASK ((1ULL << RATE_TOKEN_BITS) - 1)
+
+enum {
+	RATE_SCOPE_IP,
+	RATE_SCOPE_USER,
+	RATE_SCOPE_COUNT
+};
+
+static const char *rate_scope_names[RATE_SCOPE_COUNT] = {"ip", "user"};
+
+// 共享令牌桶文件的布局（原生字节序），各字段只用原子操作读写
+struct rate_limit_file {
+	unsigned long long magic;
+	unsigned long long limited[RATE_SCOPE_COUNT]; // 被拒绝的请求数
+	unsigned long long table_full; // 探测范围内没有可用槽位、未做限制就放行的请求数
+	struct {
+		unsigned long long key; // 作用域和标识的哈希，0 表示空槽位
+		unsigned long long state; // (上次补充的毫秒时间 << RATE_TOKEN_BITS) | 剩余令牌，0 表示新槽位（令牌已满）
+	} slots[RATE_LIMIT_SLOTS];
+};
+
+static struct rate_limit_file *g_rate_limit; // 已映射的令牌桶文件，常驻进程只映射一次
+
+// 函数：获取客户端 IP（优先从 Cloudflare 代理头获取，其次从 REMOTE_ADDR 获取），用于保存和显示
+const char *client_ip() {
+	const char *ip = getenv("HTTP_CF_CONNECTING_IP");
+	if (ip == NULL) ip = getenv("REMOTE_ADDR");
+	if (ip == NULL || *ip == '\0') ip = "UNKNOWN_IP"; // 如果无法获取 IP，则设置为 "UNKNOWN_IP"
+	return ip;
+}
+
+// 函数：判断地址是否在 CHAT_TRUSTED_PROXY（逗号分隔的地址列表）中
+static int trusted_proxy(const char *addr) {
+	const char *list = getenv("CHAT_TRUSTED_PROXY");
+	if (list == NULL || addr == NULL || *addr == '\0') return 0;
+	size_t len = strlen(addr);
+	for (const char *p = list; *p != '\0';) {
+		while (*p == ' ' || *p == ',') p++;
+		size_t n = strcspn(p, ", ");
+		if (n == len && strncmp(p, addr, n) == 0) return 1;
+		p += n;
+	}
+	return 0;
+}
+
+// 函数：获取用于发送频率限制的客户端 IP：连接的对端地址，来自可信代理时才使用代理头
+const char *rate_limit_ip() {
+	const char *remote = getenv("REMOTE_ADDR");
+	const char *forwarded = getenv("HTTP_CF_CONNECTING_IP");
+	if (forwarded != NULL && *forwarded != '\0' && trusted_proxy(remote)) return forwarded;
+	if (remote == NULL || *remote == '\0') return "UNKNOWN_IP";
+	return remote;
+}
+
+// 函数：映射共享令牌桶文件，文件不存在时创建；格式不符或失败时返回 NULL（不做限制）
+static struct rate_limit_file *rate_limit_map() {
+	if (g_rate_limit != NULL) return g_rate_limit;
+	int fd = open(g_rate_limit_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	if (fd < 0) return NULL;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (st.st_size < (off_t)sizeof(struct rate_limit_file) && ftruncate(fd, sizeof(struct rate_limit_file)) != 0)) {
+		close(fd);
+		return NULL;
+	}
+	struct rate_limit_file *f = mmap(NULL, sizeof(struct rate_limit_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (f == MAP_FAILED) return NULL;
+	unsigned long long expected = 0;
+	__atomic_compare_exchange_n(&f->magic, &expected, RATE_LIMIT_MAGIC, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&f->magic, __ATOMIC_RELAXED) != RATE_LIMIT_MAGIC) {
+		fprintf(stderr, "Rate limit file %s has an unknown format; delete it to reset.\n", g_rate_limit_path);
+		munmap(f, sizeof(struct rate_limit_file));
+		return NULL;
+	}
+	g_rate_limit = f;
+	return f;
+}
+
+// 函数：从 scope 作用域中标识为 id 的令牌桶取出 cost 个令牌
+// 令牌不足时不扣除，返回 1 并在 *retry_after 中给出需要等待的秒数；允许时返回 0
+int rate_limit_take(int scope, const char *id, int cost, int per_minute, int burst, int *retry_after) {
+	struct rate_limit_file *f = rate_limit_map();
+	if (f == NULL) return 0;
+
+	unsigned long long key = 14695981039346656037ULL ^ (unsigned long long)scope;
+	for (const unsigned char *p = (const unsigned char *)id; *p; p++) key = (key ^ *p) * 1099511628211ULL;
+	// FNV 的低位在相似的字符串（如同一网段的 IP）之间差别很小，再混合一次，否则线性探测会聚成一团
+	key ^= key >> 31;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 29;
+	if (key == 0) key = 1;
+
+	// 时间戳只用于计算补充的令牌；系统重启后时钟变小，按令牌已满处理
+	unsigned long long now = (timer_now() / 1000000) & ((1ULL << (64 - RATE_TOKEN_BITS)) - 1);
+	if (burst > (int)(RATE_TOKEN_MASK / RATE_TOKEN_SCALE)) burst = RATE_TOKEN_MASK / RATE_TOKEN_SCALE;
+	unsigned long long capacity = (unsigned long long)burst * RATE_TOKEN_SCALE;
+	unsigned long long refill_ms = 60000ULL * burst / per_minute + 1; // 从空到满所需的时间
+
+	// 线性探测；没有找到时占用空槽位，或者替换一个早已补满的槽位（它的状态与新建的相同）
+	unsigned long long *state = NULL;
+	unsigned long long *stale_key = NULL;
+	unsigned long long stale_value = 0;
+	for (int i = 0; i < RATE_LIMIT_PROBES && state == NULL; i++) {
+		size_t index = (key + i) % RATE_LIMIT_SLOTS;
+		unsigned long long slot_key = __atomic_load_n(&f->slots[index].key, __ATOMIC_ACQUIRE);
+		if (slot_key == 0) {
+			unsigned long long empty = 0;
+			if (__atomic_compare_exchange_n(&f->slots[index].key, &empty, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				state = &f->slots[index].state;
+				break;
+			}
+			slot_key = empty; // 其他进程刚刚占用了这个槽位
+		}
+		if (slot_key == key) {
+			state = &f->slots[index].state;
+		} else if (stale_key == NULL) {
+			unsigned long long s = __atomic_load_n(&f->slots[index].state, __ATOMIC_RELAXED);
+			unsigned long long last = s >> RATE_TOKEN_BITS;
+			if (s == 0 || last > now || now - last > refill_ms) {
+				stale_key = &f->slots[index].key;
+				stale_value = slot_key;
+			}
+		}
+	}
+	if (state == NULL && stale_key != NULL &&
+	    __atomic_compare_exchange_n(stale_key, &stale_value, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		state = stale_key + 1;
+		__atomic_store_n(state, 0, __ATOMIC_RELEASE);
+	}
+	if (state == NULL) {
+		__atomic_fetch_add(&f->table_full, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	unsigned long long need = (unsigned long long)(cost < burst ? cost : burst) * RATE_TOKEN_SCALE;
+	unsigned long long old = __atomic_load_n(state, __ATOMIC_ACQUIRE);
+	for (;;) {
+		unsigned long long tokens = capacity;
+		if (old != 0) {
+			unsigned long long last = old >> RATE_TOKEN_BITS;
+			tokens = old & RATE_TOKEN_MASK;
+			if (last > now) {
+				tokens = capacity;
+			} else {
+				tokens += (now - last) * per_minute * RATE_TOKEN_SCALE / 60000;
+				if (tokens > capacity) tokens = capacity;
+			}
+		}
+		if (tokens < need) {
+			unsigned long long wait_ms = (need - tokens) * 60000 / ((unsigned long long)per_minute * RATE_TOKEN_SCALE);
+			*retry_after = (int)(wait_ms / 1000) + 1;
+			__atomic_fetch_add(&f->limited[scope], 1, __ATOMIC_RELAXED);
+			return 1;
+		}
+		unsigned long long new_state = (now << RATE_TOKEN_BITS) | (tokens - need);
+		if (new_state == 0) new_state = 1; // 0 保留给新槽位
+		if (__atomic_compare_exchange_n(state, &old, new_state, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return 0;
+	}
+}
+
+// 函数：按作用域检查发送频率；超出限制时发送 429 响应并返回 1
+// id 为 IP 或用户名；CHAT_RATE_LIMIT=0 时总是放行
+int rate_limit_check(int scope, const char *id, int cost) {
+	const char *enabled = getenv("CHAT_RATE_LIMIT");
+	if (enabled != NULL && strcmp(enabled, "0") == 0) return 0;
+	int per_minute = scope == RATE_SCOPE_IP ? config_int("CHAT_RATE_IP_PER_MINUTE", RATE_IP_PER_MINUTE)
+	                                        : config_int("CHAT_RATE_USER_PER_MINUTE", RATE_USER_PER_MINUTE);
+	int burst = scope == RATE_SCOPE_IP ? config_int("CHAT_RATE_IP_BURST", RATE_IP_BURST)
+	                                   : config_int("CHAT_RATE_USER_BURST", RATE_USER_BURST);
+	int retry_after = 0;
+	long long start = timer_now();
+	int limited = rate_limit_take(scope, id, cost, per_minute, burst, &retry_after);
+	timer_add(PHASE_RATE_LIMIT, start);
+	if (!limited) return 0;
+
+	char header[64];
+	snprintf(header, sizeof(header), "Retry-After: %d\r\n", retry_after);
+	char body[128];
+	int body_len = snprintf(body, sizeof(body), "{\"status\":\"error\",\"message\":\"Too many messages. Please slow down.\","
+	                        "\"retry_after\":%d}\n", retry_after);
+	send_json_text(429, "Too Many Requests", header, body, body_len);
+	return 1;
+}
+
+// 函数：不经过写入队列，在一个事务中直接写入一批消息并清理旧消息，然后重建快照并通知推送连接
+// 成功时返回 NULL，失败时回滚并返回错误信息
+const char *post_direct(sqlite3 *db, time_t now, const char *user_ip, const char *username, char **messages, int message_count) {
+	// 所有消息在同一个事务中写入，只提交一次
+	long long start = timer_now();
+	if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK) {
+		return "Failed to begin transaction.";
+	}
+
+	// 准备插入语句：将新消息插入到 messages 表中
+	sqlite3_stmt *stmt;
+	if (db_prepare(db, SQL_INSERT_MESSAGE, &stmt) != SQLITE_OK) {
+		sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+		return "Failed to prepare insert statement.";
+	}
+	int rc = insert_messages(stmt, now, user_ip, username, messages, message_count);
+	db_finalize(stmt); // 结束语句
+	if (rc != SQLITE_OK) {
+		// 任何一条写入失败都回滚整批消息
+		sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+		return "Failed to execute insert statement.";
+	}
+	long long new_id = sqlite3_last_insert_rowid(db); // 最后一条新消息的 ID，用于通知订阅者
+	timer_add(PHASE_INSERT, start);
+
+	// 清理旧消息：整批只清理一次
+	start = timer_now();
+	rc = prune_old_messages(db, new_id, message_count);
+	timer_add(PHASE_PRUNE, start);
+	if (rc == SQLITE_OK) {
+		start = timer_now();
+		rc = sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+		timer_add(PHASE_INSERT, start);
+	}
+	if (rc != SQLITE_OK) {
+		sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+		return "Failed to execute delete statement.";
+	}
+	ring_note_commit(new_id);
+
+	// 把新消息追加到变更日志（只读副本据此复制），再重建最新消息快照（失败时 GET 会退回实时查询）
+	start = timer_now();
+	changelog_ship(db);
+	rebuild_snapshot(db);
+	timer_add(PHASE_SNAPSHOT, start);
+
+	// 唤醒正在等待新消息的推送连接
+	notify_new_message(new_id);
+	return NULL;
+}
+
+// 处理 POST 请求的函数（原先的聊天消息处理）
+int handle_post_message() {
+	// 获取 POST 请求的内容长度
+	char *content_length_str = getenv("CONTENT_LENGTH");
+	long long content_length = 0;
+	if (content_length_str != NULL) {
+		content_length = atoll(content_length_str); // 将字符串转换为整数
+	}
+
+	// 检查内容长度是否有效；请求体流式读取，不受缓冲区大小限制
+	if (content_length <= 0) {
+		// 如果内容长度无效，则打印错误信息
+		send_fixed_response(400, "Bad Request", JSON_ERROR("Invalid or missing POST data length."));
+		return 1;
+	}
+
+	char username[256] = ""; // 用户名缓冲区
+	char password[256] = ""; // 密码缓冲区
+	char message_buffers[MAX_BATCH_MESSAGES][MAX_MESSAGE_LENGTH + 1]; // 各条消息内容（超长部分读取时直接丢弃）
+	char *messages[MAX_BATCH_MESSAGES];
+	int message_count = 0;
+
+	// 解析 POST 数据，每个 message 字段是一条消息（批量发送时有多个）
+	form_reader reader;
+	form_reader_init(&reader, stdin, content_length);
+	char key[16];
+	int read_rc;
+	while ((read_rc = form_next_name(&reader, key, sizeof(key))) > 0) {
+		if (strcmp(key, "message") != 0) {
+			form_read_value(&reader, NULL, 0);
+			continue;
+		}
+		if (message_count == MAX_BATCH_MESSAGES) {
+			send_fixed_response(400, "Bad Request", JSON_ERROR("Too many messages in one request."));
+			return 1;
+		}
+		// 超出最大长度的消息被截断
+		if (form_read_value(&reader, message_buffers[message_count], sizeof(message_buffers[message_count])) > MAX_MESSAGE_LENGTH) {
+			fprintf(stderr, "Warning: Message truncated to %d characters.\n", MAX_MESSAGE_LENGTH); // 打印警告信息
+		}
+		messages[message_count] = message_buffers[message_count];
+		message_count++;
+	}
+	if (read_rc < 0) {
+		// 如果读取失败，则打印错误信息
+		send_fixed_response(500, "Internal Server Error", JSON_ERROR("Failed to read POST data from stdin."));
+		return 1;
+	}
+	
+	// 从环境变量中获取 Cookie：优先使用会话令牌，没有令牌时退回用户名和密码
+	const char *cookie_str = getenv("HTTP_COOKIE");
+	char session_token[SESSION_TOKEN_SIZE];
+	int authenticated = 0; // 已通过会话令牌验证，无需再查询密码
+	if (get_cookie(cookie_str, "session", session_token, sizeof(session_token)) && session_token[0] != '\0') {
+		long long start = timer_now();
+		int verified = session_verify_token(session_token, username, sizeof(username));
+		timer_add(PHASE_AUTH, start);
+		if (!verified) {
+			char cookie_header[128];
+			session_cookie_header(NULL, cookie_header, sizeof(cookie_header));
+			send_fixed_response_with_headers(401, "Unauthorized", cookie_header, JSON_ERROR("Session expired or revoked. Please log in again."));
+			return 1;
+		}
+		authenticated = 1;
+	} else {
+		parse_cookies(cookie_str, username, sizeof(username), password, sizeof(password));
+	}
+
+	for (int i = 0; i < message_count; i++) {
+		// 检查消息内容是否为空
+		if (strlen(messages[i]) == 0) {
+			message_count = 0;
+			break;
+		}
+	}
+	if (message_count == 0) {
+		// 如果消息为空，则打印错误信息
+		send_fixed_response(400, "Bad Request", JSON_ERROR("Message is empty."));
+		return 1;
+	}
+	
+	// 如果没有从Cookie中获取到用户名，则使用默认值
+	if (strlen(username) == 0) {
+		strncpy(username, "anonymous", sizeof(username));
+	}
+
+	// 发送频率限制：在打开任何数据库之前检查 IP 和已验证的会话用户；
+	// 使用密码的用户在密码验证通过后再检查，避免他人冒用用户名耗尽其令牌
+	const char *user_ip = client_ip(); // 保存并显示的 IP
+	if (rate_limit_check(RATE_SCOPE_IP, rate_limit_ip(), message_count) ||
+	    (authenticated && rate_limit_check(RATE_SCOPE_USER, username, message_count))) {
+		return 1;
+	}
+
+	sqlite3 *db; // SQLite 数据库连接对象
+	sqlite3_stmt *stmt; // SQLite 预处理语句对象
+	int rc; // SQLite 操作的返回码
+
+	// ========== 身份验证逻辑开始 ==========
+	if (!authenticated && strcmp(username, "anonymous") != 0) {
+		// 用户数据保存在主数据库中
+		rc = db_acquire(&db);
+		if (rc) {
+			send_fixed_response(500, "Internal Server Error", JSON_ERROR("Can't open database."));
+			return 1;
+		}
+
+		// 尝试从 users 表中查询用户
+		long long start = timer_now();
+		const char *sql_check_user = "SELECT password FROM users WHERE username = ?;";
+		rc = db_prepare(db, sql_check_user, &stmt);
+		if (rc != SQLITE_OK) {
+			db_release(db);
+			send_fixed_response(500, "Internal Server Error", JSON_ERROR("Failed to prepare user check statement."));
+			return 1;
+		}
+		sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+		
+		// 检查用户是否存在
+		rc = sqlite3_step(stmt);
+		if (rc == SQLITE_ROW) {
+			// 用户已存在，检查密码是否匹配
+			const char *stored_password = (const char *)sqlite3_column_text(stmt, 0);
+			if (strlen(password) == 0 || strcmp(password, stored_password) != 0) {
+				db_finalize(stmt);
+				db_release(db);
+				send_fixed_response(400, "Bad Request", JSON_ERROR("Incorrect password or password not provided for existing user."));
+				return 1;
+			}
+		} else {
+			// 查询出错
+			db_finalize(stmt);
+			db_release(db);
+			send_fixed_response(500, "Internal Server Error", JSON_ERROR("User check failed."));
+			return 1;
+		}
+		db_finalize(stmt); // 结束语句
+		db_release(db);
+		timer_add(PHASE_AUTH, start);
+		if (rate_limit_check(RATE_SCOPE_USER, username, message_count)) {
+			return 1;
+		}
+	}
+	// ========== 身份验证逻辑结束 ==========
+
+	time_t now = time(NULL);
+	int mode = queue_mode();
+	int committed = 1; // 消息是否已提交到数据库（否则仍在写入队列中）
+	if (mode != QUEUE_OFF) {
+		// 追加到写入队列，按配置的持久性落盘后即可确认
+		long long start = timer_now();
+		int appended = queue_append(mode, now, user_ip, username, messages, message_count);
+		timer_add(PHASE_QUEUE, start);
+		if (appended != 0) {
+			send_fixed_response(500, "Internal Server Error", JSON_ERROR("Failed to queue messages."));
+			return 1;
+		}
+		// 尝试成为刷新者；没拿到锁或提交失败时消息仍在队列中，由之后的刷新者提交
+		int flushed = -1;
+		if (db_acquire_room(&db) == SQLITE_OK) {
+			flushed = queue_flush(db);
+			db_release(db);
+		}
+		if (flushed < 0) {
+			fprintf(stderr, "Failed to flush write queue %s; messages stay queued.\n", g_room.queue_path);
+			committed = 0;
+		}
+	} else {
+		// 打开当前聊天室的数据库连接
+		rc = db_acquire_room(&db);
+		if (rc) {
+			// 如果打开数据库失败，则打印错误信息
+			send_fixed_response(500, "Internal Server Error", JSON_ERROR("Can't open database."));
+			return 1;
+		}
+		const char *error = post_direct(db, now, user_ip, username, messages, message_count);
+		db_release(db); // 释放数据库连接
+		if (error != NULL) {
+			cJSON *response_json = cJSON_CreateObject();
 			cJSON_AddStringToObject(response_json, "status", "error");
-			cJSON_AddStringToObject(response_json, "message", "Username and password are required.");
-			send_json_response(400, "Bad Request", response_json);
+			cJSON_AddStringToObject(response_json, "message", error);
+			send_json_response(500, "Internal Server Error", response_json);
+			return 1;
+		}
+	}
+
+	// 打印成功信息；提交失败时消息已安全写入队列，如实告知
+	char body[128];
+	int body_len = committed ? snprintf(body, sizeof(body), "{\"status\":\"success\",\"message\":\"Message posted and old messages cleaned.\","
+	                                    "\"count\":%d}\n", message_count)
+	                         : snprintf(body, sizeof(body), "{\"status\":\"success\",\"message\":\"Message queued; it will be committed shortly.\","
+	                                    "\"count\":%d}\n", message_count);
+	send_json_text(200, "OK", NULL, body, body_len);
+
+	return 0; // 程序成功执行
+}
+
+// 新增：处理用户管理请求
+int handle_user_management(const char *action, const char *request_method) {
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	int rc;
+
+	rc = db_acquire(&db);
+	if (rc) {
+		send_fixed_response(500, "Internal Server Error", JSON_ERROR("Can't open database for user management."));
+		return 1;
+	}
+	
+	// 获取 POST/PATCH/DELETE 数据
+	char *content_length_str = getenv("CONTENT_LENGTH");
+	long long content_length = 0;
+	if (content_length_str != NULL) {
+		content_length = atoll(content_length_str);
+	}
+
+	char username[256] = "";
+	char password[256] = "";
+	char new_password[256] = "";
+
+	// 解析表单数据（流式读取，过长的字段在读取时就被发现）
+	form_reader reader;
+	form_reader_init(&reader, stdin, content_length > 0 ? content_length : 0);
+	char key[16];
+	while (form_next_name(&reader, key, sizeof(key)) > 0) {
+		if (strcmp(key, "username") == 0) {
+			if (form_read_value(&reader, username, sizeof(username)) >= sizeof(username)) {
+				// 如果用户名过长，发送错误响应并退出
+				send_fixed_response(400, "Bad Request", JSON_ERROR("Username is too long."));
+				db_release(db);
+				return 1;
+			}
+		} else if (strcmp(key, "password") == 0) {
+			if (form_read_value(&reader, password, sizeof(password)) >= sizeof(password)) {
+				// 密码过长，发送错误响应并退出
+				send_fixed_response(400, "Bad Request", JSON_ERROR("Password is too long."));
+				db_release(db);
+				return 1;
+			}
+		} else if (strcmp(key, "new_password") == 0) {
+			if (form_read_value(&reader, new_password, sizeof(new_password)) >= sizeof(new_password)) {
+				// 新密码过长，发送错误响应并退出
+				send_fixed_response(400, "Bad Request", JSON_ERROR("New password is too long."));
+				db_release(db);
+				return 1;
+			}
+		} else {
+			form_read_value(&reader, NULL, 0);
+		}
+	}
+	
+	// 如果是 DELETE 请求，则从 Cookie 中获取用户名和密码
+	if (strcmp(request_method, "DELETE") == 0) {
+		const char *cookie_str = getenv("HTTP_COOKIE");
+		parse_cookies(cookie_str, username, sizeof(username), password, sizeof(password));
+	}
+
+
+	// 注册 (POST action=register)
+	if (strcmp(request_method, "POST") == 0 && strcmp(action, "register") == 0) {
+		if (strlen(username) == 0 || strlen(password) == 0) {
+			send_fixed_response(400, "Bad Request", JSON_ERROR("Username and password are required."));
+			return 1;
+		}
+
+		const char *sql_check_user = "SELECT username FROM users WHERE username = ?;";
+		rc = db_prepare(db, sql_check_user, &stmt);
+		sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			db_finalize(stmt);
+			db_release(db);
+			send_fixed_response(409, "Conflict", JSON_ERROR("User already exists."));
+			return 1;
+		}
+		db_finalize(stmt);
+		
+		const char *sql_insert_user = "INSERT INTO users (username, password) VALUES (?, ?);";
+		rc = db_prepare(db, sql_insert_user, &stmt);
+		sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, password, -1, SQLITE_STATIC);
+		rc = sqlite3_step(stmt);
+		if (rc != SQLITE_DONE) {
+			db_finalize(stmt);
+			db_release(db);
+			send_fixed_response(500, "Internal Server Error", JSON_ERROR("Failed to register user."));
+			return 1;
+		}
+		db_finalize(stmt);
+
+		// 注册后直接登录：签发会话令牌（沿用该用户名之前的撤销纪元，旧令牌仍然无效）
+		char token[SESSION_TOKEN_SIZE], cookie_header[SESSION_TOKEN_SIZE + 128] = "";
+		long long epoch = session_epoch_from_db(db, username);
+		if (epoch >= 0 && session_issue_token(username, epoch, token, sizeof(token)) == 0) {
+			session_cookie_header(token, cookie_header, sizeof(cookie_header));
+		}
+
+		db_release(db);
+		send_fixed_response_with_headers(200, "OK", cookie_header, JSON_SUCCESS("User registered successfully."));
+		return 0;
+	}
+
+	// 登录 (POST action=login)
+	if (strcmp(request_method, "POST") == 0 && strcmp(action, "login") == 0) {
+		if (strlen(username) == 0 || strlen(password) == 0) {
+			send_fixed_response(400, "Bad Request", JSON_ERROR("Username and password are required."));
+			return 1;
+		}
+		long long start = timer_now();
+		const char *sql_check_user = "SELECT password FROM users WHERE username = ?;";
+		rc = db_prepare(db, sql_check_user, &stmt);
+		sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			const char *stored_password = (const char *)sqlite3_column_text(stmt, 0);
+			if (strcmp(password, stored_password) == 0) {
+				db_finalize(stmt);
+				timer_add(PHASE_AUTH, start);
+
+				// 签发会话令牌，之后发送消息时不再查询密码
+				char token[SESSION_TOKEN_SIZE], cookie_header[SESSION_TOKEN_SIZE + 128];
+				long long epoch = session_epoch_from_db(db, username);
+				if (epoch < 0 || session_issue_token(username, epoch, token, sizeof(token)) != 0) {
+					db_release(db);
+					send_fixed_response(500, "Internal Server Error", JSON_ERROR("Failed to issue session token."));
+					return 1;
+				}
+				session_cookie_header(token, cookie_header, sizeof(cookie_header));
+
+				db_release(db);
+				send_fixed_response_with_headers(200, "OK", cookie_header, JSON_SUCCESS("Login successful."));
+				return 0;
+			}
+		}
+		db_finalize(stmt);
+		timer_add(PHASE_AUTH, start);
+		db_release(db);
+		send_fixed_response(401, "Unauthorized", JSON_ERROR("Invalid username or password."));
+		return 1;
+	}
+	
+	// 修改密码 (POST action=update)
+	if (strcmp(request_method, "POST") == 0 && strcmp(action, "update") == 0) {
+		if (strlen(username) == 0 || strlen(password) == 0 || strlen(new_password) == 0) {
+			send_fixed_response(400, "Bad Request", JSON_ERROR("Username, old password, and new password are required."));
+			return 1;
+		}
+
+		const char *sql_check_user = "SELECT password FROM users WHERE username = ?;";
+		rc = db_prepare(db, sql_check_user, &stmt);
+		sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			const char *stored_password = (const char *)sqlite3_column_text(stmt, 0);
+			if (strcmp(password, stored_password) == 0) {
+				db_finalize(stmt);
+				
+				// 修改密码并使之前签发的令牌全部失效（同一个事务），再为当前会话签发新令牌
+				const char *sql_update = "UPDATE users SET password = ? WHERE username = ?;";
+				rc = db_prepare(db, sql_update, &stmt);
+				if (rc == SQLITE_OK) {
+					sqlite3_bind_text(stmt, 1, new_password, -1, SQLITE_STATIC);
+					sqlite3_bind_text(stmt, 2, username, -1, SQLITE_STATIC);
+					rc = session_revoke_user(db, stmt, username) == 0 ? SQLITE_OK : SQLITE_ERROR;
+				}
+				if (rc != SQLITE_OK) {
+					db_release(db);
+					send_fixed_response(500, "Internal Server Error", JSON_ERROR("Failed to update password."));
+					return 1;
+				}
+
+				char token[SESSION_TOKEN_SIZE], cookie_header[SESSION_TOKEN_SIZE + 128] = "";
+				long long epoch = session_epoch_from_db(db, username);
+				if (epoch >= 0 && session_issue_token(username, epoch, token, sizeof(token)) == 0) {
+					session_cookie_header(token, cookie_header, sizeof(cookie_header));
+				}
+
+				db_release(db);
+				send_fixed_response_with_headers(200, "OK", cookie_header, JSON_SUCCESS("Password updated successfully."));
+				return 0;
+			}
+		}
+		db_finalize(stmt);
+		db_release(db);
+		send_fixed_response(401, "Unauthorized", JSON_ERROR("Incorrect username or password."));
+		return 1;
+	}
+	
+	// 删除账户 (DELETE action=delete)
+	if (strcmp(request_method, "DELETE") == 0 && strcmp(action, "delete") == 0) {
+		if (strlen(username) == 0 || strlen(password) == 0) {
+			send_fixed_response(400, "Bad Request", JSON_ERROR("Username and password are required."));
+			return 1;
+		}
+
+		const char *sql_check_user = "SELECT password FROM users WHERE username = ?;";
+		rc = db_prepare(db, sql_check_user, &stmt);
+		sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			const char *stored_password = (const char *)sqlite3_column_text(stmt, 0);
+			if (strcmp(password, stored_password) == 0) {
+				db_finalize(stmt);
+
+				// 删除账户并使该用户已签发的令牌全部失效（同一个事务），再清除当前会话 Cookie
+				const char *sql_delete = "DELETE FROM users WHERE username = ?;";
+				rc = db_prepare(db, sql_delete, &stmt);
+				if (rc == SQLITE_OK) {
+					sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+					rc = session_revoke_user(db, stmt, username) == 0 ? SQLITE_OK : SQLITE_ERROR;
+				}
+				if (rc != SQLITE_OK) {
+					db_release(db);
+					send_fixed_response(500, "Internal Server Error", JSON_ERROR("Failed to delete user."));
+					return 1;
+				}
+
+				char cookie_header[128];
+				session_cookie_header(NULL, cookie_header, sizeof(cookie_header));
+				db_release(db);
+				send_fixed_response_with_headers(200, "OK", cookie_header, JSON_SUCCESS("User deleted successfully."));
+				return 0;
+			}
+		}
+		db_finalize(stmt);
+		db_release(db);
+		send_fixed_response(401, "Unauthorized", JSON_ERROR("Invalid username or password."));
+		return 1;
+	}
+	
+	// 退出登录 (POST action=logout)：清除会话 Cookie（HttpOnly，前端脚本无法自行删除）
+	if (strcmp(request_method, "POST") == 0 && strcmp(action, "logout") == 0) {
+		char cookie_header[128];
+		session_cookie_header(NULL, cookie_header, sizeof(cookie_header));
+		db_release(db);
+		send_fixed_response_with_headers(200, "OK", cookie_header, JSON_SUCCESS("Logged out."));
+		return 0;
+	}
+
+	// 其他未支持的用户管理请求
+	db_release(db);
+	send_fixed_response(405, "Method Not Allowed", JSON_ERROR("Unsupported user management action or method."));
+	return 1;
+}
+
+
+// 函数：以 Prometheus 文本格式输出各阶段耗时的直方图（GET action=metrics）
+// 统计来自所有进程共用的直方图文件，进程重启后不会清零；删除文件即可重置
+int handle_get_metrics() {
+	struct metrics_file *m = metrics_map();
+	FILE *out = response_begin(200, "OK", "Cache-Control: no-store\r\n", "text/plain; version=0.0.4");
+	fputs("# HELP chat_phase_duration_seconds Time spent in each phase of a request.\n"
+	      "# TYPE chat_phase_duration_seconds histogram\n", out);
+	for (int i = 0; m != NULL && i < PHASE_COUNT; i++) {
+		unsigned long long cumulative = 0;
+		for (int b = 0; b < METRICS_BUCKETS; b++) {
+			cumulative += __atomic_load_n(&m->phases[i].buckets[b], __ATOMIC_RELAXED);
+			if (b < METRICS_BUCKETS - 1) {
+				fprintf(out, "chat_phase_duration_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n", phase_names[i],
+				        metrics_bucket_us[b] / 1e6, cumulative);
+			} else {
+				fprintf(out, "chat_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", phase_names[i], cumulative);
+			}
+		}
+		// 各字段分别读取，并发写入时 _count 与桶之间可能相差几个请求，抓取时可以接受
+		fprintf(out, "chat_phase_duration_seconds_sum{phase=\"%s\"} %.9f\n", phase_names[i],
+		        __atomic_load_n(&m->phases[i].sum_ns, __ATOMIC_RELAXED) / 1e9);
+		fprintf(out, "chat_phase_duration_seconds_count{phase=\"%s\"} %llu\n", phase_names[i],
+		        __atomic_load_n(&m->phases[i].count, __ATOMIC_RELAXED));
+	}
+	struct rate_limit_file *f = rate_limit_map();
+	if (f != NULL) {
+		fputs("# HELP chat_rate_limited_total Messages rejected with 429 by the flood control.\n"
+		      "# TYPE chat_rate_limited_total counter\n", out);
+		for (int i = 0; i < RATE_SCOPE_COUNT; i++) {
+			fprintf(out, "chat_rate_limited_total{scope=\"%s\"} %llu\n", rate_scope_names[i],
+			        __atomic_load_n(&f->limited[i], __ATOMIC_RELAXED));
+		}
+		fprintf(out, "# HELP chat_rate_limit_table_full_total Requests let through because the bucket table was full.\n"
+		             "# TYPE chat_rate_limit_table_full_total counter\n"
+		             "chat_rate_limit_table_full_total %llu\n", __atomic_load_n(&f->table_full, __ATOMIC_RELAXED));
+	}
+	response_end();
+	return 0;
+}
+
+// 函数：按请求方法和 action 参数分发请求（CGI 与 SCGI 模式共用）
+int route_request() {
+	char *request_method = getenv("REQUEST_METHOD");
+	char *query_string = getenv("QUERY_STRING");
+
+	if (request_method == NULL) {
+		send_fixed_response(500, "Internal Server Error", JSON_ERROR("REQUEST_METHOD not set."));
+		return 1;
+	}
+
+	arena_reset(); // 回收上一个请求（常驻模式）从内存池分配的内存
+
+	char action[256] = "";
+	get_query_param(query_string, "action", action, sizeof(action));
+
+	// 选择聊天室；常驻模式下每个请求都要重新设置，不能沿用上一个请求的聊天室
+	char room[MAX_ROOM_NAME_LENGTH + 2] = ""; // 多留一个字节用于发现过长的名称
+	get_query_param(query_string, "room", room, sizeof(room));
+	if (select_room(room) != 0) {
+		send_fixed_response(400, "Bad Request", JSON_ERROR("Room name is too long."));
+		return 1;
+	}
+
+	// 只读副本：写请求应发往主实例，读请求的响应带上复制延迟
+	replica_lag_header();
+	if (replica_mode() && strcmp(request_method, "GET") != 0) {
+		send_fixed_response(403, "Forbidden", JSON_ERROR("This server is a read-only replica; send writes to the primary."));
+		return 1;
+	}
+
+	// 根据请求方法和 action 参数进行路由
+	if (strcmp(request_method, "GET") == 0) {
+		if (strcmp(action, "stream") == 0) {
+			if (g_db_persistent) {
+				// SCGI 工作进程（--serve 模式的推送不经过这里）：推送连接会占住工作进程最长 STREAM_TIMEOUT_SECONDS 秒，
+				// 几个打开的聊天页面就能占满全部工作进程，因此拒绝推送，页面改用定时刷新
+				send_fixed_response(503, "Service Unavailable", JSON_ERROR("Streaming is not available in SCGI mode; poll instead."));
+				return 1;
+			}
+			// 推送新消息；连接会保持几十秒，不计入耗时统计。先补交写入队列中遗留的消息
+			g_request_untimed = 1;
+			queue_recover();
+			return handle_stream_messages();
+		}
+		if (strcmp(action, "metrics") == 0) {
+			// 各阶段耗时的直方图
+			return handle_get_metrics();
+		}
+		if (strcmp(action, "search") == 0) {
+			// 搜索历史消息
+			return handle_search_messages();
+		}
+		// 获取信息；先补交写入队列中遗留的消息
+		queue_recover();
+		return handle_get_messages();
+	} else if (strcmp(request_method, "POST") == 0) {
+		if (strcmp(action, "register") == 0 || strcmp(action, "login") == 0 || strcmp(action, "update") == 0 ||
+		    strcmp(action, "logout") == 0) {
+			// 注册、登录、修改密码或退出登录
+			return handle_user_management(action, request_method);
+		} else {
+			// 发送消息
+			return handle_post_message();
+		}
+	} else if (strcmp(request_method, "DELETE") == 0) {
+		if (strcmp(action, "delete") == 0) {
+			// 删除账户
+			return handle_user_management(action, request_method);
+		} else {
+			send_fixed_response(405, "Method Not Allowed", JSON_ERROR("Unsupported DELETE action."));
 			return 1;
 		}
+	} else {
+		send_fixed_response(405, "Method Not Allowed", JSON_ERROR("Unsupported request method."));
+		return 1;
+	}
+}
+
+// ========== 在线备份与增量清理 ==========
+// 用法：chat_handler.cgi --backup <目标目录>，chat_handler.cgi --compact
+// 两者都是独立的维护进程（可由 cron 定时运行），依次处理数据目录中的主数据库和全部聊天室数据库，服务不需要停止。
+// 备份使用 SQLite 在线备份 API，每步复制 CHAT_BACKUP_STEP_PAGES 页，之后休眠 CHAT_BACKUP_SLEEP_MS 毫秒。
+// 整个备份期间保持一个读事务，得到的是开始时刻的一致快照，期间的提交不会让备份从头开始；
+// WAL 模式下读事务不阻塞写者，只是推迟检查点，WAL 文件在备份期间会变大。每个数据库先写临时文件，完成后改名；
+// 聊天室的归档目录随后复制（归档文件只追加，先复制索引再复制数据即可得到一致的副本）。
+// 清理：新数据库创建时就使用增量自动清理（auto_vacuum=INCREMENTAL），清理旧消息后空闲页留在数据库中，
+// --compact 每步释放 CHAT_COMPACT_STEP_PAGES 页，每步是一个短的写事务，步与步之间休眠，让请求的写事务插进来；
+// 之前创建的数据库第一次运行时先转换（执行一次 VACUUM，期间写者等待，热表只保留最新消息，通常只需几毫秒）。
+// 两者都报告每个数据库处理的页数、每秒页数和最长的一步（请求因此可能等待的最长时间）。
+
+#define BACKUP_STEP_PAGES 64 // 在线备份每步复制的页数（可用 CHAT_BACKUP_STEP_PAGES 修改）
+#define BACKUP_SLEEP_MS 5 // 在线备份每步之后的休眠（可用 CHAT_BACKUP_SLEEP_MS 修改）
+#define COMPACT_STEP_PAGES 32 // 增量清理每步释放的页数（可用 CHAT_COMPACT_STEP_PAGES 修改）
+#define COMPACT_SLEEP_MS 5 // 增量清理每步之后的休眠（可用 CHAT_COMPACT_SLEEP_MS 修改）
+#define MAINTENANCE_MAX_RETRIES 1000 // 连续遇到锁的次数上限，超过后放弃这个数据库
+
+// 一个数据库的备份或清理统计
+struct maintenance_stats {
+	long long pages; // 复制或释放的页数
+	int steps;
+	int retries; // 遇到锁而重试的次数
+	double elapsed_ms; // 总耗时（含休眠）
+	double max_step_ms; // 最长的一步
+};
+
+// 函数：判断目录项是否为数据库文件（主数据库或聊天室数据库）
+static int maintenance_db_filter(const struct dirent *entry) {
+	size_t len = strlen(entry->d_name);
+	return strcmp(entry->d_name, DB_FILE) == 0 ||
+	       (strncmp(entry->d_name, "chat_room_", 10) == 0 && len > 13 && strcmp(entry->d_name + len - 3, ".db") == 0);
+}
+
+// 函数：以读写方式打开已有的数据库（不创建、不迁移，不进入连接池），设置与请求相同的锁等待
+static sqlite3 *maintenance_open(const char *path) {
+	sqlite3 *db;
+	if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Can't open database %s: %s\n", path, sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return NULL;
+	}
+	sqlite3_busy_handler(db, db_busy_handler, NULL);
+	return db;
+}
+
+// 函数：执行返回一个整数的查询（PRAGMA 等），失败返回 -1
+static long long maintenance_query_int(sqlite3 *db, const char *sql) {
+	sqlite3_stmt *stmt;
+	long long value = -1;
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) return -1;
+	if (sqlite3_step(stmt) == SQLITE_ROW) value = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	return value;
+}
+
+// 函数：记录一步的耗时
+static void maintenance_step(struct maintenance_stats *stats, long long start_us) {
+	double ms = (monotonic_us() - start_us) / 1000.0;
+	stats->steps++;
+	if (ms > stats->max_step_ms) stats->max_step_ms = ms;
+}
+
+// 函数：输出一个数据库的统计
+static void maintenance_report(const char *action, const char *name, const struct maintenance_stats *stats) {
+	printf("%s %s: %lld pages in %d steps, %.1f ms, %.0f pages/s, longest step %.2f ms, %d busy retries\n", action, name,
+	       stats->pages, stats->steps, stats->elapsed_ms,
+	       stats->elapsed_ms > 0 ? stats->pages * 1000.0 / stats->elapsed_ms : 0.0, stats->max_step_ms, stats->retries);
+}
+
+// 函数：把数据库 src_path 在线备份到 dest_path（先写 dest_path.tmp，完成后改名）；成功返回 0
+static int backup_database(const char *src_path, const char *dest_path, struct maintenance_stats *stats) {
+	int step_pages = config_int("CHAT_BACKUP_STEP_PAGES", BACKUP_STEP_PAGES);
+	int sleep_ms = config_int("CHAT_BACKUP_SLEEP_MS", BACKUP_SLEEP_MS);
+	char tmp_path[PATH_MAX + 8];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", dest_path);
+	unlink(tmp_path);
+	long long start = monotonic_us();
+	sqlite3 *src = maintenance_open(src_path), *dest = NULL;
+	if (src == NULL) return 1;
+	// 读事务固定快照：之后的提交不会让备份从头开始
+	int rc = sqlite3_exec(src, "BEGIN; SELECT COUNT(*) FROM sqlite_master;", 0, 0, 0);
+	if (rc == SQLITE_OK) rc = sqlite3_open(tmp_path, &dest);
+	if (rc == SQLITE_OK) chmod(tmp_path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP); // 与数据库相同的 660 权限
+	sqlite3_backup *backup = rc == SQLITE_OK ? sqlite3_backup_init(dest, "main", src, "main") : NULL;
+	int busy = 0;
+	rc = backup != NULL ? SQLITE_OK : SQLITE_ERROR;
+	while (backup != NULL) {
+		long long step_start = monotonic_us();
+		rc = sqlite3_backup_step(backup, step_pages);
+		maintenance_step(stats, step_start);
+		if (rc == SQLITE_DONE) break;
+		if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+			stats->retries++;
+			if (++busy > MAINTENANCE_MAX_RETRIES) break;
+		} else if (rc != SQLITE_OK) {
+			break;
+		} else {
+			busy = 0;
+		}
+		if (sleep_ms > 0) usleep(sleep_ms * 1000);
+	}
+	if (backup != NULL) {
+		stats->pages = sqlite3_backup_pagecount(backup);
+		sqlite3_backup_finish(backup);
+	}
+	if (rc != SQLITE_DONE) fprintf(stderr, "Failed to back up %s: %s\n", src_path, sqlite3_errmsg(dest != NULL ? dest : src));
+	sqlite3_exec(src, "COMMIT;", 0, 0, 0);
+	sqlite3_close(src);
+	if (dest != NULL && sqlite3_close(dest) != SQLITE_OK) rc = SQLITE_ERROR;
+	stats->elapsed_ms = (monotonic_us() - start) / 1000.0;
+	if (rc != SQLITE_DONE || rename(tmp_path, dest_path) != 0) {
+		unlink(tmp_path);
+		return 1;
+	}
+	return 0;
+}
+
+// 函数：复制一个文件（先写临时文件再改名），返回复制的字节数，失败返回 -1
+static long long backup_copy_file(const char *src_path, const char *dest_path) {
+	char tmp_path[PATH_MAX + 296];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", dest_path);
+	int in = open(src_path, O_RDONLY | O_CLOEXEC);
+	int out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	long long total = in >= 0 && out >= 0 ? 0 : -1;
+	char buf[65536];
+	ssize_t n;
+	while (total >= 0 && (n = read(in, buf, sizeof(buf))) != 0) {
+		if (n < 0 || write(out, buf, n) != n) total = -1;
+		else total += n;
+	}
+	if (in >= 0) close(in);
+	if (out >= 0 && (fsync(out) != 0 || close(out) != 0)) total = -1;
+	if (total < 0 || rename(tmp_path, dest_path) != 0) {
+		unlink(tmp_path);
+		return -1;
+	}
+	return total;
+}
+
+// 函数：复制聊天室的归档目录；归档先写数据再写索引，所以先复制全部索引，再复制数据。返回复制的字节数，失败返回 -1
+static long long backup_archive(const char *src_dir, const char *dest_dir) {
+	struct dirent **names;
+	int n = scandir(src_dir, &names, NULL, alphasort);
+	if (n < 0) return 0; // 没有归档
+	long long total = 0;
+	if (mkdir(dest_dir, S_IRWXU | S_IRWXG) != 0 && errno != EEXIST) total = -1;
+	for (int pass = 0; pass < 2; pass++) {
+		const char *suffix = pass == 0 ? ".idx" : ".dat";
+		for (int i = 0; i < n && total >= 0; i++) {
+			size_t len = strlen(names[i]->d_name);
+			if (len <= 4 || strcmp(names[i]->d_name + len - 4, suffix) != 0) continue;
+			char src_path[PATH_MAX + 288], dest_path[PATH_MAX + 288];
+			snprintf(src_path, sizeof(src_path), "%s/%s", src_dir, names[i]->d_name);
+			snprintf(dest_path, sizeof(dest_path), "%s/%s", dest_dir, names[i]->d_name);
+			long long copied = backup_copy_file(src_path, dest_path);
+			total = copied >= 0 ? total + copied : -1;
+		}
+	}
+	for (int i = 0; i < n; i++) free(names[i]);
+	free(names);
+	if (total < 0) fprintf(stderr, "Failed to copy archive %s.\n", src_dir);
+	return total;
+}
+
+// 函数：列出数据目录（由 g_db_path 确定）中的数据库文件；返回数量，失败返回 -1（调用方释放 *names）
+static int maintenance_list(char *dir, size_t dir_size, struct dirent ***names) {
+	snprintf(dir, dir_size, "%.*s", (int)(strrchr(g_db_path, '/') - g_db_path), g_db_path);
+	int n = scandir(dir, names, maintenance_db_filter, alphasort);
+	if (n < 0) perror(dir);
+	return n;
+}
+
+// 函数：在线备份数据目录中的全部数据库和归档到 dest_dir；成功返回 0
+int run_backup(const char *dest_dir) {
+	char dir[MAX_DATA_DIR_LENGTH + 1];
+	struct dirent **names;
+	int n = maintenance_list(dir, sizeof(dir), &names);
+	if (n < 0) return 1;
+	if (mkdir(dest_dir, S_IRWXU | S_IRWXG) != 0 && errno != EEXIST) {
+		perror(dest_dir);
+		n = -1;
+	}
+	int rc = n < 0;
+	struct maintenance_stats total = {0};
+	for (int i = 0; i < n; i++) {
+		char src_path[PATH_MAX], dest_path[PATH_MAX];
+		struct maintenance_stats stats = {0};
+		snprintf(src_path, sizeof(src_path), "%s/%s", dir, names[i]->d_name);
+		snprintf(dest_path, sizeof(dest_path), "%s/%s", dest_dir, names[i]->d_name);
+		if (backup_database(src_path, dest_path, &stats) != 0) rc = 1;
+		maintenance_report("backup", names[i]->d_name, &stats);
+		total.pages += stats.pages;
+		total.steps += stats.steps;
+		total.retries += stats.retries;
+		total.elapsed_ms += stats.elapsed_ms;
+		if (stats.max_step_ms > total.max_step_ms) total.max_step_ms = stats.max_step_ms;
+
+		char src_archive[PATH_MAX + 16], dest_archive[PATH_MAX + 16];
+		snprintf(src_archive, sizeof(src_archive), "%s" ARCHIVE_SUFFIX, src_path);
+		snprintf(dest_archive, sizeof(dest_archive), "%s" ARCHIVE_SUFFIX, dest_path);
+		long long copied = backup_archive(src_archive, dest_archive);
+		if (copied < 0) rc = 1;
+		if (copied > 0) printf("backup %s" ARCHIVE_SUFFIX ": %lld bytes\n", names[i]->d_name, copied);
+		free(names[i]);
+	}
+	if (n >= 0) free(names);
+	maintenance_report("backup", "total", &total);
+	return rc;
+}
+
+// 函数：增量清理一个数据库：需要时先转换为增量自动清理，再分步释放全部空闲页；成功返回 0
+static int compact_database(const char *path, struct maintenance_stats *stats) {
+	int step_pages = config_int("CHAT_COMPACT_STEP_PAGES", COMPACT_STEP_PAGES);
+	int sleep_ms = config_int("CHAT_COMPACT_SLEEP_MS", COMPACT_SLEEP_MS);
+	long long start = monotonic_us();
+	sqlite3 *db = maintenance_open(path);
+	if (db == NULL) return 1;
+	int rc = SQLITE_OK;
+	long long free_pages = maintenance_query_int(db, "PRAGMA freelist_count;");
+	if (maintenance_query_int(db, "PRAGMA auto_vacuum;") != 2) {
+		// 旧数据库：设置只在 VACUUM 之后生效，VACUUM 同时释放全部空闲页（只需一次，期间写者等待）
+		long long step_start = monotonic_us();
+		rc = sqlite3_exec(db, "PRAGMA auto_vacuum = INCREMENTAL; VACUUM;", 0, 0, 0);
+		maintenance_step(stats, step_start);
+		if (rc == SQLITE_OK) {
+			printf("compact %s: converted to incremental auto-vacuum, VACUUM blocked writers for %.2f ms\n",
+			       strrchr(path, '/') + 1, stats->max_step_ms);
+			stats->pages = free_pages;
+		}
+	} else {
+		int busy = 0;
+		while (rc == SQLITE_OK && free_pages > 0) {
+			char sql[64];
+			snprintf(sql, sizeof(sql), "PRAGMA incremental_vacuum(%d);", step_pages);
+			long long step_start = monotonic_us();
+			rc = sqlite3_exec(db, sql, 0, 0, 0);
+			maintenance_step(stats, step_start);
+			if (rc == SQLITE_BUSY && ++busy <= MAINTENANCE_MAX_RETRIES) {
+				stats->retries++;
+				rc = SQLITE_OK;
+			} else if (rc == SQLITE_OK) {
+				long long left = maintenance_query_int(db, "PRAGMA freelist_count;");
+				stats->pages += free_pages - left;
+				free_pages = left;
+				busy = 0;
+			}
+			if (free_pages > 0 && sleep_ms > 0) usleep(sleep_ms * 1000);
+		}
+	}
+	// WAL 模式下文件在检查点时才变短；PASSIVE 不等待读者和写者
+	if (rc == SQLITE_OK) sqlite3_exec(db, "PRAGMA wal_checkpoint(PASSIVE);", 0, 0, 0);
+	if (rc != SQLITE_OK) fprintf(stderr, "Failed to compact %s: %s\n", path, sqlite3_errmsg(db));
+	sqlite3_close(db);
+	stats->elapsed_ms = (monotonic_us() - start) / 1000.0;
+	return rc == SQLITE_OK ? 0 : 1;
+}
+
+// 函数：增量清理数据目录中的全部数据库；成功返回 0
+int run_compact() {
+	char dir[MAX_DATA_DIR_LENGTH + 1];
+	struct dirent **names;
+	int n = maintenance_list(dir, sizeof(dir), &names);
+	if (n < 0) return 1;
+	int rc = 0;
+	for (int i = 0; i < n; i++) {
+		char path[PATH_MAX];
+		struct stat before, after;
+		struct maintenance_stats stats = {0};
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]->d_name);
+		if (stat(path, &before) != 0) before.st_size = 0;
+		if (compact_database(path, &stats) != 0) rc = 1;
+		if (stat(path, &after) != 0) after.st_size = 0;
+		maintenance_report("compact", names[i]->d_name, &stats);
+		printf("compact %s: file %lld -> %lld bytes\n", names[i]->d_name, (long long)before.st_size, (long long)after.st_size);
+		free(names[i]);
+	}
+	free(names);
+	return rc;
+}
+
+// ========== SCGI 常驻工作进程模式 ==========
+// 用法：chat_handler.cgi --scgi <unix:/path/to.sock | [host:]port> [worker 数量]
+// 由 nginx 等支持 SCGI 的前端转发请求，预先 fork 的工作进程各自保持数据库连接
+
+#define SCGI_DEFAULT_WORKERS 4 // 默认工作进程数量
+#define SCGI_MAX_HEADER_SIZE 16384 // SCGI 请求头的最大长度
+#define SERVER_MAX_WORKERS 64 // 工作进程数量上限（SCGI 与 HTTP 服务器模式共用）
+
+static volatile sig_atomic_t g_server_stop = 0; // 收到 SIGTERM 或 SIGINT 后置 1（SCGI 与 HTTP 服务器模式共用）
+
+// 处理函数会读取的 CGI 变量，其余 SCGI 请求头忽略
+static const char *scgi_cgi_vars[] = {"CONTENT_LENGTH", "REQUEST_METHOD", "QUERY_STRING", "HTTP_COOKIE",
+                                      "REMOTE_ADDR", "HTTP_CF_CONNECTING_IP", "HTTP_IF_NONE_MATCH",
+                                      "HTTP_LAST_EVENT_ID", "HTTP_ACCEPT_ENCODING", NULL};
+
+static void handle_stop_signal(int sig) {
+	(void)sig;
+	g_server_stop = 1;
+}
+
+// 函数：创建监听套接字，addr 为 "unix:/path" 或 "[host:]port"
+static int listen_socket(const char *addr) {
+	int fd;
+	if (strncmp(addr, "unix:", 5) == 0) {
+		struct sockaddr_un sun;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(addr + 5) >= sizeof(sun.sun_path)) {
+			fprintf(stderr, "Socket path is too long.\n");
+			return -1;
+		}
+		strcpy(sun.sun_path, addr + 5);
+		unlink(sun.sun_path);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+			perror("bind");
+			return -1;
+		}
+		chmod(sun.sun_path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP); // 660 权限，与数据库文件一致
+	} else {
+		struct sockaddr_in sin;
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // 默认只监听本机
+		const char *port = strrchr(addr, ':');
+		if (port) {
+			char host[64];
+			size_t host_len = port - addr;
+			if (host_len >= sizeof(host)) {
+				fprintf(stderr, "Invalid listen address: %s\n", addr);
+				return -1;
+			}
+			memcpy(host, addr, host_len);
+			host[host_len] = '\0';
+			if (inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+				fprintf(stderr, "Invalid listen address: %s\n", addr);
+				return -1;
+			}
+			port++;
+		} else {
+			port = addr;
+		}
+		sin.sin_port = htons(atoi(port));
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		int one = 1;
+		if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (fd < 0 || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+			perror("bind");
+			return -1;
+		}
+	}
+	if (listen(fd, SOMAXCONN) != 0) {
+		perror("listen");
+		return -1;
+	}
+	return fd;
+}
+
+// 函数：从连接中读取 SCGI 请求头（netstring 格式），并设置为 CGI 环境变量
+// 只读取请求头本身，请求体留在套接字中，由处理函数通过 stdin 读取
+static int scgi_read_headers(int conn, char *headers, size_t headers_size) {
+	size_t len = 0;
+	char c;
+	for (;;) {
+		if (read(conn, &c, 1) != 1) return -1;
+		if (c == ':') break;
+		if (!isdigit((unsigned char)c)) return -1;
+		len = len * 10 + (c - '0');
+		if (len >= headers_size) return -1;
+	}
+
+	size_t got = 0;
+	while (got < len + 1) { // 包括结尾的 ','
+		ssize_t n = read(conn, headers + got, len + 1 - got);
+		if (n <= 0) return -1;
+		got += n;
+	}
+	if (headers[len] != ',') return -1;
+	headers[len] = '\0';
+
+	// 清除上一个请求留下的 CGI 变量，避免串到当前请求
+	for (int i = 0; scgi_cgi_vars[i]; i++) {
+		unsetenv(scgi_cgi_vars[i]);
+	}
+
+	// 请求头由 "名称\0值\0" 依次排列
+	char *p = headers;
+	while (p < headers + len) {
+		char *name = p;
+		char *value = name + strlen(name) + 1;
+		if (value >= headers + len) return -1;
+		p = value + strlen(value) + 1;
+		for (int i = 0; scgi_cgi_vars[i]; i++) {
+			if (strcmp(name, scgi_cgi_vars[i]) == 0) {
+				setenv(name, value, 1);
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+// 函数：工作进程主循环，逐个接受连接并复用 route_request 处理
+static void scgi_worker_loop(int listen_fd, int index) {
+	(void)index;
+	char headers[SCGI_MAX_HEADER_SIZE];
+	int devnull = open("/dev/null", O_RDWR);
+
+	g_db_persistent = 1;
+	setvbuf(stdin, NULL, _IONBF, 0); // 不缓冲 stdin，避免上一个连接的数据残留在缓冲区中
+
+	while (!g_server_stop) {
+		int conn = accept(listen_fd, NULL, NULL);
+		if (conn < 0) {
+			if (errno == EINTR) continue;
+			perror("SCGI accept");
+			break;
+		}
+
+		if (scgi_read_headers(conn, headers, sizeof(headers)) == 0) {
+			dup2(conn, STDIN_FILENO);
+			dup2(conn, STDOUT_FILENO);
+			clearerr(stdin);
+			timer_reset();
+			route_request();
+			fflush(stdout);
+			metrics_record();
+			dup2(devnull, STDIN_FILENO);
+			dup2(devnull, STDOUT_FILENO);
+		}
+		close(conn);
+	}
+
+	db_shutdown();
+	exit(0);
+}
+
+// 函数：主进程 fork 出 workers 个工作进程运行 worker_loop（参数为监听套接字和工作进程的序号），
+// 并在工作进程退出时重新拉起；收到 SIGTERM 或 SIGINT 后结束全部工作进程
+static int run_workers(int listen_fd, int workers, void (*worker_loop)(int, int), const char *name) {
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_stop_signal;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN); // 客户端提前断开时不终止工作进程
+
+	pid_t pids[SERVER_MAX_WORKERS];
+	for (int i = 0; i < workers; i++) {
+		pids[i] = fork();
+		if (pids[i] == 0) worker_loop(listen_fd, i);
+	}
+
+	while (!g_server_stop) {
+		int status;
+		pid_t pid = wait(&status);
+		if (pid < 0) continue;
+		for (int i = 0; i < workers; i++) {
+			if (pids[i] == pid && !g_server_stop) {
+				fprintf(stderr, "%s worker %d exited, restarting.\n", name, (int)pid);
+				pids[i] = fork();
+				if (pids[i] == 0) worker_loop(listen_fd, i);
+			}
+		}
+	}
+
+	for (int i = 0; i < workers; i++) {
+		kill(pids[i], SIGTERM);
+	}
+	while (wait(NULL) > 0);
+	close(listen_fd);
+	return 0;
+}
+
+// 函数：启动 SCGI 服务器
+int run_scgi_server(const char *addr, int workers) {
+	if (workers <= 0 || workers > SERVER_MAX_WORKERS) workers = SCGI_DEFAULT_WORKERS;
+
+	if (init_database() != 0) {
+		fprintf(stderr, "Failed to initialize database.\n");
+		return 1;
+	}
+
+	int listen_fd = listen_socket(addr);
+	if (listen_fd < 0) return 1;
+	fprintf(stderr, "SCGI server listening on %s with %d workers.\n", addr, workers);
+	return run_workers(listen_fd, workers, scgi_worker_loop, "SCGI");
+}
+
+
+// ========== HTTP/WebSocket 服务器模式 ==========
+// 用法：chat_handler.cgi --serve <[host:]port | unix:/path> [工作进程数量]
+// 不经过 busybox_HTTPD 和 CGI，直接接受浏览器的 HTTP/1.1 连接（保持连接，支持流水线请求）。
+// 默认每个 CPU 一个单线程工作进程（绑定到各自的 CPU），每个工作进程用 epoll 同时处理全部连接。
+// 普通的 API 请求按 CGI 的方式设置环境变量后交给 route_request，stdin 和 stdout 换成内存中的请求体和响应，
+// 所以响应与 CGI 模式逐字节相同，只是 Status 头换成了 HTTP 状态行。
+// 推送连接（?action=stream 的 Server-Sent Events，或同一地址上的 WebSocket）不占用工作进程：
+// 工作进程为有订阅者的聊天室保存一份最近消息的进程内日志，通过 inotify 监视通知文件，
+// 有新消息时从共享环（不可用时才查询数据库）读取一次、生成一次事件，再在一遍循环中追加给全部订阅者。
+// WebSocket 上每条新消息是一个文本帧，内容与 SSE 事件的 data 相同；客户端发来的文本帧作为 POST 请求体
+// （message=...）发送消息，JSON 结果同样以文本帧返回。
+// 聊天页面和账户管理页面也由服务器提供，页面中的 ./cgi-bin/chat_handler.cgi 地址不变。页面文件和 make 时生成的
+// .gz/.br 版本在工作进程中保持打开，请求时只选择版本、写响应头，内容由 sendfile 从页缓存直接发送，
+// 并带有强 ETag 和较长的缓存时间，浏览器在缓存期内不再请求，之后的验证请求回应 304。
+
+#define SERVER_MAX_REQUEST_HEADER 16384 // HTTP 请求头的最大长度
+#define SERVER_MAX_BODY (1024 * 1024) // 请求体的最大长度
+#define SERVER_MAX_PENDING (4 * 1024 * 1024) // 推送连接积压的待发送数据上限，超过时断开（客户端重连后补发）
+#define SERVER_READ_CHUNK 16384 // 每次从连接读取的字节数
+#define SERVER_MAX_EVENTS 256 // 每次 epoll_wait 处理的事件数量
+#define SERVER_IDLE_SECONDS 60 // 空闲的保持连接在多少秒后关闭
+#define SERVER_LOG_MESSAGES 256 // 每个聊天室在进程内保留的最近消息数量，新订阅者从这里补发
+#define SERVER_API_PATH "/chat_handler.cgi" // 以此结尾的路径为聊天 API（与 CGI 部署时的地址相同）
+#define STATIC_MAX_AGE 86400 // 页面的默认缓存时间（秒），可用 CHAT_STATIC_MAX_AGE 修改；过期后凭 ETag 验证，未修改时回应 304
+#define WS_MAX_FRAME 65536 // 客户端发来的 WebSocket 帧的最大长度
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11" // 计算 Sec-WebSocket-Accept 的固定字符串（RFC 6455）
+
+enum {
+	WS_OPCODE_TEXT = 0x1,
+	WS_OPCODE_CLOSE = 0x8,
+	WS_OPCODE_PING = 0x9,
+	WS_OPCODE_PONG = 0xa,
+};
+
+enum {
+	CONN_HTTP, // 普通请求（保持连接）
+	CONN_SSE, // Server-Sent Events 订阅者
+	CONN_WEBSOCKET, // WebSocket 订阅者
+};
+
+// 一个客户端连接
+struct server_conn {
+	int fd; // 已关闭时为 -1（本轮事件处理完后才释放）
+	int kind;
+	int close_after_write; // 发送完 out 中的数据后关闭
+	int want_write; // 已在 epoll 中注册 EPOLLOUT
+	int room; // 订阅的聊天室（g_server.rooms 的下标），没有订阅时为 -1
+	int subscriber_index; // 在聊天室订阅者数组中的位置
+	time_t last_active; // 最近一次收到数据的时间
+	time_t last_sent; // 最近一次发送数据的时间（推送连接据此发送心跳）
+	char remote_addr[INET6_ADDRSTRLEN];
+	char *in, *out; // 已收到但未处理的数据；等待发送的数据（从 out_pos 开始）
+	size_t in_len, in_cap, out_pos, out_len, out_cap;
+	int file_fd; // out 发送完后继续用 sendfile 发送的文件（file_pos 到 file_end），-1 表示没有
+	off_t file_pos, file_end;
+	char *ws_query, *ws_cookie, *ws_forwarded_ip; // WebSocket 握手时的查询字符串、Cookie 和代理头，发送消息时沿用
+	struct server_conn *prev, *next; // 全部连接的链表（关闭后 next 用于待释放链表）
+};
+
+// 进程内日志中的一条消息（已写成 JSON 对象）
+struct server_log_entry {
+	long long id;
+	char *json;
+	size_t len;
+};
+
+// 一个有订阅者的聊天室
+struct server_room {
+	int in_use;
+	int pending; // 收到了通知，本轮事件处理完后推送
+	char name[MAX_ROOM_NAME_LENGTH + 1]; // 空字符串为默认聊天室
+	int watch; // 通知文件的 inotify 监视描述符，-1 表示尚未监视
+	long long last_id; // 已推送给订阅者的最新消息 ID
+	long long log_base_id; // 日志包含 ID 大于它的全部消息
+	unsigned long long log_head; // 累计写入日志的消息数，下一条写到 log[log_head % SERVER_LOG_MESSAGES]
+	struct server_log_entry log[SERVER_LOG_MESSAGES];
+	struct server_conn **subscribers;
+	int subscriber_count, subscriber_capacity;
+};
+
+// 解析后的 HTTP 请求，字符串指向连接的接收缓冲区
+struct http_request {
+	char *method, *path, *query;
+	int minor_version;
+	long long content_length;
+	int chunked;
+	int keep_alive;
+	const char *cookie, *accept_encoding, *if_none_match, *last_event_id, *forwarded_ip;
+	const char *connection, *upgrade, *ws_key, *ws_version;
+};
+
+// 由服务器直接提供的页面（位于 CHAT_DOC_ROOT，默认为当前目录）。make 时生成的 .gz 和 .br 文件（--precompress）
+// 按 Accept-Encoding 原样用 sendfile 发送；文件在工作进程中保持打开，每秒检查一次是否被替换
+struct server_asset {
+	const char *path;
+	const char *file;
+	int fd[3]; // 各编码的文件（下标为 ENCODING_*），-1 表示没有
+	off_t size[3];
+	struct stat st[3]; // 打开时的文件信息，据此发现文件被修改或替换（没有文件时为全 0）
+	char etag[3][40]; // 强 ETag：原始页面内容的 SHA-256 前缀，压缩版本加上编码名称
+};
+
+static struct server_asset server_assets[] = {
+	{.path = "/chat.html", .file = "chat.html"},
+	{.path = "/user_management.html", .file = "user_management.html"},
+};
+
+// 工作进程的状态
+static struct {
+	int epoll_fd;
+	int listen_fd;
+	int notify_fd; // inotify，监视各聊天室的通知文件
+	struct server_conn *conns; // 全部打开的连接
+	struct server_conn *closed; // 本轮已关闭、待释放的连接
+	struct server_room *rooms;
+	int room_count;
+	int static_max_age; // 页面的 Cache-Control max-age
+} g_server;
+
+// 函数：确保缓冲区至少能容纳 need 字节，失败返回 -1
+static int server_reserve(char **buf, size_t *cap, size_t need) {
+	if (need <= *cap) return 0;
+	size_t new_cap = *cap ? *cap * 2 : 4096;
+	while (new_cap < need) new_cap *= 2;
+	char *p = realloc(*buf, new_cap);
+	if (p == NULL) return -1;
+	*buf = p;
+	*cap = new_cap;
+	return 0;
+}
+
+// 函数：取消连接对聊天室的订阅
+static void server_unsubscribe(struct server_conn *c) {
+	if (c->room < 0) return;
+	struct server_room *room = &g_server.rooms[c->room];
+	struct server_conn *last = room->subscribers[--room->subscriber_count];
+	room->subscribers[c->subscriber_index] = last;
+	last->subscriber_index = c->subscriber_index;
+	c->room = -1;
+}
+
+// 函数：关闭连接；结构体在本轮事件处理完后才释放，之后的事件仍可以安全地检查 fd
+static void server_conn_close(struct server_conn *c) {
+	if (c->fd < 0) return;
+	server_unsubscribe(c);
+	close(c->fd);
+	c->fd = -1;
+	if (c->file_fd >= 0) close(c->file_fd);
+	c->file_fd = -1;
+	if (c->prev != NULL) c->prev->next = c->next;
+	else g_server.conns = c->next;
+	if (c->next != NULL) c->next->prev = c->prev;
+	c->next = g_server.closed;
+	g_server.closed = c;
+}
+
+// 函数：释放本轮关闭的连接
+static void server_free_closed() {
+	while (g_server.closed != NULL) {
+		struct server_conn *c = g_server.closed;
+		g_server.closed = c->next;
+		free(c->in);
+		free(c->out);
+		free(c->ws_query);
+		free(c->ws_cookie);
+		free(c->ws_forwarded_ip);
+		free(c);
+	}
+}
+
+// 函数：写出之后的处理：需要关闭且已发送完时关闭连接（返回 -1），否则按是否还有待发送数据调整 EPOLLOUT
+static int server_after_write(struct server_conn *c) {
+	int want_write = c->out_pos < c->out_len || c->file_fd >= 0;
+	if (!want_write && c->close_after_write) {
+		server_conn_close(c);
+		return -1;
+	}
+	if (want_write != c->want_write) {
+		struct epoll_event ev = {.events = EPOLLIN | (want_write ? EPOLLOUT : 0), .data.ptr = c};
+		epoll_ctl(g_server.epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+		c->want_write = want_write;
+	}
+	return 0;
+}
+
+// 函数：尽量写出积压的数据；连接已关闭时返回 -1
+static int server_flush(struct server_conn *c) {
+	while (c->out_pos < c->out_len) {
+		ssize_t n = write(c->fd, c->out + c->out_pos, c->out_len - c->out_pos);
+		if (n > 0) {
+			c->out_pos += n;
+			c->last_sent = time(NULL);
+			continue;
+		}
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		server_conn_close(c);
+		return -1;
+	}
+	if (c->out_pos == c->out_len) c->out_pos = c->out_len = 0;
+	while (c->out_len == 0 && c->file_fd >= 0) {
+		ssize_t n = sendfile(c->fd, c->file_fd, &c->file_pos, c->file_end - c->file_pos);
+		if (n > 0) {
+			c->last_sent = time(NULL);
+			if (c->file_pos == c->file_end) {
+				close(c->file_fd);
+				c->file_fd = -1;
+			}
+			continue;
+		}
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		server_conn_close(c); // 出错，或文件被截短
+		return -1;
+	}
+	return server_after_write(c);
+}
+
+// 函数：发送数据；没有积压时直接写入套接字，写不完的部分放入发送缓冲区。连接已关闭时返回 -1
+static int server_send(struct server_conn *c, const void *data, size_t len) {
+	size_t pending = c->out_len - c->out_pos;
+	if (pending == 0 && c->file_fd < 0 && len > 0) {
+		ssize_t n;
+		do {
+			n = write(c->fd, data, len);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			server_conn_close(c);
+			return -1;
+		}
+		if (n > 0) {
+			data = (const char *)data + n;
+			len -= n;
+			c->last_sent = time(NULL);
+		}
+		c->out_pos = c->out_len = 0;
+	}
+	if (len > 0) {
+		// 推送连接的客户端长时间不读取时断开，避免积压占满内存
+		if (c->kind != CONN_HTTP && pending + len > SERVER_MAX_PENDING) {
+			server_conn_close(c);
+			return -1;
+		}
+		if (c->out_pos > 0) {
+			memmove(c->out, c->out + c->out_pos, pending);
+			c->out_pos = 0;
+			c->out_len = pending;
+		}
+		if (server_reserve(&c->out, &c->out_cap, c->out_len + len) != 0) {
+			server_conn_close(c);
+			return -1;
+		}
+		memcpy(c->out + c->out_len, data, len);
+		c->out_len += len;
+	}
+	return server_after_write(c);
+}
+
+// 函数：发送响应头和文件 fd 的前 size 字节；文件内容由 sendfile 直接从页缓存发送，不复制到用户空间。
+// 套接字写不下时复制一个描述符，剩下的部分在可写时由 server_flush 继续发送
+static int server_send_file(struct server_conn *c, const char *header, size_t header_len, int fd, off_t size) {
+	off_t pos = 0;
+	if (c->out_pos == c->out_len) {
+		ssize_t n;
+		do {
+			n = send(c->fd, header, header_len, size > 0 ? MSG_MORE : 0); // 响应头与文件开头合并成一个数据包
+		} while (n < 0 && errno == EINTR);
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			server_conn_close(c);
+			return -1;
+		}
+		if (n > 0) {
+			header += n;
+			header_len -= n;
+			c->last_sent = time(NULL);
+		}
+		while (header_len == 0 && pos < size) {
+			n = sendfile(c->fd, fd, &pos, size - pos);
+			if (n > 0 || (n < 0 && errno == EINTR)) continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+			server_conn_close(c);
+			return -1;
+		}
+	}
+	if (pos < size) {
+		// 页面文件之后可能被替换，复制的描述符保证发送完原来的内容
+		c->file_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (c->file_fd < 0) {
+			server_conn_close(c);
+			return -1;
+		}
+		c->file_pos = pos;
+		c->file_end = size;
+	}
+	if (header_len > 0) return server_send(c, header, header_len); // 排在文件之前
+	return server_after_write(c);
+}
+
+// 函数：发送 JSON 错误响应（格式与 API 的错误响应相同）并在发送完后关闭连接；message 中不能有需要转义的字符
+static int server_send_error(struct server_conn *c, int http_status, const char *status_text, const char *message,
+                             const char *extra_headers) {
+	char body[256], response[768];
+	int body_len = snprintf(body, sizeof(body), "{\"status\":\"error\",\"message\":\"%s\"}\n", message);
+	int len = snprintf(response, sizeof(response),
+	                   "HTTP/1.1 %d %s\r\n%sContent-Type: application/json\r\nContent-Length: %d\r\nConnection: close\r\n\r\n%s",
+	                   http_status, status_text, extra_headers ? extra_headers : "", body_len, body);
+	c->close_after_write = 1;
+	return server_send(c, response, len);
+}
+
+// 函数：生成 WebSocket 帧头（服务器发出的帧不带掩码），返回帧头长度
+static size_t ws_frame_header(unsigned char *header, int opcode, size_t len) {
+	header[0] = 0x80 | opcode; // FIN
+	if (len < 126) {
+		header[1] = len;
+		return 2;
+	}
+	if (len <= 0xffff) {
+		header[1] = 126;
+		header[2] = len >> 8;
+		header[3] = len;
+		return 4;
+	}
+	header[1] = 127;
+	for (int i = 0; i < 8; i++) header[2 + i] = (unsigned long long)len >> (56 - 8 * i);
+	return 10;
+}
+
+// 函数：发送一个 WebSocket 帧
+static int ws_send(struct server_conn *c, int opcode, const char *payload, size_t len) {
+	char *frame = malloc(len + 10);
+	if (frame == NULL) {
+		server_conn_close(c);
+		return -1;
+	}
+	size_t header_len = ws_frame_header((unsigned char *)frame, opcode, len);
+	memcpy(frame + header_len, payload, len);
+	int rc = server_send(c, frame, header_len + len);
+	free(frame);
+	return rc;
+}
+
+// 函数：发送关闭帧（status 为 RFC 6455 的关闭状态码），发送完后关闭连接
+static int ws_close(struct server_conn *c, int status) {
+	char payload[2] = {(char)(status >> 8), (char)status};
+	c->close_after_write = 1;
+	return ws_send(c, WS_OPCODE_CLOSE, payload, sizeof(payload));
+}
+
+// 函数：把日志中的一条消息写成 SSE 事件或 WebSocket 文本帧
+static void server_write_event(FILE *out, int websocket, const struct server_log_entry *e) {
+	if (websocket) {
+		unsigned char header[10];
+		fwrite(header, 1, ws_frame_header(header, WS_OPCODE_TEXT, e->len), out);
+		fwrite(e->json, 1, e->len, out);
+	} else {
+		// JSON 输出不含换行，可以直接作为一行 data
+		fprintf(out, "id: %lld\ndata: ", e->id);
+		fwrite(e->json, 1, e->len, out);
+		fputs("\n\n", out);
+	}
+}
+
+// 函数：把一条消息写成 JSON 对象，放入 e（e->json 由调用方释放）；失败返回 -1
+static int server_render_message(struct server_log_entry *e, long long id, long long timestamp, const char *ip,
+                                 const char *username, const char *message) {
+	FILE *out = open_memstream(&e->json, &e->len);
+	if (out == NULL) return -1;
+	json_write_message_fields(out, id, timestamp, ip, username, message);
+	fclose(out);
+	e->id = id;
+	return 0;
+}
+
+// 函数：把一条消息追加到聊天室的进程内日志（覆盖最早的一条），并推进 last_id
+static int server_log_append(struct server_room *room, long long id, long long timestamp, const char *ip,
+                             const char *username, const char *message) {
+	struct server_log_entry entry;
+	if (server_render_message(&entry, id, timestamp, ip, username, message) != 0) return -1;
+	struct server_log_entry *slot = &room->log[room->log_head % SERVER_LOG_MESSAGES];
+	if (room->log_head >= SERVER_LOG_MESSAGES) {
+		room->log_base_id = slot->id;
+		free(slot->json);
+	}
+	*slot = entry;
+	room->log_head++;
+	room->last_id = id;
+	return 0;
+}
+
+// 函数：从共享环读取 ID 大于 after_id 的消息并追加到日志；只有环有效、没有落后于通知且包含全部这些消息时才使用，
+// 成功返回追加的条数，否则返回 -1（调用方改为查询数据库）
+static int server_room_fetch_ring(struct server_room *room, long long after_id) {
+	struct ring_file *ring = ring_map(0);
+	if (ring == NULL) return -1;
+	static struct ring_slot copies[MAX_MESSAGES_GET];
+	long long latest_id, min_id;
+	int count = ring_read(ring, after_id, copies, &latest_id, &min_id);
+	if (count < 0 || latest_id < read_notified_id() || (count > 0 && after_id < min_id - 1)) return -1;
+	const char *fields[MAX_MESSAGES_GET][3];
+	for (int i = 0; i < count; i++) {
+		if (ring_slot_fields(&copies[i], fields[i]) != 0) return -1;
+	}
+	for (int i = count - 1; i >= 0; i--) {
+		if (server_log_append(room, copies[i].id, copies[i].timestamp, fields[i][0], fields[i][1], fields[i][2]) != 0) {
+			return count - 1 - i;
+		}
+	}
+	return count;
+}
+
+// 函数：把新消息（ID 大于 room->last_id）追加到日志，返回追加的条数，失败时返回 -1
+// 优先读取共享环；否则查询数据库，每次最多 SERVER_LOG_MESSAGES 条（调用方在取满时继续）
+static int server_room_fetch(struct server_room *room) {
+	select_room(room->name);
+	int count = server_room_fetch_ring(room, room->last_id);
+	if (count >= 0) return count;
+
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	if (db_acquire_room(&db) != SQLITE_OK) return -1;
+	count = -1;
+	if (db_prepare(db, "SELECT id, timestamp, ip, username, message FROM messages WHERE id > ? ORDER BY id ASC LIMIT ?;", &stmt) ==
+	    SQLITE_OK) {
+		sqlite3_bind_int64(stmt, 1, room->last_id);
+		sqlite3_bind_int(stmt, 2, SERVER_LOG_MESSAGES);
+		count = 0;
+		while (sqlite3_step(stmt) == SQLITE_ROW &&
+		       server_log_append(room, sqlite3_column_int64(stmt, 0), sqlite3_column_int64(stmt, 1),
+		                         (const char *)sqlite3_column_text(stmt, 2), (const char *)sqlite3_column_text(stmt, 3),
+		                         (const char *)sqlite3_column_text(stmt, 4)) == 0) {
+			count++;
+		}
+		db_finalize(stmt);
+	}
+	db_release(db);
+	return count;
+}
 
-		const char *sql_check_user = "SELECT username FROM users WHERE username = ?;";
-		rc = sqlite3_prepare_v2(db, sql_check_user, -1, &stmt, 0);
-		sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-		if (sqlite3_step(stmt) == SQLITE_ROW) {
-			sqlite3_finalize(stmt);
-			sqlite3_close(db);
-			cJSON *response_json = cJSON_CreateObject();
-			cJSON_AddStringToObject(response_json, "status", "error");
-			cJSON_AddStringToObject(response_json, "message", "User already exists.");
-			send_json_response(409, "Conflict", response_json);
-			return 1;
+// 函数：把聊天室的新消息推送给全部订阅者
+// 新消息只读取一次、生成一次 SSE 事件和 WebSocket 帧，再在一遍循环中追加到每个订阅者；不按订阅者查询数据库
+static void server_room_publish(int index) {
+	for (;;) {
+		struct server_room *room = &g_server.rooms[index];
+		unsigned long long first = room->log_head;
+		int count = server_room_fetch(room);
+		if (count <= 0) return;
+
+		char *sse = NULL, *ws = NULL;
+		size_t sse_len = 0, ws_len = 0;
+		FILE *sse_out = open_memstream(&sse, &sse_len);
+		FILE *ws_out = open_memstream(&ws, &ws_len);
+		if (sse_out != NULL && ws_out != NULL) {
+			for (unsigned long long i = first; i < room->log_head; i++) {
+				server_write_event(sse_out, 0, &room->log[i % SERVER_LOG_MESSAGES]);
+				server_write_event(ws_out, 1, &room->log[i % SERVER_LOG_MESSAGES]);
+			}
 		}
-		sqlite3_finalize(stmt);
-		
-		const char *sql_insert_user = "INSERT INTO users (username, password) VALUES (?, ?);";
-		rc = sqlite3_prepare_v2(db, sql_insert_user, -1, &stmt, 0);
-		sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-		sqlite3_bind_text(stmt, 2, password, -1, SQLITE_STATIC);
-		rc = sqlite3_step(stmt);
-		if (rc != SQLITE_DONE) {
-			sqlite3_finalize(stmt);
-			sqlite3_close(db);
-			cJSON *response_json = cJSON_CreateObject();
-			cJSON_AddStringToObject(response_json, "status", "error");
-			cJSON_AddStringToObject(response_json, "message", "Failed to register user.");
-			send_json_response(500, "Internal Server Error", response_json);
-			return 1;
+		if (sse_out != NULL) fclose(sse_out);
+		if (ws_out != NULL) fclose(ws_out);
+		// 倒序遍历：发送失败的订阅者被关闭时，数组末尾（已处理过）的订阅者移到它的位置
+		for (int i = room->subscriber_count - 1; i >= 0; i--) {
+			struct server_conn *c = room->subscribers[i];
+			if (c->close_after_write) continue;
+			if (c->kind == CONN_WEBSOCKET) server_send(c, ws, ws_len);
+			else server_send(c, sse, sse_len);
 		}
-		sqlite3_finalize(stmt);
+		free(sse);
+		free(ws);
+		if (count < SERVER_LOG_MESSAGES) return;
+	}
+}
 
-		sqlite3_close(db);
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "success");
-		cJSON_AddStringToObject(response_json, "message", "User registered successfully.");
-		send_json_response(200, "OK", response_json);
-		return 0;
+// 函数：开始监视当前聊天室（select_room 选择的）的通知文件
+static void server_room_watch(struct server_room *room) {
+	if (g_server.notify_fd < 0) return;
+	int fd = open(g_room.notify_path, O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP); // 确保通知文件存在
+	if (fd >= 0) close(fd);
+	room->watch = inotify_add_watch(g_server.notify_fd, g_room.notify_path, IN_CLOSE_WRITE);
+}
+
+// 函数：释放没有订阅者的聊天室
+static void server_room_free(struct server_room *room) {
+	if (room->watch >= 0) inotify_rm_watch(g_server.notify_fd, room->watch);
+	unsigned long long n = room->log_head < SERVER_LOG_MESSAGES ? room->log_head : SERVER_LOG_MESSAGES;
+	for (unsigned long long i = room->log_head - n; i < room->log_head; i++) {
+		free(room->log[i % SERVER_LOG_MESSAGES].json);
 	}
+	free(room->subscribers);
+	memset(room, 0, sizeof(*room));
+}
 
-	// 登录 (POST action=login)
-	if (strcmp(request_method, "POST") == 0 && strcmp(action, "login") == 0) {
-		if (strlen(username) == 0 || strlen(password) == 0) {
-			cJSON *response_json = cJSON_CreateObject();
-			cJSON_AddStringToObject(response_json, "status", "error");
-			cJSON_AddStringToObject(response_json, "message", "Username and password are required.");
-			send_json_response(400, "Bad Request", response_json);
-			return 1;
+// 函数：找到或创建聊天室 name 的进程内日志（调用方已用 select_room 选择该聊天室），返回下标，失败时返回 -1
+// 新建时先开始监视再读取当前最新的消息，两者之间写入的消息会由之后的通知补上
+static int server_room_open(const char *name) {
+	int index = -1;
+	for (int i = 0; i < g_server.room_count; i++) {
+		if (g_server.rooms[i].in_use && strcmp(g_server.rooms[i].name, name) == 0) return i;
+		if (!g_server.rooms[i].in_use && index < 0) index = i;
+	}
+	if (index < 0) {
+		struct server_room *rooms = realloc(g_server.rooms, (g_server.room_count + 1) * sizeof(*rooms));
+		if (rooms == NULL) return -1;
+		g_server.rooms = rooms;
+		index = g_server.room_count++;
+	}
+	struct server_room *room = &g_server.rooms[index];
+	memset(room, 0, sizeof(*room));
+	snprintf(room->name, sizeof(room->name), "%s", name);
+	room->watch = -1;
+	server_room_watch(room);
+
+	// 共享环中的最新消息作为日志的初始内容；环不存在时先从 SQLite 重建
+	struct ring_file *ring = ring_map(0);
+	if (ring == NULL || ring->magic != RING_MAGIC) {
+		sqlite3 *db;
+		if (db_acquire_room(&db) == SQLITE_OK) {
+			rebuild_snapshot(db);
+			db_release(db);
 		}
-		const char *sql_check_user = "SELECT password FROM users WHERE username = ?;";
-		rc = sqlite3_prepare_v2(db, sql_check_user, -1, &stmt, 0);
-		sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-		if (sqlite3_step(stmt) == SQLITE_ROW) {
-			const char *stored_password = (const char *)sqlite3_column_text(stmt, 0);
-			if (strcmp(password, stored_password) == 0) {
-				sqlite3_finalize(stmt);
-				sqlite3_close(db);
-				cJSON *response_json = cJSON_CreateObject();
-				cJSON_AddStringToObject(response_json, "status", "success");
-				cJSON_AddStringToObject(response_json, "message", "Login successful.");
-				send_json_response(200, "OK", response_json);
-				return 0;
-			}
+	}
+	long long latest_id, min_id;
+	static struct ring_slot copies[MAX_MESSAGES_GET];
+	ring = ring_map(0);
+	int count = ring != NULL ? ring_read(ring, 0, copies, &latest_id, &min_id) : -1;
+	if (count >= 0 && latest_id >= read_notified_id()) {
+		room->last_id = room->log_base_id = count > 0 ? copies[count - 1].id - 1 : latest_id;
+		if (server_room_fetch_ring(room, room->last_id) >= 0) {
+			room->in_use = 1;
+			return index;
 		}
-		sqlite3_finalize(stmt);
-		sqlite3_close(db);
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "Invalid username or password.");
-		send_json_response(401, "Unauthorized", response_json);
-		return 1;
 	}
-	
-	// 修改密码 (POST action=update)
-	if (strcmp(request_method, "POST") == 0 && strcmp(action, "update") == 0) {
-		if (strlen(username) == 0 || strlen(password) == 0 || strlen(new_password) == 0) {
-			cJSON *response_json = cJSON_CreateObject();
-			cJSON_AddStringToObject(response_json, "status", "error");
-			cJSON_AddStringToObject(response_json, "message", "Username, old password, and new password are required.");
-			send_json_response(400, "Bad Request", response_json);
-			return 1;
+
+	// 共享环不可用：只记下最新 ID，日志从之后的新消息开始（更早的消息由补发时查询数据库）
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	int rc = db_acquire_room(&db);
+	if (rc == SQLITE_OK) {
+		rc = db_prepare(db, "SELECT IFNULL(MAX(id), 0) FROM messages;", &stmt);
+		if (rc == SQLITE_OK) {
+			if (sqlite3_step(stmt) == SQLITE_ROW) room->last_id = room->log_base_id = sqlite3_column_int64(stmt, 0);
+			else rc = SQLITE_ERROR;
+			db_finalize(stmt);
 		}
+		db_release(db);
+	}
+	if (rc != SQLITE_OK) {
+		server_room_free(room);
+		return -1;
+	}
+	room->in_use = 1;
+	return index;
+}
 
-		const char *sql_check_user = "SELECT password FROM users WHERE username = ?;";
-		rc = sqlite3_prepare_v2(db, sql_check_user, -1, &stmt, 0);
-		sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-		if (sqlite3_step(stmt) == SQLITE_ROW) {
-			const char *stored_password = (const char *)sqlite3_column_text(stmt, 0);
-			if (strcmp(password, stored_password) == 0) {
-				sqlite3_finalize(stmt);
-				
-				const char *sql_update = "UPDATE users SET password = ? WHERE username = ?;";
-				rc = sqlite3_prepare_v2(db, sql_update, -1, &stmt, 0);
-				sqlite3_bind_text(stmt, 1, new_password, -1, SQLITE_STATIC);
-				sqlite3_bind_text(stmt, 2, username, -1, SQLITE_STATIC);
-				if (sqlite3_step(stmt) == SQLITE_DONE) {
-					sqlite3_finalize(stmt);
-					sqlite3_close(db);
-					cJSON *response_json = cJSON_CreateObject();
-					cJSON_AddStringToObject(response_json, "status", "success");
-					cJSON_AddStringToObject(response_json, "message", "Password updated successfully.");
-					send_json_response(200, "OK", response_json);
-					return 0;
+// 函数：把 ID 大于 last_id 的消息补发给新订阅者（到聊天室日志的 last_id 为止，之后的由推送负责）
+// 在日志范围内的直接取自日志；更早的（离线很久后重连的客户端）查询一次数据库
+static int server_catch_up(struct server_conn *c, struct server_room *room, long long last_id) {
+	if (last_id >= room->last_id) return 0;
+	int websocket = c->kind == CONN_WEBSOCKET;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&buf, &len);
+	if (out == NULL) {
+		server_conn_close(c);
+		return -1;
+	}
+	if (last_id < room->log_base_id) {
+		sqlite3 *db;
+		sqlite3_stmt *stmt;
+		if (db_acquire_room(&db) == SQLITE_OK) {
+			if (db_prepare(db, "SELECT id, timestamp, ip, username, message FROM messages WHERE id > ? AND id <= ? ORDER BY id ASC;",
+			               &stmt) == SQLITE_OK) {
+				sqlite3_bind_int64(stmt, 1, last_id);
+				sqlite3_bind_int64(stmt, 2, room->log_base_id);
+				while (sqlite3_step(stmt) == SQLITE_ROW) {
+					struct server_log_entry e;
+					if (server_render_message(&e, sqlite3_column_int64(stmt, 0), sqlite3_column_int64(stmt, 1),
+					                          (const char *)sqlite3_column_text(stmt, 2), (const char *)sqlite3_column_text(stmt, 3),
+					                          (const char *)sqlite3_column_text(stmt, 4)) != 0) {
+						break;
+					}
+					server_write_event(out, websocket, &e);
+					free(e.json);
 				}
+				db_finalize(stmt);
 			}
+			db_release(db);
 		}
-		sqlite3_finalize(stmt);
-		sqlite3_close(db);
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "Incorrect username or password.");
-		send_json_response(401, "Unauthorized", response_json);
-		return 1;
 	}
-	
-	// 删除账户 (DELETE action=delete)
-	if (strcmp(request_method, "DELETE") == 0 && strcmp(action, "delete") == 0) {
-		if (strlen(username) == 0 || strlen(password) == 0) {
-			cJSON *response_json = cJSON_CreateObject();
-			cJSON_AddStringToObject(response_json, "status", "error");
-			cJSON_AddStringToObject(response_json, "message", "Username and password are required.");
-			send_json_response(400, "Bad Request", response_json);
-			return 1;
+	unsigned long long n = room->log_head < SERVER_LOG_MESSAGES ? room->log_head : SERVER_LOG_MESSAGES;
+	for (unsigned long long i = room->log_head - n; i < room->log_head; i++) {
+		const struct server_log_entry *e = &room->log[i % SERVER_LOG_MESSAGES];
+		if (e->id > last_id) server_write_event(out, websocket, e);
+	}
+	fclose(out);
+	int rc = server_send(c, buf, len);
+	free(buf);
+	return rc;
+}
+
+// 函数：处理推送请求（GET action=stream）：带 Upgrade: websocket 时建立 WebSocket，否则返回 SSE 流
+// 补发客户端缺少的消息后加入聊天室的订阅者，之后的新消息由 server_room_publish 推送
+static int server_subscribe(struct server_conn *c, const struct http_request *req) {
+	int websocket = req->upgrade != NULL && strcasecmp(req->upgrade, "websocket") == 0;
+	char header[256];
+	if (websocket) {
+		if (req->ws_version == NULL || strcmp(req->ws_version, "13") != 0) {
+			return server_send_error(c, 426, "Upgrade Required", "Unsupported WebSocket version.", "Sec-WebSocket-Version: 13\r\n");
 		}
+		if (req->ws_key == NULL || strlen(req->ws_key) > 64) {
+			return server_send_error(c, 400, "Bad Request", "Missing Sec-WebSocket-Key.", NULL);
+		}
+		char key[128];
+		unsigned char digest[EVP_MAX_MD_SIZE];
+		unsigned int digest_len;
+		char accept[64];
+		int key_len = snprintf(key, sizeof(key), "%s" WS_GUID, req->ws_key);
+		EVP_Digest(key, key_len, digest, &digest_len, EVP_sha1(), NULL);
+		EVP_EncodeBlock((unsigned char *)accept, digest, digest_len);
+		snprintf(header, sizeof(header),
+		         "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n",
+		         accept);
+	} else {
+		// 与 CGI 模式相同的响应头；retry 为连接断开后浏览器的重连间隔
+		snprintf(header, sizeof(header),
+		         "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: keep-alive\r\n\r\n"
+		         "retry: 3000\n\n");
+	}
 
-		const char *sql_check_user = "SELECT password FROM users WHERE username = ?;";
-		rc = sqlite3_prepare_v2(db, sql_check_user, -1, &stmt, 0);
-		sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-		if (sqlite3_step(stmt) == SQLITE_ROW) {
-			const char *stored_password = (const char *)sqlite3_column_text(stmt, 0);
-			if (strcmp(password, stored_password) == 0) {
-				sqlite3_finalize(stmt);
+	char room_name[MAX_ROOM_NAME_LENGTH + 2] = ""; // 多留一个字节用于发现过长的名称
+	get_query_param(req->query, "room", room_name, sizeof(room_name));
+	if (select_room(room_name) != 0) return server_send_error(c, 400, "Bad Request", "Room name is too long.", NULL);
 
-				const char *sql_delete = "DELETE FROM users WHERE username = ?;";
-				rc = sqlite3_prepare_v2(db, sql_delete, -1, &stmt, 0);
-				sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-				if (sqlite3_step(stmt) == SQLITE_DONE) {
-					sqlite3_finalize(stmt);
-					sqlite3_close(db);
-					cJSON *response_json = cJSON_CreateObject();
-					cJSON_AddStringToObject(response_json, "status", "success");
-					cJSON_AddStringToObject(response_json, "message", "User deleted successfully.");
-					send_json_response(200, "OK", response_json);
-					return 0;
-				}
+	// 浏览器重连时通过 Last-Event-ID 告知已收到的最后一条消息，优先于 since 参数
+	long long last_id = 0;
+	char since_str[32];
+	if (req->last_event_id != NULL && *req->last_event_id) {
+		last_id = atoll(req->last_event_id);
+	} else if (get_query_param(req->query, "since", since_str, sizeof(since_str))) {
+		last_id = atoll(since_str);
+	}
+	if (last_id < 0) last_id = 0;
+
+	int index = server_room_open(room_name);
+	if (index < 0) return server_send_error(c, 500, "Internal Server Error", "Can't open database.", NULL);
+	// 客户端已经收到（例如从另一个工作进程）比本进程日志更新的消息时，先处理尚未读取的通知
+	if (last_id > g_server.rooms[index].last_id) server_room_publish(index);
+	struct server_room *room = &g_server.rooms[index];
+	if (room->subscriber_count == room->subscriber_capacity) {
+		int capacity = room->subscriber_capacity ? room->subscriber_capacity * 2 : 16;
+		struct server_conn **subscribers = realloc(room->subscribers, capacity * sizeof(*subscribers));
+		if (subscribers == NULL) return server_send_error(c, 500, "Internal Server Error", "Out of memory.", NULL);
+		room->subscribers = subscribers;
+		room->subscriber_capacity = capacity;
+	}
+
+	if (websocket) {
+		c->ws_query = strdup(req->query);
+		c->ws_cookie = req->cookie ? strdup(req->cookie) : NULL;
+		c->ws_forwarded_ip = req->forwarded_ip ? strdup(req->forwarded_ip) : NULL;
+	}
+	c->kind = websocket ? CONN_WEBSOCKET : CONN_SSE;
+	if (server_send(c, header, strlen(header)) != 0) return -1;
+	if (server_catch_up(c, room, last_id) != 0) return -1;
+	c->room = index;
+	c->subscriber_index = room->subscriber_count;
+	room->subscribers[room->subscriber_count++] = c;
+	return 0;
+}
+
+// 函数：按请求设置 CGI 环境变量（与 SCGI 模式读取的变量相同），请求中没有的变量清除
+static void server_set_cgi_env(const char *method, const char *query, long long content_length, const char *cookie,
+                               const char *remote_addr, const char *forwarded_ip, const char *accept_encoding,
+                               const char *if_none_match, const char *last_event_id) {
+	for (int i = 0; scgi_cgi_vars[i]; i++) {
+		unsetenv(scgi_cgi_vars[i]);
+	}
+	char length[24];
+	snprintf(length, sizeof(length), "%lld", content_length);
+	setenv("REQUEST_METHOD", method, 1);
+	setenv("QUERY_STRING", query, 1);
+	setenv("CONTENT_LENGTH", length, 1);
+	setenv("REMOTE_ADDR", remote_addr, 1);
+	if (cookie != NULL) setenv("HTTP_COOKIE", cookie, 1);
+	if (forwarded_ip != NULL) setenv("HTTP_CF_CONNECTING_IP", forwarded_ip, 1);
+	if (accept_encoding != NULL) setenv("HTTP_ACCEPT_ENCODING", accept_encoding, 1);
+	if (if_none_match != NULL) setenv("HTTP_IF_NONE_MATCH", if_none_match, 1);
+	if (last_event_id != NULL) setenv("HTTP_LAST_EVENT_ID", last_event_id, 1);
+}
+
+// 函数：用 route_request 处理已设置好环境变量的请求，stdin 为 body，CGI 格式的输出放入 *output（调用方 free）
+static int server_capture(const char *body, size_t body_len, char **output, size_t *output_len) {
+	static char empty[1];
+	*output = NULL;
+	FILE *in = fmemopen(body_len > 0 ? (void *)body : empty, body_len > 0 ? body_len : 1, "r");
+	FILE *out = open_memstream(output, output_len);
+	if (in == NULL || out == NULL) {
+		if (in != NULL) fclose(in);
+		if (out != NULL) fclose(out);
+		free(*output);
+		*output = NULL;
+		return -1;
+	}
+	FILE *saved_in = stdin, *saved_out = stdout;
+	stdin = in;
+	stdout = out;
+	route_request();
+	stdin = saved_in;
+	stdout = saved_out;
+	fclose(in);
+	fclose(out);
+	return 0;
+}
+
+// 函数：把 CGI 格式的输出（Status 头、其他响应头、空行、响应体）转换为 HTTP/1.1 响应并发送
+static int server_send_cgi_output(struct server_conn *c, const char *output, size_t len) {
+	const char *header_end = memmem(output, len, "\r\n\r\n", 4);
+	if (header_end == NULL) return server_send_error(c, 500, "Internal Server Error", "Malformed handler response.", NULL);
+	const char *body = header_end + 4;
+	size_t body_len = output + len - body;
+
+	char *response = NULL;
+	size_t response_len = 0;
+	FILE *out = open_memstream(&response, &response_len);
+	if (out == NULL) return server_send_error(c, 500, "Internal Server Error", "Out of memory.", NULL);
+	const char *status = "200 OK"; // CGI 规范：没有 Status 头时为 200
+	int status_len = strlen(status), has_length = 0;
+	for (const char *line = output; line < header_end + 2;) {
+		const char *eol = memmem(line, header_end + 2 - line, "\r\n", 2);
+		if (strncasecmp(line, "Status:", 7) == 0) {
+			status = line + 7;
+			while (*status == ' ') status++;
+			status_len = eol - status;
+		} else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+			has_length = 1;
+		}
+		line = eol + 2;
+	}
+	fprintf(out, "HTTP/1.1 %.*s\r\n", status_len, status);
+	for (const char *line = output; line < header_end + 2;) {
+		const char *eol = memmem(line, header_end + 2 - line, "\r\n", 2);
+		if (strncasecmp(line, "Status:", 7) != 0) fwrite(line, 1, eol + 2 - line, out);
+		line = eol + 2;
+	}
+	if (!has_length && atoi(status) != 304) fprintf(out, "Content-Length: %zu\r\n", body_len);
+	fprintf(out, "Connection: %s\r\n\r\n", c->close_after_write ? "close" : "keep-alive");
+	fwrite(body, 1, body_len, out);
+	fclose(out);
+	int rc = server_send(c, response, response_len);
+	free(response);
+	return rc;
+}
+
+// 函数：处理一个 API 请求：设置 CGI 环境变量，把请求体和响应放在内存中调用 route_request
+static int server_run_request(struct server_conn *c, const struct http_request *req, const char *body) {
+	timer_reset();
+	server_set_cgi_env(req->method, req->query, req->content_length, req->cookie, c->remote_addr, req->forwarded_ip,
+	                   req->accept_encoding, req->if_none_match, req->last_event_id);
+	char *output;
+	size_t output_len;
+	if (server_capture(body, req->content_length, &output, &output_len) != 0) {
+		return server_send_error(c, 500, "Internal Server Error", "Out of memory.", NULL);
+	}
+	c->close_after_write = !req->keep_alive;
+	int rc = server_send_cgi_output(c, output, output_len);
+	free(output);
+	metrics_record(); // 先把响应交给客户端，再记录耗时
+	return rc;
+}
+
+// 函数：把 WebSocket 上发来的文本帧作为 POST 请求体发送消息（沿用握手时的聊天室和 Cookie），JSON 结果以文本帧返回
+static int server_ws_post(struct server_conn *c, const char *payload, size_t len) {
+	timer_reset();
+	server_set_cgi_env("POST", c->ws_query, len, c->ws_cookie, c->remote_addr, c->ws_forwarded_ip, NULL, NULL, NULL);
+	char *output;
+	size_t output_len;
+	if (server_capture(payload, len, &output, &output_len) != 0) return ws_close(c, 1011);
+	const char *body = memmem(output, output_len, "\r\n\r\n", 4);
+	body = body != NULL ? body + 4 : output + output_len;
+	size_t body_len = output + output_len - body;
+	if (body_len > 0 && body[body_len - 1] == '\n') body_len--;
+	int rc = ws_send(c, WS_OPCODE_TEXT, body, body_len);
+	free(output);
+	metrics_record();
+	return rc;
+}
+
+// 函数：处理 WebSocket 连接上收到的帧（客户端发来的帧必须带掩码；不支持分片和二进制帧）
+static int ws_handle_frames(struct server_conn *c) {
+	while (c->in_len >= 2 && !c->close_after_write) {
+		unsigned char *p = (unsigned char *)c->in;
+		int opcode = p[0] & 0x0f, fin = p[0] & 0x80;
+		unsigned long long len = p[1] & 0x7f;
+		size_t header_len = 2;
+		if (len == 126) {
+			if (c->in_len < 4) return 0;
+			len = (unsigned long long)p[2] << 8 | p[3];
+			header_len = 4;
+		} else if (len == 127) {
+			if (c->in_len < 10) return 0;
+			len = 0;
+			for (int i = 2; i < 10; i++) len = len << 8 | p[i];
+			header_len = 10;
+		}
+		if (!(p[1] & 0x80)) return ws_close(c, 1002);
+		if (len > WS_MAX_FRAME) return ws_close(c, 1009);
+		if (opcode >= WS_OPCODE_CLOSE && (len > 125 || !fin)) return ws_close(c, 1002); // 控制帧
+		if (c->in_len < header_len + 4 + len) return 0;
+
+		const unsigned char *mask = p + header_len;
+		char *payload = (char *)p + header_len + 4;
+		for (unsigned long long i = 0; i < len; i++) payload[i] ^= mask[i & 3];
+		int rc = 0;
+		if (opcode == WS_OPCODE_CLOSE) {
+			c->close_after_write = 1;
+			rc = ws_send(c, WS_OPCODE_CLOSE, payload, len >= 2 ? 2 : 0); // 回应客户端的关闭状态码
+		} else if (opcode == WS_OPCODE_PING) {
+			rc = ws_send(c, WS_OPCODE_PONG, payload, len);
+		} else if (opcode == WS_OPCODE_TEXT && fin) {
+			rc = server_ws_post(c, payload, len);
+		} else if (opcode != WS_OPCODE_PONG) {
+			rc = ws_close(c, 1003);
+		}
+		if (rc != 0) return rc;
+		size_t consumed = header_len + 4 + len;
+		memmove(c->in, c->in + consumed, c->in_len - consumed);
+		c->in_len -= consumed;
+	}
+	return 0;
+}
+
+// 函数：就地解析请求行和请求头（各行的结尾改为 '\0'），header_len 包括结尾的空行；格式错误时返回 -1
+static int http_parse_request(char *buf, size_t header_len, struct http_request *req) {
+	memset(req, 0, sizeof(*req));
+	char *end = buf + header_len;
+	char *target = NULL;
+	for (char *line = buf; line < end;) {
+		char *eol = memchr(line, '\n', end - line);
+		if (eol == NULL) break;
+		*eol = '\0';
+		if (eol > line && eol[-1] == '\r') eol[-1] = '\0';
+		if (req->method == NULL) {
+			// 请求行：方法 目标 HTTP/1.x
+			char *sp1 = strchr(line, ' ');
+			char *sp2 = sp1 ? strchr(sp1 + 1, ' ') : NULL;
+			if (sp2 == NULL || strncmp(sp2 + 1, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)sp2[8])) return -1;
+			*sp1 = *sp2 = '\0';
+			req->method = line;
+			target = sp1 + 1;
+			req->minor_version = sp2[8] - '0';
+		} else if (*line) {
+			char *value = strchr(line, ':');
+			if (value == NULL) return -1;
+			*value++ = '\0';
+			while (*value == ' ' || *value == '\t') value++;
+			for (char *t = value + strlen(value); t > value && (t[-1] == ' ' || t[-1] == '\t');) *--t = '\0';
+			if (strcasecmp(line, "Content-Length") == 0) {
+				char *num_end;
+				req->content_length = strtoll(value, &num_end, 10);
+				if (num_end == value || *num_end || req->content_length < 0) return -1;
+			} else if (strcasecmp(line, "Transfer-Encoding") == 0) req->chunked = 1;
+			else if (strcasecmp(line, "Cookie") == 0) req->cookie = value;
+			else if (strcasecmp(line, "Accept-Encoding") == 0) req->accept_encoding = value;
+			else if (strcasecmp(line, "If-None-Match") == 0) req->if_none_match = value;
+			else if (strcasecmp(line, "Last-Event-ID") == 0) req->last_event_id = value;
+			else if (strcasecmp(line, "CF-Connecting-IP") == 0) req->forwarded_ip = value;
+			else if (strcasecmp(line, "Connection") == 0) req->connection = value;
+			else if (strcasecmp(line, "Upgrade") == 0) req->upgrade = value;
+			else if (strcasecmp(line, "Sec-WebSocket-Key") == 0) req->ws_key = value;
+			else if (strcasecmp(line, "Sec-WebSocket-Version") == 0) req->ws_version = value;
+		}
+		line = eol + 1;
+	}
+	if (req->method == NULL || target[0] != '/') return -1;
+	req->path = target;
+	req->query = strchr(target, '?');
+	if (req->query != NULL) *req->query++ = '\0';
+	else req->query = target + strlen(target); // 空字符串
+	// HTTP/1.1 默认保持连接，HTTP/1.0 需要明确要求
+	req->keep_alive = req->minor_version >= 1;
+	if (req->connection != NULL && strcasestr(req->connection, "close") != NULL) req->keep_alive = 0;
+	else if (req->connection != NULL && strcasestr(req->connection, "keep-alive") != NULL) req->keep_alive = 1;
+	return 0;
+}
+
+// 函数：两次 stat 是否为同一个未修改的文件
+static int same_file(const struct stat *a, const struct stat *b) {
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+	       a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// 函数：生成页面各编码版本的文件路径
+static void server_asset_path(const struct server_asset *asset, int encoding, char *path, size_t size) {
+	static const char *suffixes[] = {"", ".gz", ".br"};
+	const char *root = getenv("CHAT_DOC_ROOT");
+	snprintf(path, size, "%s/%s%s", root != NULL && *root ? root : ".", asset->file, suffixes[encoding]);
+}
+
+// 函数：关闭页面已打开的文件
+static void server_asset_close(struct server_asset *asset) {
+	for (int e = 0; e < 3; e++) {
+		if (asset->fd[e] >= 0) close(asset->fd[e]);
+		asset->fd[e] = -1;
+		memset(&asset->st[e], 0, sizeof(asset->st[e]));
+	}
+}
+
+// 函数：打开页面及其预压缩版本并计算 ETag；比原始页面旧的压缩版本（页面改了但没有重新 make）不使用
+static void server_asset_load(struct server_asset *asset) {
+	char path[PATH_MAX];
+	server_asset_close(asset);
+	server_asset_path(asset, ENCODING_IDENTITY, path, sizeof(path));
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		if (fd >= 0) close(fd);
+		return;
+	}
+	char *content = malloc(st.st_size + 1);
+	ssize_t got = 0, n = 1;
+	while (content != NULL && got < st.st_size && n > 0) {
+		n = pread(fd, content + got, st.st_size - got, got);
+		if (n > 0) got += n;
+	}
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len = 0;
+	if (content == NULL || got != st.st_size || !EVP_Digest(content, got, digest, &digest_len, EVP_sha256(), NULL)) {
+		free(content);
+		close(fd);
+		return;
+	}
+	free(content);
+	char hash[17];
+	for (int i = 0; i < 8; i++) snprintf(hash + i * 2, 3, "%02x", digest[i]);
+	asset->fd[ENCODING_IDENTITY] = fd;
+	asset->size[ENCODING_IDENTITY] = st.st_size;
+	asset->st[ENCODING_IDENTITY] = st;
+	snprintf(asset->etag[ENCODING_IDENTITY], sizeof(asset->etag[0]), "\"%s\"", hash);
+
+	for (int e = ENCODING_GZIP; e <= ENCODING_BROTLI; e++) {
+		server_asset_path(asset, e, path, sizeof(path));
+		int variant_fd = open(path, O_RDONLY | O_CLOEXEC);
+		struct stat variant_st;
+		if (variant_fd < 0 || fstat(variant_fd, &variant_st) != 0) {
+			if (variant_fd >= 0) close(variant_fd);
+			continue;
+		}
+		asset->st[e] = variant_st;
+		if (variant_st.st_mtim.tv_sec < st.st_mtim.tv_sec ||
+		    (variant_st.st_mtim.tv_sec == st.st_mtim.tv_sec && variant_st.st_mtim.tv_nsec < st.st_mtim.tv_nsec)) {
+			fprintf(stderr, "%s is older than %s, run make to rebuild it.\n", path, asset->file);
+			close(variant_fd);
+			continue;
+		}
+		asset->fd[e] = variant_fd;
+		asset->size[e] = variant_st.st_size;
+		snprintf(asset->etag[e], sizeof(asset->etag[0]), "\"%s-%s\"", hash, encoding_names[e]);
+	}
+}
+
+// 函数：检查页面文件是否被修改、替换、新建或删除，有变化时重新打开（每秒一次，请求处理时不检查）
+static void server_assets_refresh() {
+	for (size_t i = 0; i < sizeof(server_assets) / sizeof(server_assets[0]); i++) {
+		struct server_asset *asset = &server_assets[i];
+		int changed = 0;
+		for (int e = 0; e < 3 && !changed; e++) {
+			char path[PATH_MAX];
+			struct stat st;
+			server_asset_path(asset, e, path, sizeof(path));
+			if (stat(path, &st) != 0) memset(&st, 0, sizeof(st));
+			changed = !same_file(&st, &asset->st[e]);
+		}
+		if (changed) server_asset_load(asset);
+	}
+}
+
+// 函数：发送页面：按 Accept-Encoding 选择预压缩版本，ETag 匹配时回应 304
+static int server_send_asset(struct server_conn *c, const struct http_request *req, const struct server_asset *asset) {
+	if (asset->fd[ENCODING_IDENTITY] < 0) return server_send_error(c, 404, "Not Found", "Not found.", NULL);
+	int encoding = negotiate_encoding(req->accept_encoding);
+	if (asset->fd[encoding] < 0) encoding = ENCODING_IDENTITY;
+	const char *etag = asset->etag[encoding];
+	int not_modified = req->if_none_match != NULL && strstr(req->if_none_match, etag) != NULL;
+	const char *connection = req->keep_alive ? "keep-alive" : "close";
+	char header[512];
+	int len;
+	if (not_modified) {
+		len = snprintf(header, sizeof(header),
+		               "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nCache-Control: public, max-age=%d\r\nVary: Accept-Encoding\r\n"
+		               "Connection: %s\r\n\r\n", etag, g_server.static_max_age, connection);
+	} else {
+		char encoding_header[64] = "";
+		if (encoding != ENCODING_IDENTITY) snprintf(encoding_header, sizeof(encoding_header), "Content-Encoding: %s\r\n", encoding_names[encoding]);
+		len = snprintf(header, sizeof(header),
+		               "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\n%sContent-Length: %lld\r\nETag: %s\r\n"
+		               "Cache-Control: public, max-age=%d\r\nVary: Accept-Encoding\r\nConnection: %s\r\n\r\n",
+		               encoding_header, (long long)asset->size[encoding], etag, g_server.static_max_age, connection);
+	}
+	c->close_after_write = !req->keep_alive;
+	if (not_modified || strcmp(req->method, "HEAD") == 0) return server_send(c, header, len);
+	return server_send_file(c, header, len, asset->fd[encoding], asset->size[encoding]);
+}
+
+// 函数：为页面生成 .gz 和 .br 预压缩文件（make 时运行），使用最高压缩级别；成功返回 0
+int precompress_files(int count, char *files[]) {
+	int rc = 0;
+	for (int i = 0; i < count; i++) {
+		FILE *in = fopen(files[i], "rb");
+		struct stat st;
+		char *content = NULL;
+		if (in == NULL || fstat(fileno(in), &st) != 0 || (content = malloc(st.st_size + 1)) == NULL ||
+		    fread(content, 1, st.st_size, in) != (size_t)st.st_size) {
+			fprintf(stderr, "Failed to read %s.\n", files[i]);
+			if (in != NULL) fclose(in);
+			free(content);
+			rc = 1;
+			continue;
+		}
+		fclose(in);
+		size_t sizes[3] = {st.st_size, 0, 0};
+		for (int e = ENCODING_GZIP; e <= ENCODING_BROTLI; e++) {
+			unsigned char *out = compress_body_level(e, e == ENCODING_GZIP ? Z_BEST_COMPRESSION : BROTLI_MAX_QUALITY,
+			                                         content, st.st_size, &sizes[e]);
+			char path[PATH_MAX], tmp_path[PATH_MAX + 8];
+			snprintf(path, sizeof(path), "%s.%s", files[i], e == ENCODING_GZIP ? "gz" : "br");
+			snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+			// 先写临时文件再改名，正在运行的服务器不会读到写了一半的文件
+			FILE *out_file = out != NULL ? fopen(tmp_path, "wb") : NULL;
+			int ok = out_file != NULL && fwrite(out, 1, sizes[e], out_file) == sizes[e];
+			if (out_file != NULL && fclose(out_file) != 0) ok = 0;
+			if (!ok || rename(tmp_path, path) != 0) {
+				fprintf(stderr, "Failed to write %s.\n", path);
+				unlink(tmp_path);
+				rc = 1;
 			}
+			free(out);
 		}
-		sqlite3_finalize(stmt);
-		sqlite3_close(db);
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "Invalid username or password.");
-		send_json_response(401, "Unauthorized", response_json);
-		return 1;
+		free(content);
+		printf("%s: %zu bytes, gzip %zu, br %zu\n", files[i], sizes[0], sizes[1], sizes[2]);
 	}
-	
-	// 其他未支持的用户管理请求
-	sqlite3_close(db);
-	cJSON *response_json = cJSON_CreateObject();
-	cJSON_AddStringToObject(response_json, "status", "error");
-	cJSON_AddStringToObject(response_json, "message", "Unsupported user management action or method.");
-	send_json_response(405, "Method Not Allowed", response_json);
-	return 1;
+	return rc;
 }
 
+// 函数：按路径分发一个完整的请求（请求体在 body 中）
+static int server_handle_request(struct server_conn *c, const struct http_request *req, const char *body) {
+	size_t path_len = strlen(req->path), api_len = strlen(SERVER_API_PATH);
+	if (path_len >= api_len && strcmp(req->path + path_len - api_len, SERVER_API_PATH) == 0) {
+		char action[256] = "";
+		get_query_param(req->query, "action", action, sizeof(action));
+		if (strcmp(req->method, "GET") == 0 && strcmp(action, "stream") == 0) return server_subscribe(c, req);
+		return server_run_request(c, req, body);
+	}
+	if (strcmp(req->method, "GET") == 0 || strcmp(req->method, "HEAD") == 0) {
+		const char *path = strcmp(req->path, "/") == 0 ? "/chat.html" : req->path;
+		for (size_t i = 0; i < sizeof(server_assets) / sizeof(server_assets[0]); i++) {
+			if (strcmp(path, server_assets[i].path) == 0) return server_send_asset(c, req, &server_assets[i]);
+		}
+	}
+	return server_send_error(c, 404, "Not Found", "Not found.", NULL);
+}
 
-int main() {
-	// 在处理请求之前，先初始化数据库
-	if (init_database() != 0) {
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "Failed to initialize database.");
-		send_json_response(500, "Internal Server Error", response_json);
-		return 1;
+// 函数：处理连接上已收到的数据：逐个处理完整的 HTTP 请求（流水线），升级为 WebSocket 后处理帧
+static int server_handle_input(struct server_conn *c) {
+	// 文件还没有发完时暂不处理后面的请求，等 server_flush 发完再继续（保持响应的顺序）
+	while (c->kind == CONN_HTTP && c->in_len > 0 && !c->close_after_write && c->file_fd < 0) {
+		char *header_end = memmem(c->in, c->in_len, "\r\n\r\n", 4);
+		if (header_end == NULL) {
+			if (c->in_len > SERVER_MAX_REQUEST_HEADER) {
+				return server_send_error(c, 431, "Request Header Fields Too Large", "Request header is too large.", NULL);
+			}
+			return 0;
+		}
+		size_t header_len = header_end + 4 - c->in;
+		if (header_len > SERVER_MAX_REQUEST_HEADER) {
+			return server_send_error(c, 431, "Request Header Fields Too Large", "Request header is too large.", NULL);
+		}
+		// 在副本上解析：请求体还没有收完时，接收缓冲区中的请求头要保持原样
+		char header[SERVER_MAX_REQUEST_HEADER];
+		struct http_request req;
+		memcpy(header, c->in, header_len);
+		if (http_parse_request(header, header_len, &req) != 0) return server_send_error(c, 400, "Bad Request", "Malformed request.", NULL);
+		if (req.chunked) return server_send_error(c, 411, "Length Required", "Chunked request bodies are not supported.", NULL);
+		if (req.content_length > SERVER_MAX_BODY) return server_send_error(c, 413, "Payload Too Large", "Request body is too large.", NULL);
+		size_t consumed = header_len + req.content_length;
+		if (c->in_len < consumed) return 0; // 请求体还没有收完
+
+		if (server_handle_request(c, &req, c->in + header_len) != 0) return -1;
+		// 移除已处理的请求；升级为 WebSocket 时之后的数据是第一个帧
+		memmove(c->in, c->in + consumed, c->in_len - consumed);
+		c->in_len -= consumed;
 	}
+	if (c->kind == CONN_WEBSOCKET) return ws_handle_frames(c);
+	if (c->kind == CONN_SSE) c->in_len = 0; // SSE 客户端不应再发送数据
+	return 0;
+}
 
-	char *request_method = getenv("REQUEST_METHOD");
-	char *query_string = getenv("QUERY_STRING");
+// 函数：读取连接上的数据并处理；连接已关闭时返回 -1
+static int server_read(struct server_conn *c) {
+	int eof = 0;
+	while (c->in_len < SERVER_MAX_REQUEST_HEADER + SERVER_MAX_BODY) {
+		if (server_reserve(&c->in, &c->in_cap, c->in_len + SERVER_READ_CHUNK) != 0) {
+			server_conn_close(c);
+			return -1;
+		}
+		ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+		if (n > 0) {
+			c->in_len += n;
+			c->last_active = time(NULL);
+			continue;
+		}
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (n < 0) {
+			server_conn_close(c);
+			return -1;
+		}
+		eof = 1;
+		break;
+	}
+	if (server_handle_input(c) != 0) return -1;
+	if (eof) {
+		// 客户端关闭了发送方向：处理完已收到的请求后关闭
+		if (c->kind != CONN_HTTP) {
+			server_conn_close(c);
+			return -1;
+		}
+		c->close_after_write = 1;
+		return server_after_write(c);
+	}
+	return 0;
+}
 
-	if (request_method == NULL) {
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "REQUEST_METHOD not set.");
-		send_json_response(500, "Internal Server Error", response_json);
-		return 1;
+// 函数：接受新连接（监听套接字为非阻塞，多个工作进程以 EPOLLEXCLUSIVE 等待，每次只唤醒一个）
+static void server_accept() {
+	for (;;) {
+		struct sockaddr_storage addr;
+		socklen_t addr_len = sizeof(addr);
+		int fd = accept4(g_server.listen_fd, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+			return;
+		}
+		struct server_conn *c = calloc(1, sizeof(*c));
+		if (c == NULL) {
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->file_fd = -1;
+		c->room = -1;
+		c->last_active = c->last_sent = time(NULL);
+		if (addr.ss_family == AF_INET) {
+			inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr, c->remote_addr, sizeof(c->remote_addr));
+			int one = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // 小响应不等待合并
+		}
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+		if (epoll_ctl(g_server.epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+			close(fd);
+			free(c);
+			continue;
+		}
+		c->next = g_server.conns;
+		if (c->next != NULL) c->next->prev = c;
+		g_server.conns = c;
 	}
+}
 
-	char action[256] = "";
-	if (query_string != NULL) {
-		char *action_param = strstr(query_string, "action=");
-		if (action_param) {
-			char *start = action_param + 7;
-			char *end = strchr(start, '&');
-			if (end) {
-				strncpy(action, start, end - start);
-				action[end - start] = '\0';
-			} else {
-				strncpy(action, start, sizeof(action) - 1);
+// 函数：读取 inotify 事件，标记有新消息的聊天室，每个聊天室只推送一次
+static void server_read_notifications() {
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+	while ((n = read(g_server.notify_fd, events, sizeof(events))) > 0) {
+		for (char *p = events; p < events + n;) {
+			const struct inotify_event *event = (const struct inotify_event *)p;
+			for (int i = 0; i < g_server.room_count; i++) {
+				struct server_room *room = &g_server.rooms[i];
+				if (!room->in_use || room->watch != event->wd) continue;
+				if (event->mask & IN_IGNORED) room->watch = -1; // 通知文件被删除，由定时检查重新监视
+				else room->pending = 1;
 			}
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	for (int i = 0; i < g_server.room_count; i++) {
+		if (g_server.rooms[i].in_use && g_server.rooms[i].pending) {
+			g_server.rooms[i].pending = 0;
+			server_room_publish(i);
 		}
 	}
+}
 
-	// 根据请求方法和 action 参数进行路由
-	if (strcmp(request_method, "GET") == 0) {
-		// 获取信息
-		return handle_get_messages();
-	} else if (strcmp(request_method, "POST") == 0) {
-		if (strcmp(action, "register") == 0 || strcmp(action, "login") == 0 || strcmp(action, "update") == 0) {
-			// 注册或登录
-			return handle_user_management(action, request_method);
-		} else {
-			// 发送消息
-			return handle_post_message();
+// 函数：每秒一次的检查：关闭空闲的保持连接，向推送连接发送心跳，释放没有订阅者的聊天室，
+// 补交各聊天室写入队列中遗留的记录，并检查有无新消息（防止漏掉通知，或无法使用 inotify）
+static void server_tick(time_t now) {
+	for (struct server_conn *c = g_server.conns, *next; c != NULL; c = next) {
+		next = c->next;
+		if (c->kind == CONN_HTTP) {
+			if (c->out_pos == c->out_len && c->file_fd < 0 && now - c->last_active > SERVER_IDLE_SECONDS) server_conn_close(c);
+		} else if (now - c->last_sent >= STREAM_HEARTBEAT_SECONDS && c->out_pos == c->out_len) {
+			if (c->kind == CONN_SSE) server_send(c, ": keepalive\n\n", 13);
+			else ws_send(c, WS_OPCODE_PING, "", 0);
+			c->last_sent = now;
 		}
-	} else if (strcmp(request_method, "DELETE") == 0) {
-		if (strcmp(action, "delete") == 0) {
-			// 删除账户
-			return handle_user_management(action, request_method);
-		} else {
-			cJSON *response_json = cJSON_CreateObject();
-			cJSON_AddStringToObject(response_json, "status", "error");
-			cJSON_AddStringToObject(response_json, "message", "Unsupported DELETE action.");
-			send_json_response(405, "Method Not Allowed", response_json);
-			return 1;
+	}
+	for (int i = 0; i < g_server.room_count; i++) {
+		struct server_room *room = &g_server.rooms[i];
+		if (!room->in_use) continue;
+		if (room->subscriber_count == 0) {
+			server_room_free(room);
+			continue;
 		}
-	} else {
-		cJSON *response_json = cJSON_CreateObject();
-		cJSON_AddStringToObject(response_json, "status", "error");
-		cJSON_AddStringToObject(response_json, "message", "Unsupported request method.");
-		send_json_response(405, "Method Not Allowed", response_json);
+		select_room(room->name);
+		if (room->watch < 0) server_room_watch(room);
+		queue_recover(); // 补交写入队列中没有刷新者处理的记录
+		server_room_publish(i);
+	}
+	server_assets_refresh();
+}
+
+// 函数：工作进程主循环：绑定到一个 CPU，用 epoll 等待新连接、连接上的数据和新消息通知
+static void server_worker_loop(int listen_fd, int index) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(index % cpus, &set);
+		sched_setaffinity(0, sizeof(set), &set);
+	}
+	g_db_persistent = 1;
+	g_server.listen_fd = listen_fd;
+	g_server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	g_server.notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (g_server.epoll_fd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	g_server.static_max_age = config_int("CHAT_STATIC_MAX_AGE", STATIC_MAX_AGE);
+	for (size_t i = 0; i < sizeof(server_assets) / sizeof(server_assets[0]); i++) {
+		for (int e = 0; e < 3; e++) server_assets[i].fd[e] = -1;
+		server_asset_load(&server_assets[i]);
+	}
+	struct epoll_event ev = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &g_server.listen_fd};
+	epoll_ctl(g_server.epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+	if (g_server.notify_fd >= 0) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &g_server.notify_fd;
+		epoll_ctl(g_server.epoll_fd, EPOLL_CTL_ADD, g_server.notify_fd, &ev);
+	}
+
+	struct epoll_event events[SERVER_MAX_EVENTS];
+	time_t last_tick = time(NULL);
+	while (!g_server_stop) {
+		int n = epoll_wait(g_server.epoll_fd, events, SERVER_MAX_EVENTS, 1000);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.ptr == &g_server.listen_fd) {
+				server_accept();
+				continue;
+			}
+			if (events[i].data.ptr == &g_server.notify_fd) {
+				server_read_notifications();
+				continue;
+			}
+			struct server_conn *c = events[i].data.ptr;
+			if (c->fd < 0) continue; // 本轮已被关闭
+			if ((events[i].events & EPOLLOUT) && server_flush(c) != 0) continue;
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) server_read(c);
+			else if (c->kind == CONN_HTTP && c->file_fd < 0 && c->in_len > 0) server_handle_input(c); // 文件发完了，处理排在后面的请求
+		}
+		time_t now = time(NULL);
+		if (now != last_tick) {
+			last_tick = now;
+			server_tick(now);
+		}
+		server_free_closed();
+	}
+
+	db_shutdown();
+	exit(0);
+}
+
+// 函数：启动 HTTP/WebSocket 服务器，workers 不大于 0 时每个 CPU 一个工作进程
+int run_http_server(const char *addr, int workers) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers <= 0) workers = cpus > 0 ? cpus : 1;
+	if (workers > SERVER_MAX_WORKERS) workers = SERVER_MAX_WORKERS;
+
+	if (init_database() != 0) {
+		fprintf(stderr, "Failed to initialize database.\n");
+		return 1;
+	}
+
+	int listen_fd = listen_socket(addr);
+	if (listen_fd < 0) return 1;
+	fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+	fprintf(stderr, "HTTP server listening on %s with %d workers.\n", addr, workers);
+	return run_workers(listen_fd, workers, server_worker_loop, "HTTP");
+}
+
+
+int main(int argc, char *argv[]) {
+	arena_init();
+	if (configure_paths() != 0) {
+		send_fixed_response(500, "Internal Server Error", JSON_ERROR("CHAT_DATA_DIR is too long."));
+		return 1;
+	}
+	if (argc >= 2 && strcmp(argv[1], "--rotate-session-key") == 0) {
+		return session_rotate_key();
+	}
+	if (argc >= 3 && strcmp(argv[1], "--scgi") == 0) {
+		return run_scgi_server(argv[2], argc >= 4 ? atoi(argv[3]) : SCGI_DEFAULT_WORKERS);
+	}
+	if (argc >= 3 && strcmp(argv[1], "--serve") == 0) {
+		return run_http_server(argv[2], argc >= 4 ? atoi(argv[3]) : 0);
+	}
+	if (argc >= 3 && strcmp(argv[1], "--precompress") == 0) {
+		return precompress_files(argc - 2, argv + 2);
+	}
+	if (argc >= 2 && strcmp(argv[1], "--replicate") == 0) {
+		return run_replicator();
+	}
+	if (argc >= 3 && strcmp(argv[1], "--backup") == 0) {
+		return run_backup(argv[2]);
+	}
+	if (argc >= 2 && strcmp(argv[1], "--compact") == 0) {
+		return run_compact();
+	}
+
+	// 在处理请求之前，先初始化数据库
+	timer_reset();
+	long long start = timer_now();
+	int init_failed = init_database();
+	timer_add(PHASE_INIT, start);
+	if (init_failed) {
+		send_fixed_response(500, "Internal Server Error", JSON_ERROR("Failed to initialize database."));
 		return 1;
 	}
+
+	int rc = route_request();
+	fflush(stdout); // 先把响应交给 Web 服务器，再记录耗时
+	metrics_record();
+	return rc;
 }